@@ -22,11 +22,15 @@ const char tag[] = "denseSift3d";
 
 /* The help message */
 const char help_msg[] = 
-        "Usage: denseSift3D [input.nii] [descriptors%.nii] \n"
+        "Usage: denseSift3D [input.nii] [descriptors.nii] \n"
         "\n"
         "Extracts a dense gradient histogram image from the input file. The \n"
-        "output is a set of 12 images, each representing a channel or \n"
-        "histogram bin. The last '%' character in the output filename is \n"
+        "output is a single multi-channel image, where each of the 12 \n"
+        "channels represents a histogram bin. NIFTI files store the channels \n"
+        "as vector components in the fifth dimension. \n"
+        "\n"
+        "If the output filename contains a '%' character, the output is \n"
+        "instead a set of 12 single-channel images, and the last '%' is \n"
         "replaced by the channel index.\n"
         "\n"
         "Supported image formats: \n"
@@ -35,10 +39,12 @@ const char help_msg[] =
         "	.nii.gz (gzip-compressed nifti-1) \n"
 	"	directory containing .dcm files \n"
         "\n"
-        "Example: \n"
+        "Examples: \n"
+        "       denseSift3d in.nii.gz out.nii.gz \n"
         "       denseSift3d in.nii.gz out%.nii.gz \n"
         "\n"
-        "Upon completion, the output would be the following 12 images: \n"
+        "Upon completion, the second example would write the following 12 \n"
+        "images: \n"
         "       -out0.nii.gz \n"
         "       -out1.nii.gz \n"
         "            ... \n"
@@ -107,15 +113,31 @@ int main(int argc, char **argv) {
                 return 1;
         }
 
-        /* Ensure the output file name has a % character */
-        if ((marker = strrchr(out_path, '%')) == NULL) {
-                err_msg("output filename must contain '%'.");
+        /* Extract the descriptors */
+        if (SIFT3D_extract_dense_descriptors(&sift3d, &im, &desc)) {
+                err_msgu("Failed to extract descriptors.");
                 return 1;
         }
+
+        /* Without a % character, write all channels to a single file */
+        if ((marker = strrchr(out_path, '%')) == NULL) {
+
+                if (im_write(out_path, &desc)) {
+
+                        char msg[BUF_SIZE];
+
+                        snprintf(msg, BUF_SIZE, "Failed to write output "
+                                "image \"%s\".", out_path);
+                        err_msg(msg);
+                        return 1;
+                }
+
+                return 0;
+        }
         marker_pos = marker - out_path;
 
         /* Get the output file name length */
-        len = strlen(out_path) + (int) ceil(log10((double) im.nc)) - 1;
+        len = strlen(out_path) + (int) ceil(log10((double) desc.nc)) - 1;
         if (len > BUF_SIZE) {
 
                 char msg[BUF_SIZE];
@@ -126,13 +148,6 @@ int main(int argc, char **argv) {
                 return 1;
         }
 
-        /* Extract the descriptors */
-        if (SIFT3D_extract_dense_descriptors(&sift3d, &im, &desc)) {
-                err_msgu("Failed to extract descriptors.");
-                return 1;
-        }
-        
-
         /* Write each channel as a separate image */
         for (c = 0; c < desc.nc; c++) {
 
@@ -18,6 +18,8 @@
 #define KEYS 'a'
 #define DESC 'b'
 #define DRAW 'c'
+#define QUANTIZE 'd'
+#define PCA 'e'
 
 /* Message buffer size */
 #define BUF_SIZE 1024
@@ -39,6 +41,13 @@ const char help_msg[] =
         " --desc [filename] \n"
         "       Specifies the output file name for the descriptors. \n"
         "       Supported file formats: .csv, .csv.gz \n"
+        " --quantize \n"
+        "       Writes the descriptor histograms as integers in [0, 255], \n"
+        "       taking less space. \n"
+        " --pca [filename] \n"
+        "       Projects the descriptors onto a PCA basis learned by \n"
+        "       pcaSift3D, writing compressed descriptors. Cannot be \n"
+        "       combined with --quantize. \n"
         " --draw [filename] \n"
         "       Draws the keypoints in image space. \n"
         "       Supported file formats: .dcm, .nii, .nii.gz, directory \n"
@@ -64,13 +73,15 @@ int main(int argc, char *argv[]) {
 	SIFT3D sift3d;
 	Keypoint_store kp;
 	SIFT3D_Descriptor_store desc;
-	char *im_path, *keys_path, *desc_path, *draw_path;
-        int c, num_args;
+	char *im_path, *keys_path, *desc_path, *draw_path, *pca_path;
+        int c, num_args, quantize;
 
         const struct option longopts[] = {
                 {"keys", required_argument, NULL, KEYS},
                 {"desc", required_argument, NULL, DESC},
                 {"draw", required_argument, NULL, DRAW},
+                {"quantize", no_argument, NULL, QUANTIZE},
+                {"pca", required_argument, NULL, PCA},
                 {0, 0, 0, 0}
         };
 
@@ -101,7 +112,8 @@ int main(int argc, char *argv[]) {
 
         // Parse the kpSift3d options
         opterr = 1;
-        keys_path = desc_path = draw_path = NULL;
+        keys_path = desc_path = draw_path = pca_path = NULL;
+        quantize = SIFT3D_FALSE;
         while ((c = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
                 switch (c) {
                         case KEYS:
@@ -113,6 +125,12 @@ int main(int argc, char *argv[]) {
                         case DRAW:
                                 draw_path = optarg;
                                 break;
+                        case QUANTIZE:
+                                quantize = SIFT3D_TRUE;
+                                break;
+                        case PCA:
+                                pca_path = optarg;
+                                break;
                         case '?':
                         default:
                                 return 1;
@@ -124,6 +142,10 @@ int main(int argc, char *argv[]) {
                 err_msg("No outputs specified.");
                 return 1;
         }
+        if (quantize && pca_path != NULL) {
+                err_msg("Cannot combine --quantize with --pca.");
+                return 1;
+        }
 
         // Parse the required arguments
         num_args = argc - optind;
@@ -164,8 +186,52 @@ int main(int argc, char *argv[]) {
                 return 1;
         }
 
+        // Optionally extract compressed descriptors
+        if (desc_path != NULL && pca_path != NULL) {
+
+                SIFT3D_PCA pca;
+                SIFT3D_Descriptor_soa desc_pca;
+
+                // Read the basis
+                if (init_SIFT3D_PCA(&pca)) {
+                        err_msgu("Failed to initialize the PCA basis.");
+                        return 1;
+                }
+                if (read_SIFT3D_PCA(pca_path, &pca)) {
+
+                        char msg[BUF_SIZE];
+
+                        snprintf(msg, BUF_SIZE, "Failed to read the PCA "
+                                "basis from \"%s\"", pca_path);
+                        err_msg(msg);
+                        return 1;
+                }
+
+                // Extract and project the descriptors
+                init_SIFT3D_Descriptor_soa(&desc_pca);
+                if (SIFT3D_extract_descriptors_pca(&sift3d, &kp, &pca, 
+                        &desc_pca)) {
+                        err_msgu("Failed to extract descriptors.");
+                        return 1;
+                }
+
+                // Write the descriptors
+                c = write_SIFT3D_Descriptor_soa(desc_path, &desc_pca);
+                cleanup_SIFT3D_Descriptor_soa(&desc_pca);
+                cleanup_SIFT3D_PCA(&pca);
+                if (c) {
+
+                        char msg[BUF_SIZE];
+
+                        snprintf(msg, BUF_SIZE, "Failed to write the "
+				"descriptors to \"%s\"", desc_path);
+                        err_msg(msg);
+                        return 1;
+                }
+        }
+
         // Optionally extract descriptors
-        if (desc_path != NULL) {
+        if (desc_path != NULL && pca_path == NULL) {
 
                 // Extract descriptors
 	        if (SIFT3D_extract_descriptors(&sift3d, &kp,&desc)) {
@@ -173,8 +239,22 @@ int main(int argc, char *argv[]) {
                         return 1;
                 }
 
-                // Write the descriptors
-                if (write_SIFT3D_Descriptor_store(desc_path, &desc)) {
+                // Write the descriptors, optionally quantized
+                if (quantize) {
+
+                        SIFT3D_Descriptor_u8 desc_u8;
+
+                        init_SIFT3D_Descriptor_u8(&desc_u8);
+                        if (SIFT3D_Descriptor_store_to_u8(&desc, &desc_u8)) {
+                                err_msgu("Failed to quantize descriptors.");
+                                return 1;
+                        }
+                        c = write_SIFT3D_Descriptor_u8(desc_path, &desc_u8);
+                        cleanup_SIFT3D_Descriptor_u8(&desc_u8);
+                } else {
+                        c = write_SIFT3D_Descriptor_store(desc_path, &desc);
+                }
+                if (c) {
 
                         char msg[BUF_SIZE];
 
@@ -0,0 +1,301 @@
+/* -----------------------------------------------------------------------------
+ * pcaSift3D.c
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2015-2016 Blaine Rister et al., see LICENSE for details.
+ * -----------------------------------------------------------------------------
+ * This file contains the CLI to learn a PCA basis of SIFT3D descriptors from
+ * a set of training images or descriptor files.
+ * -----------------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "immacros.h"
+#include "imutil.h"
+#include "sift.h"
+
+/* Options */
+#define DIMS 'a'
+
+/* Defaults */
+#define DIMS_DEFAULT 96
+
+/* Message buffer size */
+#define BUF_SIZE 1024
+
+/* Help message */
+const char help_msg[] =
+        "Usage: pcaSift3D [basis.csv] [input1] [input2] ... \n"
+        "\n"
+        "Learns a PCA basis of the SIFT3D descriptors of a set of training "
+        "inputs, and writes it to a file. Each input is either an image, "
+        "from which descriptors are extracted, or a descriptor file written "
+        "by kpSift3D --desc, with or without --quantize. The inputs are "
+        "processed one at a time, and images without keypoints are skipped. "
+        "The basis can then be used to extract compressed descriptors with "
+        "kpSift3D --pca. \n"
+        "\n"
+        "Examples: \n"
+        " pcaSift3D --dims 64 basis.csv.gz image1.nii image2.nii \n"
+        " pcaSift3D basis.csv.gz desc1.csv.gz desc2.csv.gz \n"
+        "\n"
+        "Supported file formats for the basis and descriptor files: .csv, "
+        ".csv.gz \n"
+        "Supported file formats for images: .dcm, .nii, .nii.gz, "
+        "directory \n"
+        "\n"
+        "Options: \n"
+        " --dims [value] \n"
+        "       The number of principal axes to keep, i.e. the length of the \n"
+        "       compressed descriptors. Values of 64 to 128 typically retain \n"
+        "       most of the variance. Default: 96 \n"
+        "\n";
+
+/* Print an error message */
+static void err_msg(const char *msg) {
+        SIFT3D_ERR("pcaSift3D: %s \n"
+                "Use \"pcaSift3D --help\" for more information. \n", msg);
+}
+
+/* Report an unexpected error. */
+static void err_msgu(const char *msg) {
+        err_msg(msg);
+        print_bug_msg();
+}
+
+/* Returns nonzero if path names a descriptor file, i.e. ends in .csv or 
+ * .csv.gz. */
+static int is_desc_file(const char *path) {
+
+        const char *const exts[] = {".csv", ".csv.gz"};
+        int i;
+
+        const size_t len = strlen(path);
+
+        for (i = 0; i < 2; i++) {
+
+                const size_t ext_len = strlen(exts[i]);
+
+                if (len > ext_len && !strcmp(path + len - ext_len, exts[i]))
+                        return SIFT3D_TRUE;
+        }
+
+        return SIFT3D_FALSE;
+}
+
+/* Read a descriptor file written by kpSift3D --desc into desc. Quantized
+ * descriptors, written with --quantize, are recognized by their histogram
+ * elements above 1, and dequantized. */
+static int read_desc_file(const char *path, 
+        SIFT3D_Descriptor_store *const desc) {
+
+        Mat_rm mat, mat_float;
+        double max_val;
+        int i, j, ret;
+
+        if (init_Mat_rm(&mat, 0, 0, DOUBLE, SIFT3D_FALSE))
+                return SIFT3D_FAILURE;
+        if (init_Mat_rm(&mat_float, 0, 0, FLOAT, SIFT3D_FALSE)) {
+                cleanup_Mat_rm(&mat);
+                return SIFT3D_FAILURE;
+        }
+
+        if ((ret = read_Mat_rm(path, &mat)))
+                goto read_desc_quit;
+
+        // Normalized histograms have no element above 1
+        max_val = 0.0;
+        SIFT3D_MAT_RM_LOOP_START(&mat, i, j)
+                if (j >= IM_NDIMS)
+                        max_val = SIFT3D_MAX(max_val, 
+                                SIFT3D_MAT_RM_GET(&mat, i, j, double));
+        SIFT3D_MAT_RM_LOOP_END
+        if (max_val > 1.0) {
+                SIFT3D_MAT_RM_LOOP_START(&mat, i, j)
+                        if (j >= IM_NDIMS)
+                                SIFT3D_MAT_RM_GET(&mat, i, j, double) /= 
+                                        SIFT3D_desc_quant_scale;
+                SIFT3D_MAT_RM_LOOP_END
+        }
+
+        ret = convert_Mat_rm(&mat, &mat_float, FLOAT) ||
+                Mat_rm_to_SIFT3D_Descriptor_store(&mat_float, desc);
+
+read_desc_quit:
+
+        cleanup_Mat_rm(&mat);
+        cleanup_Mat_rm(&mat_float);
+        return ret ? SIFT3D_FAILURE : SIFT3D_SUCCESS;
+}
+
+/* CLI to learn a PCA basis */
+int main(int argc, char *argv[]) {
+
+	Image im;
+	SIFT3D sift3d;
+	Keypoint_store kp;
+	SIFT3D_Descriptor_store store;
+        SIFT3D_PCA_stats stats;
+        SIFT3D_PCA pca;
+	char *basis_path;
+        int c, i, num_args, num_inputs, num_stores, dims;
+
+        const struct option longopts[] = {
+                {"dims", required_argument, NULL, DIMS},
+                {0, 0, 0, 0}
+        };
+
+        // Parse the GNU standard options
+        switch (parse_gnu(argc, argv)) {
+                case SIFT3D_HELP:
+                        puts(help_msg);
+                        print_opts_SIFT3D();
+                        return 0;
+                case SIFT3D_VERSION:
+                        return 0;
+                case SIFT3D_FALSE:
+                        break;
+                default:
+                        err_msgu("Unexpected return from parse_gnu \n");
+                        return 1;
+        }
+
+	// Initialize the SIFT data
+	if (init_SIFT3D(&sift3d)) {
+		err_msgu("Failed to initialize SIFT data.");
+                return 1;
+        }
+
+        // Parse the SIFT3D options and increment the argument list
+        if ((argc = parse_args_SIFT3D(&sift3d, argc, argv, SIFT3D_FALSE)) < 0)
+                return 1;
+
+        // Parse the pcaSift3D options
+        opterr = 1;
+        dims = DIMS_DEFAULT;
+        while ((c = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+                switch (c) {
+                        case DIMS:
+                                dims = atoi(optarg);
+                                if (dims < 1 || dims > DESC_NUMEL) {
+                                        err_msg("Invalid value for dims.");
+                                        return 1;
+                                }
+                                break;
+                        case '?':
+                        default:
+                                return 1;
+                }
+        }
+
+        // Parse the required arguments
+        num_args = argc - optind;
+        if (num_args < 2) {
+                err_msg("Not enough arguments.");
+                return 1;
+        }
+        basis_path = argv[optind];
+        num_inputs = num_args - 1;
+
+	// Initialize data
+	init_Keypoint_store(&kp);
+	init_im(&im);
+	init_SIFT3D_Descriptor_store(&store);
+        if (init_SIFT3D_PCA(&pca) || init_SIFT3D_PCA_stats(&stats)) {
+                err_msgu("Failed to initialize the PCA basis.");
+                return 1;
+        }
+
+        // Accumulate the statistics of the descriptors of each input, one at
+        // a time, skipping the empty ones
+        num_stores = 0;
+        for (i = 0; i < num_inputs; i++) {
+
+                const char *const path = argv[optind + 1 + i];
+
+                // Read a descriptor file
+                if (is_desc_file(path)) {
+                        if (read_desc_file(path, &store)) {
+
+                                char msg[BUF_SIZE];
+
+                                snprintf(msg, BUF_SIZE, "Could not read "
+                                        "descriptors from \"%s\"", path);
+                                err_msg(msg);
+                                return 1;
+                        }
+                } else {
+
+                        // Read the image
+                        if (im_read(path, &im)) {
+
+                                char msg[BUF_SIZE];
+
+                                snprintf(msg, BUF_SIZE, "Could not read "
+                                        "image \"%s\"", path);
+                                err_msg(msg);
+                                return 1;
+                        }
+
+                        // Extract keypoints, skipping the image if there 
+                        // are none
+                        if (SIFT3D_detect_keypoints(&sift3d, &im, &kp)) {
+                                err_msgu("Failed to detect keypoints.");
+                                return 1;
+                        }
+                        if (kp.slab.num < 1) {
+                                SIFT3D_ERR("pcaSift3D: warning: no keypoints "
+                                        "were found in \"%s\", skipping "
+                                        "it. \n", path);
+                                continue;
+                        }
+
+                        // Extract descriptors
+                        if (SIFT3D_extract_descriptors(&sift3d, &kp, 
+                                &store)) {
+                                err_msgu("Failed to extract descriptors.");
+                                return 1;
+                        }
+                }
+
+                // Add the descriptors to the statistics
+                if (add_SIFT3D_PCA_stats(&stats, &store)) {
+                        err_msgu("Failed to accumulate the descriptors.");
+                        return 1;
+                }
+                num_stores++;
+        }
+        if (num_stores < 1) {
+                err_msg("No descriptors were found in the inputs.");
+                return 1;
+        }
+
+        // Learn the basis
+        if (learn_SIFT3D_PCA_stats(&stats, dims, &pca)) {
+                err_msg("Failed to learn the PCA basis.");
+                return 1;
+        }
+
+        // Write the basis
+        if (write_SIFT3D_PCA(basis_path, &pca)) {
+
+                char msg[BUF_SIZE];
+
+                snprintf(msg, BUF_SIZE, "Failed to write the basis to \"%s\"",
+                        basis_path);
+                err_msg(msg);
+                return 1;
+        }
+
+        // Clean up
+        cleanup_SIFT3D_Descriptor_store(&store);
+        cleanup_SIFT3D_PCA_stats(&stats);
+        cleanup_SIFT3D_PCA(&pca);
+        cleanup_Keypoint_store(&kp);
+        cleanup_SIFT3D(&sift3d);
+        im_free(&im);
+
+	return 0;
+}
@@ -29,6 +29,11 @@
 #define NUM_ITER 'l'
 #define TYPE 'm' 
 #define RESAMPLE 'n'
+#define NN_CHECKS 'o'
+#define QUANTIZE 'p'
+#define CONFIDENCE 'q'
+#define SPRT 'r'
+#define PROSAC 's'
 
 /* Message buffer size */
 #define BUF_SIZE 1024
@@ -69,10 +74,28 @@ static void print_help() {
         "Other options: \n"
         " --nn_thresh [value] - Matching threshold on the nearest neighbor \n"
         "       ratio, in the interval (0, 1]. (default: %.2f) \n"
+        " --nn_checks [value] - Match approximately, comparing each \n"
+        "       feature against at most this many others. Higher values \n"
+        "       are slower, but find more of the exact matches. Use 0 for \n"
+        "       exact matching. (default: %d) \n"
+        " --quantize - Match the descriptors after quantizing them to \n"
+        "       bytes, which is faster. Cannot be combined with \n"
+        "       --nn_checks. \n"
         " --err_thresh [value] - RANSAC inlier threshold, in the interval \n"
         "       (0, inf). This is a threshold on the squared Euclidean \n"
         "       distance in real-world units. (default: %.1f) \n"
         " --num_iter [value] - Number of RANSAC iterations. (default: %d) \n"
+        " --ransac_conf [value] - Stop RANSAC early, once the probability \n"
+        "       of having drawn a sample of inliers reaches this value, in \n"
+        "       the interval [0, 1). Use 0 to run all iterations. \n"
+        "       (default: 0) \n"
+        " --sprt - Abandon poor RANSAC hypotheses after testing a few \n"
+        "       points, by a sequential probability ratio test. If the \n"
+        "       test rejects every hypothesis, RANSAC is repeated \n"
+        "       without it. \n"
+        " --prosac - Draw the first RANSAC samples from the closest \n"
+        "       matches, growing to all matches over the iterations \n"
+        "       (PROSAC). \n"
         " --type [value] - Type of transformation to be applied. \n"
         "       Supported arguments: \"affine\" (default: affine) \n"
 	" --resample - Internally resample the images to have the same \n"
@@ -80,7 +103,8 @@ static void print_help() {
 	"	have very different resolutions, for example registering 5mm \n"
 	"	to 1mm slices. \n"
         "\n",
-        SIFT3D_nn_thresh_default, SIFT3D_err_thresh_default, 
+        SIFT3D_nn_thresh_default, SIFT3D_nn_checks_default, 
+        SIFT3D_err_thresh_default, 
         SIFT3D_num_iter_default);
         print_opts_SIFT3D();
 }
@@ -118,10 +142,15 @@ int main(int argc, char *argv[]) {
                 {"keys", required_argument, NULL, KEYS},
                 {"lines", required_argument, NULL, LINES},
                 {"nn_thresh", required_argument, NULL, NN_THRESH},
+                {"nn_checks", required_argument, NULL, NN_CHECKS},
                 {"err_thresh", required_argument, NULL, ERR_THRESH},
                 {"num_iter", required_argument, NULL, NUM_ITER},
                 {"type", required_argument, NULL, TYPE},
 		{"resample", no_argument, NULL, RESAMPLE},
+                {"quantize", no_argument, NULL, QUANTIZE},
+                {"ransac_conf", required_argument, NULL, CONFIDENCE},
+                {"sprt", no_argument, NULL, SPRT},
+                {"prosac", no_argument, NULL, PROSAC},
                 {0, 0, 0, 0}
         };
 
@@ -205,6 +234,15 @@ int main(int argc, char *argv[]) {
                         }
                         break;
                 }
+                case NN_CHECKS:
+                {
+                        const int nn_checks = atoi(optarg);
+                        if (set_nn_checks_Reg_SIFT3D(&reg, nn_checks)) {
+                                err_msg("Invalid value for nn_checks.");
+                                return 1;
+                        }
+                        break;
+                }
                 case ERR_THRESH:
                 {
                         const double err_thresh = atof(optarg);
@@ -223,6 +261,21 @@ int main(int argc, char *argv[]) {
                         }
                         break;
                 }
+                case CONFIDENCE:
+                {
+                        const double confidence = atof(optarg);
+                        if (set_confidence_Ransac(&ran, confidence)) {
+                                err_msg("Invalid value for ransac_conf.");
+                                return 1;
+                        }
+                        break;
+                }
+                case SPRT:
+                        set_sprt_Ransac(&ran, SIFT3D_TRUE);
+                        break;
+                case PROSAC:
+                        set_prosac_Ransac(&ran, SIFT3D_TRUE);
+                        break;
                 case TYPE:
                         if (!strcmp(optarg, str_affine)) {
                                 type = AFFINE;
@@ -240,12 +293,21 @@ int main(int argc, char *argv[]) {
                 case RESAMPLE:
                         resample = SIFT3D_TRUE;
                         break;
+                case QUANTIZE:
+                        set_quantize_Reg_SIFT3D(&reg, SIFT3D_TRUE);
+                        break;
                 case '?':
                 default:
                         return 1;
                 }
         }
 
+        // Check for incompatible options
+        if (reg.quantize && reg.nn_checks > 0) {
+                err_msg("Cannot combine --quantize with --nn_checks.");
+                return 1;
+        }
+
         // Ensure that at least one output was specified
         if (!have_match && !have_tform) {
                 err_msg("No outputs were specified.");
@@ -0,0 +1,118 @@
+/* -----------------------------------------------------------------------------
+ * eigenC.c
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2015-2016 Blaine Rister et al., see LICENSE for details.
+ * -----------------------------------------------------------------------------
+ * Comparison of eigen_sym_3x3 with the LAPACK solver of eigen_Mat_rm, on
+ * random, diagonal and degenerate symmetric matrices.
+ */
+
+/* System headers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+/* SIFT3D headers */
+#include "immacros.h"
+#include "imutil.h"
+
+/* Test parameters */
+const int num_tests = 20000; // Number of random matrices
+const double tol = 1E-12; // Maximum error, relative to the largest eigenvalue
+
+/* Make a random symmetric matrix. Every 7th matrix is diagonal, and every
+ * 11th has a triple eigenvalue. */
+void rand_sym(const int test, double *const A) {
+
+        int i, j;
+
+        for (i = 0; i < 3; i++) {
+                for (j = i; j < 3; j++) {
+
+                        // Scale the entries across 5 orders of magnitude
+                        double val = (2.0 * rand() / RAND_MAX - 1.0) *
+                                pow(10.0, rand() % 6 - 3);
+
+                        if (test % 7 == 0 && i != j)
+                                val = 0.0;
+                        if (test % 11 == 0)
+                                val = i == j ? 1.0 : 0.0;
+
+                        A[i * 3 + j] = A[j * 3 + i] = val;
+                }
+        }
+}
+
+int main(void) {
+
+        Mat_rm A_mat, Q_mat, L_mat;
+        double A[9], Q[9], L[3];
+        double err_val, err_vec, err_orth;
+        int test, i, j, k, ret;
+
+        // Initialize the LAPACK matrices
+        if (init_Mat_rm(&A_mat, 3, 3, DOUBLE, SIFT3D_FALSE) ||
+                init_Mat_rm(&Q_mat, 0, 0, DOUBLE, SIFT3D_FALSE) ||
+                init_Mat_rm(&L_mat, 0, 0, DOUBLE, SIFT3D_FALSE))
+                return 1;
+
+        srand(5);
+        ret = 1;
+        err_val = err_vec = err_orth = 0.0;
+        for (test = 0; test < num_tests; test++) {
+
+                double scale;
+
+                rand_sym(test, A);
+
+                // Solve with both methods
+                if (eigen_sym_3x3(A, Q, L)) {
+                        fprintf(stderr, "eigen_sym_3x3 failed. \n");
+                        goto quit;
+                }
+                for (i = 0; i < 9; i++) {
+                        A_mat.u.data_double[i] = A[i];
+                }
+                if (eigen_Mat_rm(&A_mat, &Q_mat, &L_mat)) {
+                        fprintf(stderr, "eigen_Mat_rm failed. \n");
+                        goto quit;
+                }
+
+                // Measure the errors relative to the largest eigenvalue
+                scale = SIFT3D_MAX(fabs(L_mat.u.data_double[0]),
+                        fabs(L_mat.u.data_double[2]));
+                for (i = 0; i < 3; i++) {
+                        err_val = SIFT3D_MAX(err_val,
+                                fabs(L[i] - L_mat.u.data_double[i]) / scale);
+                }
+
+                // Measure the residuals |A q - l q| and |Q^T Q - I|
+                for (j = 0; j < 3; j++) {
+                        for (i = 0; i < 3; i++) {
+
+                                double res, dot;
+
+                                res = -L[j] * Q[i * 3 + j];
+                                dot = i == j ? -1.0 : 0.0;
+                                for (k = 0; k < 3; k++) {
+                                        res += A[i * 3 + k] * Q[k * 3 + j];
+                                        dot += Q[k * 3 + i] * Q[k * 3 + j];
+                                }
+                                err_vec = SIFT3D_MAX(err_vec,
+                                        fabs(res) / scale);
+                                err_orth = SIFT3D_MAX(err_orth, fabs(dot));
+                        }
+                }
+        }
+
+        printf("Maximum relative error of %d matrices: eigenvalues %.2e, "
+                "eigenvectors %.2e, orthogonality %.2e \n", num_tests,
+                err_val, err_vec, err_orth);
+        ret = err_val > tol || err_vec > tol || err_orth > tol;
+
+quit:
+        cleanup_Mat_rm(&A_mat);
+        cleanup_Mat_rm(&Q_mat);
+        cleanup_Mat_rm(&L_mat);
+        return ret;
+}
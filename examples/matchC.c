@@ -0,0 +1,249 @@
+/* -----------------------------------------------------------------------------
+ * matchC.c
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2015-2016 Blaine Rister et al., see LICENSE for details.
+ * -----------------------------------------------------------------------------
+ * Comparison of SIFT3D_nn_match with an exhaustive search, which applies the
+ * ratio test and the forward-backward check to double-precision SSDs. The
+ * matches must agree, except where the distances of two candidates are
+ * within float tolerance of each other.
+ */
+
+/* System headers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+/* SIFT3D headers */
+#include "immacros.h"
+#include "imutil.h"
+#include "sift.h"
+
+/* Test parameters */
+const int num1 = 1000; // Number of descriptors in d1
+const int num2 = 1500; // Number of descriptors in d2
+const int num_dup = 100; // Number of descriptors duplicated in d2
+const float nn_thresh = 0.8f; // Matching threshold
+const double tol = 1E-5; // Float tolerance, relative to the norms
+
+/* Results of the exhaustive search for one descriptor */
+typedef struct _Ref_match {
+        double ssd[3]; // The three smallest SSDs, in ascending order
+        double norm_sq; // Largest squared norm of the descriptors compared
+        int best; // Index of the nearest neighbor
+} Ref_match;
+
+/* Returns a uniform random number in [0, 1]. */
+double rand_unit(void) {
+        return (double) rand() / RAND_MAX;
+}
+
+/* Returns the squared norm of row i of mat, excluding the coordinates. */
+double row_norm_sq(const Mat_rm *const mat, const int i) {
+
+        double norm_sq;
+        int j;
+
+        norm_sq = 0.0;
+        for (j = IM_NDIMS; j < mat->num_cols; j++) {
+                const double val = SIFT3D_MAT_RM_GET(mat, i, j, float);
+                norm_sq += val * val;
+        }
+
+        return norm_sq;
+}
+
+/* Search the rows of mat2 for the nearest neighbors of row i of mat1, as the
+ * exhaustive search of SIFT3D_nn_match did. Ties go to the first index. */
+void ref_search(const Mat_rm *const mat1, const int i,
+        const Mat_rm *const mat2, Ref_match *const ref) {
+
+        int i2, j, k;
+
+        ref->ssd[0] = ref->ssd[1] = ref->ssd[2] = HUGE_VAL;
+        ref->norm_sq = row_norm_sq(mat1, i);
+        ref->best = -1;
+        for (i2 = 0; i2 < mat2->num_rows; i2++) {
+
+                double ssd;
+
+                ssd = 0.0;
+                for (j = IM_NDIMS; j < mat1->num_cols; j++) {
+                        const double diff =
+                                (double) SIFT3D_MAT_RM_GET(mat1, i, j, float) -
+                                (double) SIFT3D_MAT_RM_GET(mat2, i2, j, float);
+                        ssd += diff * diff;
+                }
+                ref->norm_sq = SIFT3D_MAX(ref->norm_sq, 
+                        row_norm_sq(mat2, i2));
+
+                // Insert into the three smallest SSDs
+                if (ssd < ref->ssd[0])
+                        ref->best = i2;
+                for (k = 0; k < 3; k++) {
+                        if (ssd < ref->ssd[k]) {
+                                const double temp = ref->ssd[k];
+                                ref->ssd[k] = ssd;
+                                ssd = temp;
+                        }
+                }
+        }
+}
+
+/* Returns the match of the exhaustive search, or -1 if the ratio test
+ * rejects it. */
+int ref_decide(const Ref_match *const ref) {
+        return ref->ssd[0] / ref->ssd[1] > nn_thresh * nn_thresh ?
+                -1 : ref->best;
+}
+
+/* Returns nonzero if float rounding could change the decision of ref, i.e. if
+ * the candidates could be reordered, or the ratio is at the threshold. */
+int ref_fragile(const Ref_match *const ref) {
+
+        const double eps = tol * ref->norm_sq;
+
+        return ref->ssd[1] - ref->ssd[0] <= eps ||
+                ref->ssd[2] - ref->ssd[1] <= eps ||
+                fabs(ref->ssd[0] / ref->ssd[1] - nn_thresh * nn_thresh) <= tol;
+}
+
+/* Fill row i of mat with uniform random values. */
+void rand_row(Mat_rm *const mat, const int i) {
+
+        int j;
+
+        for (j = 0; j < mat->num_cols; j++) {
+                SIFT3D_MAT_RM_GET(mat, i, j, float) = j < IM_NDIMS ? 0.0f :
+                        (float) rand_unit();
+        }
+}
+
+/* Copy row i2 of src to row i of dst, with added uniform noise of the given 
+ * amplitude. */
+void noisy_copy(const Mat_rm *const src, const int i2, const double amp,
+        Mat_rm *const dst, const int i) {
+
+        int j;
+
+        for (j = 0; j < dst->num_cols; j++) {
+                SIFT3D_MAT_RM_GET(dst, i, j, float) = 
+                        SIFT3D_MAT_RM_GET(src, i2, j, float);
+                if (j >= IM_NDIMS)
+                        SIFT3D_MAT_RM_GET(dst, i, j, float) += 
+                                (float) (amp * (2.0 * rand_unit() - 1.0));
+        }
+}
+
+int main(void) {
+
+        Mat_rm mat1, mat2;
+        SIFT3D_Descriptor_store d1, d2;
+        Ref_match *refs1, *refs2;
+        int *matches;
+        int i, j, num_matches, num_fragile, num_wrong, ret;
+
+        init_SIFT3D_Descriptor_store(&d1);
+        init_SIFT3D_Descriptor_store(&d2);
+        matches = NULL;
+        refs1 = refs2 = NULL;
+        ret = 1;
+
+        // Allocate the descriptor matrices
+        if (init_Mat_rm(&mat1, num1, IM_NDIMS + DESC_NUMEL, FLOAT, 
+                SIFT3D_FALSE))
+                return 1;
+        if (init_Mat_rm(&mat2, num2, IM_NDIMS + DESC_NUMEL, FLOAT, 
+                SIFT3D_FALSE)) {
+                cleanup_Mat_rm(&mat1);
+                return 1;
+        }
+        if ((refs1 = malloc(num1 * sizeof(Ref_match))) == NULL ||
+                (refs2 = malloc(num2 * sizeof(Ref_match))) == NULL)
+                goto quit;
+
+        // Make d2 random, with some exact duplicates
+        srand(3);
+        for (i = 0; i < num2; i++) {
+                if (i < num_dup || i >= 2 * num_dup) {
+                        rand_row(&mat2, i);
+                        continue;
+                }
+                for (j = 0; j < mat2.num_cols; j++) {
+                        SIFT3D_MAT_RM_GET(&mat2, i, j, float) =
+                                SIFT3D_MAT_RM_GET(&mat2, i - num_dup, j, 
+                                        float);
+                }
+        }
+
+        // Make d1 from noisy copies of d2, at amplitudes around the
+        // threshold, and unrelated descriptors
+        for (i = 0; i < num1; i++) {
+                if (i % 4 == 3)
+                        rand_row(&mat1, i);
+                else
+                        noisy_copy(&mat2, rand() % num2, 1.2 * rand_unit(),
+                                &mat1, i);
+        }
+
+        // Match
+        if (Mat_rm_to_SIFT3D_Descriptor_store(&mat1, &d1) ||
+                Mat_rm_to_SIFT3D_Descriptor_store(&mat2, &d2) ||
+                SIFT3D_nn_match(&d1, &d2, nn_thresh, &matches))
+                goto quit;
+
+        // Run the exhaustive search in both directions
+#pragma omp parallel for
+        for (i = 0; i < num1; i++) {
+                ref_search(&mat1, i, &mat2, refs1 + i);
+        }
+#pragma omp parallel for
+        for (i = 0; i < num2; i++) {
+                ref_search(&mat2, i, &mat1, refs2 + i);
+        }
+
+        // Compare the matches
+        num_matches = num_fragile = num_wrong = 0;
+        for (i = 0; i < num1; i++) {
+
+                int match;
+
+                // Apply the ratio test and the forward-backward check
+                match = ref_decide(refs1 + i);
+                if (match >= 0 && ref_decide(refs2 + match) != i)
+                        match = -1;
+                num_matches += match >= 0;
+
+                if (match == matches[i])
+                        continue;
+
+                // Disagreements are only allowed at float tolerance
+                if (ref_fragile(refs1 + i) ||
+                        (match >= 0 && ref_fragile(refs2 + match)) ||
+                        (matches[i] >= 0 && ref_fragile(refs2 + matches[i]))) {
+                        num_fragile++;
+                } else {
+                        num_wrong++;
+                        printf("Descriptor %d: matched %d, expected %d \n", i,
+                                matches[i], match);
+                }
+        }
+
+        printf("%d of %d descriptors matched. %d decisions differ at float "
+                "tolerance, %d differ otherwise. \n", num_matches, num1,
+                num_fragile, num_wrong);
+        ret = num_wrong > 0;
+
+quit:
+        if (matches != NULL)
+                free(matches);
+        if (refs1 != NULL)
+                free(refs1);
+        if (refs2 != NULL)
+                free(refs2);
+        cleanup_SIFT3D_Descriptor_store(&d1);
+        cleanup_SIFT3D_Descriptor_store(&d2);
+        cleanup_Mat_rm(&mat1);
+        cleanup_Mat_rm(&mat2);
+        return ret;
+}
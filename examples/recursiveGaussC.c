@@ -0,0 +1,113 @@
+/* -----------------------------------------------------------------------------
+ * recursiveGaussC.c
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2015-2016 Blaine Rister et al., see LICENSE for details.
+ * -----------------------------------------------------------------------------
+ * Comparison of the recursive Gaussian filter with the FIR filter. This checks
+ * the bound documented in get_recursive_error_Gauss_filter on random images.
+ */
+
+/* System headers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+/* SIFT3D headers */
+#include "immacros.h"
+#include "imutil.h"
+
+/* Test parameters */
+const int im_dim = 96; // Size of the test image in each dimension
+const double sigmas[] = {1.0, 2.0, 3.0, 4.0, 6.0}; // Filter widths to test
+const int num_sigmas = sizeof(sigmas) / sizeof(double);
+
+/* Filter im with the FIR and recursive filters of the given sigma, and compare
+ * the outputs away from the image boundaries. Returns 1 if the bound is
+ * exceeded, 0 if it holds, and -1 on error. */
+int compare(const Image *const im, const double max_in, const double sigma) {
+
+        Gauss_filter gauss;
+        Image fir, rec;
+        double err, bound, diff_max;
+        int x, y, z, margin, ret;
+
+        init_im(&fir);
+        init_im(&rec);
+        if (init_Gauss_filter(&gauss, sigma, 3))
+                return -1;
+
+        // Get the bound of get_recursive_error_Gauss_filter
+        ret = -1;
+        if (get_recursive_error_Gauss_filter(&gauss, &err))
+                goto compare_quit;
+        bound = err * (3.0 + 3.0 * err + err * err) * max_in;
+
+        // Apply both filters
+        gauss.recursive = SIFT3D_FALSE;
+        if (apply_Gauss_filter(im, &fir, &gauss, -1.0))
+                goto compare_quit;
+        gauss.recursive = SIFT3D_TRUE;
+        if (apply_Gauss_filter(im, &rec, &gauss, -1.0))
+                goto compare_quit;
+
+        // Compare them where the FIR kernel does not reach the boundaries
+        margin = gauss.f.width / 2;
+        diff_max = 0.0;
+        SIFT3D_IM_LOOP_LIMITED_START(im, x, y, z, margin, im->nx - margin - 1,
+                margin, im->ny - margin - 1, margin, im->nz - margin - 1)
+
+                const double diff = fabs(
+                        (double) SIFT3D_IM_GET_VOX(&fir, x, y, z, 0) -
+                        (double) SIFT3D_IM_GET_VOX(&rec, x, y, z, 0));
+
+                diff_max = SIFT3D_MAX(diff_max, diff);
+
+        SIFT3D_IM_LOOP_END
+
+        ret = diff_max > bound;
+        printf("sigma %4.1f: error %.3e, bound %.3e %s \n", sigma, diff_max,
+                bound, ret ? "EXCEEDED" : "ok");
+
+compare_quit:
+        cleanup_Gauss_filter(&gauss);
+        im_free(&fir);
+        im_free(&rec);
+        return ret;
+}
+
+int main(void) {
+
+        Image im;
+        double max_in;
+        int i, x, y, z, ret, failed;
+
+        // Make an image of uniform noise in [-1, 1]
+        init_im(&im);
+        im.nx = im.ny = im.nz = im_dim;
+        im.nc = 1;
+        im_default_stride(&im);
+        if (im_resize(&im))
+                return 1;
+        srand(1);
+        max_in = 0.0;
+        SIFT3D_IM_LOOP_START(&im, x, y, z)
+                const double val = 2.0 * rand() / RAND_MAX - 1.0;
+                SIFT3D_IM_GET_VOX(&im, x, y, z, 0) = (float) val;
+                max_in = SIFT3D_MAX(max_in, fabs(val));
+        SIFT3D_IM_LOOP_END
+
+        // Compare the filters at each sigma
+        failed = 0;
+        for (i = 0; i < num_sigmas; i++) {
+                if ((ret = compare(&im, max_in, sigmas[i])) < 0) {
+                        fprintf(stderr, "Failed to filter at sigma %f. \n",
+                                sigmas[i]);
+                        im_free(&im);
+                        return 1;
+                }
+                failed |= ret;
+        }
+
+        im_free(&im);
+        return failed;
+}
@@ -45,6 +45,11 @@ extern "C" {
 	 "warnings or sub-optimal performance. \n")
 #endif
 
+// Use OpenMP tasks, which need version 4.5 for taskloop
+#if defined(_OPENMP) && _OPENMP >= 201511
+#define SIFT3D_OMP_TASKS
+#endif
+
 // Get a pointer to the [nx, ny, nz] array of an image
 #define SIFT3D_IM_GET_DIMS(im) \
         (&(im)->nx)
@@ -172,6 +172,7 @@ typedef struct _Image {
         size_t xs, ys, zs;      // Stride in x, y, and z
         int nc;                 // The number of channels
 	int cl_valid;		// If TRUE, cl_image is valid
+        int data_shared;        // If TRUE, data belongs to another object
 
 } Image;
 
@@ -191,6 +192,7 @@ typedef struct _Gauss_filter {
 
 	double sigma;
 	Sep_FIR_filter f;
+        int recursive;  // If TRUE, apply_Gauss_filter approximates f recursively
 
 } Gauss_filter;
 
@@ -217,6 +219,11 @@ typedef struct _Pyramid {
 	// Levels in all octaves
 	Image *levels;	
 
+        // Arena holding the data of all levels
+        void *arena;            // Allocated block, to be freed
+        float *arena_data;      // Aligned start of the level data
+        size_t arena_size;      // Capacity of arena_data, in floats
+
 	// Scale-space parameters
 	double sigma_n;
 	double sigma0;
@@ -293,6 +300,8 @@ typedef struct _Tri {
 typedef struct _Mesh {
 	Tri *tri; 	// Triangles
 	int num;	// Number of triangles
+        int *lut_start; // First candidate triangle of each direction cell
+        unsigned char *lut_tri; // Candidate triangles, see init_Mesh_lut
 } Mesh;
 
 /* Struct defining a 3D SIFT descriptor */
@@ -312,6 +321,104 @@ typedef struct _SIFT3D_Descriptor_store {
 
 } SIFT3D_Descriptor_store;
 
+/* Struct to hold SIFT3D descriptors as separate arrays. Row i of hists is 
+ * the histograms of descriptor i, in the column order of 
+ * SIFT3D_Descriptor_store_to_Mat_rm, without the coordinates. Descriptors
+ * projected by a SIFT3D_PCA instead have rows of the reduced length dim.
+ * hists is 64-byte aligned, and so is each row if dim is a multiple of 16. */
+typedef struct _SIFT3D_Descriptor_soa {
+
+        void *mem;              // Memory holding hists
+        float *hists;           // [num x dim] histograms
+        double *coords;         // [num x IM_NDIMS] sub-pixel [x, y, z]
+        double *scales;         // [num] absolute scale
+        size_t num;             // Number of descriptors
+        size_t cap;             // Capacity of the arrays, in descriptors
+        int dim;                // Length of each row, DESC_NUMEL by default
+        int nx, ny, nz;         // Image dimensions
+
+} SIFT3D_Descriptor_soa;
+
+/* Struct to hold quantized SIFT3D descriptors. The layout is that of
+ * SIFT3D_Descriptor_soa, but each histogram element is scaled by
+ * SIFT3D_desc_quant_scale and rounded to a byte. This takes a quarter of the
+ * memory. */
+typedef struct _SIFT3D_Descriptor_u8 {
+
+        void *mem;              // Memory holding hists
+        unsigned char *hists;   // [num x DESC_NUMEL] quantized histograms
+        double *coords;         // [num x IM_NDIMS] sub-pixel [x, y, z]
+        double *scales;         // [num] absolute scale
+        size_t num;             // Number of descriptors
+        size_t cap;             // Capacity of the arrays, in descriptors
+        int nx, ny, nz;         // Image dimensions
+
+} SIFT3D_Descriptor_u8;
+
+/* Struct defining a PCA basis of SIFT3D descriptors, as learned by
+ * learn_SIFT3D_PCA. A descriptor x, in the column order of 
+ * SIFT3D_Descriptor_soa, is projected to basis * (x - mean). */
+typedef struct _SIFT3D_PCA {
+
+        Mat_rm mean;            // [1 x DESC_NUMEL] FLOAT mean descriptor
+        Mat_rm basis;           // [dim x DESC_NUMEL] FLOAT principal axes,
+                                // by decreasing variance
+
+} SIFT3D_PCA;
+
+/* Struct accumulating the statistics of a set of SIFT3D descriptors, from
+ * which learn_SIFT3D_PCA_stats learns a PCA basis. See 
+ * add_SIFT3D_PCA_stats. */
+typedef struct _SIFT3D_PCA_stats {
+
+        Mat_rm sum;             // [1 x DESC_NUMEL] DOUBLE sum of the descriptors
+        Mat_rm prod;            // [DESC_NUMEL x DESC_NUMEL] DOUBLE sum of their
+                                // outer products
+        size_t num;             // Number of descriptors
+
+} SIFT3D_PCA_stats;
+
+/* Struct to cache the gradients of the levels of a GSS pyramid. Each 
+ * gradient is a 3-channel image, computed on first use, and the least 
+ * recently used gradients are evicted to stay within max_bytes. */
+typedef struct _Grad_cache {
+
+        Image *grads;           // Gradient of each level, if data != NULL
+        unsigned long *last_use; // Time of the last use of each level
+        unsigned long clock;    // Current time, incremented on each use
+        size_t bytes;           // Memory held by the cached gradients
+        size_t max_bytes;       // Memory cap, or 0 to disable the cache
+        int num_levels;         // Length of grads and last_use
+
+} Grad_cache;
+
+/* Struct defining a row of voxels in a Sphere_table, with offsets relative
+ * to the voxel containing the window center. */
+typedef struct _Sphere_row {
+
+        int dy, dz;             // Offsets of the row
+        int dx_start, dx_end;   // Offsets of the first and last voxels
+        size_t idx;             // Index of the first voxel in the weights
+
+} Sphere_row;
+
+/* Struct to hold the voxels of a spherical window, with their Gaussian 
+ * weights, as a list of rows. See IM_LOOP_WINDOW_START in sift.c. */
+typedef struct _Sphere_table {
+
+        Sphere_row *rows;       // Rows of voxels, in z, y order
+        float *weights;         // Weight of each voxel, row by row
+        float *disp_x, *disp_y, *disp_z; // Displacements from the center
+        int x_min, y_min, z_min; // Offsets of the first displacements
+        int num_rows;           // Length of rows
+
+        // Parameters of the window
+        double rad_sq, sigma_sq; // Squared radius and Gaussian parameter
+        double ux, uy, uz;      // Image units
+        int generic;            // If true, valid for any integer center
+
+} Sphere_table;
+
 /* Struct to hold all parameters and internal data of the 
  * SIFT3D algorithms */
 typedef struct _SIFT3D {
@@ -331,6 +438,18 @@ typedef struct _SIFT3D {
 	// DoG pyramid
 	Pyramid dog;
 
+        // Maximum absolute value of each DoG level
+        float *dog_max;
+
+        // Gradients of the Gaussian pyramid levels
+        Grad_cache grad_cache;
+
+        // Spherical windows of the orientation and descriptor stages, for 
+        // each level of the Gaussian pyramid
+        Sphere_table *ori_windows;
+        Sphere_table *desc_windows;
+        int num_windows;
+
 	// Image to process
 	Image im;
 
@@ -338,9 +457,23 @@ typedef struct _SIFT3D {
 	double peak_thresh; // Keypoint peak threshold
 	double corner_thresh; // Keypoint corner threshold
         int dense_rotate; // If true, dense descriptors are rotation-invariant
+        int recursive_gauss; // If true, Gaussian filters are recursive
+        int fused_dog; // If true, the DoG pyramid is computed on the fly
+        int ori_field; // If true, orientations come from a filtered tensor field
 
 } SIFT3D;
 
+/* Selects the voxels of SIFT3D_extract_dense_descriptors_roi. A voxel is
+ * selected if it lies in the bounding box, on the sampling grid starting at
+ * the first corner of the box, and in the mask. Use init_Dense_ROI to select
+ * every voxel. */
+typedef struct _Dense_ROI {
+        const Image *mask;      // Nonzero voxels are selected, or NULL for all
+        int start[IM_NDIMS];    // First corner of the bounding box
+        int end[IM_NDIMS];      // Last corner, inclusive, or -1 for the last voxel
+        int stride[IM_NDIMS];   // Spacing of the sampling grid, in voxels
+} Dense_ROI;
+
 /* Geometric transformations that can be applied by this library. */
 typedef enum _tform_type {
 	AFFINE,         // Affine (linear + constant)
@@ -396,6 +529,10 @@ typedef struct _Tps {
 typedef struct _Ransac {
  	double err_thresh; //error threshold for RANSAC inliers
 	int num_iter; //number of RANSAC iterations
+	unsigned int seed; //seed of the random streams, or 0 to use rand()
+	double confidence; //stop once an inlier sample is this likely, or 0
+	int sprt; //abandon bad hypotheses early by a sequential test
+	int prosac; //draw the first samples from the first, best points
 } Ransac;
 
 #ifdef __cplusplus
@@ -18,6 +18,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <float.h>
+#include <limits.h>
 #include <zlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -27,6 +28,10 @@
 #include "dicom.h"
 #include "imutil.h"
 
+#ifdef SIFT3D_OMP_TASKS
+#include <omp.h>
+#endif
+
 /* Check for a version number */
 #if !defined(SIFT3D_VERSION_NUMBER)
 #error imutil.c: Must define the preprocessor macro SIFT3D_VERSION_NUMBER
@@ -51,6 +56,36 @@
 //#define SIFT3D_USE_OPENCL // Use OpenCL acceleration
 #define SIFT3D_RANSAC_REFINE	// Use least-squares refinement in RANSAC
 
+/* Target size of the tiles gathered by convolve_sep_tiles, in bytes. This 
+ * should fit comfortably in each core's L2 cache. */
+#define SIFT3D_CONV_TILE_BYTES (1 << 17)
+
+/* Maximum number of parallel work items in convolve_sep_tiles */
+#define SIFT3D_CONV_MAX_CHUNKS 256
+
+/* Ratio of the half-width of a Gaussian filter to its sigma, see 
+ * init_Gauss_filter */
+#ifndef SIFT3D_GAUSS_WIDTH_FCTR
+#define SIFT3D_GAUSS_WIDTH_FCTR 3.0
+#endif
+
+/* Select SIMD convolution kernels at runtime on x86 with GCC-compatible 
+ * compilers. Other platforms use the portable kernel. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIFT3D_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+/* Alignment of each level in a Pyramid arena, in bytes */
+#define SIFT3D_PYR_LEVEL_ALIGN 64
+
+/* Pyramid arenas of at least this many bytes are aligned to huge pages, and
+ * the OS is advised to back them with huge pages, where supported. */
+#define SIFT3D_PYR_HUGE_PAGE_BYTES (1 << 21)
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
 /* SIFT3D version message */
 const char version_msg[] =
     "SIFT3D version " XSTR(SIFT3D_VERSION_NUMBER)  " \n"
@@ -80,6 +115,15 @@ const mode_t out_mode = 0755;
 const double SIFT3D_err_thresh_default = 5.0;
 const int SIFT3D_num_iter_default = 500;
 
+/* Internal parameters */
+const double gauss_recursive_min_sigma = 2.0; // Smallest sigma, in voxels, for recursive Gaussian filters
+const int ransac_batch = 64; // RANSAC iterations between updates of the adaptive parameters
+const double sprt_epsilon_init = 0.1; // Inlier ratio of the SPRT, before any model is found
+const double sprt_delta_init = 0.01; // Initial ratio of points consistent with a bad hypothesis
+const double sprt_delta_min = 1E-3; // Smallest estimate of the above
+const double sprt_model_cost = 200.0; // Cost of a RANSAC hypothesis, in points tested
+const double prosac_max_iter = 200000.0; // Iterations over which PROSAC grows its pool to all points
+
 /* Declarations for the virtual function implementations */
 static int copy_Affine(const void *const src, void *const dst);
 static int copy_Tps(const void *const src, void *const dst);
@@ -124,16 +168,59 @@ const Tform_vtable Tps_vtable = {
 /* Internal macros */
 #define TFORM_GET_VTABLE(arg) (((Affine *) arg)->tform.vtable)
 #define AFFINE_GET_DIM(affine) ((affine)->A.num_rows)
+#define RANSAC_NUM_SEL (IM_NDIMS + 1) // Points per minimal affine sample
+#define RANSAC_BLOCK 64 // Points per word of the RANSAC consensus bitmap
 
 /* Global data */
 CL_data cl_data;
 
 /* Internal types */
-typedef struct _List {
-	struct _List *next;
-	struct _List *prev;
-	int idx;
-} List;
+/* Scratch space for the RANSAC hypotheses of one thread */
+typedef struct _Ransac_state {
+	double A[IM_NDIMS][RANSAC_NUM_SEL];	// Current affine hypothesis
+	int sample[RANSAC_NUM_SEL];	// Points of the minimal sample
+	int swaps[RANSAC_NUM_SEL];	// Swaps of the current sample
+	int *perm;			// Permutation of the point indices
+	uint64_t *cset;			// Consensus set of the hypothesis, as a
+					// bitmap of RANSAC_BLOCK-bit words
+	int num_pts;			// Number of points
+} Ransac_state;
+
+/* Points and parameters shared by the iterations of find_tform_ransac */
+typedef struct _Ransac_run {
+	const double *src[IM_NDIMS];	// Source coordinates, one array each
+	const double *ref[IM_NDIMS];	// Reference coordinates, likewise
+	int num_pts;			// Number of points
+	const int *prosac_iter;		// PROSAC schedule, or NULL
+	double err_thresh_sq;		// Squared inlier threshold
+	double sprt_A;			// SPRT threshold, or DBL_MAX if disabled
+	double sprt_pos, sprt_neg;	// SPRT ratios of inliers and outliers
+	unsigned int seed;		// Base seed of the random streams
+} Ransac_run;
+
+/* Kernels computing one position of a tile of lines, see 
+ * convolve_line_scalar and convolve_line_sym_scalar */
+typedef void (*convolve_line_fn)(const float *const, float *const, const int,
+        const int, const int *const, const float *const);
+typedef void (*convolve_line_sym_fn)(const float *const, float *const, 
+        const int, const int, const int, const float *const);
+typedef struct _Convolve_kernels {
+        convolve_line_fn gen;
+        convolve_line_sym_fn sym;
+} Convolve_kernels;
+
+/* Arguments shared by the tasks of convolve_sep_tiles */
+typedef struct _Convolve_tiles {
+        Convolve_kernels kernels;
+        const Image *src;
+        Image *dst;
+        const Sep_FIR_filter *f;
+        const int *samp_lo;
+        const float *samp_w;
+        const float *iir;
+        int dim, tile_dim, outer_dim, tile_len, num_tiles, fold_start, 
+                fold_end, fold_step, margin, direct_in, direct_out;
+} Convolve_tiles;
 
 /* LAPACK declarations */
 #ifdef SIFT3D_MEX
@@ -148,6 +235,8 @@ typedef mwSignedIndex fortran_int;
 #define dgetrf_ dgetrf
 #define dgetrs_ dgetrs
 #define dsyevd_ dsyevd
+#define sgemm_ sgemm
+#define dgemm_ dgemm
 #endif
 #else
 typedef int32_t fortran_int;
@@ -176,6 +265,19 @@ extern void dsyevd_(const char *, const char *, const fortran_int *, double *,
 		    const fortran_int *, fortran_int *, const fortran_int *,
 		    fortran_int *);
 
+/* BLAS declarations */
+extern void sgemm_(const char *, const char *, const fortran_int *,
+		   const fortran_int *, const fortran_int *, const float *,
+		   const float *, const fortran_int *, const float *,
+		   const fortran_int *, const float *, float *,
+		   const fortran_int *);
+
+extern void dgemm_(const char *, const char *, const fortran_int *,
+		   const fortran_int *, const fortran_int *, const double *,
+		   const double *, const fortran_int *, const double *,
+		   const fortran_int *, const double *, double *,
+		   const fortran_int *);
+
 /* Internal helper routines */
 static char *read_file(const char *path);
 static int do_mkdir(const char *path, mode_t mode);
@@ -193,12 +295,11 @@ static int compile_cl_program_from_source(cl_program * program,
 					  cl_device_id * devices,
 					  int num_devices, char **src,
 					  int num_str);
-static int init_List(List ** list, const int num);
-static int List_get(List * list, const int idx, List ** el);
-static void List_remove(List ** list, List * el);
-static void cleanup_List(List * list);
-static int rand_rows(const Mat_rm *const in1, const Mat_rm *const in2, 
-        const int num_rows, Mat_rm *const out1, Mat_rm *const out2);
+static void rand_sample(const int pool, const int force_last, 
+        Ransac_state *const st, uint64_t *const rng);
+static uint64_t ransac_rand(uint64_t *const state);
+static int init_Ransac_state(Ransac_state *const st, const int num_pts);
+static void cleanup_Ransac_state(Ransac_state *const st);
 static int make_spline_matrix(Mat_rm * src, Mat_rm * src_in, Mat_rm * sp_src,
 			      int K_terms, int *r, int dim);
 static int make_affine_matrix(const Mat_rm *const pts_in, const int dim, 
@@ -207,16 +308,61 @@ static Mat_rm *extract_ctrl_pts(void *tform, tform_type type);
 static Mat_rm *extract_ctrl_pts_Tps(Tps * tps);
 static int solve_system(const Mat_rm *const src, const Mat_rm *const ref, 
         void *const tform);
-static double tform_err_sq(const void *const tform, const Mat_rm *const src, 
-        const Mat_rm *const ref, const int i);
-static int ransac(const Mat_rm *const src, const Mat_rm *const ref, 
-        const Ransac *const ran, void *tform, int **const cset, int *const len);
+static int solve_affine_sample(const Ransac_run *const run, 
+        Ransac_state *const st);
+static void affine_err_sq(const Ransac_run *const run, 
+        const Ransac_state *const st, const int start, const int num,
+        double *const err_sq);
+static void ransac(const Ransac_run *const run, const int iter, 
+        Ransac_state *const st, int *const len, int *const tested);
+static void set_sprt_Ransac_run(Ransac_run *const run, const double epsilon,
+        const double delta);
+static int ransac_search(const Ransac *const ran, const int sprt,
+	Ransac_run *const run, int *const len_best_out, 
+	int *const iter_best_out);
+static int init_prosac_schedule(const int num_pts, const int num_sel, 
+        int **const sched);
 static int convolve_sep(const Image * const src,
 			Image * const dst, const Sep_FIR_filter * const f,
 			const int dim, const double unit);
 static int convolve_sep_gen(const Image * const src,
 			Image * const dst, const Sep_FIR_filter * const f,
 			const int dim, const double unit);
+static int convolve_sep_tiles(const Image * const src,
+			Image * const dst, const Sep_FIR_filter * const f,
+			const int dim, const double unit, const int fold);
+static int run_convolve_tiles(Convolve_tiles *const ct);
+static int convolve_tiles(const Convolve_tiles *const ct, const int task_start,
+        const int task_end);
+static int recursive_gauss_sep(const Image *const src, Image *const dst,
+        const double sigma, const int dim);
+static int get_recursive_gauss_coeffs(const double sigma, float *const coeffs);
+static void recursive_gauss_lines(float *const buf, const int len, 
+        const int run, const float *const coeffs);
+static void convolve_line_scalar(const float *const buf, float *const out,
+        const int run, const int width, const int *const lo, 
+        const float *const w);
+static void convolve_line_sym_scalar(const float *const center, 
+        float *const out, const int run, const int half_width, 
+        const int step, const float *const taps);
+#ifdef SIFT3D_X86_DISPATCH
+static void convolve_line_avx2(const float *const buf, float *const out,
+        const int run, const int width, const int *const lo, 
+        const float *const w);
+static void convolve_line_avx512(const float *const buf, float *const out,
+        const int run, const int width, const int *const lo, 
+        const float *const w);
+static void convolve_line_sym_avx2(const float *const center, 
+        float *const out, const int run, const int half_width, 
+        const int step, const float *const taps);
+static void convolve_line_sym_avx512(const float *const center, 
+        float *const out, const int run, const int half_width, 
+        const int step, const float *const taps);
+#endif
+static Convolve_kernels get_convolve_kernels(void);
+static size_t get_Pyramid_level_stride(const size_t size);
+static int resize_Pyramid_arena(Pyramid *const pyr, const int *const base_dims,
+        const int nc);
 static int convolve_sep_cl(const Image * const src,
 			Image * const dst, const Sep_FIR_filter * const f,
 			int dim, const double unit);
@@ -540,6 +686,8 @@ void init_Mesh(Mesh * const mesh)
 {
 	mesh->tri = NULL;
 	mesh->num = -1;
+        mesh->lut_start = NULL;
+        mesh->lut_tri = NULL;
 }
 
 /* Release all memory associated with a triangle mesh. mesh cannot be reused
@@ -547,6 +695,8 @@ void init_Mesh(Mesh * const mesh)
 void cleanup_Mesh(Mesh * const mesh)
 {
 	free(mesh->tri);
+        free(mesh->lut_start);
+        free(mesh->lut_tri);
 }
 
 /* Convert a matrix to a different type. in and out may be the same pointer.
@@ -1246,13 +1396,17 @@ int im_read(const char *path, Image *const im) {
  * Note: For performance, you can use this to resize
  * an existing image.
  *
+ * The fifth dimension, which holds the vector components written by 
+ * write_nii, is read as channels. Files with more than one time point in
+ * the fourth dimension are rejected.
+ *
  * Supported formats:
  * - NIFTI */
 static int read_nii(const char *path, Image *const im)
 {
 
 	nifti_image *nifti;
-	int x, y, z, i, dim_counter;
+	int x, y, z, c, i, nc, dim_counter;
 
 	// Read NIFTI file
 	if ((nifti = nifti_image_read(path, 1)) == NULL) {
@@ -1268,13 +1422,16 @@ static int read_nii(const char *path, Image *const im)
 		}
 	}
 
-        // Check the dimensionality
-	if (dim_counter > 3) {
+        // Check the dimensionality, rejecting time series
+	if (dim_counter > 5 || (dim_counter > IM_NDIMS && nifti->dim[4] > 1)) {
 		SIFT3D_ERR("read_nii: file %s has unsupported "
 			"dimensionality %d\n", path, dim_counter);
 		goto read_nii_quit;
 	}
 
+        // Read the vector dimension as channels
+        nc = dim_counter == 5 ? nifti->dim[5] : 1;
+
         // Fill the trailing dimensions with 1
         for (i = dim_counter; i < IM_NDIMS; i++) {
                 SIFT3D_IM_GET_DIMS(im)[i] = 1;
@@ -1289,15 +1446,17 @@ static int read_nii(const char *path, Image *const im)
 	im->nx = nifti->nx;
 	im->ny = nifti->ny;
 	im->nz = nifti->nz;
-	im->nc = 1;
+	im->nc = nc;
 	im_default_stride(im);
 	im_resize(im);
 
+        // NIFTI stores each channel as a contiguous volume
 #define IM_COPY_FROM_TYPE(type) \
-    SIFT3D_IM_LOOP_START(im, x, y, z)   \
-        SIFT3D_IM_GET_VOX(im, x, y, z, 0) = (float) ((type *)nifti->data)[ \
-        SIFT3D_IM_GET_IDX(im, x, y, z, 0)]; \
-    SIFT3D_IM_LOOP_END
+    SIFT3D_IM_LOOP_START_C(im, x, y, z, c)   \
+        SIFT3D_IM_GET_VOX(im, x, y, z, c) = (float) ((type *)nifti->data)[ \
+        x + (size_t) im->nx * (y + (size_t) im->ny * (z + \
+                (size_t) im->nz * c))]; \
+    SIFT3D_IM_LOOP_END_C
 
 	// Copy the data into im
 	switch (nifti->datatype) {
@@ -1404,25 +1563,30 @@ int im_write(const char *path, const Image *const im) {
 
 /* Helper function to write an Image to the specified path.
  * Supported formats:
- * -NIFTI (.nii, .nii.gz) */
+ * -NIFTI (.nii, .nii.gz)
+ *
+ * Multi-channel images are written as a single 5D file with dim[5] = nc
+ * and intent NIFTI_INTENT_VECTOR, the NIFTI convention for vector-valued
+ * voxels. The header is written first, then the data is streamed one
+ * xy-plane at a time, converting the interleaved channels of im to the
+ * planar NIFTI order without copying the whole image. */
 static int write_nii(const char *path, const Image *const im)
 {
 
 	nifti_image *nifti;
-	size_t i;
+        znzFile fp;
+        float *plane;
+        size_t plane_bytes;
+        int x, y, z, c;
 
-	const int dims[] = { 3, im->nx, im->ny, im->nz, 0, 0, 0, 0 };
+	const int dims[] = { im->nc > 1 ? 5 : 3, im->nx, im->ny, im->nz, 1, 
+                im->nc, 1, 1 };
 
-	// Verify inputs
-	if (im->nc != 1) {
-		SIFT3D_ERR("write_nii: unsupported number of "
-			"channels: %d. This function only supports single-"
-			"channel images.", im->nc);
-		return SIFT3D_FAILURE;
-	}
+        fp = NULL;
+        plane = NULL;
 
-	// Init a nifti struct and allocate memory
-	if ((nifti = nifti_make_new_nim(dims, DT_FLOAT32, 1))
+	// Init a nifti struct, without allocating the data
+	if ((nifti = nifti_make_new_nim(dims, DT_FLOAT32, 0))
 	    == NULL)
 		goto write_nii_quit;
 
@@ -1431,10 +1595,9 @@ static int write_nii(const char *path, const Image *const im)
         nifti->dy = im->uy;
         nifti->dz = im->uz;
 
-	// Copy the data
-	for (i = 0; i < im->size; i++) {
-		((float *)nifti->data)[i] = im->data[i];
-	}
+        // Mark the channels as vector components
+        if (im->nc > 1)
+                nifti->intent_code = NIFTI_INTENT_VECTOR;
 
 	if (nifti_set_filenames(nifti, path, 0, 1))
 		goto write_nii_quit;
@@ -1443,13 +1606,49 @@ static int write_nii(const char *path, const Image *const im)
 	if (!nifti_nim_is_valid(nifti, 1))
 		goto write_nii_quit;
 
-	nifti_image_write(nifti);
+        // Allocate a buffer for one plane of one channel
+        plane_bytes = (size_t) im->nx * im->ny * sizeof(float);
+        if ((plane = (float *) malloc(plane_bytes)) == NULL)
+                goto write_nii_quit;
+
+        // Write the header, leaving the file open for the data
+        fp = nifti_image_write_hdr_img(nifti, 2, "wb");
+        if (znz_isnull(fp)) {
+                SIFT3D_ERR("write_nii: failed to open file %s \n", path);
+                goto write_nii_quit;
+        }
+
+        // Stream the data, channel-major, one plane at a time
+        for (c = 0; c < im->nc; c++) {
+        for (z = 0; z < im->nz; z++) {
+
+                float *dst = plane;
+
+                for (y = 0; y < im->ny; y++) {
+                for (x = 0; x < im->nx; x++) {
+                        *dst++ = SIFT3D_IM_GET_VOX(im, x, y, z, c);
+                }}
+
+                if (nifti_write_buffer(fp, plane, plane_bytes) != 
+                        plane_bytes) {
+                        SIFT3D_ERR("write_nii: failed to write data to "
+                                "file %s \n", path);
+                        goto write_nii_quit;
+                }
+        }}
+
+        znzclose(fp);
+        free(plane);
 	nifti_free_extensions(nifti);
 	nifti_image_free(nifti);
 
 	return SIFT3D_SUCCESS;
 
  write_nii_quit:
+        if (!znz_isnull(fp))
+                znzclose(fp);
+        if (plane != NULL)
+                free(plane);
 	if (nifti != NULL) {
 		nifti_free_extensions(nifti);
 		nifti_image_free(nifti);
@@ -1484,15 +1683,46 @@ static const char *get_file_ext(const char *name)
 
 /* Write a matrix to a .csv or .csv.gz file. */
 int write_Mat_rm(const char *path, const Mat_rm * const mat)
+{
+	return write_Mat_rm_cat(path, mat, NULL);
+}
+
+/* Write the matrices left and right side by side to a .csv or .csv.gz file,
+ * as if they were concatenated horizontally. Unlike concat_Mat_rm, the
+ * matrices may have different types, e.g. FLOAT coordinates next to INT
+ * features. They must have the same number of rows. right may be NULL, in
+ * which case this writes left alone. */
+int write_Mat_rm_cat(const char *path, const Mat_rm *const left,
+	const Mat_rm *const right)
 {
 
 	FILE *file;
 	gzFile gz;
 	const char *ext;
-	int i, j, compress;
+	int i, j, k, compress;
 
+	const Mat_rm *const mats[2] = {left, right};
+	const int num_mats = right == NULL ? 1 : 2;
 	const char *mode = "w";
 
+	// Verify inputs
+	for (k = 0; k < num_mats; k++) {
+		switch (mats[k]->type) {
+		case DOUBLE:
+		case FLOAT:
+		case INT:
+			break;
+		default:
+			SIFT3D_ERR("write_Mat_rm_cat: unknown type \n");
+			return SIFT3D_FAILURE;
+		}
+	}
+	if (right != NULL && right->num_rows != left->num_rows) {
+		SIFT3D_ERR("write_Mat_rm_cat: mismatched rows: %d, %d \n",
+			left->num_rows, right->num_rows);
+		return SIFT3D_FAILURE;
+	}
+
 	// Validate and create the output directory
 	if (mkpath(path, out_mode))
 		return SIFT3D_FAILURE;
@@ -1512,35 +1742,46 @@ int write_Mat_rm(const char *path, const Mat_rm * const mat)
 			return SIFT3D_FAILURE;
 	}
 
-#define WRITE_MAT(mat, format, type) \
-    SIFT3D_MAT_RM_LOOP_START(mat, i, j) \
-                const char delim = j < mat->num_cols - 1 ? ',' : '\n'; \
+#define WRITE_VAL(format, val) \
                 if (compress) { \
-                        gzprintf(gz, format, SIFT3D_MAT_RM_GET(mat, i, j, \
-                                type)); \
+                        gzprintf(gz, format, val); \
                         gzputc(gz, delim); \
                 } else { \
-                	fprintf(file, format, SIFT3D_MAT_RM_GET(mat, i, j, \
-                 		type)); \
+                	fprintf(file, format, val); \
                         fputc(delim, file); \
-                } \
-    SIFT3D_MAT_RM_LOOP_END
+                }
 
-	// Write the matrix
-	switch (mat->type) {
-	case DOUBLE:
-		WRITE_MAT(mat, "%f", double); 
-		break;
-	case FLOAT:
-		WRITE_MAT(mat, "%f", float); 
-		break;
-	case INT:
-		WRITE_MAT(mat, "%d", int); 
-		break;
-	default:
-		goto write_mat_quit;
+	// Write each row of the matrices
+	for (i = 0; i < left->num_rows; i++) {
+		for (k = 0; k < num_mats; k++) {
+
+			const Mat_rm *const mat = mats[k];
+
+			for (j = 0; j < mat->num_cols; j++) {
+
+				const char delim = k == num_mats - 1 &&
+					j == mat->num_cols - 1 ? '\n' : ',';
+
+				switch (mat->type) {
+				case DOUBLE:
+					WRITE_VAL("%f", SIFT3D_MAT_RM_GET(mat,
+						i, j, double));
+					break;
+				case FLOAT:
+					WRITE_VAL("%f", SIFT3D_MAT_RM_GET(mat,
+						i, j, float));
+					break;
+				case INT:
+					WRITE_VAL("%d", SIFT3D_MAT_RM_GET(mat,
+						i, j, int));
+					break;
+				default:
+					goto write_mat_quit;
+				}
+			}
+		}
 	}
-#undef WRITE_MAT
+#undef WRITE_VAL
 
 	// Check for errors and finish writing the matrix
 	if (compress) {
@@ -1563,6 +1804,127 @@ int write_Mat_rm(const char *path, const Mat_rm * const mat)
 	return SIFT3D_FAILURE;
 }
 
+/* Read a matrix from a .csv or .csv.gz file, as written by write_Mat_rm. 
+ * Values are separated by commas or whitespace, one row per line, and every
+ * row must have the same number of values. mat must be initialized, and is
+ * resized to a DOUBLE matrix. */
+int read_Mat_rm(const char *path, Mat_rm *const mat)
+{
+
+	gzFile gz;
+	char *buf, *pos, *end;
+	size_t len, cap;
+	int i, num_read, num_rows, num_cols, row_cols, ret;
+
+	const size_t chunk = 1 << 16;
+
+	// Read the whole file. gzread also reads uncompressed files.
+	if ((gz = gzopen(path, "rb")) == Z_NULL) {
+		SIFT3D_ERR("read_Mat_rm: failed to open %s \n", path);
+		return SIFT3D_FAILURE;
+	}
+	buf = NULL;
+	len = cap = 0;
+	do {
+		if (len + chunk + 1 > cap) {
+			cap = 2 * (len + chunk + 1);
+			if ((buf = SIFT3D_safe_realloc(buf, cap)) == NULL) {
+				gzclose(gz);
+				return SIFT3D_FAILURE;
+			}
+		}
+		if ((num_read = gzread(gz, buf + len, chunk)) < 0) {
+			SIFT3D_ERR("read_Mat_rm: failed to read %s \n", path);
+			gzclose(gz);
+			free(buf);
+			return SIFT3D_FAILURE;
+		}
+		len += num_read;
+	} while (num_read > 0);
+	gzclose(gz);
+	buf[len] = '\0';
+
+	// Count the rows and columns, then parse the values
+	ret = SIFT3D_FAILURE;
+	num_rows = num_cols = 0;
+	for (i = 0; i < 2; i++) {
+
+		const int parse = i == 1;
+
+		if (parse) {
+			if (num_rows < 1) {
+				SIFT3D_ERR("read_Mat_rm: %s is empty \n", 
+					path);
+				goto read_mat_quit;
+			}
+			mat->type = DOUBLE;
+			mat->num_rows = num_rows;
+			mat->num_cols = num_cols;
+			if (resize_Mat_rm(mat))
+				goto read_mat_quit;
+			num_rows = 0;
+		}
+
+		pos = buf;
+		row_cols = 0;
+		while (SIFT3D_TRUE) {
+
+			const char c = *pos;
+
+			// Finish a row at each line break, skipping empty lines
+			if (c == '\n' || c == '\0') {
+				if (row_cols > 0) {
+					if (num_rows == 0)
+						num_cols = row_cols;
+					if (row_cols != num_cols) {
+						SIFT3D_ERR("read_Mat_rm: row %d "
+							"of %s has %d values, "
+							"expected %d \n", 
+							num_rows, path, 
+							row_cols, num_cols);
+						goto read_mat_quit;
+					}
+					num_rows++;
+					row_cols = 0;
+				}
+				if (c == '\0')
+					break;
+				pos++;
+				continue;
+			}
+
+			// Skip the delimiters
+			if (c == ',' || c == ' ' || c == '\t' || c == '\r') {
+				pos++;
+				continue;
+			}
+
+			// Parse a value
+			{
+				const double val = strtod(pos, &end);
+
+				if (end == pos) {
+					SIFT3D_ERR("read_Mat_rm: invalid value "
+						"in row %d of %s \n", num_rows,
+						path);
+					goto read_mat_quit;
+				}
+				if (parse && row_cols < num_cols) {
+					SIFT3D_MAT_RM_GET(mat, num_rows, 
+						row_cols, double) = val;
+				}
+			}
+			row_cols++;
+			pos = end;
+		}
+	}
+	ret = SIFT3D_SUCCESS;
+
+ read_mat_quit:
+	free(buf);
+	return ret;
+}
+
 /* Shortcut to initialize an image for first-time use.
  * Allocates memory, and assumes the default stride. This
  * function calls init_im and initializes all values to 0. */
@@ -1696,10 +2058,22 @@ int im_resize(Image *const im)
         // Do nothing if the size has not changed
         if (im->size == size)
                 return SIFT3D_SUCCESS;
-	im->size = size;
 
 	// Allocate new memory
-	im->data = SIFT3D_safe_realloc(im->data, size * sizeof(float));
+        if (im->data_shared) {
+
+                // Detach from the shared buffer, keeping the old contents
+                float *const data = (float *) malloc(size * sizeof(float));
+
+                if (data != NULL)
+                        memcpy(data, im->data, 
+                                SIFT3D_MIN(im->size, size) * sizeof(float));
+                im->data = data;
+                im->data_shared = SIFT3D_FALSE;
+        } else {
+	        im->data = SIFT3D_safe_realloc(im->data, size * sizeof(float));
+        }
+	im->size = size;
 
 #ifdef SIFT3D_USE_OPENCL
 	{
@@ -2061,10 +2435,10 @@ int im_copy_data(const Image * const src, Image * const dst)
 	return SIFT3D_SUCCESS;
 }
 
-/* Clean up memory for an Image */
+/* Clean up memory for an Image. Shared data is left to its owner. */
 void im_free(Image * im)
 {
-	if (im->data != NULL)
+	if (im->data != NULL && !im->data_shared)
 		free(im->data);
 }
 
@@ -2412,128 +2786,581 @@ static int convolve_sep(const Image * const src,
 #endif
 }
 
-/* Convolve_sep for general filters */
+/* Convolve_sep for general filters. */
 static int convolve_sep_gen(const Image * const src,
 			Image * const dst, const Sep_FIR_filter * const f,
 			const int dim, const double unit)
 {
-	register int x, y, z, c, d;
-
-	register const int half_width = f->width / 2;
-	register const int nx = src->nx;
-	register const int ny = src->ny;
-	register const int nz = src->nz;
-        register const float conv_eps = 0.1f;
-	register const int dim_end = SIFT3D_IM_GET_DIMS(src)[dim] - 1;
-        register const float unit_factor =  unit /
-                SIFT3D_IM_GET_UNITS(src)[dim];
-        register const int unit_half_width = 
-                (int) ceilf(half_width * unit_factor);
-        int start[] = {0, 0, 0};
-        int end[] = {nx - 1, ny - 1, nz - 1};
-
-        // Compute starting and ending points for the convolution dimension
-        start[dim] += unit_half_width;
-        end[dim] -= unit_half_width + 1;
-
-	//TODO: Convert this to convolve_x, which only convolves in x,
-	// then make a wrapper to restride, transpose, convolve x, and transpose 
-	// back
-
-	// Resize the output, with the default stride
-        if (im_copy_dims(src, dst))
-                return SIFT3D_FAILURE;
-	im_default_stride(dst);
-	if (im_resize(dst))
-		return SIFT3D_FAILURE;
+        return convolve_sep_tiles(src, dst, f, dim, unit, SIFT3D_FALSE);
+}
 
-	// Initialize the output to zeros
-	im_zero(dst);
+/* Helper function for convolve_sep_gen and convolve_sep_sym.
+ *
+ * Filters along any dimension directly, using strided access, so the caller
+ * never has to transpose the image. Each task gathers a tile of lines into a
+ * thread-local buffer sized to fit in L2 cache, and convolves them back into
+ * dst. Since the input is buffered, src and dst may be the same image, in
+ * which case the filtering is done in place. 
+ *
+ * The buffer is laid out so that neighboring lines are contiguous, so the
+ * innermost loop of every pass, including x, runs over adjacent voxels and is
+ * handled by the best convolve_line_* kernel for this CPU.
+ *
+ * The sampling positions and boundary mirroring along dim depend only on the
+ * output position, so they are computed once per call rather than once per
+ * voxel. 
+ *
+ * If fold is true and the filter taps fall on whole voxels, interior 
+ * positions skip the interpolation and sum each pair of mirrored voxels 
+ * before multiplying by their shared tap. This requires f to be symmetric. */
+static int convolve_sep_tiles(const Image * const src,
+			Image * const dst, const Sep_FIR_filter * const f,
+			const int dim, const double unit, const int fold)
+{
+        Convolve_tiles ct;
+	int *samp_lo;
+	float *samp_w;
+	int i, d, n, fold_start, fold_end, ret;
 
-#define SAMP_AND_ACC(src, dst, tap, coords, c) \
-{ \
-        float frac; \
-\
-        const int idx_lo[] = {(coords)[0], (coords)[1], (coords)[2]}; \
-        int idx_hi[] = {idx_lo[0], idx_lo[1], idx_lo[2]}; \
-\
-        /* Convert the physical coordinates to integer indices*/ \
-        idx_hi[dim] += 1; \
-        frac = (coords)[dim] - (float) idx_lo[dim]; \
-\
-        /* Sample with linear interpolation */ \
-        SIFT3D_IM_GET_VOX(dst, x, y, z, c) += (tap) * \
-                ((1.0f - frac) * \
-                SIFT3D_IM_GET_VOX(src, idx_lo[0], idx_lo[1], idx_lo[2], c) + \
-                frac * \
-                SIFT3D_IM_GET_VOX(src, idx_hi[0], idx_hi[1], idx_hi[2], c)); \
-}
+	const int width = f->width;
+	const int half_width = width / 2;
+        const float conv_eps = 0.1f;
+        const float unit_factor =  unit / SIFT3D_IM_GET_UNITS(src)[dim];
+        const int fold_step = (int) unit_factor;
 
-	// First pass: process the interior
-#pragma omp parallel for private(x) private(y) private(c)
-	SIFT3D_IM_LOOP_LIMITED_START_C(dst, x, y, z, c, start[0], end[0], 
-                start[1], end[1], start[2], end[2])
+        // Verify inputs
+        if (dim < 0 || dim >= IM_NDIMS) {
+                SIFT3D_ERR("convolve_sep_tiles: invalid dimension: %d \n", dim);
+                return SIFT3D_FAILURE;
+        }
 
-                float coords[] = { x, y, z };
+        // Allocate the sampling positions and weights
+        n = SIFT3D_IM_GET_DIMS(src)[dim];
+        if ((samp_lo = (int *) malloc(n * width * sizeof(int))) == NULL)
+                return SIFT3D_FAILURE;
+        if ((samp_w = (float *) malloc(2 * n * width * sizeof(float))) == 
+                NULL) {
+                free(samp_lo);
+                return SIFT3D_FAILURE;
+        }
 
+        // Compute the sampling positions, mirroring at the boundaries
+        for (i = 0; i < n; i++) {
                 for (d = -half_width; d <= half_width; d++) {
 
+                        float frac;
+
+                        const int dim_end = n - 1;
+                        const int samp_idx = i * width + d + half_width;
                         const float tap = f->kernel[d + half_width];
                         const float step = d * unit_factor;
+                        float coord = (float) i - step;
 
-                        // Adjust the sampling coordinates
-                        coords[dim] -= step;
-
-                        // Sample
-                        SAMP_AND_ACC(src, dst, tap, coords, c);
+                        // Mirror coordinates
+                        if ((int) coord < 0) {
+                                coord = -coord;
+                                assert((int) coord >= 0);
+                        } else if ((int) coord >= dim_end) {
+                                coord = 2.0f * dim_end - coord - conv_eps;
+                                assert((int) coord < dim_end);
+                        }
 
-                        // Reset the sampling coordinates
-                        coords[dim] += step;
+                        // Fold the linear interpolation into the taps
+                        samp_lo[samp_idx] = (int) coord;
+                        frac = coord - (float) samp_lo[samp_idx];
+                        samp_w[2 * samp_idx] = tap * (1.0f - frac);
+                        samp_w[2 * samp_idx + 1] = tap * frac;
                 }
+        }
 
-	SIFT3D_IM_LOOP_END_C
+        // Get the interior positions, which can be folded
+        if (fold && width % 2 == 1 && fold_step >= 1 && 
+                (float) fold_step == unit_factor) {
+                fold_start = half_width * fold_step;
+                fold_end = n - 2 - half_width * fold_step;
+        } else {
+                fold_start = 0;
+                fold_end = -1;
+        }
 
-        // Second pass: process the boundaries
-#pragma omp parallel for private(x) private(y) private(c)
-        SIFT3D_IM_LOOP_START_C(dst, x, y, z, c)
+        // Filter the tiles
+        ct.src = src;
+        ct.dst = dst;
+        ct.dim = dim;
+        ct.f = f;
+        ct.samp_lo = samp_lo;
+        ct.samp_w = samp_w;
+        ct.fold_start = fold_start;
+        ct.fold_end = fold_end;
+        ct.fold_step = fold_step;
+        ct.iir = NULL;
+        ct.margin = 0;
+        ret = run_convolve_tiles(&ct);
+
+        free(samp_lo);
+        free(samp_w);
+
+        return ret;
+}
+
+/* Helper function for convolve_sep_tiles and recursive_gauss_sep. Resizes
+ * ct->dst, unless filtering in place, then filters ct->src in parallel. The 
+ * caller fills in the fields of ct describing the filter, and this function
+ * fills in the rest.
+ *
+ * Return: SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+static int run_convolve_tiles(Convolve_tiles *const ct) {
 
-                const int i_coords[] = { x, y, z };
+        int n, tile_len, num_tiles, num_outer, num_tasks, num_chunks, chunk, 
+                ret;
 
-                // Skip pixels we have already processed
-                if (i_coords[dim] >= start[dim] && i_coords[dim] <= end[dim]) 
-                        continue;
+        const Image *const src = ct->src;
+        Image *const dst = ct->dst;
+        const int dim = ct->dim;
+        const int nc = src->nc;
+        const int tile_dim = dim == 0 ? 1 : 0;
+        const int outer_dim = dim == 2 ? 1 : 2;
 
-                // Process the boundary pixel
-                for (d = -half_width; d <= half_width; d++) {
+	// Resize the output, with the default stride, unless filtering in place
+        if (dst != src) {
+                if (im_copy_dims(src, dst))
+                        return SIFT3D_FAILURE;
+                im_default_stride(dst);
+                if (im_resize(dst))
+                        return SIFT3D_FAILURE;
+        }
 
-                        float coords[] = { x, y, z };
-                        const float tap = f->kernel[d + half_width];
-                        const float step = d * unit_factor;
+        // Divide the image into tasks. Each task is a tile of lines, 
+        // adjacent in tile_dim, at a single position in outer_dim. Tile x 
+        // where possible, since it is contiguous.
+        n = SIFT3D_IM_GET_DIMS(src)[dim] + 2 * ct->margin;
+        tile_len = SIFT3D_CONV_TILE_BYTES / (n * nc * sizeof(float));
+        tile_len = SIFT3D_MAX(SIFT3D_MIN(tile_len, 
+                SIFT3D_IM_GET_DIMS(src)[tile_dim]), 1);
+        num_tiles = (SIFT3D_IM_GET_DIMS(src)[tile_dim] + tile_len - 1) / 
+                tile_len;
+        num_outer = SIFT3D_IM_GET_DIMS(src)[outer_dim];
+        num_tasks = num_tiles * num_outer;
+
+        // Check if the tiles can be read or written without reordering
+        ct->direct_in = tile_dim == 0 && src->xs == (size_t) nc;
+        ct->direct_out = tile_dim == 0 && dst->xs == (size_t) nc;
+
+        // Save the rest of the arguments for the tasks
+        ct->kernels = get_convolve_kernels();
+        ct->tile_dim = tile_dim;
+        ct->outer_dim = outer_dim;
+        ct->tile_len = tile_len;
+        ct->num_tiles = num_tiles;
+
+        // Group the tasks into chunks, each with its own buffer
+        num_chunks = SIFT3D_MIN(num_tasks, SIFT3D_CONV_MAX_CHUNKS);
+
+        ret = SIFT3D_SUCCESS;
+#ifdef SIFT3D_OMP_TASKS
+        if (omp_in_parallel()) {
+                // Share the chunks with the rest of the team, e.g. when 
+                // called from a task in build_pyramids
+#pragma omp taskloop grainsize(1) shared(ret)
+                for (chunk = 0; chunk < num_chunks; chunk++) {
+                        if (convolve_tiles(ct, chunk * num_tasks / num_chunks,
+                                (chunk + 1) * num_tasks / num_chunks))
+                                ret = SIFT3D_FAILURE;
+                }
+        } else
+#endif
+        {
+#pragma omp parallel for schedule(dynamic)
+                for (chunk = 0; chunk < num_chunks; chunk++) {
+                        if (convolve_tiles(ct, chunk * num_tasks / num_chunks,
+                                (chunk + 1) * num_tasks / num_chunks))
+                                ret = SIFT3D_FAILURE;
+                }
+        }
 
-                        // Adjust the sampling coordinates
-                        coords[dim] -= step;
+        return ret;
+}
 
-                        // Mirror coordinates
-                        if ((int) coords[dim] < 0) {
-                                coords[dim] = -coords[dim];
-                                assert((int) coords[dim] >= 0);
-                        } else if ((int) coords[dim] >= dim_end) {
-                                coords[dim] = 2.0f * dim_end - coords[dim] -    
-                                        conv_eps;
-                                assert((int) coords[dim] < dim_end);
+/* Helper function for run_convolve_tiles. Filters the tiles numbered 
+ * task_start through task_end - 1, using a buffer of its own.
+ *
+ * Return: SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+static int convolve_tiles(const Convolve_tiles *const ct, const int task_start,
+        const int task_end)
+{
+        float *buf;
+        int task;
+
+        const Image *const src = ct->src;
+        Image *const dst = ct->dst;
+        const size_t *const src_strides = SIFT3D_IM_GET_STRIDES(src);
+        const size_t *const dst_strides = SIFT3D_IM_GET_STRIDES(dst);
+        const int dim = ct->dim;
+        const int tile_dim = ct->tile_dim;
+        const int n = SIFT3D_IM_GET_DIMS(src)[dim];
+        const int nc = src->nc;
+        const int margin = ct->margin;
+        const int width = ct->iir == NULL ? ct->f->width : 0;
+        const int half_width = width / 2;
+
+        // Allocate a buffer for the lines and their margins, and one line of
+        // output
+        if ((buf = (float *) malloc((size_t) (n + 2 * margin + 1) * 
+                ct->tile_len * nc * sizeof(float))) == NULL)
+                return SIFT3D_FAILURE;
+
+        for (task = task_start; task < task_end; task++) {
+
+                size_t src_offset, dst_offset;
+                float *lines;
+                int coords[IM_NDIMS];
+                int pos, len, run, r, c;
+
+                const int tile = task % ct->num_tiles;
+                const int outer = task / ct->num_tiles;
+
+                // Get the coordinates of this task's first voxel
+                coords[dim] = 0;
+                coords[tile_dim] = tile * ct->tile_len;
+                coords[ct->outer_dim] = outer;
+                src_offset = SIFT3D_IM_GET_IDX(src, coords[0], coords[1], 
+                        coords[2], 0);
+                dst_offset = SIFT3D_IM_GET_IDX(dst, coords[0], coords[1], 
+                        coords[2], 0);
+
+                // Get the number of lines, and floats per line position
+                len = SIFT3D_MIN(ct->tile_len, 
+                        SIFT3D_IM_GET_DIMS(src)[tile_dim] - coords[tile_dim]);
+                run = len * nc;
+                lines = buf + margin * run;
+
+                // Gather the lines
+                for (pos = 0; pos < n; pos++) {
+
+                        const float *const in = src->data + src_offset + 
+                                pos * src_strides[dim];
+                        float *const line = lines + pos * run;
+
+                        if (ct->direct_in) {
+                                memcpy(line, in, run * sizeof(float));
+                                continue;
                         }
 
-                        // Sample
-                        SAMP_AND_ACC(src, dst, tap, coords, c);
+                        for (r = 0; r < len; r++) {
+                        for (c = 0; c < nc; c++) {
+                                line[r * nc + c] = 
+                                        in[r * src_strides[tile_dim] + c];
+                        }
+                        }
                 }
 
-	SIFT3D_IM_LOOP_END_C 
+                // Apply a recursive filter in place, then write the lines
+                if (ct->iir != NULL) {
+
+                        // Mirror the lines into the margins
+                        for (pos = 1; pos <= margin; pos++) {
+                                memcpy(lines - pos * run, lines + pos * run,
+                                        run * sizeof(float));
+                                memcpy(lines + (n - 1 + pos) * run, 
+                                        lines + (n - 1 - pos) * run,
+                                        run * sizeof(float));
+                        }
+
+                        recursive_gauss_lines(buf, n + 2 * margin, run, 
+                                ct->iir);
+                }
+
+                // Write each position back to the same place in dst
+                for (pos = 0; pos < n; pos++) {
+
+                        float *line_out;
+
+                        float *const out = dst->data + dst_offset + 
+                                pos * dst_strides[dim];
+
+                        if (ct->iir != NULL) {
+                                // Already filtered
+                                line_out = lines + pos * run;
+                        } else {
+                                // Convolve
+                                const int samp_idx = pos * width;
+
+                                line_out = ct->direct_out ? out : 
+                                        lines + n * run;
+                                if (pos >= ct->fold_start && 
+                                        pos <= ct->fold_end) {
+                                        ct->kernels.sym(lines + pos * run, 
+                                                line_out, run, half_width, 
+                                                ct->fold_step, 
+                                                ct->f->kernel + half_width);
+                                } else {
+                                        ct->kernels.gen(lines, line_out, run, 
+                                                width, ct->samp_lo + samp_idx,
+                                                ct->samp_w + 2 * samp_idx);
+                                }
+
+                                if (ct->direct_out)
+                                        continue;
+                        }
+
+                        if (ct->direct_out) {
+                                memcpy(out, line_out, run * sizeof(float));
+                                continue;
+                        }
 
-#undef SAMP_AND_ACC
+                        for (r = 0; r < len; r++) {
+                        for (c = 0; c < nc; c++) {
+                                out[r * dst_strides[tile_dim] + c] = 
+                                        line_out[r * nc + c];
+                        }
+                        }
+                }
+        }
+
+        free(buf);
 
         return SIFT3D_SUCCESS;
 }
 
+/* Helper function for convolve_sep_tiles. Computes one position of a tile of 
+ * lines, as a weighted sum of the line positions given by lo.
+ *
+ * Parameters:
+ *  -buf: The lines, with run floats per line position.
+ *  -out: The output, of length run.
+ *  -run: The number of floats per line position.
+ *  -width: The number of filter taps.
+ *  -lo: The line position sampled by each tap. Each tap also samples the 
+ *      following position, for linear interpolation.
+ *  -w: The weights of positions lo[j] and lo[j] + 1, interleaved. */
+static void convolve_line_scalar(const float *const buf, float *const out,
+        const int run, const int width, const int *const lo, 
+        const float *const w)
+{
+        int j, k;
+
+        for (k = 0; k < run; k++) {
+                out[k] = 0.0f;
+        }
+
+        for (j = 0; j < width; j++) {
+
+                const float w_lo = w[2 * j];
+                const float w_hi = w[2 * j + 1];
+                const float *const in_lo = buf + lo[j] * run;
+                const float *const in_hi = in_lo + run;
+
+                for (k = 0; k < run; k++) {
+                        out[k] += w_lo * in_lo[k] + w_hi * in_hi[k];
+                }
+        }
+}
+
+/* Helper function for convolve_sep_tiles. As convolve_line_scalar, but for 
+ * interior positions of symmetric filters, where the taps fall on whole 
+ * voxels. 
+ *
+ * Parameters:
+ *  -center: The line position at the center of the filter.
+ *  -out: The output, of length run.
+ *  -run: The number of floats per line position.
+ *  -half_width: The number of taps on either side of the center.
+ *  -step: The number of line positions between taps.
+ *  -taps: The center tap, followed by the taps on one side. */
+static void convolve_line_sym_scalar(const float *const center, 
+        float *const out, const int run, const int half_width, 
+        const int step, const float *const taps)
+{
+        int d, k;
+
+        for (k = 0; k < run; k++) {
+                out[k] = taps[0] * center[k];
+        }
+
+        for (d = 1; d <= half_width; d++) {
+
+                const float tap = taps[d];
+                const float *const below = center - d * step * run;
+                const float *const above = center + d * step * run;
+
+                for (k = 0; k < run; k++) {
+                        out[k] += tap * (below[k] + above[k]);
+                }
+        }
+}
+
+#ifdef SIFT3D_X86_DISPATCH
+/* As convolve_line_scalar, but processes 8 voxels at a time with AVX2. */
+__attribute__((target("avx2,fma")))
+static void convolve_line_avx2(const float *const buf, float *const out,
+        const int run, const int width, const int *const lo, 
+        const float *const w)
+{
+        int j, k;
+
+        for (k = 0; k + 8 <= run; k += 8) {
+
+                __m256 acc = _mm256_setzero_ps();
+
+                for (j = 0; j < width; j++) {
+
+                        const float *const in_lo = buf + lo[j] * run + k;
+
+                        acc = _mm256_fmadd_ps(_mm256_set1_ps(w[2 * j]), 
+                                _mm256_loadu_ps(in_lo), acc);
+                        acc = _mm256_fmadd_ps(_mm256_set1_ps(w[2 * j + 1]), 
+                                _mm256_loadu_ps(in_lo + run), acc);
+                }
+
+                _mm256_storeu_ps(out + k, acc);
+        }
+
+        // Process the remainder
+        for (; k < run; k++) {
+
+                float acc = 0.0f;
+
+                for (j = 0; j < width; j++) {
+
+                        const float *const in_lo = buf + lo[j] * run + k;
+
+                        acc += w[2 * j] * in_lo[0] + w[2 * j + 1] * in_lo[run];
+                }
+
+                out[k] = acc;
+        }
+}
+
+/* As convolve_line_scalar, but processes 16 voxels at a time with AVX-512. */
+__attribute__((target("avx512f")))
+static void convolve_line_avx512(const float *const buf, float *const out,
+        const int run, const int width, const int *const lo, 
+        const float *const w)
+{
+        int j, k;
+
+        for (k = 0; k < run; k += 16) {
+
+                // Mask off the remainder on the last iteration
+                const __mmask16 mask = run - k >= 16 ? 0xffff : 
+                        (__mmask16) ((1 << (run - k)) - 1);
+                __m512 acc = _mm512_setzero_ps();
+
+                for (j = 0; j < width; j++) {
+
+                        const float *const in_lo = buf + lo[j] * run + k;
+
+                        acc = _mm512_fmadd_ps(_mm512_set1_ps(w[2 * j]), 
+                                _mm512_maskz_loadu_ps(mask, in_lo), acc);
+                        acc = _mm512_fmadd_ps(_mm512_set1_ps(w[2 * j + 1]), 
+                                _mm512_maskz_loadu_ps(mask, in_lo + run), acc);
+                }
+
+                _mm512_mask_storeu_ps(out + k, mask, acc);
+        }
+}
+
+/* As convolve_line_sym_scalar, but processes 8 voxels at a time with AVX2. */
+__attribute__((target("avx2,fma")))
+static void convolve_line_sym_avx2(const float *const center, 
+        float *const out, const int run, const int half_width, 
+        const int step, const float *const taps)
+{
+        int d, k;
+
+        const int skip = step * run;
+
+        for (k = 0; k + 8 <= run; k += 8) {
+
+                __m256 acc = _mm256_mul_ps(_mm256_set1_ps(taps[0]), 
+                        _mm256_loadu_ps(center + k));
+
+                for (d = 1; d <= half_width; d++) {
+
+                        const __m256 pair = _mm256_add_ps(
+                                _mm256_loadu_ps(center + k - d * skip),
+                                _mm256_loadu_ps(center + k + d * skip));
+
+                        acc = _mm256_fmadd_ps(_mm256_set1_ps(taps[d]), pair, 
+                                acc);
+                }
+
+                _mm256_storeu_ps(out + k, acc);
+        }
+
+        // Process the remainder
+        for (; k < run; k++) {
+
+                float acc = taps[0] * center[k];
+
+                for (d = 1; d <= half_width; d++) {
+                        acc += taps[d] * (center[k - d * skip] + 
+                                center[k + d * skip]);
+                }
+
+                out[k] = acc;
+        }
+}
+
+/* As convolve_line_sym_scalar, but processes 16 voxels at a time with 
+ * AVX-512. */
+__attribute__((target("avx512f")))
+static void convolve_line_sym_avx512(const float *const center, 
+        float *const out, const int run, const int half_width, 
+        const int step, const float *const taps)
+{
+        int d, k;
+
+        const int skip = step * run;
+
+        for (k = 0; k < run; k += 16) {
+
+                // Mask off the remainder on the last iteration
+                const __mmask16 mask = run - k >= 16 ? 0xffff : 
+                        (__mmask16) ((1 << (run - k)) - 1);
+                __m512 acc = _mm512_mul_ps(_mm512_set1_ps(taps[0]), 
+                        _mm512_maskz_loadu_ps(mask, center + k));
+
+                for (d = 1; d <= half_width; d++) {
+
+                        const __m512 pair = _mm512_add_ps(
+                                _mm512_maskz_loadu_ps(mask, 
+                                        center + k - d * skip),
+                                _mm512_maskz_loadu_ps(mask, 
+                                        center + k + d * skip));
+
+                        acc = _mm512_fmadd_ps(_mm512_set1_ps(taps[d]), pair, 
+                                acc);
+                }
+
+                _mm512_mask_storeu_ps(out + k, mask, acc);
+        }
+}
+#endif
+
+/* Returns the fastest convolve_line_* kernels supported by this CPU. */
+static Convolve_kernels get_convolve_kernels(void)
+{
+        Convolve_kernels kernels;
+
+        kernels.gen = convolve_line_scalar;
+        kernels.sym = convolve_line_sym_scalar;
+
+#ifdef SIFT3D_X86_DISPATCH
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+                kernels.gen = convolve_line_avx512;
+                kernels.sym = convolve_line_sym_avx512;
+        } else if (__builtin_cpu_supports("avx2") && 
+                __builtin_cpu_supports("fma")) {
+                kernels.gen = convolve_line_avx2;
+                kernels.sym = convolve_line_sym_avx2;
+        }
+#endif
+
+        return kernels;
+}
+
 /* Same as convolve_sep, but with OpenCL acceleration. This does NOT
  * read back the results to C-accessible data. Use im_read_back for that. */
 SIFT3D_IGNORE_UNUSED
@@ -2593,14 +3420,146 @@ static int convolve_sep_cl(const Image * const src, Image * const dst,
 #endif
 }
 
- /* Convolve_sep for symmetric filters. */
+/* Convolve_sep for symmetric filters. Folds the mirrored taps when they 
+ * fall on whole voxels, which includes the common case of filtering in the 
+ * image's own units. Otherwise, this is the same as convolve_sep_gen. */
 static int convolve_sep_sym(const Image * const src, Image * const dst,
 			    const Sep_FIR_filter * const f, const int dim,
                             const double unit)
 {
+        return convolve_sep_tiles(src, dst, f, dim, unit, SIFT3D_TRUE);
+}
+
+/* Smooths an image along one dimension with a recursive approximation of 
+ * the Gaussian filter, due to Young and van Vliet (1995). The cost per voxel
+ * does not depend on sigma. The lines are extended by mirroring at the 
+ * boundaries, as in convolve_sep_gen. 
+ *
+ * Parameters:
+ *  -src: The input image.
+ *  -dst: The output image. May be the same as src.
+ *  -sigma: The scale parameter, in voxels of src along dim. Must be at least
+ *      gauss_recursive_min_sigma.
+ *  -dim: The dimension to filter.
+ *
+ * Return: SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+static int recursive_gauss_sep(const Image *const src, Image *const dst,
+        const double sigma, const int dim) {
+
+        Convolve_tiles ct;
+        float coeffs[4];
+
+        const int n = SIFT3D_IM_GET_DIMS(src)[dim];
+
+        if (get_recursive_gauss_coeffs(sigma, coeffs))
+                return SIFT3D_FAILURE;
+
+        // Warm up the recursion on the mirrored margins, which cover the 
+        // same support as the FIR filter
+        ct.margin = SIFT3D_MIN((int) ceil(SIFT3D_GAUSS_WIDTH_FCTR * sigma) * 
+                2, n - 1);
+
+        // Filter the tiles
+        ct.src = src;
+        ct.dst = dst;
+        ct.dim = dim;
+        ct.iir = coeffs;
+        ct.f = NULL;
+        ct.samp_lo = NULL;
+        ct.samp_w = NULL;
+        ct.fold_start = 0;
+        ct.fold_end = -1;
+        ct.fold_step = 0;
+        return run_convolve_tiles(&ct);
+}
+
+/* Helper function to compute the coefficients of the recursive Gaussian 
+ * filter, as in Young and van Vliet (1995).
+ *
+ * Parameters:
+ *  -sigma: The scale parameter, in voxels.
+ *  -coeffs: An array of length 4. On return, holds the input weight,
+ *      followed by the weights of the three previous outputs.
+ *
+ * Return: SIFT3D_SUCCESS on success, SIFT3D_FAILURE if sigma is too small. */
+static int get_recursive_gauss_coeffs(const double sigma, float *const coeffs) {
+
+        double q, q2, q3, b0, b1, b2, b3;
+
+        if (sigma < gauss_recursive_min_sigma) {
+                SIFT3D_ERR("get_recursive_gauss_coeffs: sigma (%f) must be at "
+                        "least %f \n", sigma, gauss_recursive_min_sigma);
+                return SIFT3D_FAILURE;
+        }
+
+        q = sigma >= 2.5 ? 0.98711 * sigma - 0.96330 :
+                3.97156 - 4.14554 * sqrt(1.0 - 0.26891 * sigma);
+        q2 = q * q;
+        q3 = q2 * q;
+
+        b0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+        b1 = 2.44413 * q + 2.85619 * q2 + 1.26661 * q3;
+        b2 = -(1.4281 * q2 + 1.26661 * q3);
+        b3 = 0.422205 * q3;
+
+        coeffs[0] = (float) (1.0 - (b1 + b2 + b3) / b0);
+        coeffs[1] = (float) (b1 / b0);
+        coeffs[2] = (float) (b2 / b0);
+        coeffs[3] = (float) (b3 / b0);
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Helper function to apply the recursive Gaussian filter to a tile of lines,
+ * in place. The recursion starts from the steady state of a constant line 
+ * at each end.
+ *
+ * Parameters:
+ *  -buf: The lines, with run floats per line position.
+ *  -len: The number of line positions.
+ *  -run: The number of floats per line position.
+ *  -coeffs: The output of get_recursive_gauss_coeffs. */
+static void recursive_gauss_lines(float *const buf, const int len, 
+        const int run, const float *const coeffs) {
+
+        int pos, k;
+
+        const float B = coeffs[0];
+        const float a1 = coeffs[1];
+        const float a2 = coeffs[2];
+        const float a3 = coeffs[3];
+
+        // Causal pass. The first position is unchanged.
+        for (pos = 1; pos < len; pos++) {
+
+                float *const cur = buf + pos * run;
+                const float *const prev1 = buf + (pos - 1) * run;
+                const float *const prev2 = buf + SIFT3D_MAX(pos - 2, 0) * run;
+                const float *const prev3 = buf + SIFT3D_MAX(pos - 3, 0) * run;
+
+#pragma omp simd
+                for (k = 0; k < run; k++) {
+                        cur[k] = B * cur[k] + a1 * prev1[k] + a2 * prev2[k] + 
+                                a3 * prev3[k];
+                }
+        }
+
+        // Anti-causal pass. The last position is unchanged.
+        for (pos = len - 2; pos >= 0; pos--) {
 
-	// TODO: Symmetry-specific function
-	return convolve_sep_gen(src, dst, f, dim, unit);
+                float *const cur = buf + pos * run;
+                const float *const next1 = buf + (pos + 1) * run;
+                const float *const next2 = buf + 
+                        SIFT3D_MIN(pos + 2, len - 1) * run;
+                const float *const next3 = buf + 
+                        SIFT3D_MIN(pos + 3, len - 1) * run;
+
+#pragma omp simd
+                for (k = 0; k < run; k++) {
+                        cur[k] = B * cur[k] + a1 * next1[k] + a2 * next2[k] + 
+                                a3 * next3[k];
+                }
+        }
 }
 
 /* Permute the dimensions of an image.
@@ -3107,6 +4066,88 @@ int mul_Mat_rm(const Mat_rm * const mat_in1, const Mat_rm * const mat_in2,
 	return SIFT3D_SUCCESS;
 }
 
+/* Computes mat_out = mat_in1 * transpose(mat_in2), where mat_in1 is [m x k]
+ * and mat_in2 is [n x k], so each element of the [m x n] output is the dot 
+ * product of a row of mat_in1 and a row of mat_in2. 
+ *
+ * FLOAT and DOUBLE matrices are multiplied by BLAS, which is much faster 
+ * than mul_Mat_rm for large matrices.
+ *
+ * This function resizes mat_out and sets its type to that of the inputs. */
+int mul_Mat_rm_trans(const Mat_rm * const mat_in1, 
+        const Mat_rm * const mat_in2, Mat_rm * const mat_out)
+{
+
+	int i, j, k;
+
+        const char transa = 'T';
+        const char transb = 'N';
+        const fortran_int m = mat_in1->num_rows;
+        const fortran_int n = mat_in2->num_rows;
+        const fortran_int len = mat_in1->num_cols;
+
+	// Verify inputs
+	if (mat_in1->num_cols != mat_in2->num_cols ||
+	    mat_in1->type != mat_in2->type) {
+                SIFT3D_ERR("mul_Mat_rm_trans: invalid input dimensions "
+                        "or types \n");
+		return SIFT3D_FAILURE;
+        }
+
+	// Resize mat_out
+	mat_out->type = mat_in1->type;
+	mat_out->num_rows = mat_in1->num_rows;
+	mat_out->num_cols = mat_in2->num_rows;
+	if (resize_Mat_rm(mat_out))
+		return SIFT3D_FAILURE;
+
+        // Handle empty products, which BLAS does not accept
+        if (m < 1 || n < 1)
+                return SIFT3D_SUCCESS;
+        if (len < 1)
+                return zero_Mat_rm(mat_out);
+
+        // In column-major order, the output is transpose(mat_out) = 
+        // mat_in2 * transpose(mat_in1), where the inputs are transposed
+	switch (mat_out->type) {
+	case DOUBLE:
+        {
+                const double alpha = 1.0;
+                const double beta = 0.0;
+
+                dgemm_(&transa, &transb, &n, &m, &len, &alpha, 
+                        mat_in2->u.data_double, &len, mat_in1->u.data_double, 
+                        &len, &beta, mat_out->u.data_double, &n);
+		break;
+        }
+	case FLOAT:
+        {
+                const float alpha = 1.0f;
+                const float beta = 0.0f;
+
+                sgemm_(&transa, &transb, &n, &m, &len, &alpha, 
+                        mat_in2->u.data_float, &len, mat_in1->u.data_float, 
+                        &len, &beta, mat_out->u.data_float, &n);
+		break;
+        }
+	case INT:
+                SIFT3D_MAT_RM_LOOP_START(mat_out, i, j)
+                        int acc = 0;
+                        for (k = 0; k < mat_in1->num_cols; k++) {
+                                acc += SIFT3D_MAT_RM_GET(mat_in1, i, k, int) *
+                                        SIFT3D_MAT_RM_GET(mat_in2, j, k, int);
+                        }
+                        SIFT3D_MAT_RM_GET(mat_out, i, j, int) = acc;
+                SIFT3D_MAT_RM_LOOP_END
+                break;
+	default:
+		SIFT3D_ERR("mul_Mat_rm_trans: unknown type \n");
+		return SIFT3D_FAILURE;
+	}
+
+	return SIFT3D_SUCCESS;
+}
+
 /* Computes the eigendecomposition of a real symmetric matrix, 
  * A = Q * diag(L) * Q', where Q is a real orthogonal matrix and L is a real 
  * diagonal matrix.
@@ -3216,6 +4257,138 @@ int eigen_Mat_rm(Mat_rm * A, Mat_rm * Q, Mat_rm * L)
 	return SIFT3D_FAILURE;
 }
 
+/* Computes the eigendecomposition of a symmetric 3x3 matrix by the cyclic
+ * Jacobi method, without allocating memory. This is much faster than 
+ * eigen_Mat_rm for small matrices, and just as accurate.
+ *
+ * Parameters:
+ *  -A: The matrix, as an array of 9 doubles in row-major order. Only the 
+ *      upper triangle is read.
+ *  -Q: If not NULL, an array of 9 doubles in row-major order. On return,
+ *      the columns are the unit eigenvectors.
+ *  -L: An array of 3 doubles. On return, the eigenvalues, in ascending order.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE if the iteration does 
+ * not converge, e.g. if A contains NaN. */
+int eigen_sym_3x3(const double *const A, double *const Q, double *const L)
+{
+	double a[3][3], v[3][3];
+	int i, j, k, p, q, sweep;
+
+	const int max_sweeps = 50;
+
+	// Copy the upper triangle of A, and initialize the eigenvectors
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 3; j++) {
+			a[i][j] = i <= j ? A[i * 3 + j] : A[j * 3 + i];
+			v[i][j] = i == j ? 1.0 : 0.0;
+		}
+	}
+
+	for (sweep = 0; sweep < max_sweeps; sweep++) {
+
+		// Stop when the off-diagonal part vanishes
+		if (a[0][1] == 0.0 && a[0][2] == 0.0 && a[1][2] == 0.0)
+			break;
+
+		// Rotate each off-diagonal element to zero
+		for (p = 0; p < 2; p++) {
+			for (q = p + 1; q < 3; q++) {
+
+				double theta, t, c, s;
+
+				const double apq = a[p][q];
+				const double app = a[p][p];
+				const double aqq = a[q][q];
+
+				if (apq == 0.0)
+					continue;
+
+				// Flush elements which no longer affect the 
+				// diagonal
+				if (sweep > 3 && 
+				    fabs(app) + 100.0 * fabs(apq) == fabs(app) &&
+				    fabs(aqq) + 100.0 * fabs(apq) == fabs(aqq)) {
+					a[p][q] = a[q][p] = 0.0;
+					continue;
+				}
+
+				// Compute the rotation
+				theta = (aqq - app) / (2.0 * apq);
+				t = 1.0 / (fabs(theta) + sqrt(theta * theta + 1.0));
+				if (theta < 0.0)
+					t = -t;
+				c = 1.0 / sqrt(t * t + 1.0);
+				s = t * c;
+
+				// Apply it to the columns, then the rows of a
+				for (k = 0; k < 3; k++) {
+					const double akp = a[k][p];
+					const double akq = a[k][q];
+					a[k][p] = c * akp - s * akq;
+					a[k][q] = s * akp + c * akq;
+				}
+				for (k = 0; k < 3; k++) {
+					const double apk = a[p][k];
+					const double aqk = a[q][k];
+					a[p][k] = c * apk - s * aqk;
+					a[q][k] = s * apk + c * aqk;
+				}
+				a[p][q] = a[q][p] = 0.0;
+
+				// Accumulate the eigenvectors
+				for (k = 0; k < 3; k++) {
+					const double vkp = v[k][p];
+					const double vkq = v[k][q];
+					v[k][p] = c * vkp - s * vkq;
+					v[k][q] = s * vkp + c * vkq;
+				}
+			}
+		}
+	}
+
+	if (sweep == max_sweeps) {
+		SIFT3D_ERR("eigen_sym_3x3: failed to converge \n");
+		return SIFT3D_FAILURE;
+	}
+
+	// Sort the eigenvalues in ascending order
+	for (i = 0; i < 3; i++) {
+		L[i] = a[i][i];
+	}
+	for (i = 0; i < 3; i++) {
+
+		int min_idx = i;
+
+		for (j = i + 1; j < 3; j++) {
+			if (L[j] < L[min_idx])
+				min_idx = j;
+		}
+
+		if (min_idx != i) {
+			const double tmp = L[i];
+			L[i] = L[min_idx];
+			L[min_idx] = tmp;
+			for (k = 0; k < 3; k++) {
+				const double vtmp = v[k][i];
+				v[k][i] = v[k][min_idx];
+				v[k][min_idx] = vtmp;
+			}
+		}
+	}
+
+	// Optionally return the eigenvectors
+	if (Q != NULL) {
+		for (i = 0; i < 3; i++) {
+			for (j = 0; j < 3; j++) {
+				Q[i * 3 + j] = v[i][j];
+			}
+		}
+	}
+
+	return SIFT3D_SUCCESS;
+}
+
 /* Solves the system AX=B exactly. A must be a square matrix.
  * This function first computes the reciprocal condition number of A.
  * If it is below the parameter "limit", it returns SIFT3D_SINGULAR. If limit 
@@ -3602,8 +4775,10 @@ int apply_Sep_FIR_filter(const Image * const src, Image * const dst,
 			 Sep_FIR_filter * const f, const double unit)
 {
 
+#ifdef SIFT3D_USE_OPENCL
 	Image temp;
 	Image *cur_src, *cur_dst;
+#endif
 	int i;
 
         const double unit_default = -1.0;
@@ -3619,6 +4794,7 @@ int apply_Sep_FIR_filter(const Image * const src, Image * const dst,
         if (im_copy_dims(src, dst))
                 return SIFT3D_FAILURE; 
 
+#ifdef SIFT3D_USE_OPENCL
 	// Allocate temporary storage
 	init_im(&temp);
 	if (im_copy_data(src, &temp))
@@ -3642,29 +4818,8 @@ int apply_Sep_FIR_filter(const Image * const src, Image * const dst,
                 const double unit_arg = unit == unit_default ?
                         SIFT3D_IM_GET_UNITS(src)[i] : unit;
 
-#ifdef SIFT3D_USE_OPENCL
                 convolve_sep(cur_src, cur_dst, f, i, unit_arg);
 		SWAP_BUFFERS
-#else
-                // Transpose so that the filter dimension is x
-                if (i != 0) {
-                        if (im_permute(cur_src, 0, i, cur_dst))
-				goto apply_sep_f_quit;
-                        SWAP_BUFFERS
-                }
-
-		// Apply the filter
-		convolve_sep(cur_src, cur_dst, f, 0, unit_arg);
-		SWAP_BUFFERS
-
-                // Transpose back
-                if (i != 0) {
-			if (im_permute(cur_src, 0, i, cur_dst))
-				goto apply_sep_f_quit;
-                        SWAP_BUFFERS
-
-		}
-#endif
 	}
 
 	// Swap back
@@ -3683,6 +4838,85 @@ int apply_Sep_FIR_filter(const Image * const src, Image * const dst,
 apply_sep_f_quit:
 	im_free(&temp);
 	return SIFT3D_FAILURE;
+#else
+        // Filter x into dst, then filter y and z in place, without transposing
+	for (i = 0; i < IM_NDIMS; i++) {
+
+                // Check for default parameters
+                const double unit_arg = unit == unit_default ?
+                        SIFT3D_IM_GET_UNITS(src)[i] : unit;
+
+                if (convolve_sep(i == 0 ? src : dst, dst, f, i, unit_arg))
+                        return SIFT3D_FAILURE;
+	}
+
+	return SIFT3D_SUCCESS;
+#endif
+}
+
+/* Apply a Gaussian filter in multiple dimensions. If gauss->recursive is 
+ * false, this is the same as apply_Sep_FIR_filter with gauss->f. Otherwise,
+ * each dimension where sigma spans at least gauss_recursive_min_sigma voxels
+ * is filtered with a recursive approximation, whose cost does not depend on 
+ * sigma. See get_recursive_error_Gauss_filter for its accuracy.
+ *
+ * Parameters:
+ *  -src: The input image.
+ *  -dst: The filtered image.
+ *  -gauss: The filter to apply.
+ *  -unit: The physical units of the filter kernel. Use -1.0 for the default,
+ *      which is the same units as src.
+ *
+ * Return: SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int apply_Gauss_filter(const Image *const src, Image *const dst,
+        const Gauss_filter *const gauss, const double unit)
+{
+        Sep_FIR_filter *const f = (Sep_FIR_filter *) &gauss->f;
+
+#ifdef SIFT3D_USE_OPENCL
+        return apply_Sep_FIR_filter(src, dst, f, unit);
+#else
+        int i;
+
+        const double unit_default = -1.0;
+
+        if (!gauss->recursive)
+                return apply_Sep_FIR_filter(src, dst, f, unit);
+
+        // Verify inputs
+        if (unit < 0 && unit != unit_default) {
+                SIFT3D_ERR("apply_Gauss_filter: invalid unit: %f, use "
+                        "%f for default \n", unit, unit_default);
+                return SIFT3D_FAILURE;
+        }
+
+        // Resize the output
+        if (im_copy_dims(src, dst))
+                return SIFT3D_FAILURE; 
+
+        // Filter x into dst, then filter y and z in place
+	for (i = 0; i < IM_NDIMS; i++) {
+
+                // Check for default parameters
+                const double unit_arg = unit == unit_default ?
+                        SIFT3D_IM_GET_UNITS(src)[i] : unit;
+                const double sigma_vox = gauss->sigma * unit_arg / 
+                        SIFT3D_IM_GET_UNITS(src)[i];
+                const Image *const cur_src = i == 0 ? src : dst;
+
+                // Use the FIR filter where sigma is too small
+                if (sigma_vox < gauss_recursive_min_sigma) {
+                        if (convolve_sep(cur_src, dst, f, i, unit_arg))
+                                return SIFT3D_FAILURE;
+                        continue;
+                }
+
+                if (recursive_gauss_sep(cur_src, dst, sigma_vox, i))
+                        return SIFT3D_FAILURE;
+	}
+
+	return SIFT3D_SUCCESS;
+#endif
 }
 
 /* Initialize a separable FIR filter struct with the given parameters. If OpenCL
@@ -3777,6 +5011,7 @@ void init_im(Image *const im)
 {
 	im->data = NULL;
 	im->cl_valid = SIFT3D_FALSE;
+        im->data_shared = SIFT3D_FALSE;
 
 	im->ux = 1;
 	im->uy = 1;
@@ -3793,9 +5028,6 @@ void init_im(Image *const im)
  * the ratio between the width of the filter and sigma. Otherwise,
  * use the default value 3.0 
  */
-#ifndef SIFT3D_GAUSS_WIDTH_FCTR
-#define SIFT3D_GAUSS_WIDTH_FCTR 3.0
-#endif
 int init_Gauss_filter(Gauss_filter * const gauss, const double sigma,
 		      const int dim)
 {
@@ -3837,6 +5069,7 @@ int init_Gauss_filter(Gauss_filter * const gauss, const double sigma,
 
 	// Save the filter data 
 	gauss->sigma = sigma;
+        gauss->recursive = SIFT3D_FALSE;
 	if (init_Sep_FIR_filter(&gauss->f, dim, width, kernel,
 				   SIFT3D_TRUE))
                 goto init_Gauss_filter_quit;
@@ -3875,6 +5108,64 @@ int init_Gauss_incremental_filter(Gauss_filter * const gauss,
 	return SIFT3D_SUCCESS;
 }
 
+/* Measures the accuracy of the recursive approximation used by 
+ * apply_Gauss_filter, relative to gauss->f, for filtering in the filter's 
+ * own units. 
+ *
+ * On return, err is the L1 distance between the impulse responses of the two
+ * filters along one dimension. Away from the image boundaries, each voxel 
+ * filtered in three dimensions differs from the output of 
+ * apply_Sep_FIR_filter by at most err * (3 + 3 * err + err * err) times the 
+ * largest absolute value in the input. The error is zero if sigma is too 
+ * small to be approximated.
+ *
+ * Return: SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int get_recursive_error_Gauss_filter(const Gauss_filter *const gauss, 
+        double *const err) {
+
+        float coeffs[4];
+        float *line;
+        double acc;
+        int i;
+
+        const Sep_FIR_filter *const f = &gauss->f;
+        const int half_width = f->width / 2;
+        const int center = half_width + 
+                (int) ceil(4.0 * SIFT3D_GAUSS_WIDTH_FCTR * gauss->sigma);
+        const int len = 2 * center + 1;
+
+        // Small filters are never approximated
+        if (gauss->sigma < gauss_recursive_min_sigma) {
+                *err = 0.0;
+                return SIFT3D_SUCCESS;
+        }
+
+        if (get_recursive_gauss_coeffs(gauss->sigma, coeffs))
+                return SIFT3D_FAILURE;
+
+        // Get the impulse response of the recursive filter
+        if ((line = (float *) calloc(len, sizeof(float))) == NULL)
+                return SIFT3D_FAILURE;
+        line[center] = 1.0f;
+        recursive_gauss_lines(line, len, 1, coeffs);
+
+        // Compare it to the FIR filter
+        acc = 0.0;
+        for (i = 0; i < len; i++) {
+
+                const int tap = i - center + half_width;
+                const double fir = tap >= 0 && tap < f->width ? 
+                        f->kernel[tap] : 0.0;
+
+                acc += fabs((double) line[i] - fir);
+        }
+        *err = acc;
+
+        free(line);
+
+        return SIFT3D_SUCCESS;
+}
+
 /* Free a Gauss_filter */
 void cleanup_Gauss_filter(Gauss_filter * gauss)
 {
@@ -3889,6 +5180,22 @@ void init_GSS_filters(GSS_filters * const gss)
 	gss->gauss_octave = NULL;
 }
 
+/* Sets the recursive flag of every filter in a GSS_filters struct. See 
+ * apply_Gauss_filter. */
+void set_recursive_GSS_filters(GSS_filters *const gss, const int recursive)
+{
+	int i;
+
+	// We are done if gss has no filters
+	if (gss->num_filters < 1)
+		return;
+
+        gss->first_gauss.recursive = recursive;
+	for (i = 0; i < gss->num_filters; i++) {
+                gss->gauss_octave[i].recursive = recursive;
+	}
+}
+
 /* Create GSS filters to create the given scale-space 
  * pyramid. */
 int make_gss(GSS_filters * const gss, const Pyramid * const pyr)
@@ -3974,6 +5281,9 @@ void cleanup_GSS_filters(GSS_filters * const gss)
 void init_Pyramid(Pyramid * const pyr)
 {
 	pyr->levels = NULL;
+        pyr->arena = NULL;
+        pyr->arena_data = NULL;
+        pyr->arena_size = 0;
         pyr->first_level = 0;
 	pyr->num_levels = pyr->num_kp_levels = 0;
 	pyr->first_octave = 0;
@@ -3981,6 +5291,81 @@ void init_Pyramid(Pyramid * const pyr)
         pyr->sigma0 = pyr->sigma_n = 0.0;
 }
 
+/* Helper function to get the number of floats between the starts of 
+ * consecutive levels in a Pyramid arena, given the size of a level. */
+static size_t get_Pyramid_level_stride(const size_t size) {
+
+        const size_t align = SIFT3D_PYR_LEVEL_ALIGN / sizeof(float);
+
+        return (size + align - 1) / align * align;
+}
+
+/* Helper function to make room in the arena of a Pyramid for all of its 
+ * levels. The existing arena is kept if it is large enough, so that 
+ * resizing to the same dimensions allocates nothing.
+ *
+ * Parameters:
+ *  -pyr: The Pyramid, with the new number of levels and octaves.
+ *  -base_dims: The dimensions of the first octave.
+ *  -nc: The number of channels.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+static int resize_Pyramid_arena(Pyramid *const pyr, const int *const base_dims,
+        const int nc) {
+
+        int dims[IM_NDIMS];
+        size_t size, bytes, align;
+        int i, o;
+
+        const int num_total_levels = pyr->num_levels * pyr->num_octaves;
+
+        // Count the floats in all levels
+        memcpy(dims, base_dims, IM_NDIMS * sizeof(int));
+        size = 0;
+        for (o = 0; o < pyr->num_octaves; o++) {
+                size += pyr->num_levels * get_Pyramid_level_stride(
+                        (size_t) dims[0] * dims[1] * dims[2] * nc);
+                for (i = 0; i < IM_NDIMS; i++) {
+                        dims[i] /= 2;
+                }
+        }
+
+        // Keep the current arena, if possible
+        if (size <= pyr->arena_size)
+                return SIFT3D_SUCCESS;
+
+        // Detach the levels from the old arena
+        for (i = 0; i < num_total_levels; i++) {
+                Image *const level = pyr->levels + i;
+                if (level->data_shared)
+                        init_im(level);
+        }
+        if (pyr->arena != NULL)
+                free(pyr->arena);
+        pyr->arena_data = NULL;
+        pyr->arena_size = 0;
+
+        // Allocate the new arena
+        bytes = size * sizeof(float);
+        align = bytes >= SIFT3D_PYR_HUGE_PAGE_BYTES ? 
+                SIFT3D_PYR_HUGE_PAGE_BYTES : SIFT3D_PYR_LEVEL_ALIGN;
+        if ((pyr->arena = malloc(bytes + align - 1)) == NULL) {
+                SIFT3D_ERR("resize_Pyramid_arena: out of memory \n");
+                return SIFT3D_FAILURE;
+        }
+        pyr->arena_data = (float *) (((uintptr_t) pyr->arena + align - 1) & 
+                ~((uintptr_t) align - 1));
+        pyr->arena_size = size;
+
+#ifdef MADV_HUGEPAGE
+        // Ask for huge pages. This is only advice, so ignore failures.
+        if (align == SIFT3D_PYR_HUGE_PAGE_BYTES)
+                madvise(pyr->arena_data, bytes & ~(align - 1), MADV_HUGEPAGE);
+#endif
+
+        return SIFT3D_SUCCESS;
+}
+
 /* Resize a scale-space pyramid according to the size of base image im.
  *
  * Parameters:
@@ -3996,6 +5381,9 @@ void init_Pyramid(Pyramid * const pyr)
  *  -sigma_n: The nominal scale of the image im.
  *  -pyr: The Pyramid to be resized.
  *
+ * The data of all levels is carved from a single block of memory, owned by 
+ * pyr. This block is reused when the pyramid shrinks, or keeps its size.
+ *
  * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
 int resize_Pyramid(const Image *const im, const int first_level, 
         const unsigned int num_kp_levels, const unsigned int num_levels,
@@ -4005,6 +5393,7 @@ int resize_Pyramid(const Image *const im, const int first_level,
         double units[IM_NDIMS];
         int dims[IM_NDIMS];
 	double factor;
+        size_t offset;
 	int i, o, s;
 
 	const double sigma0 = pyr->sigma0;
@@ -4038,9 +5427,15 @@ int resize_Pyramid(const Image *const im, const int first_level,
 		num_total_levels * sizeof(Image))) == NULL))
                 return SIFT3D_FAILURE;
 
-	// We have nothing more to do if there are no levels
-	if (num_total_levels == 0)
+	// Release the arena if there are no levels
+	if (num_total_levels == 0) {
+                if (pyr->arena != NULL)
+                        free(pyr->arena);
+                pyr->arena = NULL;
+                pyr->arena_data = NULL;
+                pyr->arena_size = 0;
 		return SIFT3D_SUCCESS;
+        }
 
         // Initalize new levels
         for (i = old_num_total_levels; i < num_total_levels; i++) {
@@ -4059,6 +5454,11 @@ int resize_Pyramid(const Image *const im, const int first_level,
                 units[i] = SIFT3D_IM_GET_UNITS(im)[i] * factor;
         }
 
+        // Make room for all the levels in the arena
+        if (resize_Pyramid_arena(pyr, dims, im->nc))
+                return SIFT3D_FAILURE;
+        offset = 0;
+
 	// Initialize each level separately
 	SIFT3D_PYR_LOOP_START(pyr, o, s)
                         // Initialize Image fields
@@ -4070,9 +5470,15 @@ int resize_Pyramid(const Image *const im, const int first_level,
 	                level->nc = im->nc;
 	                im_default_stride(level);
 
-                        // Re-size data memory
-                        if (im_resize(level))
-                                return SIFT3D_FAILURE;
+                        // Release any memory the level owns
+                        im_free(level);
+
+                        // Carve the level from the arena
+                        level->data = pyr->arena_data + offset;
+                        level->data_shared = SIFT3D_TRUE;
+                        level->size = (size_t) level->nx * level->ny * 
+                                level->nz * level->nc;
+                        offset += get_Pyramid_level_stride(level->size);
 
 	        SIFT3D_PYR_LOOP_SCALE_END
 
@@ -4207,6 +5613,10 @@ void cleanup_Pyramid(Pyramid * const pyr)
 
 	// Free the pyramid level buffer
 	free(pyr->levels);
+
+        // Free the level data
+        if (pyr->arena != NULL)
+                free(pyr->arena);
 }
 
 /* Initialize a Slab for first use */
@@ -4381,6 +5791,10 @@ void init_Ransac(Ransac *const ran)
 {
 	ran->err_thresh = SIFT3D_err_thresh_default;
 	ran->num_iter = SIFT3D_num_iter_default;
+	ran->seed = 0;
+	ran->confidence = 0.0;
+	ran->sprt = SIFT3D_FALSE;
+	ran->prosac = SIFT3D_FALSE;
 }
 
 /* Set the err_thresh parameter in a Ransac struct, checking for validity. */
@@ -4412,180 +5826,145 @@ int set_num_iter_Ransac(Ransac *const ran, int num_iter)
         return SIFT3D_SUCCESS;
 }
 
-/* Copy a Ransac struct from src to dst. */
-int copy_Ransac(const Ransac *const src, Ransac *const dst) {
-        return set_num_iter_Ransac(dst, src->num_iter) ||
-                set_err_thresh_Ransac(dst, src->err_thresh);
+/* Set the seed of the random streams of a Ransac struct. The same seed
+ * gives the same result, regardless of the number of threads. If seed is 
+ * zero, find_tform_ransac draws a new seed from rand() on each call. */
+void set_seed_Ransac(Ransac *const ran, const unsigned int seed)
+{
+	ran->seed = seed;
 }
 
-/* Select a random subset of rows, length "num_rows".
- * This function resizes out. 
- * 
- * Returns an error if in->num_rows < num_rows.
- * Both input matrices must have type double and the same dimensions.
- *
- * All matrices must be initialized prior to calling 
- * this function.*/
-static int rand_rows(const Mat_rm *const in1, const Mat_rm *const in2, 
-        const int num_rows, Mat_rm *const out1, Mat_rm *const out2)
+/* Set the confidence parameter in a Ransac struct. If positive, RANSAC 
+ * stops once the probability of having drawn a sample of inliers reaches
+ * this value, or after num_iter iterations, whichever comes first. If zero,
+ * RANSAC always runs num_iter iterations. */
+int set_confidence_Ransac(Ransac *const ran, const double confidence)
 {
-
-	List *row_indices, *el;
-	int i, j, list_size, idx;
-
-	const int num_rows_in = in1->num_rows;
-	const int num_cols = in1->num_cols;
-	const int num_remove = in1->num_rows - num_rows;
-
-	// Verify inputs
-	if (in2->num_rows != num_rows_in || in2->num_cols != num_cols) {
-		puts("rand_rows; inputs must have the same dimension \n");
-		return SIFT3D_FAILURE;
-	}
-	if (in1->num_rows > RAND_MAX) {
-		puts("rand_rows: input matrix is too large \n");
-		return SIFT3D_FAILURE;
-	}
-	if (num_remove < 0) {
-		puts("rand_rows: not enough rows in the matrix \n");
-		return SIFT3D_FAILURE;
-	}
-	if (in1->type != DOUBLE || in2->type != DOUBLE) {
-		puts("rand_rows: inputs must have type int \n");
+	if (confidence < 0.0 || confidence >= 1.0) {
+		SIFT3D_ERR("set_confidence_Ransac: invalid confidence: %f, "
+			"must be in [0, 1) \n", confidence);
 		return SIFT3D_FAILURE;
 	}
-	// Resize the outputs
-	out1->type = out2->type = in1->type;
-	out1->num_rows = out2->num_rows = num_rows;
-	out1->num_cols = out2->num_cols = num_cols;
-	if (resize_Mat_rm(out1) || resize_Mat_rm(out2))
-		return SIFT3D_FAILURE;
-
-	// Initialize a list with all of the row indices
-	if (init_List(&row_indices, num_rows_in))
-		return SIFT3D_FAILURE;
-
-	for (i = 0; i < num_rows_in; i++) {
-		if (List_get(row_indices, i, &el))
-			return SIFT3D_FAILURE;
-		el->idx = i;
-	}
 
-	// Remove random rows
-	list_size = num_rows_in;
-	for (i = 0; i < num_remove; i++) {
-		// Draw a random number
-		idx = rand() % list_size;
+	ran->confidence = confidence;
 
-		// Remove that element
-		if (List_get(row_indices, idx, &el))
-			return SIFT3D_FAILURE;
-		List_remove(&row_indices, el);
-		list_size--;
-	}
-
-	// Build the output matrices
-	el = row_indices;
-	SIFT3D_MAT_RM_LOOP_START(out1, i, j)
-	                SIFT3D_MAT_RM_GET(out1, i, j, double) =
-	                        SIFT3D_MAT_RM_GET(in1, el->idx, j, double);
-	                SIFT3D_MAT_RM_GET(out2, i, j, double) =
-	                        SIFT3D_MAT_RM_GET(in2, el->idx, j, double);
-	        SIFT3D_MAT_RM_LOOP_COL_END
-	        // Get the next row
-	        el = el->next;
-	SIFT3D_MAT_RM_LOOP_ROW_END
+	return SIFT3D_SUCCESS;
+}
 
-	// Clean up
-        cleanup_List(row_indices);
+/* Set whether RANSAC abandons bad hypotheses early, by a sequential 
+ * probability ratio test (SPRT). See find_tform_ransac. */
+void set_sprt_Ransac(Ransac *const ran, const int sprt)
+{
+	ran->sprt = sprt;
+}
 
-	return SIFT3D_SUCCESS;
+/* Set whether RANSAC draws its first samples from the first points, as in
+ * PROSAC. The points must be sorted by decreasing quality. */
+void set_prosac_Ransac(Ransac *const ran, const int prosac)
+{
+	ran->prosac = prosac;
 }
 
-/* Initialize a list of num elements. */
-static int init_List(List ** list, const int num)
+/* Copy a Ransac struct from src to dst. */
+int copy_Ransac(const Ransac *const src, Ransac *const dst) {
+        set_seed_Ransac(dst, src->seed);
+        set_sprt_Ransac(dst, src->sprt);
+        set_prosac_Ransac(dst, src->prosac);
+        return set_num_iter_Ransac(dst, src->num_iter) ||
+                set_err_thresh_Ransac(dst, src->err_thresh) ||
+                set_confidence_Ransac(dst, src->confidence);
+}
+
+/* Select RANSAC_NUM_SEL random points, writing their indices to st->sample.
+ * The points are drawn without replacement from the first pool points, by a
+ * partial Fisher-Yates shuffle of st->perm, driven by the random stream rng.
+ * If force_last is true, the last point of the sample is point pool - 1, and
+ * the others are drawn from the points before it, as in PROSAC. The shuffle
+ * is undone afterwards, so that the sample depends only on the state of 
+ * rng. */
+static void rand_sample(const int pool, const int force_last, 
+        Ransac_state *const st, uint64_t *const rng)
 {
 
-	List *prev, *cur;
 	int i;
 
-	prev = NULL;
-	for (i = 0; i < num; i++) {
-		if ((cur = (List *) malloc(sizeof(List))) == NULL)
-			return SIFT3D_FAILURE;
-
-		if (i == 0)
-			*list = cur;
+	const int num_rand = force_last ? RANSAC_NUM_SEL - 1 : RANSAC_NUM_SEL;
+	const int range = force_last ? pool - 1 : pool;
+	int *const perm = st->perm;
 
-		cur->next = NULL;
-		cur->prev = prev;
+	// Shuffle the first num_rand indices
+	for (i = 0; i < num_rand; i++) {
 
-		if (prev != NULL)
-			prev->next = cur;
+		const int swap = i + (int) (ransac_rand(rng) % 
+			(uint64_t) (range - i));
+		const int tmp = perm[i];
 
-		prev = cur;
+		perm[i] = perm[swap];
+		perm[swap] = tmp;
+		st->swaps[i] = swap;
 	}
 
-	return SIFT3D_SUCCESS;
-}
-
-/* Get the element idx in list. Returns a pointer to the element in el.
- * Returns SIFT3D_FAILURE if NULL is reached before idx elements have been 
- * traversed. */
-static int List_get(List * list, const int idx, List ** el)
-{
-
-	int i;
+	// Save the selected indices
+	for (i = 0; i < RANSAC_NUM_SEL; i++) {
+		st->sample[i] = i < num_rand ? perm[i] : pool - 1;
+	}
 
-	// Verify inputs
-	if (idx < 0)
-		return SIFT3D_FAILURE;
+	// Undo the shuffle, in reverse order
+	for (i = num_rand - 1; i >= 0; i--) {
 
-	// Traverse the list 
-	for (i = 0; i < idx; i++) {
-		list = list->next;
+		const int swap = st->swaps[i];
+		const int tmp = perm[i];
 
-		if (list == NULL)
-			return SIFT3D_FAILURE;
+		perm[i] = perm[swap];
+		perm[swap] = tmp;
 	}
-
-	*el = list;
-	return SIFT3D_SUCCESS;
 }
 
-/* Remove an element from its list, freeing its memory. */
-static void List_remove(List ** list, List * el)
+/* Draw a 64-bit random number from the stream *state, by the SplitMix64 
+ * generator. Unlike rand(), this is thread-safe, as each thread has its own
+ * streams. */
+static uint64_t ransac_rand(uint64_t *const state)
 {
-	if (list == NULL || el == NULL)
-		return;
-
-	if (el->next != NULL)
-		el->next->prev = el->prev;
 
-	if (el->prev != NULL)
-		el->prev->next = el->next;
+	uint64_t z;
 
-	if (*list == el)
-		*list = el->next;
-
-	free(el);
+	z = (*state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
 }
 
-/* Free all of the memory for a list. */
-static void cleanup_List(List * list)
+/* Initialize the scratch space for RANSAC hypotheses on num_pts points. */
+static int init_Ransac_state(Ransac_state *const st, const int num_pts)
 {
 
-	while (1) {
-		List_remove(&list, list->prev);
+	int i;
 
-		if (list->next == NULL) {
-			List_remove(&list, list);
-			break;
-		}
+	const int num_words = (num_pts + RANSAC_BLOCK - 1) / RANSAC_BLOCK;
 
-		list = list->next;
+	st->num_pts = num_pts;
+	st->cset = NULL;
+	if ((st->perm = (int *) malloc(num_pts * sizeof(int))) == NULL ||
+		(st->cset = (uint64_t *) malloc(num_words * sizeof(uint64_t)))
+		== NULL) {
+		cleanup_Ransac_state(st);
+		return SIFT3D_FAILURE;
 	}
 
+	for (i = 0; i < num_pts; i++) {
+		st->perm[i] = i;
+	}
+
+	return SIFT3D_SUCCESS;
+}
+
+/* Free the memory of a Ransac_state. */
+static void cleanup_Ransac_state(Ransac_state *const st)
+{
+	if (st->perm != NULL)
+		free(st->perm);
+	if (st->cset != NULL)
+		free(st->cset);
 }
 
 //make the system matrix for spline
@@ -4834,138 +6213,342 @@ static int solve_system(const Mat_rm *const src, const Mat_rm *const ref,
 	return SIFT3D_FAILURE;
 }
 
-//Find the SSD error for the i'th point
-static double tform_err_sq(const void *const tform, const Mat_rm *const src, 
-        const Mat_rm *const ref, const int i)
+/* Fit the affine transformation st->A, mapping the reference points of the
+ * minimal sample st->sample to the source points. This solves the 
+ * [RANSAC_NUM_SEL x RANSAC_NUM_SEL] system by Gauss-Jordan elimination on
+ * the stack, without allocating memory. As in solve_Mat_rm, the system is 
+ * singular if its reciprocal condition number, in the 1-norm, is below
+ * 100 * eps.
+ *
+ * Returns SIFT3D_SUCCESS or SIFT3D_SINGULAR. */
+static int solve_affine_sample(const Ransac_run *const run, 
+        Ransac_state *const st)
 {
 
-	double err = 0.0;
-	//Initialization
-	//in -- inputs coordinates of source points
-	//out -- registered points
-	//r -- reference points (ground truth)
-	double x_in, y_in, z_in, x_r, y_r, z_r, x_out, y_out, z_out;
+	double M[RANSAC_NUM_SEL][2 * RANSAC_NUM_SEL];
+	double norm, norm_inv;
+	int i, j, k;
+
+	// Form [M | I], where the rows of M are the homogeneous reference 
+	// points
+	for (i = 0; i < RANSAC_NUM_SEL; i++) {
+
+		const int idx = st->sample[i];
+
+		for (j = 0; j < IM_NDIMS; j++) {
+			M[i][j] = run->ref[j][idx];
+		}
+		M[i][IM_NDIMS] = 1.0;
+		for (j = 0; j < RANSAC_NUM_SEL; j++) {
+			M[i][RANSAC_NUM_SEL + j] = i == j ? 1.0 : 0.0;
+		}
+	}
+
+	// Compute the 1-norm of M
+	norm = 0.0;
+	for (j = 0; j < RANSAC_NUM_SEL; j++) {
+
+		double sum = 0.0;
+
+		for (i = 0; i < RANSAC_NUM_SEL; i++) {
+			sum += fabs(M[i][j]);
+		}
+		norm = SIFT3D_MAX(norm, sum);
+	}
+
+	// Reduce M to the identity, with partial pivoting
+	for (k = 0; k < RANSAC_NUM_SEL; k++) {
+
+		double pivot;
+
+		// Swap the largest remaining entry of column k into row k
+		int row = k;
+		for (i = k + 1; i < RANSAC_NUM_SEL; i++) {
+			if (fabs(M[i][k]) > fabs(M[row][k]))
+				row = i;
+		}
+		if (M[row][k] == 0.0)
+			return SIFT3D_SINGULAR;
+		if (row != k) {
+			for (j = 0; j < 2 * RANSAC_NUM_SEL; j++) {
+
+				const double tmp = M[k][j];
+
+				M[k][j] = M[row][j];
+				M[row][j] = tmp;
+			}
+		}
+
+		// Scale row k, and eliminate column k from the others
+		pivot = M[k][k];
+		for (j = 0; j < 2 * RANSAC_NUM_SEL; j++) {
+			M[k][j] /= pivot;
+		}
+		for (i = 0; i < RANSAC_NUM_SEL; i++) {
+
+			const double factor = M[i][k];
+
+			if (i == k || factor == 0.0)
+				continue;
+
+			for (j = 0; j < 2 * RANSAC_NUM_SEL; j++) {
+				M[i][j] -= factor * M[k][j];
+			}
+		}
+	}
+
+	// Compute the 1-norm of the inverse, and check the condition number
+	norm_inv = 0.0;
+	for (j = 0; j < RANSAC_NUM_SEL; j++) {
+
+		double sum = 0.0;
+
+		for (i = 0; i < RANSAC_NUM_SEL; i++) {
+			sum += fabs(M[i][RANSAC_NUM_SEL + j]);
+		}
+		norm_inv = SIFT3D_MAX(norm_inv, sum);
+	}
+	if (1.0 / (norm * norm_inv) < 100.0 * DBL_EPSILON)
+		return SIFT3D_SINGULAR;
+
+	// The coefficients of each source coordinate are the inverse times 
+	// that coordinate of the sample
+	for (i = 0; i < IM_NDIMS; i++) {
+		for (j = 0; j < RANSAC_NUM_SEL; j++) {
 
-	//Find the source point
-	x_in = SIFT3D_MAT_RM_GET(ref, i, 0, double);
-	y_in = SIFT3D_MAT_RM_GET(ref, i, 1, double);
-	z_in = SIFT3D_MAT_RM_GET(ref, i, 2, double);
+			double sum = 0.0;
 
-	//Register
-	apply_tform_xyz(tform, x_in, y_in, z_in, &x_out, &y_out, &z_out);
+			for (k = 0; k < RANSAC_NUM_SEL; k++) {
+				sum += M[j][RANSAC_NUM_SEL + k] * 
+					run->src[i][st->sample[k]];
+			}
+			st->A[i][j] = sum;
+		}
+	}
 
-	//Find the reference point
-	x_r = SIFT3D_MAT_RM_GET(src, i, 0, double);
-	y_r = SIFT3D_MAT_RM_GET(src, i, 1, double);
-	z_r = SIFT3D_MAT_RM_GET(src, i, 2, double);
+	return SIFT3D_SUCCESS;
+}
 
-	//Find the SSD error
-	err = (x_r - x_out) * (x_r - x_out) + (y_r - y_out) * (y_r - y_out) +
-	    (z_r - z_out) * (z_r - z_out);
+/* Compute the squared error of the hypothesis st->A at points 
+ * [start, start + num). The loop runs over contiguous coordinates, so that
+ * the compiler can vectorize it. */
+static void affine_err_sq(const Ransac_run *const run, 
+        const Ransac_state *const st, const int start, const int num,
+        double *const err_sq)
+{
 
-	//return the result 
-	return err;
+	int k;
+
+	const double *const A0 = st->A[0];
+	const double *const A1 = st->A[1];
+	const double *const A2 = st->A[2];
+	const double *const x_src = run->src[0] + start;
+	const double *const y_src = run->src[1] + start;
+	const double *const z_src = run->src[2] + start;
+	const double *const x_ref = run->ref[0] + start;
+	const double *const y_ref = run->ref[1] + start;
+	const double *const z_ref = run->ref[2] + start;
+
+	for (k = 0; k < num; k++) {
+
+		// Transform the reference point, as in apply_Affine_xyz
+		const double x_out = A0[0] * x_ref[k] + A0[1] * y_ref[k] +
+			A0[2] * z_ref[k] + A0[3];
+		const double y_out = A1[0] * x_ref[k] + A1[1] * y_ref[k] +
+			A1[2] * z_ref[k] + A1[3];
+		const double z_out = A2[0] * x_ref[k] + A2[1] * y_ref[k] +
+			A2[2] * z_ref[k] + A2[3];
+
+		// Compare it to the source point
+		err_sq[k] = (x_src[k] - x_out) * (x_src[k] - x_out) + 
+			(y_src[k] - y_out) * (y_src[k] - y_out) +
+			(z_src[k] - z_out) * (z_src[k] - z_out);
+	}
 }
 
 /* Perform one iteration of RANSAC. 
  *
  * Parameters:
- *  src - The source points.
- *  ref - The reference points.
- *  tform - The output transformation. Must be initialized.
- *  cset - An array in which to store the concensus set. The value *cset must
- *         either be NULL, or a pointer to a previously allocated block.
+ *  run - The points and parameters shared by all iterations.
+ *  iter - The index of this iteration, which, along with run->seed, alone
+ *         determines its random stream and, with PROSAC, its sample pool.
+ *  st - Scratch space, initialized by init_Ransac_state. On return, holds
+ *         the hypothesis in st->A, and the consensus set in st->cset.
  *  len - A location in which to store the length of the cset. 
+ *  tested - A location in which to store the number of points tested. If
+ *         this is less than the number of points, the SPRT rejected the 
+ *         hypothesis, and the cset only covers the tested points.
  *
- * Returns SIFT3D_SUCCESS on success, SIFT3D_SINGULAR if the system is 
- * near singular, and SIFT3D_FAILURE otherwise. */
-static int ransac(const Mat_rm *const src, const Mat_rm *const ref, 
-        const Ransac *const ran, void *tform, int **const cset, int *const len)
-{
-	/* Initialization */
-	Mat_rm src_rand, ref_rand;
-	int i, sel_pts, cset_len;
-
-	const double err_thresh = ran->err_thresh;
-	const double err_thresh_sq = err_thresh * err_thresh;
-	const int num_src = src->num_rows;
-	const tform_type type = tform_get_type(tform);
+ * Near-singular samples are redrawn from the same stream. Nothing is 
+ * allocated, so this cannot fail. */
+static void ransac(const Ransac_run *const run, const int iter, 
+        Ransac_state *const st, int *const len, int *const tested)
+{
 
-	// Verify inputs
-	if (src->type != DOUBLE || src->type != ref->type) {
-		puts("ransac: all matrices must have type double \n");
-		return SIFT3D_FAILURE;
-	}
-	if (src->num_rows != ref->num_rows || src->num_cols != ref->num_cols) {
-		puts("ransac: src and ref must have the same dimensions \n");
-		return SIFT3D_FAILURE;
-	}
-	// Initialize
-	init_Mat_rm(&src_rand, 0, 0, DOUBLE, SIFT3D_FALSE);
-	init_Mat_rm(&ref_rand, 0, 0, DOUBLE, SIFT3D_FALSE);
+	uint64_t rng;
+	double lambda;
+	int i, start, cset_len, block_len, pool, force_last;
 
-	/*Fit random points */
-	//number of points it randomly chooses
-	switch (type) {
-	case AFFINE:
-		sel_pts = AFFINE_GET_DIM((Affine *const) tform) + 1;
-		break;
-	default:
-		printf("ransac: unknown transformation type \n");
-		goto RANSAC_FAIL;
-	}
+	const double err_thresh_sq = run->err_thresh_sq;
+	const int num_src = run->num_pts;
+	const int sprt = run->sprt_A < DBL_MAX;
 
-	//choose random points
-	if (rand_rows(src, ref, sel_pts, &src_rand, &ref_rand))
-		goto RANSAC_FAIL;
+	// Seed the stream of this iteration
+	rng = ((uint64_t) run->seed << 32) | (uint32_t) iter;
 
-	//solve the system
-	switch (solve_system(&src_rand, &ref_rand, tform)) {
-	case SIFT3D_SUCCESS:
-		break;
-	case SIFT3D_SINGULAR:
-		goto RANSAC_SINGULAR;
-	default:
-		goto RANSAC_FAIL;
+	// Choose the sample pool. PROSAC draws from the best pool rows, 
+	// always including the last of them, until the schedule reaches all
+	// of the points.
+	pool = num_src;
+	force_last = SIFT3D_FALSE;
+	if (run->prosac_iter != NULL) {
+
+		int lo = RANSAC_NUM_SEL;
+		int hi = num_src;
+
+		// Find the first pool whose schedule covers this iteration
+		if (run->prosac_iter[hi] > iter) {
+			while (lo < hi) {
+
+				const int mid = (lo + hi) / 2;
+
+				if (run->prosac_iter[mid] > iter)
+					hi = mid;
+				else
+					lo = mid + 1;
+			}
+			pool = lo;
+			force_last = SIFT3D_TRUE;
+		}
 	}
 
+	// Fit random points, until the system is non-singular
+	do {
+		rand_sample(pool, force_last, st, &rng);
+	} while (solve_affine_sample(run, st) == SIFT3D_SINGULAR);
+
 	/*Extract consensus set */
-	//Pointwise transformation to find consensus set
-	//test for each source point
+	// Test the points in blocks, each filling one word of the bitmap
 	cset_len = 0;
-	for (i = 0; i < num_src; i++) {
+	lambda = 1.0;
+	for (start = 0; start < num_src; start += RANSAC_BLOCK) {
 
-		// Calculate the error
-		const double err_sq = tform_err_sq(tform, src, ref, i);
+		double err_sq[RANSAC_BLOCK];
+		uint64_t word;
 
-		// Reject points below the error threshold
-		if (err_sq > err_thresh_sq)
-			continue;
+		const int num = SIFT3D_MIN(num_src - start, RANSAC_BLOCK);
+
+		affine_err_sq(run, st, start, num, err_sq);
+
+		// Add inliers to the consensus set
+		word = 0;
+		block_len = 0;
+		for (i = 0; i < num; i++) {
+
+			const int inlier = err_sq[i] <= err_thresh_sq;
 
-		// Add to the consensus set (++cset_len cannot be zero)
-		if ((*cset = SIFT3D_safe_realloc(*cset, 
-			++cset_len * sizeof(int))) == NULL)
-			goto RANSAC_FAIL;
+			word |= (uint64_t) inlier << i;
+			block_len += inlier;
+		}
+
+		// Reject the hypothesis once the SPRT finds it is bad, keeping 
+		// only the tested points
+		if (sprt) {
+
+			int sprt_len = 0;
+
+			for (i = 0; i < num; i++) {
+
+				const int inlier = (int) ((word >> i) & 1);
+
+				sprt_len += inlier;
+				lambda *= inlier ? run->sprt_pos : 
+					run->sprt_neg;
+				if (lambda > run->sprt_A) {
+					st->cset[start / RANSAC_BLOCK] = word & 
+						(~(uint64_t) 0 >> 
+						(RANSAC_BLOCK - 1 - i));
+					*len = cset_len + sprt_len;
+					*tested = start + i + 1;
+					return;
+				}
+			}
+		}
 
-		(*cset)[cset_len - 1] = i;
+		st->cset[start / RANSAC_BLOCK] = word;
+		cset_len += block_len;
 	}
 
 	// Return the new length of cset
 	*len = cset_len;
+	*tested = num_src;
+}
 
-	cleanup_Mat_rm(&src_rand);
-	cleanup_Mat_rm(&ref_rand);
-	return SIFT3D_SUCCESS;
+/* Helper function to set the SPRT parameters of run, for an inlier ratio
+ * epsilon, and a ratio delta of points consistent with a bad hypothesis. 
+ * The threshold follows Chum and Matas, "Optimal Randomized RANSAC", 2008.
+ * If delta is not less than epsilon, the test cannot tell good hypotheses
+ * from bad, and is disabled. */
+static void set_sprt_Ransac_run(Ransac_run *const run, const double epsilon,
+        const double delta)
+{
 
- RANSAC_SINGULAR:
-	cleanup_Mat_rm(&src_rand);
-	cleanup_Mat_rm(&ref_rand);
-	return SIFT3D_SINGULAR;
+	double C, A;
+	int i;
 
- RANSAC_FAIL:
-	cleanup_Mat_rm(&src_rand);
-	cleanup_Mat_rm(&ref_rand);
-	return SIFT3D_FAILURE;
+	if (delta >= epsilon) {
+		run->sprt_A = DBL_MAX;
+		return;
+	}
+
+	// Solve A = sprt_model_cost * C + 1 + log(A) by fixed-point iteration
+	C = (1.0 - delta) * log((1.0 - delta) / (1.0 - epsilon)) + 
+		delta * log(delta / epsilon);
+	A = sprt_model_cost * C + 1.0;
+	for (i = 0; i < 10; i++) {
+		A = sprt_model_cost * C + 1.0 + log(A);
+	}
+
+	run->sprt_A = A;
+	run->sprt_pos = delta / epsilon;
+	run->sprt_neg = (1.0 - delta) / (1.0 - epsilon);
+}
+
+/* Helper function to make the PROSAC schedule of num_pts points sorted by 
+ * decreasing quality, with samples of num_sel points. On return, element n 
+ * of the array *sched is the number of iterations drawing from the first n 
+ * points or fewer, T'_n in Chum and Matas, "Matching with PROSAC", 2005. */
+static int init_prosac_schedule(const int num_pts, const int num_sel, 
+        int **const sched)
+{
+
+	double T_n;
+	int i, n;
+
+	if ((*sched = (int *) malloc((num_pts + 1) * sizeof(int))) == NULL)
+		return SIFT3D_FAILURE;
+
+	// Expected number of samples from the first num_sel points
+	T_n = prosac_max_iter;
+	for (i = 0; i < num_sel; i++) {
+		T_n *= (double) (num_sel - i) / (num_pts - i);
+	}
+
+	// Grow the pool by one point at a time
+	for (n = 0; n <= num_sel; n++) {
+		(*sched)[n] = 1;
+	}
+	for (n = num_sel; n < num_pts; n++) {
+
+		const double T_next = T_n * (n + 1) / (n + 1 - num_sel);
+		const double steps = ceil(T_next - T_n);
+
+		(*sched)[n + 1] = (int) SIFT3D_MIN((double) (*sched)[n] + steps,
+			(double) INT_MAX);
+		T_n = T_next;
+	}
+
+	return SIFT3D_SUCCESS;
 }
 
 //Resize spline struct based on number of selected points
@@ -4988,8 +6571,161 @@ int resize_Tps(Tps * tps, int num_pts, int dim)
 	return SIFT3D_SUCCESS;
 }
 
+/* Helper function for find_tform_ransac, to run the iterations of ran in
+ * parallel batches. Hypotheses are tested by the SPRT if sprt is true.
+ * Returns the size of the largest consensus set in *len_best_out, and the
+ * iteration which found it in *iter_best_out, or -1 if there was none. */
+static int ransac_search(const Ransac *const ran, const int sprt,
+	Ransac_run *const run, int *const len_best_out, 
+	int *const iter_best_out)
+{
+
+	long long rej_tested, rej_inliers;
+	int ret, len_best, iter_best, num_iter_cur;
+
+	const int num_iter = ran->num_iter;
+	const int num_pts = run->num_pts;
+
+	// Start the SPRT from the initial guesses
+	run->sprt_A = DBL_MAX;
+	if (sprt)
+		set_sprt_Ransac_run(run, sprt_epsilon_init, sprt_delta_init);
+
+	len_best = 0;
+	iter_best = -1;
+	rej_tested = rej_inliers = 0;
+	num_iter_cur = num_iter;
+	ret = SIFT3D_SUCCESS;
+#pragma omp parallel shared(ret, len_best, iter_best, rej_tested, \
+	rej_inliers, num_iter_cur)
+{
+	Ransac_state st_thread;
+	long long rej_tested_thread, rej_inliers_thread;
+	int start, i, len, tested, len_thread, iter_thread;
+
+	const int state_err = init_Ransac_state(&st_thread, num_pts);
+
+	if (state_err)
+		ret = SIFT3D_FAILURE;
+
+	len_thread = 0;
+	iter_thread = -1;
+	rej_tested_thread = rej_inliers_thread = 0;
+	for (start = 0; start < num_iter_cur; start += ransac_batch) {
+
+		const int end = SIFT3D_MIN(start + ransac_batch, num_iter_cur);
+
+#pragma omp for schedule(dynamic)
+		for (i = start; i < end; i++) {
+
+			if (state_err)
+				continue;
+
+			ransac(run, i, &st_thread, &len, &tested);
+
+			// Count the points of the rejected hypotheses
+			if (tested < num_pts) {
+				rej_tested_thread += tested;
+				rej_inliers_thread += len;
+				continue;
+			}
+
+			// Keep the largest consensus set, breaking ties by 
+			// index
+			if (len > len_thread || (len == len_thread && 
+				i < iter_thread)) {
+				len_thread = len;
+				iter_thread = i;
+			}
+		}
+
+		// Reduce to the best iteration of all threads
+#pragma omp critical
+		{
+			if (len_thread > len_best || (len_thread == len_best &&
+				iter_thread >= 0 && iter_thread < iter_best)) {
+				len_best = len_thread;
+				iter_best = iter_thread;
+			}
+			rej_tested += rej_tested_thread;
+			rej_inliers += rej_inliers_thread;
+			rej_tested_thread = rej_inliers_thread = 0;
+		}
+#pragma omp barrier
+
+		// Update the adaptive parameters
+#pragma omp single
+		{
+			// Track the inlier ratio of the best model so far. 
+			// Until the ratio rises above delta, this disables the 
+			// SPRT, rather than rejecting every hypothesis.
+			const double epsilon = SIFT3D_MAX(
+				(double) len_best / num_pts, sprt_delta_min);
+
+			// Re-estimate the SPRT from the rejected hypotheses
+			if (sprt && rej_tested > 0) {
+				set_sprt_Ransac_run(run, epsilon,
+					SIFT3D_MAX((double) rej_inliers / 
+						rej_tested, sprt_delta_min));
+			}
+
+			// Bound the iterations needed to reach the confidence
+			if (ran->confidence > 0.0 && len_best > 0) {
+
+				double p_good = pow((double) len_best / 
+					num_pts, RANSAC_NUM_SEL);
+
+				// The SPRT rejects good samples with
+				// probability about 1 / A
+				if (run->sprt_A < DBL_MAX)
+					p_good *= 1.0 - 1.0 / run->sprt_A;
+
+				if (p_good >= 1.0) {
+					num_iter_cur = end;
+				} else if (p_good > 0.0) {
+
+					const double iter_needed = 
+						ceil(log(1.0 - ran->confidence)
+						/ log(1.0 - p_good));
+
+					if (iter_needed < num_iter_cur)
+						num_iter_cur = SIFT3D_MAX(end,
+							(int) iter_needed);
+				}
+			}
+		}
+	}
+
+	if (!state_err)
+		cleanup_Ransac_state(&st_thread);
+}
+
+	*len_best_out = len_best;
+	*iter_best_out = iter_best;
+	return ret;
+}
+
 /* Fit a transformation from ref to src points, using random sample concensus 
  * (RANSAC).
+ *
+ * The iterations run in parallel. Each draws its samples from its own
+ * random stream, determined by the seed of ran and the index of the 
+ * iteration, and ties go to the first iteration. The iterations run in 
+ * batches of ransac_batch, after which the adaptive parameters are updated.
+ * Thus, the result does not depend on the number of threads.
+ *
+ * The following options of ran speed this up:
+ *   confidence - Stop once the probability of having drawn an all-inlier 
+ *           sample reaches this value, according to the largest consensus 
+ *           set so far.
+ *   sprt - Abandon hypotheses as soon as a sequential probability ratio test
+ *           finds them bad, typically after a few points. The test adapts to
+ *           the best consensus set so far. If it rejects every good 
+ *           hypothesis, the search is repeated without it, so this never
+ *           fails where plain RANSAC would succeed.
+ *   prosac - Draw the first samples from the first rows of src and ref,
+ *           growing the pool with each iteration. The rows must be sorted 
+ *           by decreasing quality, e.g. increasing match distance.
  * 
  * Parameters:
  *   ran - Struct storing RANSAC parameters.
@@ -5003,90 +6739,142 @@ int find_tform_ransac(const Ransac *const ran, const Mat_rm *const src,
         const Mat_rm *const ref, void *const tform)
 {
 
-	Mat_rm ref_cset, src_cset;
-	void *tform_cur;
-	int *cset, *cset_best;
-	int i, j, dim, num_terms, ret, len, len_best, min_num_inliers;
+	Ransac_run run;
+	Ransac_state st;
+	Mat_rm ref_cset, src_cset, A;
+	double *coords;
+	int *prosac_iter;
+	int i, j, dim, row, len_best, iter_best, min_num_inliers, tested;
 
-	const int num_iter = ran->num_iter;
 	const int num_pts = src->num_rows;
-	const size_t tform_size = tform_get_size(tform);
+	const int num_cols = src->num_cols;
 	const tform_type type = tform_get_type(tform);
 
-	// Initialize data structures
-	cset = cset_best = NULL;
-	len_best = 0;
-	if ((tform_cur = malloc(tform_size)) == NULL ||
-	    init_tform(tform_cur, type) ||
-	    init_Mat_rm(&src_cset, len_best, IM_NDIMS, DOUBLE, SIFT3D_FALSE) ||
-	    init_Mat_rm(&ref_cset, len_best, IM_NDIMS, DOUBLE, SIFT3D_FALSE))
-		goto find_tform_quit;
+	// Verify inputs
+	if (src->type != DOUBLE || src->type != ref->type) {
+		puts("find_tform_ransac: all matrices must have type double \n");
+		return SIFT3D_FAILURE;
+	}
+	if (src->num_rows != ref->num_rows || src->num_cols != ref->num_cols) {
+		puts("find_tform_ransac: src and ref must have the same "
+		     "dimensions \n");
+		return SIFT3D_FAILURE;
+	}
 
 	// initialize type-specific variables
 	switch (type) {
 	case AFFINE:
                 dim = AFFINE_GET_DIM((Affine *const) tform);
-		num_terms = dim + 1;
 		min_num_inliers = 5;
 		break;
 	default:
 		puts("find_tform_ransac: unsupported transformation "
 		     "type \n");
-		goto find_tform_quit;
+		return SIFT3D_FAILURE;
+	}
+
+	// The minimal sample solver is specialized to IM_NDIMS dimensions
+	if (dim != IM_NDIMS || num_cols != IM_NDIMS) {
+		SIFT3D_ERR("find_tform_ransac: only %d-dimensional points are "
+			"supported \n", IM_NDIMS);
+		return SIFT3D_FAILURE;
 	}
 
-	if (num_pts < num_terms) {
+	if (num_pts < RANSAC_NUM_SEL) {
 		printf("Not enough matched points \n");
-		goto find_tform_quit;
+		return SIFT3D_FAILURE;
 	}
-	// Ransac iterations
-	for (i = 0; i < num_iter; i++) {
-		do {
-			ret = ransac(src, ref, ran, tform_cur, &cset, &len);
-		} while (ret == SIFT3D_SINGULAR);
-
-		if (ret == SIFT3D_FAILURE)
-			goto find_tform_quit;
-
-		if (len > len_best) {
-			len_best = len;
-			if ((cset_best = (int *)SIFT3D_safe_realloc(cset_best,
-				len * sizeof(int))) == NULL || 
-				copy_tform(tform_cur, tform))
-				goto find_tform_quit;
-			memcpy(cset_best, cset, len * sizeof(int));
+
+	// Initialize data structures
+	prosac_iter = NULL;
+	coords = NULL;
+	if (init_Ransac_state(&st, num_pts))
+		return SIFT3D_FAILURE;
+	if (init_Mat_rm(&src_cset, 0, num_cols, DOUBLE, SIFT3D_FALSE))
+		goto find_tform_state_quit;
+	if (init_Mat_rm(&ref_cset, 0, num_cols, DOUBLE, SIFT3D_FALSE))
+		goto find_tform_src_quit;
+	if (init_Mat_rm(&A, IM_NDIMS, RANSAC_NUM_SEL, DOUBLE, SIFT3D_FALSE))
+		goto find_tform_ref_quit;
+	if (ran->prosac && init_prosac_schedule(num_pts, RANSAC_NUM_SEL, 
+		&prosac_iter))
+		goto find_tform_quit;
+
+	// Copy the points to one array per coordinate
+	if ((coords = (double *) malloc(2 * IM_NDIMS * num_pts * 
+		sizeof(double))) == NULL)
+		goto find_tform_quit;
+	for (j = 0; j < IM_NDIMS; j++) {
+
+		double *const src_j = coords + j * num_pts;
+		double *const ref_j = coords + (IM_NDIMS + j) * num_pts;
+
+		for (i = 0; i < num_pts; i++) {
+			src_j[i] = SIFT3D_MAT_RM_GET(src, i, j, double);
+			ref_j[i] = SIFT3D_MAT_RM_GET(ref, i, j, double);
 		}
+
+		run.src[j] = src_j;
+		run.ref[j] = ref_j;
 	}
 
+	// Set the parameters shared by the iterations, drawing the base seed
+	// of the random streams
+	run.num_pts = num_pts;
+	run.prosac_iter = prosac_iter;
+	run.err_thresh_sq = ran->err_thresh * ran->err_thresh;
+	run.seed = ran->seed == 0 ? (unsigned int) rand() : ran->seed;
+
+	// Ransac iterations
+	if (ransac_search(ran, ran->sprt, &run, &len_best, &iter_best))
+		goto find_tform_quit;
+
+	// The SPRT may reject every good hypothesis. Rather than fail where 
+	// plain RANSAC would succeed, repeat the search without it
+	if (ran->sprt && len_best < min_num_inliers && 
+		ransac_search(ran, SIFT3D_FALSE, &run, &len_best, &iter_best))
+		goto find_tform_quit;
+
 	// Check if the minimum number of inliers was found
 	if (len_best < min_num_inliers) {
 		puts("find_tform_ransac: No good model was found! \n");
 		goto find_tform_quit;
 	}
 
+	// Repeat the best iteration without the SPRT, to recover its 
+	// transformation and consensus set
+	run.sprt_A = DBL_MAX;
+	ransac(&run, iter_best, &st, &len_best, &tested);
+	SIFT3D_MAT_RM_LOOP_START(&A, i, j)
+		SIFT3D_MAT_RM_GET(&A, i, j, double) = st.A[i][j];
+	SIFT3D_MAT_RM_LOOP_END
+	if (Affine_set_mat(&A, (Affine *) tform))
+		goto find_tform_quit;
+
 	// Resize the concensus set matrices
         src_cset.num_rows = ref_cset.num_rows = len_best;
         if (resize_Mat_rm(&src_cset) || resize_Mat_rm(&ref_cset))
                 goto find_tform_quit;
 
-	// Extract the concensus set
-	SIFT3D_MAT_RM_LOOP_START(&src_cset, i, j)
+	// Extract the concensus set from the bitmap
+	row = 0;
+	for (i = 0; i < num_pts; i++) {
 
-	        const int idx = cset_best[i];
+	        if (!((st.cset[i / RANSAC_BLOCK] >> (i % RANSAC_BLOCK)) & 1))
+	                continue;
 
-	        SIFT3D_MAT_RM_GET(&src_cset, i, j, double) =
-	                SIFT3D_MAT_RM_GET(src, idx, j, double);
-	        SIFT3D_MAT_RM_GET(&ref_cset, i, j, double) =
-	                SIFT3D_MAT_RM_GET(ref, idx, j, double);
-
-	SIFT3D_MAT_RM_LOOP_END
+	        for (j = 0; j < num_cols; j++) {
+	                SIFT3D_MAT_RM_GET(&src_cset, row, j, double) =
+	                        SIFT3D_MAT_RM_GET(src, i, j, double);
+	                SIFT3D_MAT_RM_GET(&ref_cset, row, j, double) =
+	                        SIFT3D_MAT_RM_GET(ref, i, j, double);
+	        }
+	        row++;
+	}
 #ifdef SIFT3D_RANSAC_REFINE
-	// Refine with least squares
-	switch (solve_system(&src_cset, &ref_cset, tform_cur)) {
+	// Refine with least squares, writing the output on success
+	switch (solve_system(&src_cset, &ref_cset, tform)) {
 	case SIFT3D_SUCCESS:
-		// Copy the refined transformation to the output
-		if (copy_tform(tform_cur, tform))
-			goto find_tform_quit;
 		break;
 	case SIFT3D_SINGULAR:
 		// Stick with the old transformation 
@@ -5101,26 +6889,29 @@ int find_tform_ransac(const Ransac *const ran, const Mat_rm *const src,
 #endif
 
         // Clean up
-	free(cset);
-	free(cset_best);
-	cleanup_tform(tform_cur);
+	if (prosac_iter != NULL)
+		free(prosac_iter);
+	if (coords != NULL)
+		free(coords);
+        cleanup_Mat_rm(&A);
         cleanup_Mat_rm(&ref_cset);
         cleanup_Mat_rm(&src_cset);
-	if (tform_cur != NULL)
-		free(tform_cur);
+	cleanup_Ransac_state(&st);
 	return SIFT3D_SUCCESS;
 
 find_tform_quit:
         // Clean up and return an error
-	if (cset != NULL)
-		free(cset);
-	if (cset_best != NULL)
-		free(cset_best);
-	cleanup_tform(tform_cur);
-	if (tform_cur != NULL)
-		free(tform_cur);
+	if (prosac_iter != NULL)
+		free(prosac_iter);
+	if (coords != NULL)
+		free(coords);
+        cleanup_Mat_rm(&A);
+find_tform_ref_quit:
         cleanup_Mat_rm(&ref_cset);
+find_tform_src_quit:
         cleanup_Mat_rm(&src_cset);
+find_tform_state_quit:
+	cleanup_Ransac_state(&st);
 	return SIFT3D_FAILURE;
 }
 
@@ -68,6 +68,8 @@ int resize_Mat_rm(Mat_rm *const mat);
 
 int eigen_Mat_rm(Mat_rm *A, Mat_rm *Q, Mat_rm *L);
 
+int eigen_sym_3x3(const double *const A, double *const Q, double *const L);
+
 int solve_Mat_rm(const Mat_rm *const A, const Mat_rm *const B, 
         const double limit, Mat_rm *const X);
 
@@ -112,6 +114,9 @@ int write_tform(const char *path, const void *const tform);
 int mul_Mat_rm(const Mat_rm *const mat_in1, const Mat_rm *const mat_in2, 
         Mat_rm *const mat_out);
 
+int mul_Mat_rm_trans(const Mat_rm *const mat_in1, const Mat_rm *const mat_in2,
+        Mat_rm *const mat_out);
+
 int draw_grid(Image *grid, int nx, int ny, int nz, int spacing, 
 					   int line_width);
 
@@ -129,6 +134,11 @@ int im_write(const char *path, const Image *const im);
 
 int write_Mat_rm(const char *path, const Mat_rm *const mat);
 
+int write_Mat_rm_cat(const char *path, const Mat_rm *const left, 
+        const Mat_rm *const right);
+
+int read_Mat_rm(const char *path, Mat_rm *const mat);
+
 int init_im_with_dims(Image *const im, const int nx, const int ny, const int nz,
                         const int nc);
 
@@ -190,18 +200,26 @@ int init_Gauss_filter(Gauss_filter *const gauss, const double sigma,
 int init_Gauss_incremental_filter(Gauss_filter *const gauss, 
                 const double s_cur, const double s_next, const int dim); 
 
+int get_recursive_error_Gauss_filter(const Gauss_filter *const gauss, 
+        double *const err);
+
 int init_Sep_FIR_filter(Sep_FIR_filter *const f, const int dim, const int width,
 			const float *const kernel, const int symmetric);
 
 int apply_Sep_FIR_filter(const Image *const src, Image *const dst, 
         Sep_FIR_filter *const f, const double unit);
 
+int apply_Gauss_filter(const Image *const src, Image *const dst,
+        const Gauss_filter *const gauss, const double unit);
+
 void cleanup_Sep_FIR_filter(Sep_FIR_filter *const f);
 
 void cleanup_Gauss_filter(Gauss_filter *gauss);
 
 void init_GSS_filters(GSS_filters *const gss);
 
+void set_recursive_GSS_filters(GSS_filters *const gss, const int recursive);
+
 int make_gss(GSS_filters *const gss, const Pyramid *const pyr);
 
 void cleanup_GSS_filters(GSS_filters *const gss);
@@ -238,6 +256,14 @@ int set_err_thresh_Ransac(Ransac *const ran, double err_thresh);
 
 int set_num_iter_Ransac(Ransac *const ran, int num_iter);
 
+void set_seed_Ransac(Ransac *const ran, const unsigned int seed);
+
+int set_confidence_Ransac(Ransac *const ran, const double confidence);
+
+void set_sprt_Ransac(Ransac *const ran, const int sprt);
+
+void set_prosac_Ransac(Ransac *const ran, const int prosac);
+
 int copy_Ransac(const Ransac *const src, Ransac *const dst);
 
 int find_tform_ransac(const Ransac *const ran, const Mat_rm *const src, 
@@ -22,6 +22,7 @@
 
 /* Default parameters */
 const double SIFT3D_nn_thresh_default = 0.8; // Default matching threshold
+const int SIFT3D_nn_checks_default = 0; // Default approximate matching checks (0 = exact)
 
 /* Internal helper routines */
 static void scale_SIFT3D(const double *const factors, 
@@ -30,6 +31,19 @@ static int im2mm(const Mat_rm *const im, const double *const units,
         Mat_rm *const mm);
 static int mm2im(const double *const src_units, const double *const ref_units,
         void *const tform);
+static int match_u8(const SIFT3D_Descriptor_store *const d1,
+        const SIFT3D_Descriptor_store *const d2, const double nn_thresh,
+        int **const matches);
+static int match_cmp(const void *a, const void *b);
+static int sort_matches(const SIFT3D_Descriptor_store *const d1,
+        const SIFT3D_Descriptor_store *const d2, const int *const matches,
+        Mat_rm *const match1, Mat_rm *const match2);
+
+/* A match, with the distance between its descriptors */
+typedef struct _Match_dist {
+        double ssd;     // Squared distance between the descriptors
+        int row;        // Row of the match in the coordinate matrices
+} Match_dist;
 
 /* Convert an [mxIM_NDIMS] coordinate matrix from image space to mm. 
  *
@@ -121,6 +135,8 @@ static int mm2im(const double *const src_units, const double *const ref_units,
 int init_Reg_SIFT3D(Reg_SIFT3D *const reg) {
 
         reg->nn_thresh = SIFT3D_nn_thresh_default;
+        reg->nn_checks = SIFT3D_nn_checks_default;
+        reg->quantize = SIFT3D_FALSE;
 	init_SIFT3D_Descriptor_store(&reg->desc_src);
 	init_SIFT3D_Descriptor_store(&reg->desc_ref);
 	init_Ransac(&reg->ran);
@@ -158,6 +174,30 @@ int set_nn_thresh_Reg_SIFT3D(Reg_SIFT3D *const reg, const double nn_thresh) {
         return SIFT3D_SUCCESS;
 }
 
+/* Set the number of checks used in approximate matching. If positive, 
+ * features are matched by SIFT3D_nn_match_approx, comparing each against 
+ * at most nn_checks others. More checks are slower, but find more of the 
+ * exact matches. If zero, features are matched exactly by SIFT3D_nn_match. */
+int set_nn_checks_Reg_SIFT3D(Reg_SIFT3D *const reg, const int nn_checks) {
+
+        if (nn_checks < 0) {
+                SIFT3D_ERR("set_nn_checks_Reg_SIFT3D: invalid number of "
+                        "checks: %d \n", nn_checks);
+                return SIFT3D_FAILURE;
+        }
+
+        reg->nn_checks = nn_checks;
+        return SIFT3D_SUCCESS;
+}
+
+/* Set whether features are matched by SIFT3D_nn_match_u8, after quantizing
+ * the descriptors to bytes. This is faster, and the matches differ from the 
+ * exact ones only by quantization. Cannot be combined with approximate 
+ * matching, see set_nn_checks_Reg_SIFT3D. */
+void set_quantize_Reg_SIFT3D(Reg_SIFT3D *const reg, const int quantize) {
+        reg->quantize = quantize;
+}
+
 /* Set the Ransac parameters of the Reg_SIFT3D struct. */
 int set_Ransac_Reg_SIFT3D(Reg_SIFT3D *const reg, const Ransac *const ran) {
         return copy_Ransac(ran, &reg->ran);
@@ -244,6 +284,7 @@ int register_SIFT3D(Reg_SIFT3D *const reg, void *const tform) {
         Mat_rm *const match_src = &reg->match_src;
         Mat_rm *const match_ref = &reg->match_ref;
         const double nn_thresh = reg->nn_thresh;
+        const int nn_checks = reg->nn_checks;
         SIFT3D_Descriptor_store *const desc_src = &reg->desc_src;
         SIFT3D_Descriptor_store *const desc_ref = &reg->desc_ref;
 
@@ -258,6 +299,11 @@ int register_SIFT3D(Reg_SIFT3D *const reg, void *const tform) {
 			"descriptors are available \n");
 		return SIFT3D_FAILURE;
 	}
+        if (reg->quantize && nn_checks > 0) {
+		SIFT3D_ERR("register_SIFT3D: quantized matching cannot be "
+			"combined with approximate matching \n");
+		return SIFT3D_FAILURE;
+        }
 
         // Initialize intermediates
         matches = NULL;
@@ -267,8 +313,14 @@ int register_SIFT3D(Reg_SIFT3D *const reg, void *const tform) {
                 return SIFT3D_FAILURE;
         }
 
-	// Match features
-	if (SIFT3D_nn_match(desc_src, desc_ref, nn_thresh, &matches)) {
+	// Match features, approximately if checks were given, or on quantized
+        // descriptors if requested
+	if (reg->quantize ? 
+                match_u8(desc_src, desc_ref, nn_thresh, &matches) :
+                nn_checks > 0 ? 
+                SIFT3D_nn_match_approx(desc_src, desc_ref, nn_thresh, 
+                        nn_checks, &matches) :
+                SIFT3D_nn_match(desc_src, desc_ref, nn_thresh, &matches)) {
 		SIFT3D_ERR("register_SIFT3D: failed to match "
                         "descriptors \n");
                 goto register_SIFT3D_quit;
@@ -291,6 +343,11 @@ int register_SIFT3D(Reg_SIFT3D *const reg, void *const tform) {
             im2mm(match_ref, reg->ref_units, &match_ref_mm))
                 goto register_SIFT3D_quit;
 
+        // Sort the matches from best to worst, for PROSAC
+        if (ran->prosac && sort_matches(desc_src, desc_ref, matches, 
+                &match_src_mm, &match_ref_mm))
+                goto register_SIFT3D_quit;
+
 	// Find the transformation in real-world units
 	if (find_tform_ransac(ran, &match_src_mm, &match_ref_mm, tform))
                 goto register_SIFT3D_quit;
@@ -314,6 +371,130 @@ register_SIFT3D_quit:
         return SIFT3D_FAILURE;
 }
 
+/* Helper function to quantize the descriptors d1 and d2, then match them 
+ * with SIFT3D_nn_match_u8. */
+static int match_u8(const SIFT3D_Descriptor_store *const d1,
+        const SIFT3D_Descriptor_store *const d2, const double nn_thresh,
+        int **const matches) {
+
+        SIFT3D_Descriptor_u8 d1_u8, d2_u8;
+        int ret;
+
+        init_SIFT3D_Descriptor_u8(&d1_u8);
+        init_SIFT3D_Descriptor_u8(&d2_u8);
+
+        ret = SIFT3D_Descriptor_store_to_u8(d1, &d1_u8) ||
+                SIFT3D_Descriptor_store_to_u8(d2, &d2_u8) ||
+                SIFT3D_nn_match_u8(&d1_u8, &d2_u8, (float) nn_thresh, 
+                        matches);
+
+        cleanup_SIFT3D_Descriptor_u8(&d1_u8);
+        cleanup_SIFT3D_Descriptor_u8(&d2_u8);
+        return ret ? SIFT3D_FAILURE : SIFT3D_SUCCESS;
+}
+
+/* Helper function to compare Match_dist structs by distance, breaking ties
+ * by row, for qsort. */
+static int match_cmp(const void *a, const void *b) {
+
+        const Match_dist *const ma = (const Match_dist *) a;
+        const Match_dist *const mb = (const Match_dist *) b;
+
+        if (ma->ssd != mb->ssd)
+                return ma->ssd < mb->ssd ? -1 : 1;
+
+        return ma->row - mb->row;
+}
+
+/* Helper function to sort the rows of the coordinate matrices match1 and 
+ * match2, as produced by SIFT3D_matches_to_Mat_rm, by increasing distance 
+ * between the matched descriptors in d1 and d2. 
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+static int sort_matches(const SIFT3D_Descriptor_store *const d1,
+        const SIFT3D_Descriptor_store *const d2, const int *const matches,
+        Mat_rm *const match1, Mat_rm *const match2) {
+
+        Mat_rm copy1, copy2;
+        Match_dist *dists;
+        size_t k;
+        int i, j, h, b, row;
+
+        const int num = match1->num_rows;
+
+        // Compute the distance of each match, in the order of the rows
+        if ((dists = (Match_dist *) malloc(num * sizeof(Match_dist))) == NULL)
+                return SIFT3D_FAILURE;
+        row = 0;
+        for (k = 0; k < d1->num; k++) {
+
+                const SIFT3D_Descriptor *desc1, *desc2;
+                double ssd;
+
+                if (matches[k] < 0)
+                        continue;
+
+                desc1 = d1->buf + k;
+                desc2 = d2->buf + matches[k];
+                ssd = 0.0;
+                for (h = 0; h < DESC_NUM_TOTAL_HIST; h++) {
+                        for (b = 0; b < HIST_NUMEL; b++) {
+
+                                const double diff = 
+                                        (double) desc1->hists[h].bins[b] -
+                                        (double) desc2->hists[h].bins[b];
+
+                                ssd += diff * diff;
+                        }
+                }
+
+                if (row >= num)
+                        break;
+                dists[row].ssd = ssd;
+                dists[row].row = row;
+                row++;
+        }
+        if (row != num) {
+                SIFT3D_ERR("sort_matches: the matches do not correspond to "
+                        "the coordinate matrices \n");
+                free(dists);
+                return SIFT3D_FAILURE;
+        }
+
+        qsort(dists, num, sizeof(Match_dist), match_cmp);
+
+        // Permute the rows
+        if (init_Mat_rm(&copy1, 0, 0, DOUBLE, SIFT3D_FALSE))
+                goto sort_matches_quit;
+        if (init_Mat_rm(&copy2, 0, 0, DOUBLE, SIFT3D_FALSE))
+                goto sort_matches_copy1_quit;
+        if (copy_Mat_rm(match1, &copy1) || copy_Mat_rm(match2, &copy2))
+                goto sort_matches_copy2_quit;
+        SIFT3D_MAT_RM_LOOP_START(match1, i, j)
+
+                const int src_row = dists[i].row;
+
+                SIFT3D_MAT_RM_GET(match1, i, j, double) = 
+                        SIFT3D_MAT_RM_GET(&copy1, src_row, j, double);
+                SIFT3D_MAT_RM_GET(match2, i, j, double) = 
+                        SIFT3D_MAT_RM_GET(&copy2, src_row, j, double);
+
+        SIFT3D_MAT_RM_LOOP_END
+
+        cleanup_Mat_rm(&copy1);
+        cleanup_Mat_rm(&copy2);
+        free(dists);
+        return SIFT3D_SUCCESS;
+
+sort_matches_copy2_quit:
+        cleanup_Mat_rm(&copy2);
+sort_matches_copy1_quit:
+        cleanup_Mat_rm(&copy1);
+sort_matches_quit:
+        free(dists);
+        return SIFT3D_FAILURE;
+}
+
 /* Helper function to scale the descriptors by the given factors */
 static void scale_SIFT3D(const double *const factors, 
 	SIFT3D_Descriptor_store *const d) {
@@ -18,6 +18,7 @@ extern "C" {
 
 /* Parameters */
 const extern double SIFT3D_nn_thresh_default; // Default matching threshold
+const extern int SIFT3D_nn_checks_default; // Default approximate matching checks
 
 /* Internal data for the SIFT3D + RANSAC registration process */
 typedef struct _Reg_SIFT3D {
@@ -28,6 +29,8 @@ typedef struct _Reg_SIFT3D {
         SIFT3D_Descriptor_store desc_src, desc_ref;
         Mat_rm match_src, match_ref;
         double nn_thresh;
+        int nn_checks;
+        int quantize;
         int verbose;
 
 } Reg_SIFT3D;
@@ -43,6 +46,10 @@ int register_SIFT3D_resample(Reg_SIFT3D *const reg, const Image *const src,
 
 int set_nn_thresh_Reg_SIFT3D(Reg_SIFT3D *const reg, const double nn_thresh);
 
+int set_nn_checks_Reg_SIFT3D(Reg_SIFT3D *const reg, const int nn_checks);
+
+void set_quantize_Reg_SIFT3D(Reg_SIFT3D *const reg, const int quantize);
+
 int set_Ransac_Reg_SIFT3D(Reg_SIFT3D *const reg, const Ransac *const ran);
 
 int set_SIFT3D_Reg_SIFT3D(Reg_SIFT3D *const reg, const SIFT3D *const sift3d);
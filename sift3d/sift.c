@@ -15,7 +15,14 @@
 #include <math.h>
 #include <assert.h>
 #include <float.h>
+#include <stdint.h>
 #include <getopt.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "imtypes.h"
 #include "immacros.h"
 #include "imutil.h"
@@ -37,12 +44,19 @@ const double corner_thresh_default = 0.5; // Minimum corner score
 const double sigma_n_default = 1.15; // Nominal scale of input data
 const double sigma0_default = 1.6; // Scale of the base octave
 
+/* Quantized descriptors */
+const double SIFT3D_desc_quant_scale = 255.0; // Scale of quantized histograms, mapping the largest possible element, 1, to 255
+
 /* SIFT3D option names */
 const char opt_peak_thresh[] = "peak_thresh";
 const char opt_corner_thresh[] = "corner_thresh";
 const char opt_num_kp_levels[] = "num_kp_levels";
 const char opt_sigma_n[] = "sigma_n";
 const char opt_sigma0[] = "sigma0";
+const char opt_recursive_gauss[] = "recursive_gauss";
+const char opt_fused_dog[] = "fused_dog";
+const char opt_grad_cache[] = "grad_cache";
+const char opt_ori_field[] = "ori_field";
 
 /* Internal parameters */
 const double max_eig_ratio =  0.90;	// Maximum ratio of eigenvalue magnitudes
@@ -53,6 +67,23 @@ const double ori_rad_fctr =  3.0; // Ratio of window radius to parameter
 const double desc_sig_fctr = 7.071067812; // See ori_sig_fctr, 5 * sqrt(2)
 const double desc_rad_fctr = 2.0;  // See ori_rad_fctr
 const double trunc_thresh = 0.2f * 128.0f / DESC_NUMEL; // Descriptor truncation threshold
+const size_t fused_dog_slab_bytes = 1 << 22; // Target size of the DoG slabs in fused mode
+const size_t extrema_slab_bytes = 1 << 18; // Target size of the extrema search slabs
+const int icos_lut_res = 16; // Cells per edge of each face of the direction cube
+const double icos_lut_margin = 1E-3; // Angular slack of the face lookup, in radians
+const int ori_field_nc = 9; // Channels of the structure tensor field
+const int dense_slab_depth = 4; // z-planes per task of the dense descriptors
+const int dense_roi_chunk = 1024; // Voxels per task of the ROI post-processing
+const size_t desc_soa_align = 64; // Alignment of SIFT3D_Descriptor_soa rows, in bytes
+const int nn_tile_rows = 256; // Rows of d1 per tile of SIFT3D_nn_match
+const int nn_tile_cols = 1024; // Rows of d2 per tile of SIFT3D_nn_match
+const int nn_u8_tile_rows = 32; // Rows of d1 per tile of SIFT3D_nn_match_u8
+const int nn_u8_tile_cols = 256; // Rows of d2 per tile of SIFT3D_nn_match_u8
+const int pca_chunk_rows = 1024; // Descriptors per chunk of the PCA covariance
+const int kd_num_trees = 4; // Trees in the forest of SIFT3D_nn_match_approx
+const int kd_leaf_size = 4; // Maximum descriptors in a k-d tree leaf
+const int kd_num_top_dims = 5; // Highest-variance dimensions to choose splits from
+const int kd_num_sample = 100; // Descriptors sampled to estimate the variance
 
 /* Internal math constants */
 const double gr = 1.6180339887; // Golden ratio
@@ -66,6 +97,94 @@ const int kp_s = 3; // column of s-coordinate
 const int kp_ori = 4; // first column of the orientation matrix
 const int ori_numel = IM_NDIMS * IM_NDIMS; // Number of orientation elements
 
+/* Get the maximum absolute value of DoG level s in octave o */
+#define SIFT3D_DOG_MAX_GET(sift3d, o, s) \
+        ((sift3d)->dog_max[((o) - (sift3d)->gpyr.first_octave) * \
+        (sift3d)->dog.num_levels + (s) - (sift3d)->dog.first_level])
+
+/* A keypoint candidate found by detect_extrema */
+typedef struct _Extremum {
+        int x, y, z;
+} Extremum;
+
+/* A unit of work for detect_extrema: a range of z-planes in one DoG level */
+typedef struct _Extrema_task {
+        int o, s;               // Octave and level
+        int z_start, z_end;     // Range of z-planes to be searched
+        int thread;             // Thread whose buffer holds the results
+        size_t offset, num;     // Location of the results in that buffer
+} Extrema_task;
+
+/* Per-thread scratch memory for detect_extrema */
+typedef struct _Extrema_buf {
+        Extremum *cand;         // Candidates found by this thread
+        size_t num, cap;        // Number and capacity of cand
+        float *window;          // DoG slabs, in fused mode
+        float *planes;          // 3x3 minimum and maximum planes
+        size_t planes_size;     // Capacity of planes, in floats
+        int *mask;              // Extremum test results for one row
+        size_t mask_size;       // Capacity of mask
+} Extrema_buf;
+
+/* Data shared by the rotation-invariant dense descriptors of all voxels */
+typedef struct _Dense_rotate {
+        Image grad_im;          // Gradient of the input, if it was computed
+        Image field;            // Structure tensor field, in ori_field mode
+        Sphere_table ori_win;   // Orientation window, centered on a voxel
+        Sphere_table desc_win;  // Descriptor window, centered on a voxel
+        Mat_rm Id;              // Orientation of the rejected voxels
+        const Image *grad;      // Points to grad_im, or NULL
+        double ori_sigma;       // Scale of the orientation window
+        double desc_sigma;      // Scale of the descriptor window
+} Dense_rotate;
+
+/* The nearest and second-nearest neighbors of a descriptor */
+typedef struct _NN_pair {
+        float ssd_best;         // SSD of the nearest neighbor
+        float ssd_nearest;      // SSD of the second-nearest neighbor
+        int best;               // Index of the nearest neighbor, or -1
+        int nearest;            // Index of the second-nearest, or -1
+} NN_pair;
+
+/* A node of a randomized k-d tree. Internal nodes split dimension dim at val,
+ * into the children a (below) and b (above). Leaves have dim = -1, and hold
+ * the descriptors idx[a, b) of the forest. */
+typedef struct _Kd_node {
+        float val;              // Splitting value
+        int dim;                // Splitting dimension, or -1 for leaves
+        int a, b;               // Children, or range of a leaf
+} Kd_node;
+
+/* A forest of randomized k-d trees over the descriptors of a 
+ * SIFT3D_Descriptor_soa. Tree t is rooted at nodes[t * max_nodes], and its 
+ * leaves index idx[t * num, (t + 1) * num). */
+typedef struct _Kd_forest {
+        const float *data;      // Histograms of the SIFT3D_Descriptor_soa
+        int *idx;               // Descriptor indices, sorted by leaf
+        Kd_node *nodes;         // Nodes of all trees
+        int num;                // Number of descriptors
+        int dim;                // Length of each descriptor
+        int max_nodes;          // Capacity of each tree, in nodes
+} Kd_forest;
+
+/* A branch not yet taken by a k-d forest search */
+typedef struct _Kd_branch {
+        double dist;            // Lower bound on the distance to the query
+        int node;               // Root of the branch
+} Kd_branch;
+
+/* Per-thread scratch memory and state of a k-d forest search */
+typedef struct _Kd_search {
+        Kd_branch *heap;        // Min-heap of the branches, by dist
+        size_t num, cap;        // Number and capacity of heap
+        int *stamp;             // The last query to check each descriptor
+        int query;              // The current query
+        int checked;            // Descriptors checked by the current query
+        int best;               // Index of the nearest descriptor, or -1
+        double ssd_best;        // SSD of the nearest descriptor
+        double ssd_nearest;     // SSD of the second-nearest descriptor
+} Kd_search;
+
 /* Get the index of bin j from triangle i */
 #define MESH_GET_IDX(mesh, i, j) \
 	((mesh)->tri[i].idx[j])
@@ -90,42 +209,43 @@ const int ori_numel = IM_NDIMS * IM_NDIMS; // Number of orientation elements
 #define HIST_GET_AZ(hist, a, p)	\
 			 HIST_GET_PO(hist, ((a) + NBINS_AZ) % NBINS_AZ, p)
 
-/* Loop through a spherical image region. im and [x, y, z] are defined as
+/* Loop through a spherical image region, using the precomputed window win,
+ * a Sphere_table from make_Sphere_table. im and [x, y, z] are defined as
  * above. vcenter is a pointer to a Cvec specifying the center of the window.
- * rad is the radius of the window. vdisp is a pointer to a Cvec storing
- * the displacement from the window center. sqdisp is a float storing the
- * squared Euclidean distance from the window center.
+ * vdisp is a pointer to a Cvec storing the displacement from the window 
+ * center. weight is a float storing the Gaussian weight of the voxel. Voxels
+ * on the image boundary are skipped.
  *
  * Note that the sphere is defined in real-world coordinates, i.e. those
- * with units (1, 1, 1). Thus, rad, sq_dist, and vdisp are defined in these
- * coordinates as well. However, x, y, z, and vcenter are defined in image
- * space.
+ * with units (1, 1, 1). Thus, vdisp is defined in these coordinates as well.
+ * However, x, y, z, and vcenter are defined in image space.
  *
- * Delimit with IM_LOOP_SPHERE_END. */
-#define IM_LOOP_SPHERE_START(im, x, y, z, vcenter, rad, vdisp, sq_dist) \
+ * Delimit with IM_LOOP_WINDOW_END. */
+#define IM_LOOP_WINDOW_START(im, win, x, y, z, vcenter, vdisp, weight) \
 { \
-        const float uxf = (float) (im)->ux; \
-        const float uyf = (float) (im)->uy; \
-        const float uzf = (float) (im)->uz; \
-	const int x_start = SIFT3D_MAX(floorf((vcenter)->x - (rad) / uxf), 1); \
-	const int x_end   = SIFT3D_MIN(ceilf((vcenter)->x + (rad) / uxf),  \
-                im->nx - 2); \
-	const int y_start = SIFT3D_MAX(floorf((vcenter)->y - (rad) / uyf), 1); \
-	const int y_end   = SIFT3D_MIN(ceilf((vcenter)->y + (rad) / uyf), \
-                im->ny - 2); \
-	const int z_start = SIFT3D_MAX(floorf((vcenter)->z - (rad) / uzf), 1); \
-	const int z_end   = SIFT3D_MIN(ceilf((vcenter)->z + (rad) / uzf), \
-                im->nz - 2); \
-	SIFT3D_IM_LOOP_LIMITED_START(im, x, y, z, x_start, x_end, y_start, \
-                 y_end, z_start, z_end) \
-                (vdisp)->x = ((float) x - (vcenter)->x) * uxf; \
-                (vdisp)->y = ((float) y - (vcenter)->y) * uyf; \
-                (vdisp)->z = ((float) z - (vcenter)->z) * uzf; \
-                (sq_dist) = SIFT3D_CVEC_L2_NORM_SQ(vdisp); \
-                if ((sq_dist) > (rad) * (rad)) \
-	                continue; \
-
-#define IM_LOOP_SPHERE_END SIFT3D_IM_LOOP_END }
+        const int _ax = (int) floorf((vcenter)->x); \
+        const int _ay = (int) floorf((vcenter)->y); \
+        const int _az = (int) floorf((vcenter)->z); \
+        int _r; \
+        for (_r = 0; _r < (win)->num_rows; _r++) { \
+                const Sphere_row *const _row = (win)->rows + _r; \
+                int _x_start, _x_end; \
+                (y) = _ay + _row->dy; \
+                (z) = _az + _row->dz; \
+                if ((y) < 1 || (y) > (im)->ny - 2 || (z) < 1 || \
+                        (z) > (im)->nz - 2) \
+                        continue; \
+                _x_start = SIFT3D_MAX(_ax + _row->dx_start, 1); \
+                _x_end = SIFT3D_MIN(_ax + _row->dx_end, (im)->nx - 2); \
+                (vdisp)->y = (win)->disp_y[_row->dy - (win)->y_min]; \
+                (vdisp)->z = (win)->disp_z[_row->dz - (win)->z_min]; \
+                for ((x) = _x_start; (x) <= _x_end; (x)++) { \
+                        (vdisp)->x = (win)->disp_x[(x) - _ax - \
+                                (win)->x_min]; \
+                        (weight) = (win)->weights[_row->idx + (x) - _ax - \
+                                _row->dx_start];
+
+#define IM_LOOP_WINDOW_END }}}
 
 // Loop over all bins in a gradient histogram. If ICOS_HIST is defined, p
 // is not referenced
@@ -163,25 +283,99 @@ const int ori_numel = IM_NDIMS * IM_NDIMS; // Number of orientation elements
         (vd)->z *= 1.0f / (float) (im)->uz; \
 }
 
+// As IM_GET_GRAD_ISO for channel 0, but reads the gradient from grad, the
+// output of im_grad_iso, unless it is NULL
+#define IM_GET_GRAD_CACHED(im, grad, x, y, z, vd) { \
+        if ((grad) != NULL) { \
+                const float *const _g = &SIFT3D_IM_GET_VOX(grad, x, y, z, 0); \
+                (vd)->x = _g[0]; \
+                (vd)->y = _g[1]; \
+                (vd)->z = _g[2]; \
+        } else IM_GET_GRAD_ISO(im, x, y, z, 0, vd) \
+}
+
 /* Global variables */
 extern CL_data cl_data;
 
 /* Helper routines */
 static int init_geometry(SIFT3D *sift3d);
+static int init_Mesh_lut(Mesh *const mesh);
+#ifndef NDEBUG
+static int check_Mesh_lut(const Mesh *const mesh);
+static int check_Mesh_lut_dir(const Mesh *const mesh, const Cvec *const x);
+#endif
+static int icos_lut_cell(const Cvec *const x);
+static int icos_tri_test(const Cvec *const x, const Tri *const tri, 
+        Cvec *const bary);
 static int set_im_SIFT3D(SIFT3D *const sift3d, const Image *const im);
 static int set_scales_SIFT3D(SIFT3D *const sift3d, const double sigma0,
         const double sigma_n);
 static int resize_SIFT3D(SIFT3D *const sift3d, const int num_kp_levels);
 static int build_gpyr(SIFT3D *sift3d);
 static int build_dog(SIFT3D *dog);
+static int build_pyramids(SIFT3D *const sift3d);
+static void make_dog_level(const Image *const gpyr_cur, 
+        const Image *const gpyr_next, Image *const dog_level, 
+        float *const dog_max);
 static int detect_extrema(SIFT3D *sift3d, Keypoint_store *kp);
+static int get_extrema_slab_depth(const Image *const level, 
+        const size_t slab_bytes);
+static int detect_extrema_task(const SIFT3D *const sift3d, 
+        const Extrema_task *const task, Extrema_buf *const buf);
+static int detect_extrema_level(const Image *const prev, 
+        const Image *const cur, const Image *const next, const int z_start,
+        const int z_end, const int z_offset, const float peak_thresh,
+        Extrema_buf *const buf);
+static void minmax_plane_3x3(const Image *const im, const int z, 
+        float *const min, float *const max);
+static void init_Grad_cache(Grad_cache *const cache);
+static void clear_Grad_cache(Grad_cache *const cache);
+static int resize_Grad_cache(Grad_cache *const cache, const int num_levels);
+static void cleanup_Grad_cache(Grad_cache *const cache);
+static int fill_Grad_cache(SIFT3D *const sift3d, 
+        const Keypoint_store *const kp);
+static const Image *get_Grad_cache(const SIFT3D *const sift3d, const int o,
+        const int s);
+static int im_grad_iso(const Image *const im, Image *const grad);
+static void init_Sphere_table(Sphere_table *const win);
+static void cleanup_Sphere_table(Sphere_table *const win);
+static int make_Sphere_table(Sphere_table *const win, const Image *const im,
+        const Cvec *const vcenter, const double rad_sq, 
+        const double sigma_sq);
+static int match_Sphere_table(const Sphere_table *const win, 
+        const Image *const im, const Cvec *const vcenter, 
+        const double rad_sq, const double sigma_sq);
+static const Sphere_table *get_Sphere_table(const Sphere_table *const win,
+        Sphere_table *const tmp, const Image *const im, 
+        const Cvec *const vcenter, const double rad_sq, 
+        const double sigma_sq);
+static int resize_windows_SIFT3D(SIFT3D *const sift3d, const int num);
+static void ori_window_params(const Keypoint *const key, 
+        double *const rad_sq, double *const sigma_sq);
+static void desc_window_params(const Keypoint *const key, 
+        double *const rad_sq, double *const sigma_sq);
+static int fill_windows_SIFT3D(SIFT3D *const sift3d, 
+        const Keypoint_store *const kp, Sphere_table *const windows, 
+        void (*params)(const Keypoint *const, double *const, double *const));
 static int assign_orientations(SIFT3D *const sift3d, Keypoint_store *const kp);
+static int assign_orientations_window(SIFT3D *const sift3d, 
+        Keypoint_store *const kp);
+static int assign_orientations_field(SIFT3D *const sift3d, 
+        Keypoint_store *const kp);
+static int make_ori_field(const Image *const im, const Image *const grad,
+        const double sigma, const int recursive, Image *const field);
+static int assign_field_ori(const Image *const field, 
+        const Cvec *const vcenter, const double thresh, Mat_rm *const R);
+static int eig_ori_tensor(const double *const A, const Cvec *const vd_win,
+        const Cvec *const vd_sgn, Mat_rm *const R, double *const conf);
 static int assign_orientation_thresh(const Image *const im, 
+        const Image *const grad, const Sphere_table *const win,
         const Cvec *const vcenter, const double sigma, const double thresh,
         Mat_rm *const R);
-static int assign_eig_ori(const Image *const im, const Cvec *const vcenter,
-                          const double sigma, Mat_rm *const R, 
-                          double *const conf);
+static int assign_eig_ori(const Image *const im, const Image *const grad,
+                          const Sphere_table *const win,
+                          const Cvec *const vcenter, const double sigma, 
+                          Mat_rm *const R, double *const conf);
 static int Cvec_to_sbins(const Cvec * const vd, Svec * const bins);
 static void refine_Hist(Hist *hist);
 static int init_cl_SIFT3D(SIFT3D *sift3d);
@@ -190,7 +384,7 @@ static int cart2bary(const Cvec * const cart, const Tri * const tri,
 static int scale_Keypoint(const Keypoint *const src, 
         const double *const factors, Keypoint *const dst);
 static int smooth_raw_input(const SIFT3D *const sift3d, const Image *const src,
-        Image *const dst);
+        const int recursive, Image *const dst);
 static int verify_keys(const Keypoint_store *const kp, const Image *const im);
 static int keypoint2base(const Keypoint *const src, Keypoint *const dst);
 static int _SIFT3D_extract_descriptors(SIFT3D *const sift3d, 
@@ -201,22 +395,89 @@ static void SIFT3D_desc_acc_interp(const SIFT3D * const sift3d,
 				   const Cvec * const grad,
 				   SIFT3D_Descriptor * const desc);
 static int extract_descrip(SIFT3D *const sift3d, const Image *const im,
-	   const Keypoint *const key, SIFT3D_Descriptor *const desc);
+           const Image *const grad_im, const Sphere_table *const win,
+           const Keypoint *const key, SIFT3D_Descriptor *const desc);
 static int argv_remove(const int argc, char **argv, 
                         const unsigned char *processed);
 static int extract_dense_descriptors_no_rotate(SIFT3D *const sift3d,
         const Image *const in, Image *const desc);
+static int extract_dense_hists_no_rotate(SIFT3D *const sift3d,
+        const Image *const in, const int recursive, Image *const desc);
 static int extract_dense_descriptors_rotate(SIFT3D *const sift3d,
         const Image *const in, Image *const desc);
 static int extract_dense_descrip_rotate(SIFT3D *const sift3d, 
-           const Image *const im, const Cvec *const vcenter, 
+           const Image *const im, const Image *const grad_im, 
+           const Sphere_table *const win, const Cvec *const vcenter, 
            const double sigma, const Mat_rm *const R, Hist *const hist);
-static void vox2hist(const Image *const im, const int x, const int y,
-        const int z, Hist *const hist);
+static int init_Dense_rotate(const SIFT3D *const sift3d, 
+        const Image *const in, const int recursive, Dense_rotate *const dr);
+static void cleanup_Dense_rotate(Dense_rotate *const dr);
+static int extract_dense_rotate_voxel(SIFT3D *const sift3d, 
+        const Dense_rotate *const dr, const Image *const in, 
+        const Cvec *const vcenter, Mat_rm *const R, Hist *const hist);
+static int select_Dense_ROI(const Dense_ROI *const roi, 
+        const int *const start, const int *const end, int *const coords);
+static int get_Dense_ROI_margin(const SIFT3D *const sift3d, 
+        const Image *const in, int *const margin);
+static int extract_dense_roi_no_rotate(SIFT3D *const sift3d, 
+        const Image *const in, const int *const coords, const int num,
+        Hist *const hists);
+static int extract_dense_roi_rotate(SIFT3D *const sift3d, 
+        const Image *const in, const int *const coords, const int num,
+        Hist *const hists);
 static void hist2vox(Hist *const hist, const Image *const im, const int x, 
         const int y, const int z);
-static int match_desc(const SIFT3D_Descriptor *const desc,
-        const SIFT3D_Descriptor_store *const store, const float nn_thresh);
+static int nn_match_store(const SIFT3D_Descriptor_store *const d1,
+        const SIFT3D_Descriptor_store *const d2, const float nn_thresh,
+        const int checks, int **const matches);
+static void set_dim_SIFT3D_Descriptor_soa(SIFT3D_Descriptor_soa *const soa,
+        const int dim);
+static float desc_row_norm_sq(const float *const row, const int dim);
+static void init_NN_pair(NN_pair *const pair);
+static void update_NN_pair(NN_pair *const pair, const float ssd, 
+        const int idx);
+static void merge_NN_pair(NN_pair *const dst, const NN_pair *const src);
+static double desc_row_ssd(const float *const row1, const float *const row2,
+        const int dim);
+static int decide_NN_pair(const NN_pair *const pair,
+        const SIFT3D_Descriptor_soa *const query, const int idx,
+        const SIFT3D_Descriptor_soa *const store, const float nn_thresh);
+static int init_NN_pairs(const int num, const int num2, const int num_threads,
+        NN_pair **const pairs1, NN_pair **const pairs2);
+static void merge_NN_cols(NN_pair *const pairs2, const int num2, 
+        const int num_threads);
+static int ratio_test_NN_pair(const NN_pair *const pair, double ssd_best,
+        double ssd_nearest, const float nn_thresh);
+#ifdef SIFT3D_MATCH_MAX_DIST
+static int match_too_far(const double *const coords1, 
+        const double *const coords2, const int nx, const int ny, 
+        const int nz);
+#endif
+static int alloc_desc_arrays(const size_t num, const size_t hist_bytes,
+        void **const mem, void **const hists, double **const coords,
+        double **const scales);
+static unsigned char quantize_desc_val(const float val);
+static void desc2soa_row(const SIFT3D_Descriptor *const desc, 
+        float *const row);
+static int verify_SIFT3D_PCA(const SIFT3D_PCA *const pca);
+static void pca_project_row(const SIFT3D_PCA *const pca, 
+        const float *const row, float *const proj);
+static int desc_u8_ssd(const unsigned char *const row1,
+        const unsigned char *const row2);
+static int decide_NN_pair_u8(const NN_pair *const pair,
+        const SIFT3D_Descriptor_u8 *const query, const int idx,
+        const SIFT3D_Descriptor_u8 *const store, const float nn_thresh);
+static int init_Kd_forest(const SIFT3D_Descriptor_soa *const soa,
+        Kd_forest *const forest);
+static void cleanup_Kd_forest(Kd_forest *const forest);
+static int build_kd_node(Kd_forest *const forest, double *const mean, 
+        double *const var, int *const top, const int start, const int end, 
+        int *const next, unsigned int *const seed);
+static int init_Kd_search(Kd_search *const search, const int num);
+static void cleanup_Kd_search(Kd_search *const search);
+static int kd_forest_match(const Kd_forest *const forest, 
+        Kd_search *const search, const float *const query, 
+        const float nn_thresh, const int checks, int *const match);
 
 /* Initialize geometry tables. */
 static int init_geometry(SIFT3D *sift3d) {
@@ -326,10 +587,283 @@ static int init_geometry(SIFT3D *sift3d) {
 		assert(fabsf(SIFT3D_CVEC_L2_NORM(&temp1) - 
                         SIFT3D_CVEC_L2_NORM(&temp3)) < 1E-10);
 	}	
+        mesh->num = ICOS_NFACES;
+
+        // Build the face lookup table
+        if (init_Mesh_lut(mesh))
+                return SIFT3D_FAILURE;
+
+#ifndef NDEBUG
+        // Verify the table against the search of all triangles
+        if (check_Mesh_lut(mesh))
+                return SIFT3D_FAILURE;
+#endif
 	
 	return SIFT3D_SUCCESS;
 }
 
+/* Get the direction cell of a nonzero vector, for the lookup table of
+ * init_Mesh_lut. The cells tile the faces of the cube [-1, 1]^3, onto 
+ * which x is projected from the origin. */
+static int icos_lut_cell(const Cvec *const x) {
+
+        float a, b, c, abs_a;
+        int face, u, v;
+
+        const float abs_x = fabsf(x->x);
+        const float abs_y = fabsf(x->y);
+        const float abs_z = fabsf(x->z);
+
+        // Find the major axis, and the cube face
+        if (abs_x >= abs_y && abs_x >= abs_z) {
+                a = x->x; b = x->y; c = x->z;
+                face = 0;
+        } else if (abs_y >= abs_z) {
+                a = x->y; b = x->z; c = x->x;
+                face = 2;
+        } else {
+                a = x->z; b = x->x; c = x->y;
+                face = 4;
+        }
+        abs_a = fabsf(a);
+        face += a < 0.0f;
+
+        // Quantize the coordinates within the face
+        u = (int) ((b / abs_a + 1.0f) * 0.5f * icos_lut_res);
+        v = (int) ((c / abs_a + 1.0f) * 0.5f * icos_lut_res);
+        u = SIFT3D_MAX(SIFT3D_MIN(u, icos_lut_res - 1), 0);
+        v = SIFT3D_MAX(SIFT3D_MIN(v, icos_lut_res - 1), 0);
+
+        return (face * icos_lut_res + v) * icos_lut_res + u;
+}
+
+/* Build the lookup table of icos_hist_bin, which lists for each direction
+ * cell of icos_lut_cell the triangles of the mesh which might contain its 
+ * directions, in ascending order. 
+ *
+ * A triangle is listed if its circumscribed cone, around the direction of 
+ * its centroid, overlaps the cone bounding the cell, with an extra margin 
+ * of icos_lut_margin. The margin covers the bary_eps tolerance and the 
+ * rounding of cart2bary. Thus every triangle which passes the test of 
+ * icos_hist_bin for some direction of the cell is listed, and testing the 
+ * candidates in ascending order returns the same triangle, and the same
+ * barycentric coordinates, as testing all triangles. */
+static int init_Mesh_lut(Mesh *const mesh) {
+
+        double centers[ICOS_NFACES][IM_NDIMS], radii[ICOS_NFACES];
+        int i, j, face, u, v, num;
+
+        const int num_cells = 6 * icos_lut_res * icos_lut_res;
+
+        // Get the cone of each triangle
+        for (i = 0; i < ICOS_NFACES; i++) {
+
+                double norm;
+
+                const Cvec *const vert = mesh->tri[i].v;
+
+                centers[i][0] = (double) vert[0].x + vert[1].x + vert[2].x;
+                centers[i][1] = (double) vert[0].y + vert[1].y + vert[2].y;
+                centers[i][2] = (double) vert[0].z + vert[1].z + vert[2].z;
+                norm = sqrt(centers[i][0] * centers[i][0] + 
+                        centers[i][1] * centers[i][1] + 
+                        centers[i][2] * centers[i][2]);
+
+                radii[i] = 0.0;
+                for (j = 0; j < 3; j++) {
+                        const double cos_ang = (centers[i][0] * vert[j].x + 
+                                centers[i][1] * vert[j].y + 
+                                centers[i][2] * vert[j].z) / (norm * 
+                                SIFT3D_CVEC_L2_NORM(vert + j));
+                        radii[i] = SIFT3D_MAX(radii[i], 
+                                acos(SIFT3D_MIN(cos_ang, 1.0)));
+                }
+                for (j = 0; j < IM_NDIMS; j++) {
+                        centers[i][j] /= norm;
+                }
+        }
+
+        // Allocate the table, with room for every triangle in each cell
+        if ((mesh->lut_start = SIFT3D_safe_realloc(mesh->lut_start,
+                (num_cells + 1) * sizeof(int))) == NULL ||
+                (mesh->lut_tri = SIFT3D_safe_realloc(mesh->lut_tri,
+                num_cells * ICOS_NFACES * sizeof(unsigned char))) == NULL) {
+                SIFT3D_ERR("init_Mesh_lut: out of memory \n");
+                return SIFT3D_FAILURE;
+        }
+
+        // List the candidates of each cell
+        num = 0;
+        for (face = 0; face < 6; face++) {
+        for (v = 0; v < icos_lut_res; v++) {
+        for (u = 0; u < icos_lut_res; u++) {
+
+                double dirs[5][IM_NDIMS], cell_radius;
+                int k;
+
+                const int axis = face / 2;
+                const double sgn = face % 2 ? -1.0 : 1.0;
+                const int cell = (face * icos_lut_res + v) * icos_lut_res + u;
+
+                // Get the directions of the center and corners of the cell,
+                // in the coordinates of icos_lut_cell
+                for (k = 0; k < 5; k++) {
+
+                        double cube[IM_NDIMS], norm;
+
+                        const double du = k == 0 ? 0.5 : (double) (k % 2);
+                        const double dv = k == 0 ? 0.5 : (double) ((k - 1) / 2);
+
+                        cube[axis] = sgn;
+                        cube[(axis + 1) % IM_NDIMS] = 
+                                2.0 * (u + du) / icos_lut_res - 1.0;
+                        cube[(axis + 2) % IM_NDIMS] = 
+                                2.0 * (v + dv) / icos_lut_res - 1.0;
+                        norm = sqrt(cube[0] * cube[0] + cube[1] * cube[1] +
+                                cube[2] * cube[2]);
+                        for (j = 0; j < IM_NDIMS; j++) {
+                                dirs[k][j] = cube[j] / norm;
+                        }
+                }
+
+                // The cell is convex, so its farthest direction from the 
+                // center is a corner
+                cell_radius = 0.0;
+                for (k = 1; k < 5; k++) {
+                        const double cos_ang = dirs[0][0] * dirs[k][0] + 
+                                dirs[0][1] * dirs[k][1] + 
+                                dirs[0][2] * dirs[k][2];
+                        cell_radius = SIFT3D_MAX(cell_radius, 
+                                acos(SIFT3D_MIN(cos_ang, 1.0)));
+                }
+
+                // List the triangles whose cones overlap the cell
+                mesh->lut_start[cell] = num;
+                for (i = 0; i < ICOS_NFACES; i++) {
+
+                        const double cos_ang = dirs[0][0] * centers[i][0] + 
+                                dirs[0][1] * centers[i][1] + 
+                                dirs[0][2] * centers[i][2];
+
+                        if (acos(SIFT3D_MAX(SIFT3D_MIN(cos_ang, 1.0), -1.0)) <=
+                                cell_radius + radii[i] + icos_lut_margin)
+                                mesh->lut_tri[num++] = (unsigned char) i;
+                }
+        }}}
+        mesh->lut_start[num_cells] = num;
+
+        // Release the unused memory
+        if ((mesh->lut_tri = SIFT3D_safe_realloc(mesh->lut_tri, 
+                num * sizeof(unsigned char))) == NULL) {
+                SIFT3D_ERR("init_Mesh_lut: out of memory \n");
+                return SIFT3D_FAILURE;
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+#ifndef NDEBUG
+/* Verify that the table of init_Mesh_lut gives the same triangles and 
+ * barycentric coordinates as testing all triangles of the mesh, for a dense
+ * set of directions. These are a grid on the faces of the direction cube, 
+ * 4 times finer than the cells of icos_lut_cell and including their 
+ * boundaries, and the directions along the edges of each triangle. Returns
+ * SIFT3D_FAILURE on the first mismatch. */
+static int check_Mesh_lut(const Mesh *const mesh) {
+
+        int face, i, j, u, v;
+
+        const int res = 4 * icos_lut_res;
+
+        // Check the grid on the faces of the cube
+        for (face = 0; face < 6; face++) {
+        for (v = 0; v <= res; v++) {
+        for (u = 0; u <= res; u++) {
+
+                float cube[IM_NDIMS];
+                Cvec x;
+
+                const int axis = face / 2;
+
+                cube[axis] = face % 2 ? -1.0f : 1.0f;
+                cube[(axis + 1) % IM_NDIMS] = 2.0f * u / res - 1.0f;
+                cube[(axis + 2) % IM_NDIMS] = 2.0f * v / res - 1.0f;
+                x.x = cube[0];
+                x.y = cube[1];
+                x.z = cube[2];
+
+                if (check_Mesh_lut_dir(mesh, &x))
+                        return SIFT3D_FAILURE;
+        }}}
+
+        // Check the edges of the triangles, including the vertices
+        for (i = 0; i < ICOS_NFACES; i++) {
+                for (j = 0; j < 3; j++) {
+                        for (u = 0; u < res; u++) {
+
+                                Cvec x, temp;
+
+                                const Cvec *const v0 = mesh->tri[i].v + j;
+                                const Cvec *const v1 = mesh->tri[i].v + 
+                                        (j + 1) % 3;
+
+                                x = *v0;
+                                temp = *v1;
+                                SIFT3D_CVEC_SCALE(&x, 
+                                        (float) (res - u) / res);
+                                SIFT3D_CVEC_SCALE(&temp, (float) u / res);
+                                SIFT3D_CVEC_OP(&x, &temp, +, &x);
+
+                                if (check_Mesh_lut_dir(mesh, &x))
+                                        return SIFT3D_FAILURE;
+                        }
+                }
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Helper function to compare the lookup of a single direction x with the 
+ * search of all triangles. See check_Mesh_lut. */
+static int check_Mesh_lut_dir(const Mesh *const mesh, const Cvec *const x) {
+
+        Cvec bary_lut, bary_all;
+        int i, tri_lut, tri_all;
+
+        const int cell = icos_lut_cell(x);
+
+        // Search all triangles
+        tri_all = -1;
+        for (i = 0; i < ICOS_NFACES; i++) {
+                if (icos_tri_test(x, mesh->tri + i, &bary_all))
+                        continue;
+                tri_all = i;
+                break;
+        }
+
+        // Search the candidates of the table
+        tri_lut = -1;
+        for (i = mesh->lut_start[cell]; i < mesh->lut_start[cell + 1]; i++) {
+                if (icos_tri_test(x, mesh->tri + mesh->lut_tri[i], 
+                        &bary_lut))
+                        continue;
+                tri_lut = mesh->lut_tri[i];
+                break;
+        }
+
+        if (tri_lut != tri_all || (tri_all >= 0 && 
+                (bary_lut.x != bary_all.x || bary_lut.y != bary_all.y ||
+                bary_lut.z != bary_all.z))) {
+                SIFT3D_ERR("check_Mesh_lut: direction (%f, %f, %f) is in "
+                        "triangle %d of the table, but %d of the mesh \n", 
+                        x->x, x->y, x->z, tri_lut, tri_all);
+                return SIFT3D_FAILURE;
+        }
+
+        return SIFT3D_SUCCESS;
+}
+#endif
+
 /* Convert Cartesian coordinates to barycentric. bary is set to all zeros if
  * the problem is unstable. 
  *
@@ -474,6 +1008,229 @@ void cleanup_SIFT3D_Descriptor_store(SIFT3D_Descriptor_store *const desc) {
         free(desc->buf);
 }
 
+/* Initialize a SIFT3D_Descriptor_soa for first use. */
+void init_SIFT3D_Descriptor_soa(SIFT3D_Descriptor_soa *const soa) {
+        soa->mem = NULL;
+        soa->hists = NULL;
+        soa->coords = NULL;
+        soa->scales = NULL;
+        soa->num = soa->cap = 0;
+        soa->dim = DESC_NUMEL;
+        soa->nx = soa->ny = soa->nz = 0;
+}
+
+/* Free all memory associated with a SIFT3D_Descriptor_soa. soa cannot be 
+ * used after calling this function, unless re-initialized. */
+void cleanup_SIFT3D_Descriptor_soa(SIFT3D_Descriptor_soa *const soa) {
+
+        if (soa->mem != NULL)
+                free(soa->mem);
+        if (soa->coords != NULL)
+                free(soa->coords);
+        if (soa->scales != NULL)
+                free(soa->scales);
+        init_SIFT3D_Descriptor_soa(soa);
+}
+
+/* Resize a SIFT3D_Descriptor_soa to hold num descriptors, keeping the first
+ * ones. Memory is only reallocated if num exceeds the capacity. On failure,
+ * soa is unchanged. */
+int resize_SIFT3D_Descriptor_soa(SIFT3D_Descriptor_soa *const soa, 
+        const size_t num) {
+
+        void *mem, *hists;
+        double *coords, *scales;
+
+        const size_t num_keep = SIFT3D_MIN(soa->num, num);
+
+        // Keep the memory if it is large enough
+        if (num <= soa->cap) {
+                soa->num = num;
+                return SIFT3D_SUCCESS;
+        }
+
+        // Allocate new arrays
+        if (alloc_desc_arrays(num, soa->dim * sizeof(float), &mem, &hists,
+                &coords, &scales)) {
+                SIFT3D_ERR("resize_SIFT3D_Descriptor_soa: out of memory \n");
+                return SIFT3D_FAILURE;
+        }
+
+        // Copy the existing descriptors
+        if (num_keep > 0) {
+                memcpy(hists, soa->hists, num_keep * soa->dim * 
+                        sizeof(float));
+                memcpy(coords, soa->coords, num_keep * IM_NDIMS * 
+                        sizeof(double));
+                memcpy(scales, soa->scales, num_keep * sizeof(double));
+        }
+
+        // Replace the old arrays
+        if (soa->mem != NULL)
+                free(soa->mem);
+        if (soa->coords != NULL)
+                free(soa->coords);
+        if (soa->scales != NULL)
+                free(soa->scales);
+        soa->mem = mem;
+        soa->hists = (float *) hists;
+        soa->coords = coords;
+        soa->scales = scales;
+        soa->num = soa->cap = num;
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Helper function to set the row length of soa to dim. If it changes, the
+ * descriptors are discarded. */
+static void set_dim_SIFT3D_Descriptor_soa(SIFT3D_Descriptor_soa *const soa,
+        const int dim) {
+
+        if (soa->dim == dim)
+                return;
+
+        cleanup_SIFT3D_Descriptor_soa(soa);
+        soa->dim = dim;
+}
+
+/* Helper function to allocate the arrays of num descriptors, with 
+ * hist_bytes of histograms each. The histograms are aligned to
+ * desc_soa_align within *mem. On failure, nothing is allocated. */
+static int alloc_desc_arrays(const size_t num, const size_t hist_bytes,
+        void **const mem, void **const hists, double **const coords,
+        double **const scales) {
+
+        *coords = *scales = NULL;
+        if ((*mem = malloc(num * hist_bytes + desc_soa_align - 1)) == NULL ||
+                (*coords = (double *) malloc(num * IM_NDIMS * 
+                        sizeof(double))) == NULL ||
+                (*scales = (double *) malloc(num * sizeof(double))) == NULL) {
+                if (*mem != NULL)
+                        free(*mem);
+                if (*coords != NULL)
+                        free(*coords);
+                return SIFT3D_FAILURE;
+        }
+        *hists = (void *) (((uintptr_t) *mem + desc_soa_align - 1) & 
+                ~(uintptr_t) (desc_soa_align - 1));
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Initialize a SIFT3D_Descriptor_u8 for first use. */
+void init_SIFT3D_Descriptor_u8(SIFT3D_Descriptor_u8 *const desc) {
+        desc->mem = NULL;
+        desc->hists = NULL;
+        desc->coords = NULL;
+        desc->scales = NULL;
+        desc->num = desc->cap = 0;
+        desc->nx = desc->ny = desc->nz = 0;
+}
+
+/* Free all memory associated with a SIFT3D_Descriptor_u8. desc cannot be 
+ * used after calling this function, unless re-initialized. */
+void cleanup_SIFT3D_Descriptor_u8(SIFT3D_Descriptor_u8 *const desc) {
+
+        if (desc->mem != NULL)
+                free(desc->mem);
+        if (desc->coords != NULL)
+                free(desc->coords);
+        if (desc->scales != NULL)
+                free(desc->scales);
+        init_SIFT3D_Descriptor_u8(desc);
+}
+
+/* Resize a SIFT3D_Descriptor_u8 to hold num descriptors. See
+ * resize_SIFT3D_Descriptor_soa. */
+int resize_SIFT3D_Descriptor_u8(SIFT3D_Descriptor_u8 *const desc, 
+        const size_t num) {
+
+        void *mem, *hists;
+        double *coords, *scales;
+
+        const size_t num_keep = SIFT3D_MIN(desc->num, num);
+
+        // Keep the memory if it is large enough
+        if (num <= desc->cap) {
+                desc->num = num;
+                return SIFT3D_SUCCESS;
+        }
+
+        // Allocate new arrays
+        if (alloc_desc_arrays(num, DESC_NUMEL, &mem, &hists, &coords, 
+                &scales)) {
+                SIFT3D_ERR("resize_SIFT3D_Descriptor_u8: out of memory \n");
+                return SIFT3D_FAILURE;
+        }
+
+        // Copy the existing descriptors
+        if (num_keep > 0) {
+                memcpy(hists, desc->hists, num_keep * DESC_NUMEL);
+                memcpy(coords, desc->coords, num_keep * IM_NDIMS * 
+                        sizeof(double));
+                memcpy(scales, desc->scales, num_keep * sizeof(double));
+        }
+
+        // Replace the old arrays
+        if (desc->mem != NULL)
+                free(desc->mem);
+        if (desc->coords != NULL)
+                free(desc->coords);
+        if (desc->scales != NULL)
+                free(desc->scales);
+        desc->mem = mem;
+        desc->hists = (unsigned char *) hists;
+        desc->coords = coords;
+        desc->scales = scales;
+        desc->num = desc->cap = num;
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Initialize a SIFT3D_PCA for first use. Returns SIFT3D_SUCCESS on 
+ * success, SIFT3D_FAILURE otherwise. */
+int init_SIFT3D_PCA(SIFT3D_PCA *const pca) {
+
+        if (init_Mat_rm(&pca->mean, 0, 0, FLOAT, SIFT3D_FALSE))
+                return SIFT3D_FAILURE;
+        if (init_Mat_rm(&pca->basis, 0, 0, FLOAT, SIFT3D_FALSE)) {
+                cleanup_Mat_rm(&pca->mean);
+                return SIFT3D_FAILURE;
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Free all memory associated with a SIFT3D_PCA. pca cannot be used after
+ * calling this function, unless re-initialized. */
+void cleanup_SIFT3D_PCA(SIFT3D_PCA *const pca) {
+        cleanup_Mat_rm(&pca->mean);
+        cleanup_Mat_rm(&pca->basis);
+}
+
+/* Initialize a SIFT3D_PCA_stats struct, with no descriptors, for first use.
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int init_SIFT3D_PCA_stats(SIFT3D_PCA_stats *const stats) {
+
+        stats->num = 0;
+        if (init_Mat_rm(&stats->sum, 1, DESC_NUMEL, DOUBLE, SIFT3D_TRUE))
+                return SIFT3D_FAILURE;
+        if (init_Mat_rm(&stats->prod, DESC_NUMEL, DESC_NUMEL, DOUBLE, 
+                SIFT3D_TRUE)) {
+                cleanup_Mat_rm(&stats->sum);
+                return SIFT3D_FAILURE;
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Free all memory associated with a SIFT3D_PCA_stats. stats cannot be used
+ * after calling this function, unless re-initialized. */
+void cleanup_SIFT3D_PCA_stats(SIFT3D_PCA_stats *const stats) {
+        cleanup_Mat_rm(&stats->sum);
+        cleanup_Mat_rm(&stats->prod);
+}
+
 /* Initializes the OpenCL data for this SIFT3D struct. This
  * increments the reference counts for shared data. */
 static int init_cl_SIFT3D(SIFT3D *sift3d) {
@@ -521,6 +1278,42 @@ int set_corner_thresh_SIFT3D(SIFT3D *const sift3d,
         return SIFT3D_SUCCESS;
 }
 
+/* Sets whether the Gaussian filters are approximated recursively, which is
+ * faster for large scales. See apply_Gauss_filter. */
+void set_recursive_gauss_SIFT3D(SIFT3D *const sift3d, const int recursive) {
+        sift3d->recursive_gauss = recursive;
+        set_recursive_GSS_filters(&sift3d->gss, recursive);
+}
+
+/* Sets whether keypoint detection computes the DoG pyramid on the fly, from
+ * slabs of the GSS pyramid, instead of storing it. This saves nearly half the
+ * memory of the pyramids, but leaves sift3d->dog empty. This function will 
+ * resize the internal data. */
+int set_fused_dog_SIFT3D(SIFT3D *const sift3d, const int fused) {
+        sift3d->fused_dog = fused;
+        return resize_SIFT3D(sift3d, sift3d->gpyr.num_kp_levels);
+}
+
+/* Sets the memory cap of the gradient cache, in bytes. If nonzero, the 
+ * gradients of the GSS pyramid levels are computed once, on first use, and 
+ * shared by orientation assignment and descriptor extraction. When the cap
+ * is reached, the least recently used levels are evicted, and levels which 
+ * still do not fit are differentiated on the fly, as when max_bytes is 0. 
+ * This discards any cached gradients. */
+void set_grad_cache_SIFT3D(SIFT3D *const sift3d, const size_t max_bytes) {
+        clear_Grad_cache(&sift3d->grad_cache);
+        sift3d->grad_cache.max_bytes = max_bytes;
+}
+
+/* Sets whether orientations are assigned from a structure tensor field, 
+ * which is computed once per pyramid level with a Gaussian filter, instead
+ * of integrating a window around each keypoint. This also applies to the 
+ * rotation-invariant dense descriptors. The orientations are close to, but
+ * not the same as, those of the default mode. See make_ori_field. */
+void set_ori_field_SIFT3D(SIFT3D *const sift3d, const int field) {
+        sift3d->ori_field = field;
+}
+
 /* Sets the number of levels per octave. This function will resize the
  * internal data. */
 int set_num_kp_levels_SIFT3D(SIFT3D *const sift3d,
@@ -577,10 +1370,18 @@ int init_SIFT3D(SIFT3D *sift3d) {
 	const double sigma_n = sigma_n_default;
 	const double sigma0 = sigma0_default;
         const int dense_rotate = SIFT3D_FALSE;
+        const int recursive_gauss = SIFT3D_FALSE;
+        const int fused_dog = SIFT3D_FALSE;
+        const int ori_field = SIFT3D_FALSE;
 
 	// First-time pyramid initialization
         init_Pyramid(dog);
         init_Pyramid(gpyr);
+        sift3d->dog_max = NULL;
+        init_Grad_cache(&sift3d->grad_cache);
+        sift3d->ori_windows = NULL;
+        sift3d->desc_windows = NULL;
+        sift3d->num_windows = 0;
 
         // First-time filter initialization
         init_GSS_filters(gss);
@@ -599,6 +1400,9 @@ int init_SIFT3D(SIFT3D *sift3d) {
 	// Save data
 	dog->first_level = gpyr->first_level = -1;
         sift3d->dense_rotate = dense_rotate;
+        sift3d->recursive_gauss = recursive_gauss;
+        sift3d->fused_dog = fused_dog;
+        sift3d->ori_field = ori_field;
         if (set_sigma_n_SIFT3D(sift3d, sigma_n) ||
                 set_sigma0_SIFT3D(sift3d, sigma0) ||
                 set_peak_thresh_SIFT3D(sift3d, peak_thresh) ||
@@ -622,9 +1426,13 @@ int copy_SIFT3D(const SIFT3D *const src, SIFT3D *const dst) {
         set_sigma0_SIFT3D(dst, src->gpyr.sigma0);
         if (set_peak_thresh_SIFT3D(dst, src->peak_thresh) ||
             set_corner_thresh_SIFT3D(dst, src->corner_thresh) ||
-            set_num_kp_levels_SIFT3D(dst, src->gpyr.num_kp_levels))
+            set_num_kp_levels_SIFT3D(dst, src->gpyr.num_kp_levels) ||
+            set_fused_dog_SIFT3D(dst, src->fused_dog))
                 return SIFT3D_FAILURE;
         dst->dense_rotate = src->dense_rotate;
+        set_recursive_gauss_SIFT3D(dst, src->recursive_gauss);
+        set_grad_cache_SIFT3D(dst, src->grad_cache.max_bytes);
+        set_ori_field_SIFT3D(dst, src->ori_field);
 
         // Copy the image, if any
         if (src->im.data != NULL && set_im_SIFT3D(dst, &src->im))
@@ -635,6 +1443,11 @@ int copy_SIFT3D(const SIFT3D *const src, SIFT3D *const dst) {
             copy_Pyramid(&src->dog, &dst->dog))
                 return SIFT3D_FAILURE;
 
+        // Copy the DoG maxima, if any
+        if (src->dog_max != NULL && dst->dog_max != NULL)
+                memcpy(dst->dog_max, src->dog_max, dst->gpyr.num_octaves *
+                        dst->dog.num_levels * sizeof(float));
+
         return SIFT3D_SUCCESS;
 }
 
@@ -648,6 +1461,10 @@ void cleanup_SIFT3D(SIFT3D *const sift3d) {
         // Clean up the pyramids
         cleanup_Pyramid(&sift3d->gpyr);
         cleanup_Pyramid(&sift3d->dog);
+        if (sift3d->dog_max != NULL)
+                free(sift3d->dog_max);
+        cleanup_Grad_cache(&sift3d->grad_cache);
+        resize_windows_SIFT3D(sift3d, 0);
 
         // Clean up the GSS filters
         cleanup_GSS_filters(&sift3d->gss);
@@ -702,12 +1519,31 @@ void print_opts_SIFT3D(void) {
                "        interval (0, inf). (default: %.2f) \n"
                " --%s [value] \n"
                "    The scale parameter of the first level of octave 0, on \n"
-               "        the interval (0, inf). (default: %.2f) \n",
+               "        the interval (0, inf). (default: %.2f) \n"
+               " --%s \n"
+               "    If specified, approximates the larger Gaussian filters \n"
+               "        recursively. This is faster, but less accurate. \n"
+               " --%s \n"
+               "    If specified, computes the DoG pyramid on the fly \n"
+               "        during keypoint detection, using less memory. \n"
+               " --%s [value] \n"
+               "    The memory cap of the gradient cache, in megabytes. \n"
+               "        If positive, the gradients of the pyramid levels \n"
+               "        are computed once and reused. (default: 0) \n"
+               " --%s \n"
+               "    If specified, assigns orientations from a smoothed \n"
+               "        structure tensor field. This is faster, especially \n"
+               "        for rotation-invariant dense descriptors, but \n"
+               "        less accurate. \n",
                opt_peak_thresh, peak_thresh_default,
                opt_corner_thresh, corner_thresh_default,
                opt_num_kp_levels, num_kp_levels_default,
                opt_sigma_n, sigma_n_default,
-               opt_sigma0, sigma0_default);
+               opt_sigma0, sigma0_default,
+               opt_recursive_gauss,
+               opt_fused_dog,
+               opt_grad_cache,
+               opt_ori_field);
 
 }
 
@@ -725,6 +1561,10 @@ void print_opts_SIFT3D(void) {
  *    			candidates (int)
  * --sigma_n - base level of blurring assumed in data (double)
  * --sigma0 - level to blur base of pyramid (double)
+ * --recursive_gauss - approximate the Gaussian filters recursively (flag)
+ * --fused_dog - compute the DoG pyramid on the fly (flag)
+ * --grad_cache - memory cap of the gradient cache, in megabytes (double)
+ * --ori_field - assign orientations from a structure tensor field (flag)
  *
  * Parameters:
  *      argc - The number of arguments
@@ -747,6 +1587,10 @@ int parse_args_SIFT3D(SIFT3D *const sift3d,
 #define NUM_KP_LEVELS 'c'
 #define SIGMA_N 'd'
 #define SIGMA0 'e'
+#define RECURSIVE_GAUSS 'f'
+#define FUSED_DOG 'g'
+#define GRAD_CACHE 'h'
+#define ORI_FIELD 'i'
 
         // Options
         const struct option longopts[] = {
@@ -755,6 +1599,10 @@ int parse_args_SIFT3D(SIFT3D *const sift3d,
                 {opt_num_kp_levels, required_argument, NULL, NUM_KP_LEVELS},
                 {opt_sigma_n, required_argument, NULL, SIGMA_N},
                 {opt_sigma0, required_argument, NULL, SIGMA0},
+                {opt_recursive_gauss, no_argument, NULL, RECURSIVE_GAUSS},
+                {opt_fused_dog, no_argument, NULL, FUSED_DOG},
+                {opt_grad_cache, required_argument, NULL, GRAD_CACHE},
+                {opt_ori_field, no_argument, NULL, ORI_FIELD},
                 {0, 0, 0, 0}
         };
 
@@ -825,6 +1673,34 @@ int parse_args_SIFT3D(SIFT3D *const sift3d,
                                 processed[idx - 1] = SIFT3D_TRUE;
                                 processed[idx] = SIFT3D_TRUE;
                                 break;
+                        case RECURSIVE_GAUSS:
+                                set_recursive_gauss_SIFT3D(sift3d, 
+                                        SIFT3D_TRUE);
+                                processed[idx] = SIFT3D_TRUE;
+                                break;
+                        case FUSED_DOG:
+                                if (set_fused_dog_SIFT3D(sift3d, SIFT3D_TRUE))
+                                        goto parse_args_quit;
+                                processed[idx] = SIFT3D_TRUE;
+                                break;
+                        case GRAD_CACHE:
+                                // Check for errors
+                                if (dval < 0.0) {
+                                        SIFT3D_ERR("SIFT3D grad_cache must "
+                                                "be nonnegative. Provided: "
+                                                "%f \n", dval);
+                                        goto parse_args_quit;
+                                }
+
+                                set_grad_cache_SIFT3D(sift3d, 
+                                        (size_t) (dval * (1 << 20)));
+                                processed[idx - 1] = SIFT3D_TRUE;
+                                processed[idx] = SIFT3D_TRUE;
+                                break;
+                        case ORI_FIELD:
+                                set_ori_field_SIFT3D(sift3d, SIFT3D_TRUE);
+                                processed[idx] = SIFT3D_TRUE;
+                                break;
                         case '?':
                         default:
                                 if (!check_err)
@@ -838,6 +1714,10 @@ int parse_args_SIFT3D(SIFT3D *const sift3d,
 #undef NUM_KP_LEVELS
 #undef SIGMA_N
 #undef SIGMA0
+#undef RECURSIVE_GAUSS
+#undef FUSED_DOG
+#undef GRAD_CACHE
+#undef ORI_FIELD
 
         // Put all unprocessed options at the end
         argc_new = argv_remove(argc, argv, processed);
@@ -911,7 +1791,11 @@ static int set_scales_SIFT3D(SIFT3D *const sift3d, const double sigma0,
                 return SIFT3D_SUCCESS;
 
         // Recompute the filters
-	return make_gss(gss, gpyr);
+	if (make_gss(gss, gpyr))
+                return SIFT3D_FAILURE;
+        set_recursive_GSS_filters(gss, sift3d->recursive_gauss);
+
+        return SIFT3D_SUCCESS;
 }
 
 /* Resize a SIFT3D struct, allocating temporary storage and recompiling the 
@@ -927,6 +1811,7 @@ static int resize_SIFT3D(SIFT3D *const sift3d, const int num_kp_levels) {
 	const unsigned int num_gpyr_levels = num_dog_levels + 1;
         const int first_octave = 0;
         const int first_level = -1;
+        const int fused_dog = sift3d->fused_dog;
 
 	// Compute the meximum allowed number of octaves
 	if (im->data != NULL) {
@@ -952,9 +1837,24 @@ static int resize_SIFT3D(SIFT3D *const sift3d, const int num_kp_levels) {
 	if (resize_Pyramid(im, first_level, num_kp_levels,
                 num_gpyr_levels, first_octave, num_octaves, gpyr) ||
 	        resize_Pyramid(im, first_level, num_kp_levels, 
-                num_dog_levels, first_octave, num_octaves, dog))
+                num_dog_levels, first_octave, fused_dog ? 0 : num_octaves, 
+                dog))
 		return SIFT3D_FAILURE;
 
+        // Resize the DoG maxima
+        if ((sift3d->dog_max = SIFT3D_safe_realloc(sift3d->dog_max,
+                num_octaves * num_dog_levels * sizeof(float))) == NULL && 
+                num_octaves > 0) {
+                SIFT3D_ERR("resize_SIFT3D: out of memory \n");
+                return SIFT3D_FAILURE;
+        }
+
+        // Resize the gradient cache and the window tables
+        if (resize_Grad_cache(&sift3d->grad_cache, 
+                num_octaves * num_gpyr_levels) ||
+                resize_windows_SIFT3D(sift3d, num_octaves * num_gpyr_levels))
+                return SIFT3D_FAILURE;
+
         // Do nothing more if we have no image
         if (im->data == NULL)
                 return SIFT3D_SUCCESS;
@@ -962,15 +1862,17 @@ static int resize_SIFT3D(SIFT3D *const sift3d, const int num_kp_levels) {
 	// Compute the Gaussian filters
 	if (make_gss(&sift3d->gss, &sift3d->gpyr))
 		return SIFT3D_FAILURE;
+        set_recursive_GSS_filters(&sift3d->gss, sift3d->recursive_gauss);
 
 	return SIFT3D_SUCCESS;
 }
 
 /* Build the GSS pyramid on a single CPU thread */
+SIFT3D_IGNORE_UNUSED
 static int build_gpyr(SIFT3D *sift3d) {
 
         const Image *prev;
-	Sep_FIR_filter *f;
+	const Gauss_filter *gauss;
 	Image *cur;
 	int o, s;
 
@@ -990,16 +1892,16 @@ static int build_gpyr(SIFT3D *sift3d) {
 		return SIFT3D_FAILURE;	
 #endif
 
-	f = (Sep_FIR_filter *) &gss->first_gauss.f;
-	if (apply_Sep_FIR_filter(prev, cur, f, unit))
+	gauss = &gss->first_gauss;
+	if (apply_Gauss_filter(prev, cur, gauss, unit))
 		return SIFT3D_FAILURE;
 
 	// Build the rest of the pyramid
 	SIFT3D_PYR_LOOP_LIMITED_START(o, s, o_start, o_end, s_start, s_end)
 			cur = SIFT3D_PYR_IM_GET(gpyr, o, s);
 			prev = SIFT3D_PYR_IM_GET(gpyr, o, s - 1);
-			f = &gss->gauss_octave[s].f;
-			if (apply_Sep_FIR_filter(prev, cur, f, unit))
+			gauss = gss->gauss_octave + s;
+			if (apply_Gauss_filter(prev, cur, gauss, unit))
 				return SIFT3D_FAILURE;
 #ifdef SIFT3D_USE_OPENCL
 			if (im_read_back(cur, SIFT3D_FALSE))
@@ -1030,41 +1932,191 @@ static int build_gpyr(SIFT3D *sift3d) {
 	return SIFT3D_SUCCESS;
 }
 
+SIFT3D_IGNORE_UNUSED
 static int build_dog(SIFT3D *sift3d) {
 
-	Image *gpyr_cur, *gpyr_next, *dog_level;
+	const Image *gpyr_cur, *gpyr_next;
+        Image *dog_level;
 	int o, s;
 
 	Pyramid *const dog = &sift3d->dog;
 	Pyramid *const gpyr = &sift3d->gpyr;
+	const int o_start = gpyr->first_octave;
+	const int o_end = SIFT3D_PYR_LAST_OCTAVE(gpyr);
+	const int s_start = dog->first_level;
+	const int s_end = SIFT3D_PYR_LAST_LEVEL(dog);
 
-	SIFT3D_PYR_LOOP_START(dog, o, s)
+	SIFT3D_PYR_LOOP_LIMITED_START(o, s, o_start, o_end, s_start, s_end)
 		gpyr_cur = SIFT3D_PYR_IM_GET(gpyr, o, s);
 		gpyr_next = SIFT3D_PYR_IM_GET(gpyr, o, s + 1);			
-		dog_level = SIFT3D_PYR_IM_GET(dog, o, s);
+		dog_level = sift3d->fused_dog ? NULL : 
+                        SIFT3D_PYR_IM_GET(dog, o, s);
 		
-		if (im_subtract(gpyr_cur, gpyr_next, 
-						dog_level))
-			return SIFT3D_FAILURE;
+                make_dog_level(gpyr_cur, gpyr_next, dog_level, 
+                        &SIFT3D_DOG_MAX_GET(sift3d, o, s));
 	SIFT3D_PYR_LOOP_END
 
 	return SIFT3D_SUCCESS;
 }
 
-/* Detect local extrema */
+/* Helper function to compute a DoG level from adjacent levels of the GSS
+ * pyramid, along with its maximum absolute value.
+ *
+ * Parameters:
+ *  -gpyr_cur: The GSS level of the same scale as the DoG level.
+ *  -gpyr_next: The next GSS level.
+ *  -dog_level: The DoG level, which must have the same dimensions as 
+ *      gpyr_cur. If NULL, only the maximum is computed.
+ *  -dog_max: Receives the maximum absolute value of the DoG level. */
+static void make_dog_level(const Image *const gpyr_cur, 
+        const Image *const gpyr_next, Image *const dog_level, 
+        float *const dog_max) {
+
+        float max;
+        int x, y, z;
+
+        max = 0.0f;
+#pragma omp parallel for private(x, y) reduction(max : max)
+        for (z = 0; z < gpyr_cur->nz; z++) {
+                for (y = 0; y < gpyr_cur->ny; y++) {
+                        for (x = 0; x < gpyr_cur->nx; x++) {
+
+                                const float dog = 
+                                        SIFT3D_IM_GET_VOX(gpyr_cur, x, y, z, 
+                                                0) -
+                                        SIFT3D_IM_GET_VOX(gpyr_next, x, y, z,
+                                                0);
+
+                                if (dog_level != NULL)
+                                        SIFT3D_IM_GET_VOX(dog_level, x, y, z,
+                                                0) = dog;
+                                max = SIFT3D_MAX(max, fabsf(dog));
+                        }
+                }
+        }
+
+        *dog_max = max;
+}
+
+/* Builds the GSS and DoG pyramids together, as a graph of OpenMP tasks. Each
+ * level is started as soon as the levels it depends on are ready, so the 
+ * DoG and the next octave overlap with the rest of the current octave. The 
+ * convolutions share their tiles with the whole team, so large levels are 
+ * still split across all threads. Without task support, this is the same as
+ * build_gpyr followed by build_dog. */
+static int build_pyramids(SIFT3D *const sift3d) {
+
+#if !defined(SIFT3D_OMP_TASKS) || defined(SIFT3D_USE_OPENCL)
+        if (build_gpyr(sift3d) || build_dog(sift3d))
+                return SIFT3D_FAILURE;
+
+        return SIFT3D_SUCCESS;
+#else
+	Pyramid *const gpyr = &sift3d->gpyr;
+	Pyramid *const dog = &sift3d->dog;
+	const GSS_filters *const gss = &sift3d->gss;
+	const int s_start = gpyr->first_level + 1;
+	const int s_end = SIFT3D_PYR_LAST_LEVEL(gpyr);
+	const int o_start = gpyr->first_octave;
+	const int o_end = SIFT3D_PYR_LAST_OCTAVE(gpyr);
+        const double unit = 1.0;
+
+        int ret = SIFT3D_SUCCESS;
+
+#pragma omp parallel shared(ret)
+#pragma omp single
+{
+        int o, s;
+
+        const Image *const im = &sift3d->im;
+        Image *const first = SIFT3D_PYR_IM_GET(gpyr, o_start, s_start - 1);
+        const Gauss_filter *const first_gauss = &gss->first_gauss;
+
+	// Build the first image
+#pragma omp task depend(out: *first) shared(ret)
+        if (apply_Gauss_filter(im, first, first_gauss, unit))
+                ret = SIFT3D_FAILURE;
+
+        for (o = o_start; o <= o_end; o++) {
+
+                // Blur each level from the one below it
+                for (s = s_start; s <= s_end; s++) {
+
+			Image *const cur = SIFT3D_PYR_IM_GET(gpyr, o, s);
+			const Image *const prev = 
+                                SIFT3D_PYR_IM_GET(gpyr, o, s - 1);
+			const Gauss_filter *const gauss = 
+                                gss->gauss_octave + s;
+
+#pragma omp task depend(in: *prev) depend(out: *cur) shared(ret)
+			if (apply_Gauss_filter(prev, cur, gauss, unit))
+                                ret = SIFT3D_FAILURE;
+                }
+
+		// Downsample
+		if (o != o_end) {
+
+                        const int downsample_level = 
+                                SIFT3D_MAX(s_end - 2, gpyr->first_level);
+			const Image *const prev = 
+                                SIFT3D_PYR_IM_GET(gpyr, o, downsample_level);
+			Image *const cur = 
+                                SIFT3D_PYR_IM_GET(gpyr, o + 1, s_start - 1);
+
+#pragma omp task depend(in: *prev) depend(out: *cur) shared(ret)
+{
+                        assert(fabs(prev->s - cur->s) < FLT_EPSILON);
+
+			if (im_downsample_2x(prev, cur))
+                                ret = SIFT3D_FAILURE;
+}
+		}
+
+                // Take the difference of each pair of adjacent levels. In
+                // fused mode, only the maximum is needed.
+                for (s = dog->first_level; s <= SIFT3D_PYR_LAST_LEVEL(dog); 
+                        s++) {
+
+                        const Image *const gpyr_cur = 
+                                SIFT3D_PYR_IM_GET(gpyr, o, s);
+                        const Image *const gpyr_next = 
+                                SIFT3D_PYR_IM_GET(gpyr, o, s + 1);
+                        Image *const dog_level = sift3d->fused_dog ? NULL :
+                                SIFT3D_PYR_IM_GET(dog, o, s);
+                        float *const dog_max = 
+                                &SIFT3D_DOG_MAX_GET(sift3d, o, s);
+
+#pragma omp task depend(in: *gpyr_cur, *gpyr_next)
+                        make_dog_level(gpyr_cur, gpyr_next, dog_level, 
+                                dog_max);
+                }
+        }
+}
+
+        return ret;
+#endif
+}
+
+/* Detect local extrema. The DoG levels are split into slabs of z-planes,
+ * which are searched in parallel. Each thread collects its candidates in its
+ * own buffer, and these are merged in the order of the slabs, so the result 
+ * does not depend on the number of threads. */
 static int detect_extrema(SIFT3D *sift3d, Keypoint_store *kp) {
 
-	Image *cur, *prev, *next;
-	Keypoint *key;
-	float pcur, dogmax, peak_thresh;
-	int o, s, x, y, z, x_start, x_end, y_start, y_end, z_start,
-		z_end, num;
+        Extrema_task *tasks;
+        Extrema_buf *bufs;
+	const Image *level;
+        size_t num, window_size, j;
+	int o, s, i, t, num_tasks, num_threads, ret;
 
 	const Pyramid *const dog = &sift3d->dog;
-	const int o_start = dog->first_octave;
-	const int o_end = SIFT3D_PYR_LAST_OCTAVE(dog);
+	const Pyramid *const gpyr = &sift3d->gpyr;
+	const int o_start = gpyr->first_octave;
+	const int o_end = SIFT3D_PYR_LAST_OCTAVE(gpyr);
 	const int s_start = dog->first_level + 1;
 	const int s_end = SIFT3D_PYR_LAST_LEVEL(dog) - 1;
+        const size_t slab_bytes = sift3d->fused_dog ? fused_dog_slab_bytes :
+                extrema_slab_bytes;
 
 	// Verify the inputs
 	if (dog->num_levels < 3) {
@@ -1074,124 +2126,484 @@ static int detect_extrema(SIFT3D *sift3d, Keypoint_store *kp) {
 	}
 
 	// Initialize dimensions of keypoint store
-	cur = SIFT3D_PYR_IM_GET(dog, o_start, s_start);
-	kp->nx = cur->nx;
-	kp->ny = cur->ny;
-	kp->nz = cur->nz;
-
-#define CMP_CUBE(im, x, y, z, CMP, IGNORESELF, val) ( \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x),     (y),     (z) - 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) - 1, (y),     (z) - 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) + 1, (y),     (z) - 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x),     (y) - 1, (z) - 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x),     (y) + 1, (z) - 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) - 1, (y) - 1, (z) - 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) + 1, (y) - 1, (z) - 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) - 1, (y) + 1, (z) - 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) + 1, (y) + 1, (z) - 1, 0) && \
-	((val) CMP SIFT3D_IM_GET_VOX( (im), (x),     (y),    (z), 0   ) || \
-	    IGNORESELF) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) - 1, (y),     (z), 0    ) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) + 1, (y),     (z), 0    ) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x),     (y) - 1, (z), 0    ) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x),     (y) + 1, (z), 0    ) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) - 1, (y) - 1, (z), 0    ) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) + 1, (y) - 1, (z), 0    ) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) - 1, (y) + 1, (z), 0    ) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) + 1, (y) + 1, (z), 0    ) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x),     (y),     (z) + 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) - 1, (y),     (z) + 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) + 1, (y),     (z) + 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x),     (y) - 1, (z) + 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x),     (y) + 1, (z) + 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) - 1, (y) - 1, (z) + 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) + 1, (y) - 1, (z) + 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) - 1, (y) + 1, (z) + 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) + 1, (y) + 1, (z) + 1, 0) )
-#ifdef CUBOID_EXTREMA
-#define CMP_PREV(im, x, y, z, CMP, val) \
-        CMP_CUBE(im, x, y, z, CMP, SIFT3D_FALSE, val)
-#define CMP_CUR(im, x, y, z, CMP, val) \
-        CMP_CUBE(im, x, y, z, CMP, SIFT3D_TRUE, val)
-#define CMP_NEXT(im, x, y, z, CMP, val) \
-        CMP_CUBE(im, x, y, z, CMP, SIFT3D_FALSE, val)
+	level = SIFT3D_PYR_IM_GET(gpyr, o_start, s_start);
+	kp->nx = level->nx;
+	kp->ny = level->ny;
+	kp->nz = level->nz;
+
+        // Count the slabs, and the largest window needed to hold them
+        num_tasks = 0;
+        window_size = 0;
+	SIFT3D_PYR_LOOP_LIMITED_START(o, s, o_start, o_end, s_start, s_end)  
+
+                const int depth = get_extrema_slab_depth(
+                        level = SIFT3D_PYR_IM_GET(gpyr, o, s), slab_bytes);
+
+                if (level->nz < 3)
+                        continue;
+
+                num_tasks += (level->nz - 2 + depth - 1) / depth;
+                window_size = SIFT3D_MAX(window_size, 3 * (size_t) (depth + 2) *
+                        level->nx * level->ny);
+	SIFT3D_PYR_LOOP_END
+
+#ifdef _OPENMP
+        num_threads = omp_get_max_threads();
 #else
-#define CMP_PREV(im, x, y, z, CMP, val) ( \
-        (val) CMP SIFT3D_IM_GET_VOX( (im), (x), (y), (z), 0) \
-)
-#define CMP_CUR(im, x, y, z, CMP, val) ( \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) + 1, (y),     (z), 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) - 1, (y),     (z), 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x),     (y) + 1, (z), 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x),     (y) - 1, (z), 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x),     (y),     (z) - 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x),     (y),     (z) + 1, 0) \
-)
-#define CMP_NEXT(im, x, y, z, CMP, val) \
-        CMP_PREV(im, x, y, z, CMP, val)
+        num_threads = 1;
 #endif
 
-	num = 0;
+        // Allocate the tasks and per-thread buffers
+        tasks = (Extrema_task *) malloc(SIFT3D_MAX(num_tasks, 1) * 
+                sizeof(Extrema_task));
+        bufs = (Extrema_buf *) calloc(num_threads, sizeof(Extrema_buf));
+        if (tasks == NULL || bufs == NULL) {
+                SIFT3D_ERR("detect_extrema: out of memory \n");
+                ret = SIFT3D_FAILURE;
+                goto detect_extrema_quit;
+        }
+
+        // Initialize the tasks
+        t = 0;
 	SIFT3D_PYR_LOOP_LIMITED_START(o, s, o_start, o_end, s_start, s_end)  
 
-		// Select current and neighboring levels
-		prev = SIFT3D_PYR_IM_GET(dog, o, s - 1);
-		cur = SIFT3D_PYR_IM_GET(dog, o, s);
-		next = SIFT3D_PYR_IM_GET(dog, o, s + 1);
-
-		// Find maximum DoG value at this level
-		dogmax = 0.0f;
-		SIFT3D_IM_LOOP_START(cur, x, y, z)
-			dogmax = SIFT3D_MAX(dogmax, 
-                                fabsf(SIFT3D_IM_GET_VOX(cur, x, y, z, 0)));
-		SIFT3D_IM_LOOP_END
-
-		// Adjust threshold
-		peak_thresh = sift3d->peak_thresh * dogmax;
-
-		// Loop through all non-boundary pixels
-		x_start = y_start = z_start = 1;
-		x_end = cur->nx - 2;
-		y_end = cur->ny - 2;
-		z_end = cur->nz - 2;
-		SIFT3D_IM_LOOP_LIMITED_START(cur, x, y, z, x_start, x_end, y_start,
-							  y_end, z_start, z_end)
-			// Sample the center value
-			pcur = SIFT3D_IM_GET_VOX(cur, x, y, z, 0);
-
-			// Apply the peak threshold
-			if ((pcur > peak_thresh || pcur < -peak_thresh) && ((
-				// Compare to the neighbors
-				CMP_PREV(prev, x, y, z, >, pcur) &&
-				CMP_CUR(cur, x, y, z, >, pcur) &&
-				CMP_NEXT(next, x, y, z, >, pcur)
-				) || (
-				CMP_PREV(prev, x, y, z, <, pcur) &&
-				CMP_CUR(cur, x, y, z, <, pcur) &&
-				CMP_NEXT(next, x, y, z, <, pcur))))
-				{
-
-                                // Add a keypoint candidate
-                                num++;
-                                if (resize_Keypoint_store(kp, num))
-                                        return SIFT3D_FAILURE;
-                                key = kp->buf + num - 1;
-                                if (init_Keypoint(key))
+                int z;
+
+                const int depth = get_extrema_slab_depth(
+                        level = SIFT3D_PYR_IM_GET(gpyr, o, s), slab_bytes);
+
+                for (z = 1; z <= level->nz - 2; z += depth) {
+                        Extrema_task *const task = tasks + t++;
+
+                        task->o = o;
+                        task->s = s;
+                        task->z_start = z;
+                        task->z_end = SIFT3D_MIN(z + depth - 1, level->nz - 2);
+                }
+	SIFT3D_PYR_LOOP_END
+        assert(t == num_tasks);
+
+        // Search the slabs
+        ret = SIFT3D_SUCCESS;
+#pragma omp parallel shared(ret) num_threads(num_threads)
+{
+        int t;
+
+#ifdef _OPENMP
+        Extrema_buf *const buf = bufs + omp_get_thread_num();
+#else
+        Extrema_buf *const buf = bufs;
+#endif
+
+        if (sift3d->fused_dog && (buf->window = (float *) malloc(window_size * 
+                sizeof(float))) == NULL)
+                ret = SIFT3D_FAILURE;
+
+#pragma omp for schedule(dynamic)
+        for (t = 0; t < num_tasks; t++) {
+
+                Extrema_task *const task = tasks + t;
+
+                task->thread = buf - bufs;
+                task->offset = buf->num;
+                task->num = 0;
+
+                if (sift3d->fused_dog && buf->window == NULL)
+                        continue;
+
+                if (detect_extrema_task(sift3d, task, buf))
+                        ret = SIFT3D_FAILURE;
+
+                task->num = buf->num - task->offset;
+        }
+}
+        if (ret)
+                goto detect_extrema_quit;
+
+        // Count the candidates
+        num = 0;
+        for (t = 0; t < num_tasks; t++) {
+                num += tasks[t].num;
+        }
+
+        // Merge the candidates into the keypoint store
+        if (resize_Keypoint_store(kp, num)) {
+                ret = SIFT3D_FAILURE;
+                goto detect_extrema_quit;
+        }
+        num = 0;
+        for (t = 0; t < num_tasks; t++) {
+
+                const Extrema_task *const task = tasks + t;
+                const Extremum *const cand = bufs[task->thread].cand + 
+                        task->offset;
+                const double sd = SIFT3D_PYR_IM_GET(gpyr, task->o, 
+                        task->s)->s;
+
+                for (j = 0; j < task->num; j++) {
+
+                        Keypoint *const key = kp->buf + num++;
+
+                        if (init_Keypoint(key)) {
+                                ret = SIFT3D_FAILURE;
+                                goto detect_extrema_quit;
+                        }
+                        key->o = task->o;
+                        key->s = task->s;
+                        key->sd = sd;
+			key->xd = (double) cand[j].x;
+			key->yd = (double) cand[j].y;
+			key->zd = (double) cand[j].z;
+                }
+        }
+
+detect_extrema_quit:
+        if (bufs != NULL) {
+                for (i = 0; i < num_threads; i++) {
+                        if (bufs[i].cand != NULL)
+                                free(bufs[i].cand);
+                        if (bufs[i].window != NULL)
+                                free(bufs[i].window);
+                        if (bufs[i].planes != NULL)
+                                free(bufs[i].planes);
+                        if (bufs[i].mask != NULL)
+                                free(bufs[i].mask);
+                }
+                free(bufs);
+        }
+        if (tasks != NULL)
+                free(tasks);
+
+	return ret;
+}
+
+/* Helper function for detect_extrema, which returns the number of z-planes 
+ * per slab of a DoG level. Each slab, with one plane on either side, fits in
+ * roughly slab_bytes for each of three DoG levels. */
+static int get_extrema_slab_depth(const Image *const level, 
+        const size_t slab_bytes) {
+
+        const size_t plane_bytes = (size_t) level->nx * level->ny * 
+                sizeof(float);
+        const int depth = (int) (slab_bytes / (3 * plane_bytes)) - 2;
+
+        return SIFT3D_MAX(SIFT3D_MIN(depth, level->nz - 2), 1);
+}
+
+/* Helper function for detect_extrema, which searches one slab of a DoG 
+ * level. In fused mode, the slab and its neighbors are computed on the fly 
+ * from the GSS pyramid, in the thread's window.
+ *
+ * Parameters:
+ *  -sift3d: Stores the pyramids and the parameters.
+ *  -task: The slab to be searched.
+ *  -buf: The buffer of the calling thread, to which candidates are appended.
+ *
+ * Return: SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+static int detect_extrema_task(const SIFT3D *const sift3d, 
+        const Extrema_task *const task, Extrema_buf *const buf) {
+
+        Image window[3];
+        int i, x, y, z;
+
+	const Pyramid *const gpyr = &sift3d->gpyr;
+	const Pyramid *const dog = &sift3d->dog;
+        const int o = task->o;
+        const int s = task->s;
+        const float peak_thresh = sift3d->peak_thresh * 
+                SIFT3D_DOG_MAX_GET(sift3d, o, s);
+
+        // Search the stored DoG levels
+        if (!sift3d->fused_dog)
+                return detect_extrema_level(SIFT3D_PYR_IM_GET(dog, o, s - 1), 
+                        SIFT3D_PYR_IM_GET(dog, o, s), 
+                        SIFT3D_PYR_IM_GET(dog, o, s + 1), task->z_start, 
+                        task->z_end, 0, peak_thresh, buf);
+
+        // Compute the DoG levels, including one plane on either side
+        for (i = 0; i < 3; i++) {
+
+                Image *const level = window + i;
+                const Image *const gpyr_cur = 
+                        SIFT3D_PYR_IM_GET(gpyr, o, s - 1 + i);
+                const Image *const gpyr_next = 
+                        SIFT3D_PYR_IM_GET(gpyr, o, s + i);
+                const int z_offset = task->z_start - 1;
+
+                init_im(level);
+                level->nx = gpyr_cur->nx;
+                level->ny = gpyr_cur->ny;
+                level->nz = task->z_end - task->z_start + 3;
+                level->nc = 1;
+                im_default_stride(level);
+                level->size = level->nz * level->zs;
+                level->data = buf->window + i * level->size;
+                level->data_shared = SIFT3D_TRUE;
+
+                SIFT3D_IM_LOOP_START(level, x, y, z)
+                        SIFT3D_IM_GET_VOX(level, x, y, z, 0) = 
+                                SIFT3D_IM_GET_VOX(gpyr_cur, x, y, 
+                                        z + z_offset, 0) -
+                                SIFT3D_IM_GET_VOX(gpyr_next, x, y, 
+                                        z + z_offset, 0);
+                SIFT3D_IM_LOOP_END
+        }
+
+        return detect_extrema_level(window, window + 1, window + 2, 1, 
+                window[1].nz - 2, task->z_start - 1, peak_thresh, buf);
+}
+
+/* Helper function for detect_extrema, which appends the local extrema of a 
+ * slab of a DoG level to a candidate buffer. Voxels on the x and y 
+ * boundaries are not searched. A voxel is an extremum if it is strictly 
+ * greater, or strictly less, than its 6-connected neighbors in cur and the 
+ * voxels at the same location in prev and next. If CUBOID_EXTREMA is 
+ * defined, it is instead compared to the whole 3x3x3 cube in each level.
+ *
+ * Each row is tested at once, comparing the center voxels to the running
+ * minima and maxima of their neighbors, in a loop the compiler vectorizes. 
+ * Only the voxels that pass are added to buf. In cuboid mode, the 3x3 minima
+ * and maxima of each plane are computed once and reused for the three 
+ * z-coordinates which need them. All levels must have a single channel.
+ *
+ * Parameters:
+ *  -prev: The DoG level below cur.
+ *  -cur: The DoG level to be searched.
+ *  -next: The DoG level above cur.
+ *  -z_start: The first z-plane of cur to be searched.
+ *  -z_end: The last z-plane of cur to be searched.
+ *  -z_offset: The z-coordinate of the first plane of cur, in the full level.
+ *  -peak_thresh: The smallest allowed absolute DoG value.
+ *  -buf: The candidate buffer.
+ *
+ * Return: SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+static int detect_extrema_level(const Image *const prev, 
+        const Image *const cur, const Image *const next, const int z_start,
+        const int z_end, const int z_offset, const float peak_thresh,
+        Extrema_buf *const buf) {
+
+        Extremum *cand;
+        int *mask;
+        int x, y, z;
+
+	const int x_start = 1;
+        const int y_start = 1;
+	const int x_end = cur->nx - 2;
+	const int y_end = cur->ny - 2;
+#ifdef CUBOID_EXTREMA
+        float *planes;
+        int i;
+
+        const size_t plane_size = (size_t) cur->nx * cur->ny;
+        const Image *const levels[3] = {prev, cur, next};
+#endif
+
+        assert(cur->nc == 1 && cur->xs == 1);
+
+        // Nothing to do without interior voxels
+        if (x_end < x_start || y_end < y_start || z_end < z_start)
+                return SIFT3D_SUCCESS;
+
+        // Make room for the row mask
+        if (buf->mask_size < (size_t) cur->nx) {
+                if ((buf->mask = SIFT3D_safe_realloc(buf->mask, 
+                        cur->nx * sizeof(int))) == NULL) {
+                        buf->mask_size = 0;
+                        return SIFT3D_FAILURE;
+                }
+                buf->mask_size = cur->nx;
+        }
+        mask = buf->mask;
+
+#ifdef CUBOID_EXTREMA
+        // Make room for three minimum and maximum planes in each level
+        if (buf->planes_size < 18 * plane_size) {
+                if ((buf->planes = SIFT3D_safe_realloc(buf->planes, 
+                        18 * plane_size * sizeof(float))) == NULL) {
+                        buf->planes_size = 0;
+                        return SIFT3D_FAILURE;
+                }
+                buf->planes_size = 18 * plane_size;
+        }
+        planes = buf->planes;
+
+// Get the minimum or maximum plane of level l at z-coordinate z 
+#define MIN_PLANE(l, z) (planes + ((l) * 6 + ((z) % 3)) * plane_size)
+#define MAX_PLANE(l, z) (planes + ((l) * 6 + 3 + ((z) % 3)) * plane_size)
+
+        // Compute the planes below and at z_start
+        for (i = 0; i < 3; i++) {
+                for (z = z_start - 1; z <= z_start; z++) {
+                        minmax_plane_3x3(levels[i], z, MIN_PLANE(i, z),
+                                MAX_PLANE(i, z));
+                }
+        }
+#endif
+
+	for (z = z_start; z <= z_end; z++) {
+
+#ifdef CUBOID_EXTREMA
+                // Compute the planes above z
+                for (i = 0; i < 3; i++) {
+                        minmax_plane_3x3(levels[i], z + 1, 
+                                MIN_PLANE(i, z + 1), MAX_PLANE(i, z + 1));
+                }
+#endif
+
+        for (y = y_start; y <= y_end; y++) {
+
+                const float *const c = &SIFT3D_IM_GET_VOX(cur, 0, y, z, 0);
+                const float *const c_ym = c - cur->ys;
+                const float *const c_yp = c + cur->ys;
+                const float *const c_zm = c - cur->zs;
+                const float *const c_zp = c + cur->zs;
+#ifdef CUBOID_EXTREMA
+                const size_t row = (size_t) y * cur->nx;
+                const float *const p_min0 = MIN_PLANE(0, z - 1) + row;
+                const float *const p_min1 = MIN_PLANE(0, z) + row;
+                const float *const p_min2 = MIN_PLANE(0, z + 1) + row;
+                const float *const p_max0 = MAX_PLANE(0, z - 1) + row;
+                const float *const p_max1 = MAX_PLANE(0, z) + row;
+                const float *const p_max2 = MAX_PLANE(0, z + 1) + row;
+                const float *const c_min0 = MIN_PLANE(1, z - 1) + row;
+                const float *const c_min2 = MIN_PLANE(1, z + 1) + row;
+                const float *const c_max0 = MAX_PLANE(1, z - 1) + row;
+                const float *const c_max2 = MAX_PLANE(1, z + 1) + row;
+                const float *const n_min0 = MIN_PLANE(2, z - 1) + row;
+                const float *const n_min1 = MIN_PLANE(2, z) + row;
+                const float *const n_min2 = MIN_PLANE(2, z + 1) + row;
+                const float *const n_max0 = MAX_PLANE(2, z - 1) + row;
+                const float *const n_max1 = MAX_PLANE(2, z) + row;
+                const float *const n_max2 = MAX_PLANE(2, z + 1) + row;
+#else
+                const float *const p = &SIFT3D_IM_GET_VOX(prev, 0, y, z, 0);
+                const float *const n = &SIFT3D_IM_GET_VOX(next, 0, y, z, 0);
+#endif
+
+                // Test the whole row
+#pragma omp simd
+                for (x = x_start; x <= x_end; x++) {
+
+                        float lo, hi;
+
+                        const float val = c[x];
+
+#ifdef CUBOID_EXTREMA
+                        // The 8-connected neighbors in the same plane
+                        lo = SIFT3D_MIN(SIFT3D_MIN(c[x - 1], c[x + 1]),
+                                SIFT3D_MIN(
+                                SIFT3D_MIN(SIFT3D_MIN(c_ym[x - 1], c_ym[x]), 
+                                        c_ym[x + 1]),
+                                SIFT3D_MIN(SIFT3D_MIN(c_yp[x - 1], c_yp[x]), 
+                                        c_yp[x + 1])));
+                        hi = SIFT3D_MAX(SIFT3D_MAX(c[x - 1], c[x + 1]),
+                                SIFT3D_MAX(
+                                SIFT3D_MAX(SIFT3D_MAX(c_ym[x - 1], c_ym[x]), 
+                                        c_ym[x + 1]),
+                                SIFT3D_MAX(SIFT3D_MAX(c_yp[x - 1], c_yp[x]), 
+                                        c_yp[x + 1])));
+
+                        // The rest of the cube in cur, then prev and next
+                        lo = SIFT3D_MIN(lo, SIFT3D_MIN(c_min0[x], c_min2[x]));
+                        hi = SIFT3D_MAX(hi, SIFT3D_MAX(c_max0[x], c_max2[x]));
+                        lo = SIFT3D_MIN(lo, SIFT3D_MIN(SIFT3D_MIN(p_min0[x], 
+                                p_min1[x]), p_min2[x]));
+                        hi = SIFT3D_MAX(hi, SIFT3D_MAX(SIFT3D_MAX(p_max0[x], 
+                                p_max1[x]), p_max2[x]));
+                        lo = SIFT3D_MIN(lo, SIFT3D_MIN(SIFT3D_MIN(n_min0[x], 
+                                n_min1[x]), n_min2[x]));
+                        hi = SIFT3D_MAX(hi, SIFT3D_MAX(SIFT3D_MAX(n_max0[x], 
+                                n_max1[x]), n_max2[x]));
+#else
+                        // The 6-connected neighbors in cur, then prev and next
+                        lo = SIFT3D_MIN(
+                                SIFT3D_MIN(SIFT3D_MIN(c[x - 1], c[x + 1]),
+                                        SIFT3D_MIN(c_ym[x], c_yp[x])),
+                                SIFT3D_MIN(SIFT3D_MIN(c_zm[x], c_zp[x]),
+                                        SIFT3D_MIN(p[x], n[x])));
+                        hi = SIFT3D_MAX(
+                                SIFT3D_MAX(SIFT3D_MAX(c[x - 1], c[x + 1]),
+                                        SIFT3D_MAX(c_ym[x], c_yp[x])),
+                                SIFT3D_MAX(SIFT3D_MAX(c_zm[x], c_zp[x]),
+                                        SIFT3D_MAX(p[x], n[x])));
+#endif
+
+                        // Apply the peak threshold and compare to the 
+                        // neighbors, without branching
+                        mask[x] = ((val > peak_thresh) | (val < -peak_thresh)) &
+                                ((val > hi) | (val < lo));
+                }
+
+                // Add the candidates which passed
+                for (x = x_start; x <= x_end; x++) {
+
+                        if (!mask[x])
+                                continue;
+
+                        // Make room for the candidate
+                        if (buf->num >= buf->cap) {
+                                buf->cap = SIFT3D_MAX(2 * buf->cap, 64);
+                                if ((buf->cand = SIFT3D_safe_realloc(buf->cand,
+                                        buf->cap * sizeof(Extremum))) == NULL) {
+                                        buf->num = buf->cap = 0;
                                         return SIFT3D_FAILURE;
-                                key->o = o;
-                                key->s = s;
-                                key->sd = cur->s;
-				key->xd = (double) x;
-				key->yd = (double) y;
-				key->zd = (double) z;
+                                }
                         }
-		SIFT3D_IM_LOOP_END
-	SIFT3D_PYR_LOOP_END
-#undef CMP_NEIGHBORS
+
+                        // Add a keypoint candidate
+                        cand = buf->cand + buf->num++;
+			cand->x = x;
+			cand->y = y;
+			cand->z = z + z_offset;
+                }
+        }
+        }
+#undef MIN_PLANE
+#undef MAX_PLANE
 
 	return SIFT3D_SUCCESS;
 }
 
+/* Helper function for detect_extrema_level, which computes the minimum and 
+ * maximum over the 3x3 neighborhood of each interior voxel in a z-plane. The
+ * outputs are planes of im->nx * im->ny floats, in which the x and y 
+ * boundaries are not written. */
+SIFT3D_IGNORE_UNUSED
+static void minmax_plane_3x3(const Image *const im, const int z, 
+        float *const min, float *const max) {
+
+        int x, y;
+
+        const int nx = im->nx;
+
+        for (y = 1; y < im->ny - 1; y++) {
+
+                const float *const r0 = &SIFT3D_IM_GET_VOX(im, 0, y - 1, z, 0);
+                const float *const r1 = &SIFT3D_IM_GET_VOX(im, 0, y, z, 0);
+                const float *const r2 = &SIFT3D_IM_GET_VOX(im, 0, y + 1, z, 0);
+                float *const min_row = min + (size_t) y * nx;
+                float *const max_row = max + (size_t) y * nx;
+
+#pragma omp simd
+                for (x = 1; x < nx - 1; x++) {
+                        min_row[x] = SIFT3D_MIN(
+                                SIFT3D_MIN(SIFT3D_MIN(r0[x - 1], r0[x]), 
+                                        SIFT3D_MIN(r0[x + 1], r1[x - 1])),
+                                SIFT3D_MIN(
+                                SIFT3D_MIN(SIFT3D_MIN(r1[x], r1[x + 1]), 
+                                        SIFT3D_MIN(r2[x - 1], r2[x])), 
+                                        r2[x + 1]));
+                        max_row[x] = SIFT3D_MAX(
+                                SIFT3D_MAX(SIFT3D_MAX(r0[x - 1], r0[x]), 
+                                        SIFT3D_MAX(r0[x + 1], r1[x - 1])),
+                                SIFT3D_MAX(
+                                SIFT3D_MAX(SIFT3D_MAX(r1[x], r1[x + 1]), 
+                                        SIFT3D_MAX(r2[x - 1], r2[x])), 
+                                        r2[x + 1]));
+                }
+        }
+}
+
 /* Bin a Cartesian gradient into Spherical gradient bins */
 SIFT3D_IGNORE_UNUSED
 static int Cvec_to_sbins(const Cvec * const vd, Svec * const bins) {
@@ -1237,1710 +2649,4745 @@ static void refine_Hist(Hist *hist) {
 
 }
 
-/* Assign rotation matrices to the keypoints. 
- * 
- * Note that this stage will modify kp, likely
- * rejecting some keypoints as orientationally
- * unstable. */
-static int assign_orientations(SIFT3D *const sift3d, 
-			       Keypoint_store *const kp) {
+/* Initialize a Grad_cache struct, with the cache disabled. */
+static void init_Grad_cache(Grad_cache *const cache) {
+        cache->grads = NULL;
+        cache->last_use = NULL;
+        cache->clock = 0;
+        cache->bytes = 0;
+        cache->max_bytes = 0;
+        cache->num_levels = 0;
+}
 
-	Keypoint *kp_pos;
-	size_t num;
-	int i, err; 
+/* Discard all cached gradients. */
+static void clear_Grad_cache(Grad_cache *const cache) {
 
-	// Iterate over the keypoints 
-        err = SIFT3D_SUCCESS;
-#pragma omp parallel for
-	for (i = 0; i < kp->slab.num; i++) {
+        int i;
 
-		Keypoint *const key = kp->buf + i;
-		const Image *const level = 
-                        SIFT3D_PYR_IM_GET(&sift3d->gpyr, key->o, key->s);
-                Mat_rm *const R = &key->R;
-                const Cvec vcenter = {key->xd, key->yd, key->zd};
-                const double sigma = ori_sig_fctr * key->sd;
+        for (i = 0; i < cache->num_levels; i++) {
 
-		// Compute dominant orientations
-                assert(R->u.data_float == key->r_data);
-		switch (assign_orientation_thresh(level, &vcenter, sigma,
-                                       sift3d->corner_thresh, R)) {
-			case SIFT3D_SUCCESS:
-				// Continue processing this keypoint
-				break;
-			case REJECT:
-				// Mark this keypoint as invalid
-                                key->xd = key->yd = key->zd = -1.0;
-                                continue;
-			default:
-				// Any other return value is an error
-                                err = SIFT3D_FAILURE;
-                                continue;
-		}
-		
-	}
+                Image *const grad = cache->grads + i;
 
-        // Check for errors
-        if (err) return err;
+                if (grad->data == NULL)
+                        continue;
 
-        // Rebuild the keypoint buffer in place
-	kp_pos = kp->buf;
-        for (i = 0; i < kp->slab.num; i++) {
+                im_free(grad);
+                init_im(grad);
+        }
+        cache->bytes = 0;
+}
 
-		Keypoint *const key = kp->buf + i;
+/* Resize a Grad_cache struct to hold num_levels pyramid levels, discarding
+ * all cached gradients. */
+static int resize_Grad_cache(Grad_cache *const cache, const int num_levels) {
 
-                // Check if the keypoint is valid
-                if (key->xd < 0.0)
-                        continue;
+        int i;
 
-                // Copy this keypoint to the next available spot
-                if (copy_Keypoint(key, kp_pos))
-                        return SIFT3D_FAILURE;
-               
-                kp_pos++;
+        clear_Grad_cache(cache);
+
+        if (num_levels == cache->num_levels)
+                return SIFT3D_SUCCESS;
+
+        // Release the tables, if there are no levels
+        cache->num_levels = 0;
+        if (num_levels == 0) {
+                if (cache->grads != NULL)
+                        free(cache->grads);
+                if (cache->last_use != NULL)
+                        free(cache->last_use);
+                cache->grads = NULL;
+                cache->last_use = NULL;
+                return SIFT3D_SUCCESS;
         }
 
-	// Release unneeded keypoint memory
-	num = kp_pos - kp->buf;
-        return resize_Keypoint_store(kp, num);
-}
+        if ((cache->grads = SIFT3D_safe_realloc(cache->grads, 
+                num_levels * sizeof(Image))) == NULL ||
+                (cache->last_use = SIFT3D_safe_realloc(cache->last_use,
+                num_levels * sizeof(unsigned long))) == NULL) {
+                SIFT3D_ERR("resize_Grad_cache: out of memory \n");
+                return SIFT3D_FAILURE;
+        }
 
-/* Helper function to call assign_eig_ori, and reject keypoints with
- * confidence below the parameter "thresh." All other parameters are the same.
- * All return values are the same, except REJECT is returned if 
- * conf < thresh. */
-static int assign_orientation_thresh(const Image *const im, 
-        const Cvec *const vcenter, const double sigma, const double thresh,
-        Mat_rm *const R) {
+        for (i = 0; i < num_levels; i++) {
+                init_im(cache->grads + i);
+                cache->last_use[i] = 0;
+        }
+        cache->num_levels = num_levels;
 
-        double conf;
-        int ret;
+        return SIFT3D_SUCCESS;
+}
 
-        ret = assign_eig_ori(im, vcenter, sigma, R, &conf);
+/* Free all memory associated with a Grad_cache struct. */
+static void cleanup_Grad_cache(Grad_cache *const cache) {
 
-        return ret == SIFT3D_SUCCESS ? 
-                (conf < thresh ? REJECT : SIFT3D_SUCCESS) : ret;
+        resize_Grad_cache(cache, 0);
+        init_Grad_cache(cache);
 }
 
+/* Compute and cache the gradients of all GSS levels containing keypoints in
+ * kp, evicting the least recently used levels to stay within the memory cap.
+ * Levels are only evicted in favor of others, so the gradients are shared
+ * across calls, e.g. by assign_orientations and 
+ * SIFT3D_extract_descriptors. Call this before a parallel loop over kp, so 
+ * the loop only reads the cache. Does nothing if the cache is disabled. */
+static int fill_Grad_cache(SIFT3D *const sift3d, 
+        const Keypoint_store *const kp) {
+
+        unsigned char *needed;
+        unsigned long start;
+        size_t k;
+        int i, j;
+
+        Grad_cache *const cache = &sift3d->grad_cache;
+        const Pyramid *const gpyr = &sift3d->gpyr;
+        const int num_levels = cache->num_levels;
 
-/* Assign an orientation to a point in an image.
- *
- * Parameters:
- *   -im: The image data.
- *   -vcenter: The center of the window, in image space.
- *   -sigma: The scale parameter. The width of the window is a constant
- *      multiple of this.
- *   -R: The place to write the rotation matrix. This is 
- *   -R
- */
-static int assign_eig_ori(const Image *const im, const Cvec *const vcenter,
-                          const double sigma, Mat_rm *const R, 
-                          double *const conf) {
+        // Do nothing if the cache is disabled
+        if (cache->max_bytes == 0 || num_levels == 0)
+                return SIFT3D_SUCCESS;
 
-    Cvec v[2];
-    Mat_rm A, L, Q;
-    Cvec vd, vd_win, vdisp, vr;
-    double d, cos_ang, abs_cos_ang, corner_score;
-    float weight, sq_dist, sgn;
-    int i, x, y, z, m;
-  
-    const double win_radius = sigma * ori_rad_fctr; 
+        // Mark the levels containing keypoints
+        if ((needed = calloc(num_levels, sizeof(unsigned char))) == NULL) {
+                SIFT3D_ERR("fill_Grad_cache: out of memory \n");
+                return SIFT3D_FAILURE;
+        }
+        for (k = 0; k < kp->slab.num; k++) {
+                const Keypoint *const key = kp->buf + k;
+                needed[SIFT3D_PYR_IM_GET(gpyr, key->o, key->s) - 
+                        gpyr->levels] = SIFT3D_TRUE;
+        }
 
-    // Verify inputs
-    if (!SIFT3D_IM_CONTAINS_CVEC(im, vcenter)) {
-        SIFT3D_ERR("assign_eig_ori: vcenter (%f, %f, %f) lies "
-                "outside the boundaries of im [%d x %d x %d] \n", 
-                vcenter->x, vcenter->y, vcenter->z, im->nx, im->ny, im->nz);
-        return SIFT3D_FAILURE;
-    }
-    if (sigma < 0) {
-        SIFT3D_ERR("assign_eig_ori: invalid sigma: %f \n", sigma);
-        return SIFT3D_FAILURE;
-    }
+        // Mark the cached levels as used, so they are not evicted below
+        start = ++cache->clock;
+        for (i = 0; i < num_levels; i++) {
+                if (needed[i] && cache->grads[i].data != NULL)
+                        cache->last_use[i] = start;
+        }
 
-    // Initialize the intermediates
-    if (init_Mat_rm(&A, 3, 3, DOUBLE, SIFT3D_TRUE))
-        return SIFT3D_FAILURE;
-    if (init_Mat_rm(&L, 0, 0, DOUBLE, SIFT3D_TRUE) ||
-	init_Mat_rm(&Q, 0, 0, DOUBLE, SIFT3D_TRUE))
-	goto eig_ori_fail;
+        // Compute the missing levels
+        for (i = 0; i < num_levels; i++) {
 
-    // Resize the output
-    R->num_rows = R->num_cols = IM_NDIMS;
-    R->type = FLOAT;
-    if (resize_Mat_rm(R))
-        goto eig_ori_fail;
+                Image *const grad = cache->grads + i;
+                const Image *const level = gpyr->levels + i;
+                const size_t bytes = (size_t) level->nx * level->ny * 
+                        level->nz * IM_NDIMS * sizeof(float);
 
-    // Form the structure tensor and window gradient
-    vd_win.x = 0.0f;
-    vd_win.y = 0.0f;
-    vd_win.z = 0.0f;
-    IM_LOOP_SPHERE_START(im, x, y, z, vcenter, win_radius, &vdisp, sq_dist)
-	// Compute Gaussian weighting, ignoring constant factor
-	weight = expf(-0.5 * sq_dist / (sigma * sigma));		
+                if (!needed[i] || grad->data != NULL)
+                        continue;
 
-	// Get the gradient	
-	IM_GET_GRAD_ISO(im, x, y, z, 0, &vd);
+                // Evict the least recently used levels not needed here
+                while (cache->bytes + bytes > cache->max_bytes) {
 
-	// Update the structure tensor
-	SIFT3D_MAT_RM_GET(&A, 0, 0, double) += (double) vd.x * vd.x * weight;
-	SIFT3D_MAT_RM_GET(&A, 0, 1, double) += (double) vd.x * vd.y * weight;
-	SIFT3D_MAT_RM_GET(&A, 0, 2, double) += (double) vd.x * vd.z * weight;
-	SIFT3D_MAT_RM_GET(&A, 1, 1, double) += (double) vd.y * vd.y * weight;
-	SIFT3D_MAT_RM_GET(&A, 1, 2, double) += (double) vd.y * vd.z * weight;
-	SIFT3D_MAT_RM_GET(&A, 2, 2, double) += (double) vd.z * vd.z * weight;
+                        int lru = -1;
 
-	// Update the window gradient
-        SIFT3D_CVEC_SCALE(&vd, weight);
-	SIFT3D_CVEC_OP(&vd_win, &vd, +, &vd_win);
-    IM_LOOP_SPHERE_END
+                        for (j = 0; j < num_levels; j++) {
+                                if (cache->grads[j].data == NULL || 
+                                        cache->last_use[j] >= start)
+                                        continue;
+                                if (lru < 0 || cache->last_use[j] < 
+                                        cache->last_use[lru])
+                                        lru = j;
+                        }
+                        if (lru < 0)
+                                break;
 
-    // Fill in the remaining elements
-    SIFT3D_MAT_RM_GET(&A, 1, 0, double) = SIFT3D_MAT_RM_GET(&A, 0, 1, double);
-    SIFT3D_MAT_RM_GET(&A, 2, 0, double) = SIFT3D_MAT_RM_GET(&A, 0, 2, double);
-    SIFT3D_MAT_RM_GET(&A, 2, 1, double) = SIFT3D_MAT_RM_GET(&A, 1, 2, double);
+                        cache->bytes -= cache->grads[lru].size * sizeof(float);
+                        im_free(cache->grads + lru);
+                        init_im(cache->grads + lru);
+                }
 
-    // Reject keypoints with weak gradient 
-    if (SIFT3D_CVEC_L2_NORM_SQ(&vd_win) < (float) ori_grad_thresh) {
-	goto eig_ori_reject;
-    } 
+                // Skip levels which do not fit
+                if (cache->bytes + bytes > cache->max_bytes)
+                        continue;
 
-    // Get the eigendecomposition
-    if (eigen_Mat_rm(&A, &Q, &L))
-	goto eig_ori_fail;
+                if (im_grad_iso(level, grad)) {
+                        im_free(grad);
+                        init_im(grad);
+                        free(needed);
+                        return SIFT3D_FAILURE;
+                }
+                cache->bytes += grad->size * sizeof(float);
+                cache->last_use[i] = start;
+        }
 
-    // Ensure we have distinct eigenvalues
-    m = L.num_rows;
-    if (m != 3)
-	goto eig_ori_reject;
+        free(needed);
+        return SIFT3D_SUCCESS;
+}
 
-    // Test the eigenvectors for stability
-    for (i = 0; i < m - 1; i++) {
-	if (fabs(SIFT3D_MAT_RM_GET(&L, i, 0, double) /
-		 SIFT3D_MAT_RM_GET(&L, i + 1, 0, double)) > max_eig_ratio)
-	    goto eig_ori_reject;
-    }
+/* Get the cached gradient of GSS level s in octave o, or NULL if it is not
+ * cached. */
+static const Image *get_Grad_cache(const SIFT3D *const sift3d, const int o,
+        const int s) {
 
-    // Assign signs to the first n - 1 vectors
-    corner_score = DBL_MAX;
-    for (i = 0; i < m - 1; i++) {
+        const Grad_cache *const cache = &sift3d->grad_cache;
+        const Pyramid *const gpyr = &sift3d->gpyr;
 
-	const int eig_idx = m - i - 1;
+        const Image *const grad = cache->num_levels == 0 ? NULL :
+                cache->grads + (SIFT3D_PYR_IM_GET(gpyr, o, s) - gpyr->levels);
 
-	// Get an eigenvector, in descending order
-	vr.x = (float) SIFT3D_MAT_RM_GET(&Q, 0, eig_idx, double);
-	vr.y = (float) SIFT3D_MAT_RM_GET(&Q, 1, eig_idx, double);
-	vr.z = (float) SIFT3D_MAT_RM_GET(&Q, 2, eig_idx, double);
+        return grad == NULL || grad->data == NULL ? NULL : grad;
+}
 
-	// Get the directional derivative
-	d = SIFT3D_CVEC_DOT(&vd, &vr);
+/* Compute the gradient of a single-channel image, as in IM_GET_GRAD_ISO.
+ * The result is a 3-channel image of the same dimensions, with the x, y, 
+ * and z components in channels 0, 1 and 2. The gradient is undefined on 
+ * the boundary, where it is set to zero. */
+static int im_grad_iso(const Image *const im, Image *const grad) {
 
-        // Get the cosine of the angle between the eigenvector and the gradient
-        cos_ang = d / (SIFT3D_CVEC_L2_NORM(&vr) * SIFT3D_CVEC_L2_NORM(&vd));
-        abs_cos_ang = fabs(cos_ang);
+        int z;
 
-        // Reject points not meeting the corner score
-        corner_score = SIFT3D_MIN(corner_score, abs_cos_ang);
+        const int nx = im->nx;
+        const int ny = im->ny;
+        const int nz = im->nz;
+        const size_t xs = im->xs;
+        const float ux_inv = 1.0f / (float) im->ux;
+        const float uy_inv = 1.0f / (float) im->uy;
+        const float uz_inv = 1.0f / (float) im->uz;
 
-	// Get the sign of the derivative
-        sgn = d > 0.0 ? 1.0f : -1.0f;
+        // Resize the output
+        memcpy(SIFT3D_IM_GET_DIMS(grad), SIFT3D_IM_GET_DIMS(im), 
+                IM_NDIMS * sizeof(int));
+        grad->nc = IM_NDIMS;
+        grad->ux = im->ux;
+        grad->uy = im->uy;
+        grad->uz = im->uz;
+        grad->s = im->s;
+        im_default_stride(grad);
+        if (im_resize(grad))
+                return SIFT3D_FAILURE;
 
-	// Enforce positive directional derivative
-	SIFT3D_CVEC_SCALE(&vr, sgn);
+#pragma omp parallel for
+        for (z = 0; z < nz; z++) {
 
-	// Add the vector to the rotation matrix
-	SIFT3D_MAT_RM_GET(R, 0, i, float) = vr.x;
-	SIFT3D_MAT_RM_GET(R, 1, i, float) = vr.y;
-	SIFT3D_MAT_RM_GET(R, 2, i, float) = vr.z;
+                int x, y;
 
-	// Save this vector for later use
-	v[i] = vr;
-    }
+                for (y = 0; y < ny; y++) {
 
-    // Take the cross product of the first two vectors
-    SIFT3D_CVEC_CROSS(v, v + 1, &vr);
+                        float *const out = &SIFT3D_IM_GET_VOX(grad, 0, y, z, 
+                                0);
+                        const float *row, *row_ym, *row_yp, *row_zm, *row_zp;
 
-    // Add the last vector
-    SIFT3D_MAT_RM_GET(R, 0, 2, float) = (float) vr.x;
-    SIFT3D_MAT_RM_GET(R, 1, 2, float) = (float) vr.y;
-    SIFT3D_MAT_RM_GET(R, 2, 2, float) = (float) vr.z;
+                        // Zero the boundary
+                        if (z == 0 || z == nz - 1 || y == 0 || y == ny - 1) {
+                                memset(out, 0, nx * IM_NDIMS * sizeof(float));
+                                continue;
+                        }
+                        for (x = 0; x < IM_NDIMS; x++) {
+                                out[x] = 0.0f;
+                                out[(nx - 1) * IM_NDIMS + x] = 0.0f;
+                        }
 
-    // Optionally write back the corner score
-    if (conf != NULL)
-        *conf = corner_score;
+                        row = &SIFT3D_IM_GET_VOX(im, 0, y, z, 0);
+                        row_ym = &SIFT3D_IM_GET_VOX(im, 0, y - 1, z, 0);
+                        row_yp = &SIFT3D_IM_GET_VOX(im, 0, y + 1, z, 0);
+                        row_zm = &SIFT3D_IM_GET_VOX(im, 0, y, z - 1, 0);
+                        row_zp = &SIFT3D_IM_GET_VOX(im, 0, y, z + 1, 0);
+
+                        // Central differences, in the same order of operations 
+                        // as IM_GET_GRAD_ISO
+#pragma omp simd
+                        for (x = 1; x < nx - 1; x++) {
+                                out[x * IM_NDIMS] = 0.5f * (row[(x + 1) * xs] -
+                                        row[(x - 1) * xs]) * ux_inv;
+                                out[x * IM_NDIMS + 1] = 0.5f * (row_yp[x * xs] -
+                                        row_ym[x * xs]) * uy_inv;
+                                out[x * IM_NDIMS + 2] = 0.5f * (row_zp[x * xs] -
+                                        row_zm[x * xs]) * uz_inv;
+                        }
+                }
+        }
 
-    cleanup_Mat_rm(&A);
-    cleanup_Mat_rm(&Q);
-    cleanup_Mat_rm(&L);
-    return SIFT3D_SUCCESS; 
+        return SIFT3D_SUCCESS;
+}
 
-eig_ori_reject:
-    if (conf != NULL)
-        *conf = 0.0;
-    cleanup_Mat_rm(&A);
-    cleanup_Mat_rm(&Q);
-    cleanup_Mat_rm(&L);
-    return REJECT;
+/* Initialize a Sphere_table struct. */
+static void init_Sphere_table(Sphere_table *const win) {
+        win->rows = NULL;
+        win->weights = NULL;
+        win->disp_x = win->disp_y = win->disp_z = NULL;
+        win->num_rows = 0;
+        win->sigma_sq = win->rad_sq = -1.0;
+        win->generic = SIFT3D_FALSE;
+}
 
-eig_ori_fail:
-    if (conf != NULL)
-        *conf = 0.0;
-    cleanup_Mat_rm(&A);
-    cleanup_Mat_rm(&Q);
-    cleanup_Mat_rm(&L);
-    return SIFT3D_FAILURE;
+/* Free all memory associated with a Sphere_table struct. */
+static void cleanup_Sphere_table(Sphere_table *const win) {
+        if (win->rows != NULL)
+                free(win->rows);
+        if (win->weights != NULL)
+                free(win->weights);
+        if (win->disp_x != NULL)
+                free(win->disp_x);
+        if (win->disp_y != NULL)
+                free(win->disp_y);
+        if (win->disp_z != NULL)
+                free(win->disp_z);
+        init_Sphere_table(win);
 }
 
-/* Assign an orientation to a point in an image.
- *
- * Parameters:
- *   -im: The image data.
- *   -kp: A container holding the keypoints. On successful return, the matrices
- *      "R" in these keypoints will be set to the assigned orientations.
- *   -conf: If not NULL, this is a pointer to array where the confidence scores
- *      are written. The scores are normally in the interval [0, 1], where 1 
- *      is the most confident, 0 is the least. A higher score means the assigned
- *      orientation is more likely to be robust. A negative score means the
- *      orientation could not be assigned. 
- *
- * If not NULL, this function will re-allocate conf. As such, *conf must either
- * be NULL or a pointer to a previously-allocated array.
+/* Build the spherical window of squared radius rad_sq, centered at vcenter
+ * in image im, for use with IM_LOOP_WINDOW_START. The radius is in 
+ * real-world coordinates, while vcenter is in image space. Each voxel 
+ * receives the Gaussian weight exp(-0.5 * d^2 / sigma_sq), ignoring the 
+ * constant factor, where d is the distance from the center. The parameters
+ * are squared by the caller, in the precision of its own arithmetic.
  *
- * Return value: 
- * SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise.
- */
-int SIFT3D_assign_orientations(const SIFT3D *const sift3d, 
-        const Image *const im, Keypoint_store *const kp, double **const conf) {
-
-        Image im_smooth;
-        Keypoint key_base;
-        int i;
+ * If vcenter lies on a voxel, the table is valid for any other voxel 
+ * center, in an image with the same units, so it only needs to be built 
+ * once per scale. */
+static int make_Sphere_table(Sphere_table *const win, const Image *const im,
+        const Cvec *const vcenter, const double rad_sq, 
+        const double sigma_sq) {
+
+        Cvec vdisp;
+        size_t num_voxels;
+        int dx, dy, dz;
+
+        const float uxf = (float) im->ux;
+        const float uyf = (float) im->uy;
+        const float uzf = (float) im->uz;
+        const double rad = sqrt(rad_sq);
+        const int ax = (int) floorf(vcenter->x);
+        const int ay = (int) floorf(vcenter->y);
+        const int az = (int) floorf(vcenter->z);
+        const int x_min = (int) floorf(vcenter->x - rad / uxf) - ax;
+        const int x_max = (int) ceilf(vcenter->x + rad / uxf) - ax;
+        const int y_min = (int) floorf(vcenter->y - rad / uyf) - ay;
+        const int y_max = (int) ceilf(vcenter->y + rad / uyf) - ay;
+        const int z_min = (int) floorf(vcenter->z - rad / uzf) - az;
+        const int z_max = (int) ceilf(vcenter->z + rad / uzf) - az;
+        const int nx = x_max - x_min + 1;
+        const int ny = y_max - y_min + 1;
+        const int nz = z_max - z_min + 1;
+
+        // Resize the tables, with weights for the whole bounding box
+        win->num_rows = 0;
+        win->generic = SIFT3D_FALSE;
+        if ((win->disp_x = SIFT3D_safe_realloc(win->disp_x, 
+                nx * sizeof(float))) == NULL ||
+                (win->disp_y = SIFT3D_safe_realloc(win->disp_y,
+                ny * sizeof(float))) == NULL ||
+                (win->disp_z = SIFT3D_safe_realloc(win->disp_z,
+                nz * sizeof(float))) == NULL ||
+                (win->rows = SIFT3D_safe_realloc(win->rows, 
+                (size_t) ny * nz * sizeof(Sphere_row))) == NULL ||
+                (win->weights = SIFT3D_safe_realloc(win->weights, 
+                (size_t) nx * ny * nz * sizeof(float))) == NULL) {
+                SIFT3D_ERR("make_Sphere_table: out of memory \n");
+                cleanup_Sphere_table(win);
+                return SIFT3D_FAILURE;
+        }
 
-        const int num = kp->slab.num;
+        // Compute the displacements along each axis
+        for (dx = x_min; dx <= x_max; dx++) {
+                win->disp_x[dx - x_min] = ((float) (ax + dx) - vcenter->x) * 
+                        uxf;
+        }
+        for (dy = y_min; dy <= y_max; dy++) {
+                win->disp_y[dy - y_min] = ((float) (ay + dy) - vcenter->y) * 
+                        uyf;
+        }
+        for (dz = z_min; dz <= z_max; dz++) {
+                win->disp_z[dz - z_min] = ((float) (az + dz) - vcenter->z) * 
+                        uzf;
+        }
+        win->x_min = x_min;
+        win->y_min = y_min;
+        win->z_min = z_min;
 
-        // Verify inputs 
-        if (verify_keys(kp, im))
-                return SIFT3D_FAILURE;
+        // Find the voxels of each row within the sphere, and their weights
+        num_voxels = 0;
+        for (dz = z_min; dz <= z_max; dz++) {
+        for (dy = y_min; dy <= y_max; dy++) {
 
-        // Initialize intermediates
-        init_im(&im_smooth);
-        init_Keypoint(&key_base);
+                Sphere_row *const row = win->rows + win->num_rows;
 
-        // Resize conf (num cannot be zero)
-        if ((*conf = SIFT3D_safe_realloc(*conf, num * sizeof(double))) == NULL)
-                goto assign_orientations_quit;
+                vdisp.y = win->disp_y[dy - y_min];
+                vdisp.z = win->disp_z[dz - z_min];
 
-        // Smooth the input
-        if (smooth_raw_input(sift3d, im, &im_smooth))
-                goto assign_orientations_quit;
+                row->dx_start = x_max + 1;
+                row->dx_end = x_min - 1;
+                for (dx = x_min; dx <= x_max; dx++) {
 
-        // Assign each orientation
-        for (i = 0; i < num; i++) {
+                        vdisp.x = win->disp_x[dx - x_min];
+                        if (SIFT3D_CVEC_L2_NORM_SQ(&vdisp) > rad_sq)
+                                continue;
 
-                Cvec vcenter;
-                int j;
+                        row->dx_start = SIFT3D_MIN(row->dx_start, dx);
+                        row->dx_end = dx;
+                }
 
-                Keypoint *const key = kp->buf + i;
-                double *const conf_ret = *conf + i;
-                Mat_rm *const R = &key->R;
+                // Skip rows outside the sphere
+                if (row->dx_end < row->dx_start)
+                        continue;
 
-                // Convert the keypoint to the base octave
-                if (keypoint2base(key, &key_base))
-                        goto assign_orientations_quit;
+                row->dy = dy;
+                row->dz = dz;
+                row->idx = num_voxels;
+                for (dx = row->dx_start; dx <= row->dx_end; dx++) {
 
-                // Convert the keypoint to a vector
-                vcenter.x = key_base.xd;
-                vcenter.y = key_base.yd;
-                vcenter.z = key_base.zd;
+                        float sq_dist;
 
-                // Assign the orientation
-                switch (assign_eig_ori(&im_smooth, &vcenter, key_base.sd, R, 
-                                       conf_ret))
-                {
-                        case SIFT3D_SUCCESS:
-                                break;
-                        case REJECT:
-                                // Set R to identity
-                                if (identity_Mat_rm(IM_NDIMS, R))
-                                        goto assign_orientations_quit;
-                                zero_Mat_rm(R);
-                                for (j = 0; j < IM_NDIMS; j++) {
-                                        SIFT3D_MAT_RM_GET(R, j, j, float) =
-                                                1.0;
-                                }
-                                *conf_ret = -1.0;
-                                break;
-                        default:
-                                // Stop processing if an error occurs
-                                goto assign_orientations_quit;
+                        vdisp.x = win->disp_x[dx - x_min];
+                        sq_dist = SIFT3D_CVEC_L2_NORM_SQ(&vdisp);
+                        win->weights[num_voxels++] = 
+                                expf(-0.5 * sq_dist / sigma_sq);
                 }
+
+                win->num_rows++;
+        }}
+
+        // Release the unused weights
+        if (num_voxels > 0 && (win->weights = SIFT3D_safe_realloc(
+                win->weights, num_voxels * sizeof(float))) == NULL) {
+                SIFT3D_ERR("make_Sphere_table: out of memory \n");
+                cleanup_Sphere_table(win);
+                return SIFT3D_FAILURE;
         }
 
-        // Clean up
-        im_free(&im_smooth);
+        // Save the parameters
+        win->rad_sq = rad_sq;
+        win->sigma_sq = sigma_sq;
+        win->ux = im->ux;
+        win->uy = im->uy;
+        win->uz = im->uz;
+        win->generic = vcenter->x == (float) ax && vcenter->y == (float) ay &&
+                vcenter->z == (float) az;
 
         return SIFT3D_SUCCESS;
+}
 
-assign_orientations_quit:
-        im_free(&im_smooth);
-        return SIFT3D_FAILURE;
+/* Returns SIFT3D_TRUE if win can be used for the window centered at vcenter
+ * in image im. The other parameters are the same as in make_Sphere_table. */
+static int match_Sphere_table(const Sphere_table *const win, 
+        const Image *const im, const Cvec *const vcenter, 
+        const double rad_sq, const double sigma_sq) {
+
+        return win->generic && win->rad_sq == rad_sq && 
+                win->sigma_sq == sigma_sq &&
+                win->ux == im->ux && win->uy == im->uy && win->uz == im->uz &&
+                vcenter->x == floorf(vcenter->x) && 
+                vcenter->y == floorf(vcenter->y) &&
+                vcenter->z == floorf(vcenter->z);
 }
 
-/* Detect keypoint locations and orientations. You must initialize
- * the SIFT3D struct, image, and keypoint store with the appropriate
- * functions prior to calling this function. */
-int SIFT3D_detect_keypoints(SIFT3D *const sift3d, const Image *const im,
-			    Keypoint_store *const kp) {
+/* Get a window for IM_LOOP_WINDOW_START. Returns win, if it matches the 
+ * parameters, which are the same as in make_Sphere_table. Otherwise, builds
+ * the window in tmp, and returns tmp. win may be NULL. Returns NULL on 
+ * failure. */
+static const Sphere_table *get_Sphere_table(const Sphere_table *const win,
+        Sphere_table *const tmp, const Image *const im, 
+        const Cvec *const vcenter, const double rad_sq, 
+        const double sigma_sq) {
+
+        if (win != NULL && match_Sphere_table(win, im, vcenter, rad_sq, 
+                sigma_sq))
+                return win;
+
+        return make_Sphere_table(tmp, im, vcenter, rad_sq, sigma_sq) ? 
+                NULL : tmp;
+}
 
-        // Verify inputs
-        if (im->nc != 1) {
-                SIFT3D_ERR("SIFT3D_detect_keypoints: invalid number "
-                        "of image channels: %d -- only single-channel images "
-                        "are supported \n", im->nc);
-                return SIFT3D_FAILURE;
+/* Resize the window tables of a SIFT3D struct to num pyramid levels, 
+ * discarding all windows. */
+static int resize_windows_SIFT3D(SIFT3D *const sift3d, const int num) {
+
+        int i;
+
+        // Release the old windows
+        for (i = 0; i < sift3d->num_windows; i++) {
+                cleanup_Sphere_table(sift3d->ori_windows + i);
+                cleanup_Sphere_table(sift3d->desc_windows + i);
+        }
+        sift3d->num_windows = 0;
+
+        // Release the tables, if there are no levels
+        if (num == 0) {
+                if (sift3d->ori_windows != NULL)
+                        free(sift3d->ori_windows);
+                if (sift3d->desc_windows != NULL)
+                        free(sift3d->desc_windows);
+                sift3d->ori_windows = NULL;
+                sift3d->desc_windows = NULL;
+                return SIFT3D_SUCCESS;
         }
 
-        // Set the image       
-        if (set_im_SIFT3D(sift3d, im))
+        if ((sift3d->ori_windows = SIFT3D_safe_realloc(sift3d->ori_windows,
+                num * sizeof(Sphere_table))) == NULL ||
+                (sift3d->desc_windows = SIFT3D_safe_realloc(
+                sift3d->desc_windows, num * sizeof(Sphere_table))) == NULL) {
+                SIFT3D_ERR("resize_windows_SIFT3D: out of memory \n");
                 return SIFT3D_FAILURE;
+        }
 
-	// Build the GSS pyramid
-	if (build_gpyr(sift3d))
-		return SIFT3D_FAILURE;
+        for (i = 0; i < num; i++) {
+                init_Sphere_table(sift3d->ori_windows + i);
+                init_Sphere_table(sift3d->desc_windows + i);
+        }
+        sift3d->num_windows = num;
 
-	// Build the DoG pyramid
-	if (build_dog(sift3d))
-		return SIFT3D_FAILURE;
+        return SIFT3D_SUCCESS;
+}
 
-	// Detect extrema
-	if (detect_extrema(sift3d, kp))
-		return SIFT3D_FAILURE;
+/* Get the window parameters of assign_eig_ori for a keypoint, as in
+ * make_Sphere_table. */
+static void ori_window_params(const Keypoint *const key, 
+        double *const rad_sq, double *const sigma_sq) {
 
-	// Assign orientations
-	if (assign_orientations(sift3d, kp))
-		return SIFT3D_FAILURE;
+        const double sigma = ori_sig_fctr * key->sd;
+        const double win_radius = sigma * ori_rad_fctr; 
 
-	return SIFT3D_SUCCESS;
+        *rad_sq = win_radius * win_radius;
+        *sigma_sq = sigma * sigma;
 }
 
-/* Get the bin and barycentric coordinates of a vector in the icosahedral 
- * histogram. */
-SIFT3D_IGNORE_UNUSED
-static int icos_hist_bin(const SIFT3D * const sift3d,
-			   const Cvec * const x, Cvec * const bary,
-			   int * const bin) { 
+/* Get the window parameters of extract_descrip for a keypoint, as in
+ * make_Sphere_table. */
+static void desc_window_params(const Keypoint *const key, 
+        double *const rad_sq, double *const sigma_sq) {
 
-	float k;
-	int i;
+        const float sigma = key->sd * desc_sig_fctr;
+	const float win_radius = desc_rad_fctr * sigma;
 
-	const Mesh * const mesh = &sift3d->mesh;
+        *rad_sq = win_radius * win_radius;
+        *sigma_sq = sigma * sigma;
+}
 
-	// Check for very small vectors
-	if (SIFT3D_CVEC_L2_NORM_SQ(x) < bary_eps)
-		return SIFT3D_FAILURE;
+/* Build the windows of the GSS levels containing keypoints in kp, unless 
+ * they are already built. All keypoints in a level share the same scale, 
+ * so each window is built once and reused by the whole level, and by 
+ * later images of the same size. Call this before a parallel loop over kp,
+ * so the loop only reads the windows.
+ *
+ * Parameters:
+ *  windows - One of the window tables of sift3d.
+ *  params - ori_window_params or desc_window_params, matching windows. */
+static int fill_windows_SIFT3D(SIFT3D *const sift3d, 
+        const Keypoint_store *const kp, Sphere_table *const windows, 
+        void (*params)(const Keypoint *const, double *const, double *const)) {
 
-	// Iterate through the faces
-	for (i = 0; i < ICOS_NFACES; i++) {
+        size_t i;
 
-		const Tri * const tri = mesh->tri + i;
+        const Pyramid *const gpyr = &sift3d->gpyr;
 
-		// Convert to barycentric coordinates
-		if (cart2bary(x, tri, bary, &k))
-			continue;
+        for (i = 0; i < kp->slab.num; i++) {
 
-		// Test for intersection
-		if (bary->x < -bary_eps || bary->y < -bary_eps ||
-		    bary->z < -bary_eps || k < 0)
-			continue;
+                const Keypoint *const key = kp->buf + i;
+                const Image *const level = 
+                        SIFT3D_PYR_IM_GET(gpyr, key->o, key->s);
+                Sphere_table *const win = windows + (level - gpyr->levels);
+                const Cvec vcenter = {key->xd, key->yd, key->zd};
+                double rad_sq, sigma_sq;
 
-		// Save the bin
-		*bin = i;
+                params(key, &rad_sq, &sigma_sq);
 
-		// No other triangles will be intersected
-		return SIFT3D_SUCCESS;
-	}	
+                // Skip windows which are built, or cannot be shared
+                if (match_Sphere_table(win, level, &vcenter, rad_sq, 
+                        sigma_sq) ||
+                        vcenter.x != floorf(vcenter.x) || 
+                        vcenter.y != floorf(vcenter.y) ||
+                        vcenter.z != floorf(vcenter.z))
+                        continue;
 
-	// Unreachable code
-	assert(SIFT3D_FALSE);
-	return SIFT3D_FAILURE;
+                if (make_Sphere_table(win, level, &vcenter, rad_sq, sigma_sq))
+                        return SIFT3D_FAILURE;
+        }
+
+        return SIFT3D_SUCCESS;
 }
 
-/* Helper routine to interpolate over the histograms of a
- * SIFT3D descriptor. */
-void SIFT3D_desc_acc_interp(const SIFT3D * const sift3d, 
-				const Cvec * const vbins, 
-				const Cvec * const grad,
-				SIFT3D_Descriptor * const desc) {
+/* Assign rotation matrices to the keypoints. 
+ * 
+ * Note that this stage will modify kp, likely
+ * rejecting some keypoints as orientationally
+ * unstable. */
+static int assign_orientations(SIFT3D *const sift3d, 
+			       Keypoint_store *const kp) {
 
-	Cvec dvbins;
-	Hist *hist;
-	float weight;
-	int dx, dy, dz, x, y, z;
+	Keypoint *kp_pos;
+	size_t num;
+	int i; 
 
-#ifdef ICOS_HIST
-	Cvec bary;
-	float mag;
-	int bin;	
-#else
-	Svec sbins, dsbins;
-	int da, dp, a, p;
-#endif
+        // Assign the orientations, marking the rejected keypoints
+        if (sift3d->ori_field ? assign_orientations_field(sift3d, kp) :
+                assign_orientations_window(sift3d, kp))
+                return SIFT3D_FAILURE;
 
-	const int y_stride = NHIST_PER_DIM;
-	const int z_stride = NHIST_PER_DIM * NHIST_PER_DIM; 
+        // Rebuild the keypoint buffer in place
+	kp_pos = kp->buf;
+        for (i = 0; i < kp->slab.num; i++) {
 
-	// Compute difference from integer bin values
-	dvbins.x = vbins->x - floorf(vbins->x);
-	dvbins.y = vbins->y - floorf(vbins->y);
-	dvbins.z = vbins->z - floorf(vbins->z);
+		Keypoint *const key = kp->buf + i;
 
-	// Compute the histogram bin
-#ifdef ICOS_HIST
-	const Mesh *const mesh = &sift3d->mesh;
+                // Check if the keypoint is valid
+                if (key->xd < 0.0)
+                        continue;
 
-	// Get the index of the intersecting face 
-	if (icos_hist_bin(sift3d, grad, &bary, &bin))
-		return;
-	
-	// Get the magnitude of the vector
-	mag = SIFT3D_CVEC_L2_NORM(grad);
+                // Copy this keypoint to the next available spot
+                if (copy_Keypoint(key, kp_pos))
+                        return SIFT3D_FAILURE;
+               
+                kp_pos++;
+        }
 
-#else
-	if (Cvec_to_sbins(grad, &sbins))
-		return;
-	dsbins.az = sbins.az - floorf(sbins.az);
-	dsbins.po = sbins.po - floorf(sbins.po);
-#endif
-	
-	for (dx = 0; dx < 2; dx++) {
-	for (dy = 0; dy < 2; dy++) {
-        for (dz = 0; dz < 2; dz++) {
+	// Release unneeded keypoint memory
+	num = kp_pos - kp->buf;
+        return resize_Keypoint_store(kp, num);
+}
 
-                x = (int) vbins->x + dx;
-                y = (int) vbins->y + dy;
-                z = (int) vbins->z + dz;
+/* Helper function for assign_orientations. Integrates the window of each 
+ * keypoint, as in assign_eig_ori. Rejected keypoints are marked with negative
+ * coordinates. */
+static int assign_orientations_window(SIFT3D *const sift3d, 
+        Keypoint_store *const kp) {
 
-                // Check boundaries
-                if (x < 0 || x >= NHIST_PER_DIM ||
-                        y < 0 || y >= NHIST_PER_DIM ||
-                        z < 0 || z >= NHIST_PER_DIM)
+	int i, err; 
+
+        // Precompute the gradients, if the cache is enabled, and the windows
+        if (fill_Grad_cache(sift3d, kp) ||
+                fill_windows_SIFT3D(sift3d, kp, sift3d->ori_windows, 
+                        ori_window_params))
+                return SIFT3D_FAILURE;
+
+	// Iterate over the keypoints 
+        err = SIFT3D_SUCCESS;
+#pragma omp parallel for
+	for (i = 0; i < kp->slab.num; i++) {
+
+		Keypoint *const key = kp->buf + i;
+		const Image *const level = 
+                        SIFT3D_PYR_IM_GET(&sift3d->gpyr, key->o, key->s);
+                const Image *const grad = get_Grad_cache(sift3d, key->o, 
+                        key->s);
+                const Sphere_table *const win = sift3d->ori_windows + 
+                        (level - sift3d->gpyr.levels);
+                Mat_rm *const R = &key->R;
+                const Cvec vcenter = {key->xd, key->yd, key->zd};
+                const double sigma = ori_sig_fctr * key->sd;
+
+		// Compute dominant orientations
+                assert(R->u.data_float == key->r_data);
+		switch (assign_orientation_thresh(level, grad, win, &vcenter, 
+                                       sigma, sift3d->corner_thresh, R)) {
+			case SIFT3D_SUCCESS:
+				// Continue processing this keypoint
+				break;
+			case REJECT:
+				// Mark this keypoint as invalid
+                                key->xd = key->yd = key->zd = -1.0;
+                                continue;
+			default:
+				// Any other return value is an error
+                                err = SIFT3D_FAILURE;
+                                continue;
+		}
+		
+	}
+
+        return err;
+}
+
+/* Helper function for assign_orientations. Computes the structure tensor 
+ * field of each pyramid level containing keypoints, one level at a time, 
+ * and reads the orientations from it. Rejected keypoints are marked with 
+ * negative coordinates. */
+static int assign_orientations_field(SIFT3D *const sift3d, 
+        Keypoint_store *const kp) {
+
+        Image field;
+        size_t i;
+        int o, s, err;
+
+        const Pyramid *const gpyr = &sift3d->gpyr;
+
+        // Precompute the gradients, if the cache is enabled
+        if (fill_Grad_cache(sift3d, kp))
+                return SIFT3D_FAILURE;
+
+        init_im(&field);
+        err = SIFT3D_SUCCESS;
+        SIFT3D_PYR_LOOP_START(gpyr, o, s)
+
+                const Image *const level = SIFT3D_PYR_IM_GET(gpyr, o, s);
+                const Image *const grad = get_Grad_cache(sift3d, o, s);
+                const double sigma = ori_sig_fctr * level->s;
+
+                // Skip levels without keypoints
+                for (i = 0; i < kp->slab.num; i++) {
+                        if (kp->buf[i].o == o && kp->buf[i].s == s)
+                                break;
+                }
+                if (i == kp->slab.num)
                         continue;
 
-                // Get the histogram
-                hist = desc->hists + x + y * y_stride + 
-                           z * z_stride;	
+                // Compute the field of this level
+                if (make_ori_field(level, grad, sigma, sift3d->recursive_gauss,
+                        &field))
+                        goto ori_field_quit;
 
-                assert(x + y * y_stride + z * z_stride < DESC_NUM_TOTAL_HIST);
+                // Assign the orientations of the keypoints in this level
+#pragma omp parallel for
+                for (i = 0; i < kp->slab.num; i++) {
 
-                // Get the spatial interpolation weight
-                weight = ((dx == 0) ? (1.0f - dvbins.x) : dvbins.x) *
-                        ((dy == 0) ? (1.0f - dvbins.y) : dvbins.y) *
-                        ((dz == 0) ? (1.0f - dvbins.z) : dvbins.z);
+                        Keypoint *const key = kp->buf + i;
+                        const Cvec vcenter = {key->xd, key->yd, key->zd};
 
-                /* Add the value into the histogram */
-#ifdef ICOS_HIST
-                assert(HIST_NUMEL == ICOS_NVERT);
-                assert(bin >= 0 && bin < ICOS_NFACES);
+                        if (key->o != o || key->s != s)
+                                continue;
 
-                // Interpolate over three vertices
-                MESH_HIST_GET(mesh, hist, bin, 0) += mag * weight * bary.x;
-                MESH_HIST_GET(mesh, hist, bin, 1) += mag * weight * bary.y;
-                MESH_HIST_GET(mesh, hist, bin, 2) += mag * weight * bary.z; 
-#else
-                // Iterate over all angles
-                for (dp = 0; dp < 2; dp ++) {
-                for (da = 0; da < 2; da ++) {
+                        assert(key->R.u.data_float == key->r_data);
+                        switch (assign_field_ori(&field, &vcenter, 
+                                sift3d->corner_thresh, &key->R)) {
+                                case SIFT3D_SUCCESS:
+                                        break;
+                                case REJECT:
+                                        key->xd = key->yd = key->zd = -1.0;
+                                        continue;
+                                default:
+                                        err = SIFT3D_FAILURE;
+                                        continue;
+                        }
+                }
 
-                        a = ((int) sbins.az + da) % NBINS_AZ;
-                        p = (int) sbins.po + dp;
-                        if (p >= NBINS_PO) {
-                                // See HIST_GET_PO
-                                a = (a + NBINS_AZ / 2) % NBINS_AZ;
-                                p = NBINS_PO - 1;
+                if (err)
+                        goto ori_field_quit;
+
+        SIFT3D_PYR_LOOP_END
+
+        im_free(&field);
+        return SIFT3D_SUCCESS;
+
+ori_field_quit:
+        im_free(&field);
+        return SIFT3D_FAILURE;
+}
+
+/* Compute the structure tensor field of an image, for assign_field_ori. Each
+ * voxel holds the sums accumulated by assign_eig_ori over a window of scale
+ * sigma centered there, with the window replaced by a Gaussian filter. This 
+ * is computed for the whole image at once with apply_Gauss_filter, so each 
+ * orientation is then a single lookup. The output has ori_field_nc channels:
+ * the upper triangle of the structure tensor, in the order xx, xy, xz, yy, 
+ * yz, zz, followed by the x, y and z components of the window gradient. 
+ *
+ * The filter is truncated to a cube rather than a sphere, and normalized, 
+ * so the field is scaled by the total weight of an untruncated window, to 
+ * keep the thresholds of assign_eig_ori meaningful.
+ *
+ * Parameters:
+ *   -im: The image data.
+ *   -grad: The gradient of im, from im_grad_iso, or NULL to compute it here.
+ *   -sigma: The scale parameter of the window, in real-world units.
+ *   -recursive: If true, the filter is approximated recursively.
+ *   -field: The output image.
+ *
+ * Return: SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+static int make_ori_field(const Image *const im, const Image *const grad,
+        const double sigma, const int recursive, Image *const field) {
+
+        Gauss_filter gauss;
+        int z;
+
+        const double unit = 1.0;
+        const float scale = (float) (pow(2.0 * M_PI, 1.5) * sigma * sigma * 
+                sigma / (im->ux * im->uy * im->uz));
+
+        // Resize the output
+        memcpy(SIFT3D_IM_GET_DIMS(field), SIFT3D_IM_GET_DIMS(im), 
+                IM_NDIMS * sizeof(int));
+        field->nc = ori_field_nc;
+        field->ux = im->ux;
+        field->uy = im->uy;
+        field->uz = im->uz;
+        field->s = im->s;
+        im_default_stride(field);
+        if (im_resize(field))
+                return SIFT3D_FAILURE;
+
+        // Form the products of the gradient, skipping the boundary as in 
+        // IM_LOOP_WINDOW_START
+#pragma omp parallel for
+        for (z = 0; z < im->nz; z++) {
+
+                int x, y, c;
+
+                for (y = 0; y < im->ny; y++) {
+                for (x = 0; x < im->nx; x++) {
+
+                        Cvec vd;
+
+                        float *const out = &SIFT3D_IM_GET_VOX(field, x, y, z, 
+                                0);
+
+                        if (x < 1 || y < 1 || z < 1 || x > im->nx - 2 || 
+                                y > im->ny - 2 || z > im->nz - 2) {
+                                for (c = 0; c < ori_field_nc; c++) {
+                                        out[c] = 0.0f;
+                                }
+                                continue;
                         }
-		
-                        assert(a >= 0);
-                        assert(a < NBINS_AZ);
-                        assert(p >= 0);
-                        assert(p < NBINS_PO);
 
-                        HIST_GET(hist, a, p) += sbins.mag * weight *
-                                ((da == 0) ? (1.0f - dsbins.az) : dsbins.az) *
-                                ((dp == 0) ? (1.0f - dsbins.po) : dsbins.po);
+                        IM_GET_GRAD_CACHED(im, grad, x, y, z, &vd);
+
+                        out[0] = vd.x * vd.x * scale;
+                        out[1] = vd.x * vd.y * scale;
+                        out[2] = vd.x * vd.z * scale;
+                        out[3] = vd.y * vd.y * scale;
+                        out[4] = vd.y * vd.z * scale;
+                        out[5] = vd.z * vd.z * scale;
+                        out[6] = vd.x * scale;
+                        out[7] = vd.y * scale;
+                        out[8] = vd.z * scale;
                 }}
-#endif
-	}}}
+        }
+
+        // Integrate the windows, in place
+        if (init_Gauss_filter(&gauss, sigma, IM_NDIMS))
+                return SIFT3D_FAILURE;
+        gauss.recursive = recursive;
+        if (apply_Gauss_filter(field, field, &gauss, unit)) {
+                cleanup_Gauss_filter(&gauss);
+                return SIFT3D_FAILURE;
+        }
+        cleanup_Gauss_filter(&gauss);
 
+        return SIFT3D_SUCCESS;
 }
 
-/* Normalize a descriptor */
-static void normalize_desc(SIFT3D_Descriptor * const desc) {
+/* As assign_orientation_thresh, but reads the structure tensor and window 
+ * gradient from the voxel of field nearest vcenter, where field is the 
+ * output of make_ori_field. */
+static int assign_field_ori(const Image *const field, 
+        const Cvec *const vcenter, const double thresh, Mat_rm *const R) {
 
-	double norm; 
-	int i, a, p;
+        double A[IM_NDIMS * IM_NDIMS];
+        Cvec vd_win;
+        double conf;
+        int ret;
 
-	norm = 0.0;
-	for (i = 0; i < DESC_NUM_TOTAL_HIST; i++) { 
+        const int x = SIFT3D_MIN((int) (vcenter->x + 0.5f), field->nx - 1);
+        const int y = SIFT3D_MIN((int) (vcenter->y + 0.5f), field->ny - 1);
+        const int z = SIFT3D_MIN((int) (vcenter->z + 0.5f), field->nz - 1);
+
+        // Verify inputs
+        if (!SIFT3D_IM_CONTAINS_CVEC(field, vcenter)) {
+                SIFT3D_ERR("assign_field_ori: vcenter (%f, %f, %f) lies "
+                        "outside the boundaries of field [%d x %d x %d] \n", 
+                        vcenter->x, vcenter->y, vcenter->z, field->nx, 
+                        field->ny, field->nz);
+                return SIFT3D_FAILURE;
+        }
+
+        {
+                const float *const vox = &SIFT3D_IM_GET_VOX(field, x, y, z, 
+                        0);
+
+                // Unpack the upper triangle of the structure tensor
+                A[0] = vox[0];
+                A[1] = vox[1];
+                A[2] = vox[2];
+                A[3] = 0.0;
+                A[4] = vox[3];
+                A[5] = vox[4];
+                A[6] = 0.0;
+                A[7] = 0.0;
+                A[8] = vox[5];
+
+                // Unpack the window gradient
+                vd_win.x = vox[6];
+                vd_win.y = vox[7];
+                vd_win.z = vox[8];
+        }
+
+        ret = eig_ori_tensor(A, &vd_win, &vd_win, R, &conf);
+
+        return ret == SIFT3D_SUCCESS ? 
+                (conf < thresh ? REJECT : SIFT3D_SUCCESS) : ret;
+}
+
+/* Helper function to call assign_eig_ori, and reject keypoints with
+ * confidence below the parameter "thresh." All other parameters are the same.
+ * All return values are the same, except REJECT is returned if 
+ * conf < thresh. */
+static int assign_orientation_thresh(const Image *const im, 
+        const Image *const grad, const Sphere_table *const win,
+        const Cvec *const vcenter, const double sigma, const double thresh,
+        Mat_rm *const R) {
+
+        double conf;
+        int ret;
+
+        ret = assign_eig_ori(im, grad, win, vcenter, sigma, R, &conf);
+
+        return ret == SIFT3D_SUCCESS ? 
+                (conf < thresh ? REJECT : SIFT3D_SUCCESS) : ret;
+}
+
+
+/* Assign an orientation to a point in an image.
+ *
+ * Parameters:
+ *   -im: The image data.
+ *   -grad: The gradient of im, from im_grad_iso, or NULL to compute it here.
+ *   -win: A window from fill_windows_SIFT3D, or NULL. If it does not match
+ *      the parameters, the window is built here.
+ *   -vcenter: The center of the window, in image space.
+ *   -sigma: The scale parameter. The width of the window is a constant
+ *      multiple of this.
+ *   -R: The place to write the rotation matrix. This is 
+ *   -R
+ */
+static int assign_eig_ori(const Image *const im, const Image *const grad,
+                          const Sphere_table *const win,
+                          const Cvec *const vcenter, const double sigma, 
+                          Mat_rm *const R, double *const conf) {
+
+    Sphere_table tmp;
+    double A[IM_NDIMS * IM_NDIMS];
+    Cvec vd, vd_win, vdisp;
+    float weight;
+    const Sphere_table *window;
+    int i, x, y, z;
+  
+    const double win_radius = sigma * ori_rad_fctr; 
+
+    // Verify inputs
+    if (!SIFT3D_IM_CONTAINS_CVEC(im, vcenter)) {
+        SIFT3D_ERR("assign_eig_ori: vcenter (%f, %f, %f) lies "
+                "outside the boundaries of im [%d x %d x %d] \n", 
+                vcenter->x, vcenter->y, vcenter->z, im->nx, im->ny, im->nz);
+        return SIFT3D_FAILURE;
+    }
+    if (sigma < 0) {
+        SIFT3D_ERR("assign_eig_ori: invalid sigma: %f \n", sigma);
+        return SIFT3D_FAILURE;
+    }
+
+    // Get the window
+    init_Sphere_table(&tmp);
+    if ((window = get_Sphere_table(win, &tmp, im, vcenter, 
+        win_radius * win_radius, sigma * sigma)) == NULL)
+        goto eig_ori_fail;
+
+    // Initialize the structure tensor
+    for (i = 0; i < IM_NDIMS * IM_NDIMS; i++) {
+        A[i] = 0.0;
+    }
+
+    // Form the structure tensor and window gradient
+    vd_win.x = 0.0f;
+    vd_win.y = 0.0f;
+    vd_win.z = 0.0f;
+    IM_LOOP_WINDOW_START(im, window, x, y, z, vcenter, &vdisp, weight)
+	// Get the gradient	
+	IM_GET_GRAD_CACHED(im, grad, x, y, z, &vd);
+
+	// Update the upper triangle of the structure tensor
+	A[0] += (double) vd.x * vd.x * weight;
+	A[1] += (double) vd.x * vd.y * weight;
+	A[2] += (double) vd.x * vd.z * weight;
+	A[4] += (double) vd.y * vd.y * weight;
+	A[5] += (double) vd.y * vd.z * weight;
+	A[8] += (double) vd.z * vd.z * weight;
+
+	// Update the window gradient
+        SIFT3D_CVEC_SCALE(&vd, weight);
+	SIFT3D_CVEC_OP(&vd_win, &vd, +, &vd_win);
+    IM_LOOP_WINDOW_END
+    cleanup_Sphere_table(&tmp);
+
+    // Get the orientation, with the eigenvector signs given by the last 
+    // weighted gradient in the window
+    return eig_ori_tensor(A, &vd_win, &vd, R, conf);
+
+eig_ori_fail:
+    if (conf != NULL)
+        *conf = 0.0;
+    cleanup_Sphere_table(&tmp);
+    return SIFT3D_FAILURE;
+}
+
+/* Helper function for assign_eig_ori and assign_field_ori. Gets the 
+ * orientation from a structure tensor.
+ *
+ * Parameters:
+ *   -A: The structure tensor, of which only the upper triangle is read.
+ *   -vd_win: The window gradient. Returns REJECT if this is too weak.
+ *   -vd_sgn: The eigenvectors are negated to have positive dot products 
+ *      with this vector.
+ *   -R: The place to write the rotation matrix.
+ *   -conf: If not NULL, the place to write the corner score.
+ *
+ * Return: SIFT3D_SUCCESS, REJECT or SIFT3D_FAILURE, as in assign_eig_ori. */
+static int eig_ori_tensor(const double *const A, const Cvec *const vd_win,
+        const Cvec *const vd_sgn, Mat_rm *const R, double *const conf) {
+
+    Cvec v[2];
+    double Q[IM_NDIMS * IM_NDIMS], L[IM_NDIMS];
+    Cvec vr;
+    double d, cos_ang, abs_cos_ang, corner_score;
+    float sgn;
+    int i, m;
+
+    // Resize the output
+    R->num_rows = R->num_cols = IM_NDIMS;
+    R->type = FLOAT;
+    if (resize_Mat_rm(R))
+        goto eig_tensor_fail;
+
+    // Reject keypoints with weak gradient 
+    if (SIFT3D_CVEC_L2_NORM_SQ(vd_win) < (float) ori_grad_thresh) {
+	goto eig_tensor_reject;
+    } 
+
+    // Get the eigendecomposition, with eigenvalues in ascending order
+    if (eigen_sym_3x3(A, Q, L))
+	goto eig_tensor_fail;
+    m = IM_NDIMS;
+
+    // Test the eigenvectors for stability
+    for (i = 0; i < m - 1; i++) {
+	if (fabs(L[i] / L[i + 1]) > max_eig_ratio)
+	    goto eig_tensor_reject;
+    }
+
+    // Assign signs to the first n - 1 vectors
+    corner_score = DBL_MAX;
+    for (i = 0; i < m - 1; i++) {
+
+	const int eig_idx = m - i - 1;
+
+	// Get an eigenvector, in descending order
+	vr.x = (float) Q[0 * IM_NDIMS + eig_idx];
+	vr.y = (float) Q[1 * IM_NDIMS + eig_idx];
+	vr.z = (float) Q[2 * IM_NDIMS + eig_idx];
+
+	// Get the directional derivative
+	d = SIFT3D_CVEC_DOT(vd_sgn, &vr);
+
+        // Get the cosine of the angle between the eigenvector and the gradient
+        cos_ang = d / (SIFT3D_CVEC_L2_NORM(&vr) * SIFT3D_CVEC_L2_NORM(vd_sgn));
+        abs_cos_ang = fabs(cos_ang);
+
+        // Reject points not meeting the corner score
+        corner_score = SIFT3D_MIN(corner_score, abs_cos_ang);
+
+	// Get the sign of the derivative
+        sgn = d > 0.0 ? 1.0f : -1.0f;
+
+	// Enforce positive directional derivative
+	SIFT3D_CVEC_SCALE(&vr, sgn);
+
+	// Add the vector to the rotation matrix
+	SIFT3D_MAT_RM_GET(R, 0, i, float) = vr.x;
+	SIFT3D_MAT_RM_GET(R, 1, i, float) = vr.y;
+	SIFT3D_MAT_RM_GET(R, 2, i, float) = vr.z;
+
+	// Save this vector for later use
+	v[i] = vr;
+    }
+
+    // Take the cross product of the first two vectors
+    SIFT3D_CVEC_CROSS(v, v + 1, &vr);
+
+    // Add the last vector
+    SIFT3D_MAT_RM_GET(R, 0, 2, float) = (float) vr.x;
+    SIFT3D_MAT_RM_GET(R, 1, 2, float) = (float) vr.y;
+    SIFT3D_MAT_RM_GET(R, 2, 2, float) = (float) vr.z;
+
+    // Optionally write back the corner score
+    if (conf != NULL)
+        *conf = corner_score;
+
+    return SIFT3D_SUCCESS; 
+
+eig_tensor_reject:
+    if (conf != NULL)
+        *conf = 0.0;
+    return REJECT;
+
+eig_tensor_fail:
+    if (conf != NULL)
+        *conf = 0.0;
+    return SIFT3D_FAILURE;
+}
+
+/* Assign an orientation to a point in an image.
+ *
+ * Parameters:
+ *   -im: The image data.
+ *   -kp: A container holding the keypoints. On successful return, the matrices
+ *      "R" in these keypoints will be set to the assigned orientations.
+ *   -conf: If not NULL, this is a pointer to array where the confidence scores
+ *      are written. The scores are normally in the interval [0, 1], where 1 
+ *      is the most confident, 0 is the least. A higher score means the assigned
+ *      orientation is more likely to be robust. A negative score means the
+ *      orientation could not be assigned. 
+ *
+ * If not NULL, this function will re-allocate conf. As such, *conf must either
+ * be NULL or a pointer to a previously-allocated array.
+ *
+ * Return value: 
+ * SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise.
+ */
+int SIFT3D_assign_orientations(const SIFT3D *const sift3d, 
+        const Image *const im, Keypoint_store *const kp, double **const conf) {
+
+        Image im_smooth;
+        Keypoint key_base;
+        int i;
+
+        const int num = kp->slab.num;
+
+        // Verify inputs 
+        if (verify_keys(kp, im))
+                return SIFT3D_FAILURE;
+
+        // Initialize intermediates
+        init_im(&im_smooth);
+        init_Keypoint(&key_base);
+
+        // Resize conf (num cannot be zero)
+        if ((*conf = SIFT3D_safe_realloc(*conf, num * sizeof(double))) == NULL)
+                goto assign_orientations_quit;
+
+        // Smooth the input
+        if (smooth_raw_input(sift3d, im, sift3d->recursive_gauss, 
+                &im_smooth))
+                goto assign_orientations_quit;
+
+        // Assign each orientation
+        for (i = 0; i < num; i++) {
+
+                Cvec vcenter;
+                int j;
+
+                Keypoint *const key = kp->buf + i;
+                double *const conf_ret = *conf + i;
+                Mat_rm *const R = &key->R;
+
+                // Convert the keypoint to the base octave
+                if (keypoint2base(key, &key_base))
+                        goto assign_orientations_quit;
+
+                // Convert the keypoint to a vector
+                vcenter.x = key_base.xd;
+                vcenter.y = key_base.yd;
+                vcenter.z = key_base.zd;
+
+                // Assign the orientation
+                switch (assign_eig_ori(&im_smooth, NULL, NULL, &vcenter, 
+                                       key_base.sd, R, conf_ret))
+                {
+                        case SIFT3D_SUCCESS:
+                                break;
+                        case REJECT:
+                                // Set R to identity
+                                if (identity_Mat_rm(IM_NDIMS, R))
+                                        goto assign_orientations_quit;
+                                zero_Mat_rm(R);
+                                for (j = 0; j < IM_NDIMS; j++) {
+                                        SIFT3D_MAT_RM_GET(R, j, j, float) =
+                                                1.0;
+                                }
+                                *conf_ret = -1.0;
+                                break;
+                        default:
+                                // Stop processing if an error occurs
+                                goto assign_orientations_quit;
+                }
+        }
+
+        // Clean up
+        im_free(&im_smooth);
+
+        return SIFT3D_SUCCESS;
+
+assign_orientations_quit:
+        im_free(&im_smooth);
+        return SIFT3D_FAILURE;
+}
+
+/* Detect keypoint locations and orientations. You must initialize
+ * the SIFT3D struct, image, and keypoint store with the appropriate
+ * functions prior to calling this function. */
+int SIFT3D_detect_keypoints(SIFT3D *const sift3d, const Image *const im,
+			    Keypoint_store *const kp) {
+
+        // Verify inputs
+        if (im->nc != 1) {
+                SIFT3D_ERR("SIFT3D_detect_keypoints: invalid number "
+                        "of image channels: %d -- only single-channel images "
+                        "are supported \n", im->nc);
+                return SIFT3D_FAILURE;
+        }
+
+        // Set the image       
+        if (set_im_SIFT3D(sift3d, im))
+                return SIFT3D_FAILURE;
+
+        // Discard the gradients of the previous pyramid
+        clear_Grad_cache(&sift3d->grad_cache);
+
+	// Build the GSS and DoG pyramids
+	if (build_pyramids(sift3d))
+		return SIFT3D_FAILURE;
+
+	// Detect extrema
+	if (detect_extrema(sift3d, kp))
+		return SIFT3D_FAILURE;
+
+	// Assign orientations
+	if (assign_orientations(sift3d, kp))
+		return SIFT3D_FAILURE;
+
+	return SIFT3D_SUCCESS;
+}
+
+/* Test whether the ray of the direction x intersects the triangle tri, 
+ * within the tolerance bary_eps. If so, returns SIFT3D_SUCCESS and writes the
+ * barycentric coordinates of the intersection in bary. */
+static int icos_tri_test(const Cvec *const x, const Tri *const tri, 
+        Cvec *const bary) {
+
+        float k;
+
+        // Convert to barycentric coordinates
+        if (cart2bary(x, tri, bary, &k))
+                return SIFT3D_FAILURE;
+
+        // Test for intersection
+        if (bary->x < -bary_eps || bary->y < -bary_eps ||
+            bary->z < -bary_eps || k < 0)
+                return SIFT3D_FAILURE;
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Get the bin and barycentric coordinates of a vector in the icosahedral 
+ * histogram. */
+SIFT3D_IGNORE_UNUSED
+static int icos_hist_bin(const SIFT3D * const sift3d,
+			   const Cvec * const x, Cvec * const bary,
+			   int * const bin) { 
+
+	int i, cell;
+
+	const Mesh * const mesh = &sift3d->mesh;
+
+	// Check for very small vectors
+	if (SIFT3D_CVEC_L2_NORM_SQ(x) < bary_eps)
+		return SIFT3D_FAILURE;
+
+        // Look up the faces which might intersect this direction
+        cell = icos_lut_cell(x);
+
+	// Iterate through the candidate faces, in ascending order
+	for (i = mesh->lut_start[cell]; i < mesh->lut_start[cell + 1]; i++) {
+
+		const int face = mesh->lut_tri[i];
+
+		// Test for intersection
+		if (icos_tri_test(x, mesh->tri + face, bary))
+			continue;
+
+		// Save the bin
+		*bin = face;
+
+		// No other triangles will be intersected
+		return SIFT3D_SUCCESS;
+	}	
+
+	// Unreachable code
+	assert(SIFT3D_FALSE);
+	return SIFT3D_FAILURE;
+}
+
+/* Helper routine to interpolate over the histograms of a
+ * SIFT3D descriptor. */
+void SIFT3D_desc_acc_interp(const SIFT3D * const sift3d, 
+				const Cvec * const vbins, 
+				const Cvec * const grad,
+				SIFT3D_Descriptor * const desc) {
+
+	Cvec dvbins;
+	Hist *hist;
+	float weight;
+	int dx, dy, dz, x, y, z;
+
+#ifdef ICOS_HIST
+	Cvec bary;
+	float mag;
+	int bin;	
+#else
+	Svec sbins, dsbins;
+	int da, dp, a, p;
+#endif
+
+	const int y_stride = NHIST_PER_DIM;
+	const int z_stride = NHIST_PER_DIM * NHIST_PER_DIM; 
+
+	// Compute difference from integer bin values
+	dvbins.x = vbins->x - floorf(vbins->x);
+	dvbins.y = vbins->y - floorf(vbins->y);
+	dvbins.z = vbins->z - floorf(vbins->z);
+
+	// Compute the histogram bin
+#ifdef ICOS_HIST
+	const Mesh *const mesh = &sift3d->mesh;
+
+	// Get the index of the intersecting face 
+	if (icos_hist_bin(sift3d, grad, &bary, &bin))
+		return;
+	
+	// Get the magnitude of the vector
+	mag = SIFT3D_CVEC_L2_NORM(grad);
+
+#else
+	if (Cvec_to_sbins(grad, &sbins))
+		return;
+	dsbins.az = sbins.az - floorf(sbins.az);
+	dsbins.po = sbins.po - floorf(sbins.po);
+#endif
+	
+	for (dx = 0; dx < 2; dx++) {
+	for (dy = 0; dy < 2; dy++) {
+        for (dz = 0; dz < 2; dz++) {
+
+                x = (int) vbins->x + dx;
+                y = (int) vbins->y + dy;
+                z = (int) vbins->z + dz;
+
+                // Check boundaries
+                if (x < 0 || x >= NHIST_PER_DIM ||
+                        y < 0 || y >= NHIST_PER_DIM ||
+                        z < 0 || z >= NHIST_PER_DIM)
+                        continue;
+
+                // Get the histogram
+                hist = desc->hists + x + y * y_stride + 
+                           z * z_stride;	
+
+                assert(x + y * y_stride + z * z_stride < DESC_NUM_TOTAL_HIST);
+
+                // Get the spatial interpolation weight
+                weight = ((dx == 0) ? (1.0f - dvbins.x) : dvbins.x) *
+                        ((dy == 0) ? (1.0f - dvbins.y) : dvbins.y) *
+                        ((dz == 0) ? (1.0f - dvbins.z) : dvbins.z);
+
+                /* Add the value into the histogram */
+#ifdef ICOS_HIST
+                assert(HIST_NUMEL == ICOS_NVERT);
+                assert(bin >= 0 && bin < ICOS_NFACES);
+
+                // Interpolate over three vertices
+                MESH_HIST_GET(mesh, hist, bin, 0) += mag * weight * bary.x;
+                MESH_HIST_GET(mesh, hist, bin, 1) += mag * weight * bary.y;
+                MESH_HIST_GET(mesh, hist, bin, 2) += mag * weight * bary.z; 
+#else
+                // Iterate over all angles
+                for (dp = 0; dp < 2; dp ++) {
+                for (da = 0; da < 2; da ++) {
+
+                        a = ((int) sbins.az + da) % NBINS_AZ;
+                        p = (int) sbins.po + dp;
+                        if (p >= NBINS_PO) {
+                                // See HIST_GET_PO
+                                a = (a + NBINS_AZ / 2) % NBINS_AZ;
+                                p = NBINS_PO - 1;
+                        }
+		
+                        assert(a >= 0);
+                        assert(a < NBINS_AZ);
+                        assert(p >= 0);
+                        assert(p < NBINS_PO);
+
+                        HIST_GET(hist, a, p) += sbins.mag * weight *
+                                ((da == 0) ? (1.0f - dsbins.az) : dsbins.az) *
+                                ((dp == 0) ? (1.0f - dsbins.po) : dsbins.po);
+                }}
+#endif
+	}}}
+
+}
+
+/* Normalize a descriptor */
+static void normalize_desc(SIFT3D_Descriptor * const desc) {
+
+	double norm; 
+	int i, a, p;
+
+	norm = 0.0;
+	for (i = 0; i < DESC_NUM_TOTAL_HIST; i++) { 
+
+                const Hist *const hist = desc->hists + i;
+
+		HIST_LOOP_START(a, p) 
+			const float el = HIST_GET(hist, a, p);
+			norm += (double) el * el;
+		HIST_LOOP_END 
+	}
+
+	norm = sqrt(norm) + DBL_EPSILON; 
+
+	for (i = 0; i < DESC_NUM_TOTAL_HIST; i++) {
+
+                Hist *const hist = desc->hists + i;
+		const float norm_inv = 1.0f / norm; 
+
+		HIST_LOOP_START(a, p) 
+			HIST_GET(hist, a, p) *= norm_inv; 
+		HIST_LOOP_END 
+	}
+}
+
+/* Set a histogram to zero */
+static void hist_zero(Hist *hist) {
+
+        int a, p;
+
+        HIST_LOOP_START(a, p)
+                HIST_GET(hist, a, p) = 0.0f;
+        HIST_LOOP_END
+}
+
+/* Helper routine to extract a single SIFT3D descriptor */
+static int extract_descrip(SIFT3D *const sift3d, const Image *const im,
+           const Image *const grad_im, const Sphere_table *const win,
+           const Keypoint *const key, SIFT3D_Descriptor *const desc) {
+
+        Sphere_table tmp;
+        float buf[IM_NDIMS * IM_NDIMS];
+        Mat_rm Rt;
+	Cvec vcenter, vim, vkp, vbins, grad, grad_rot;
+	Hist *hist;
+        const Sphere_table *window;
+        double rad_sq, sigma_sq;
+	float weight;
+	int i, x, y, z, a, p;
+
+	// Compute basic parameters 
+        const float sigma = key->sd * desc_sig_fctr;
+	const float win_radius = desc_rad_fctr * sigma;
+	const float desc_hw = win_radius / sqrt(2);
+	const float desc_width = 2.0f * desc_hw;
+	const float desc_bin_fctr = (float) NHIST_PER_DIM / desc_width;
+	const double coord_factor = pow(2.0, key->o);
+
+        // Invert the rotation matrix
+        if (init_Mat_rm_p(&Rt, buf, IM_NDIMS, IM_NDIMS, FLOAT, SIFT3D_FALSE) ||
+                transpose_Mat_rm(&key->R, &Rt))
+                return SIFT3D_FAILURE;
+
+	// Zero the descriptor
+	for (i = 0; i < DESC_NUM_TOTAL_HIST; i++) {
+		hist = desc->hists + i;
+                hist_zero(hist);
+	}
+
+	// Get the sphere window, in real-world coordinates 
+	vcenter.x = key->xd;
+	vcenter.y = key->yd;
+	vcenter.z = key->zd;
+        init_Sphere_table(&tmp);
+        desc_window_params(key, &rad_sq, &sigma_sq);
+        if ((window = get_Sphere_table(win, &tmp, im, &vcenter, rad_sq, 
+                sigma_sq)) == NULL)
+                return SIFT3D_FAILURE;
+
+	// Iterate over the window
+	IM_LOOP_WINDOW_START(im, window, x, y, z, &vcenter, &vim, weight)
+
+		// Rotate to keypoint space
+		SIFT3D_MUL_MAT_RM_CVEC(&Rt, &vim, &vkp);		
+
+		// Compute spatial bins
+		vbins.x = (vkp.x + desc_hw) * desc_bin_fctr;
+		vbins.y = (vkp.y + desc_hw) * desc_bin_fctr;
+		vbins.z = (vkp.z + desc_hw) * desc_bin_fctr;
+
+		// Reject points outside the rectangular descriptor 
+		if (vbins.x < 0 || vbins.y < 0 || vbins.z < 0 ||
+			vbins.x >= (float) NHIST_PER_DIM ||
+			vbins.y >= (float) NHIST_PER_DIM ||
+			vbins.z >= (float) NHIST_PER_DIM)
+			continue;
+
+		// Take the gradient
+		IM_GET_GRAD_CACHED(im, grad_im, x, y, z, &grad);
+
+		// Apply a Gaussian window
+		SIFT3D_CVEC_SCALE(&grad, weight);
+
+                // Rotate the gradient to keypoint space
+		SIFT3D_MUL_MAT_RM_CVEC(&Rt, &grad, &grad_rot);
+
+		// Finally, accumulate bins by 5x linear interpolation
+		SIFT3D_desc_acc_interp(sift3d, &vbins, &grad_rot, desc);
+	IM_LOOP_WINDOW_END
+        cleanup_Sphere_table(&tmp);
+
+	// Histogram refinement steps
+	for (i = 0; i < DESC_NUM_TOTAL_HIST; i++) {
+		refine_Hist(&desc->hists[i]);
+	}
+
+	// Normalize the descriptor
+	normalize_desc(desc);
+
+	// Truncate
+	for (i = 0; i < DESC_NUM_TOTAL_HIST; i++) {
+		hist = desc->hists + i;
+		HIST_LOOP_START(a, p)
+			HIST_GET(hist, a, p) = SIFT3D_MIN(HIST_GET(hist, a, p), 
+						   (float) trunc_thresh);
+		HIST_LOOP_END
+	}
+
+	// Normalize again
+	normalize_desc(desc);
+
+	// Save the descriptor location in the original image
+	// coordinates
+	desc->xd = key->xd * coord_factor;
+	desc->yd = key->yd * coord_factor;
+	desc->zd = key->zd * coord_factor;
+	desc->sd = key->sd;
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Check if the Gaussian scale-space pyramid in a SIFT3D struct is valid. This
+ * shall return SIFT3D_TRUE if the struct was initialized, and 
+ * SIFT3D_detect_keypoints has been successfully called on it since 
+ * initialization. 
+ *
+ * Note: sift3d must be initialized before calling this function. */
+int SIFT3D_have_gpyr(const SIFT3D *const sift3d) {
+
+        const Pyramid *const gpyr = &sift3d->gpyr;
+
+        return gpyr->levels != NULL && gpyr->num_levels != 0 && 
+                gpyr->num_octaves != 0;
+}
+
+/* Helper function to scale keypoint coordinates.
+ *
+ * Parameters:
+ *  -src: The source keypoints.
+ *  -factors: An array of length IM_NDIMS specifying the scaling factors.
+ *  -dst: The scaled keypoints.
+ *
+ * Return: SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+static int scale_Keypoint(const Keypoint *const src, 
+        const double *const factors, Keypoint *const dst) {
+
+        // Copy the source keypoint
+        if (copy_Keypoint(src, dst)) {
+                SIFT3D_ERR("scale_Keypoint: failed to convert keypoints \n");
+                return SIFT3D_FAILURE;
+        }
+      
+        // Scale the coordinates 
+        dst->xd *= factors[0];
+        dst->yd *= factors[1];
+        dst->zd *= factors[2];
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Helper function to smooth a "raw" input image, as if it were processed
+ * via SIFT3D_detect_keypoints.
+ *
+ * Parameters:
+ *  -sift3d: Stores the parameters sigma_n and sigma0.
+ *  -src: The input "raw" image.
+ *  -recursive: If true, the filter may be approximated recursively, see
+ *      Gauss_filter. Pass sift3d->recursive_gauss unless the result must 
+ *      not depend on the edges of src.
+ *  -dst: The output, smoothed image.
+ *
+ * Return: SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+static int smooth_raw_input(const SIFT3D *const sift3d, const Image *const src,
+        const int recursive, Image *const dst) {
+
+        Gauss_filter gauss;
+
+        const double sigma_n = sift3d->gpyr.sigma_n;
+        const double sigma0 = sift3d->gpyr.sigma0;
+        const double unit = 1.0;
+
+        // Initialize the smoothing filter        
+        if (init_Gauss_incremental_filter(&gauss, sigma_n, sigma0, IM_NDIMS))
+                return SIFT3D_FAILURE;
+        gauss.recursive = recursive;
+
+        // Smooth the input
+        if (apply_Gauss_filter(src, dst, &gauss, unit))
+                goto smooth_raw_input_quit;
+
+        // Clean up
+        cleanup_Gauss_filter(&gauss);
+        
+        return SIFT3D_SUCCESS;
+
+smooth_raw_input_quit:
+        cleanup_Gauss_filter(&gauss);
+        return SIFT3D_FAILURE;
+}
+
+/* Extract SIFT3D descriptors from a list of keypoints. Uses the Gaussian
+ * scale-space pyramid from the previous call to SIFT3D_detect_keypoints on
+ * this SIFT3D struct. To extract from an image, see 
+ * SIFT3D_extract_raw_descriptors. 
+ *
+ * Note: To check if SIFT3D_detect_keypoints has been called on this struct,
+ * use SIFT3D_have_gpyr.
+ *
+ * Parameters:
+ *  sift3d - (initialized) struct defining the algorithm parameters. Must have
+ *      been used in some previous call to SIFT3D_detect_keypoints.
+ *  kp - keypoint list populated by a feature detector 
+ *  desc - (initialized) struct to hold the descriptors
+ *
+ * Return value:
+ *  Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise.
+ */
+int SIFT3D_extract_descriptors(SIFT3D *const sift3d, 
+        const Keypoint_store *const kp, 
+        SIFT3D_Descriptor_store *const desc) {
+
+	// Verify inputs
+	if (verify_keys(kp, &sift3d->im))
+		return SIFT3D_FAILURE;
+
+        // Check if a Gaussian scale-space pyramid is available for processing
+        if (!SIFT3D_have_gpyr(sift3d)) {
+                SIFT3D_ERR("SIFT3D_extract_descriptors: no Gaussian pyramid is "
+                        "available. Make sure SIFT3D_detect_keypoints was "
+                        "called prior to calling this function. \n");
+                return SIFT3D_FAILURE;
+        }
+
+        // Extract features
+        if (_SIFT3D_extract_descriptors(sift3d, &sift3d->gpyr, kp, desc))
+                return SIFT3D_FAILURE;
+
+        return SIFT3D_SUCCESS;
+}
+
+/* As SIFT3D_extract_descriptors, but projects each descriptor onto the
+ * PCA basis pca as soon as it is extracted. The result is written to desc,
+ * with pca->basis.num_rows elements per descriptor. The full descriptors are
+ * never stored, so this takes a fraction of the memory of extracting all of
+ * them and then calling SIFT3D_PCA_project. desc must be initialized prior
+ * to calling this function. */
+int SIFT3D_extract_descriptors_pca(SIFT3D *const sift3d, 
+        const Keypoint_store *const kp, const SIFT3D_PCA *const pca,
+        SIFT3D_Descriptor_soa *const desc) {
+
+	int i, ret;
+
+        const Pyramid *const gpyr = &sift3d->gpyr;
+	const Image *const first_level = 
+                SIFT3D_PYR_IM_GET(gpyr, gpyr->first_octave, gpyr->first_level);
+	const int num = kp->slab.num;
+        const int dim = pca->basis.num_rows;
+
+	// Verify inputs
+	if (verify_keys(kp, &sift3d->im) || verify_SIFT3D_PCA(pca))
+		return SIFT3D_FAILURE;
+
+        // Check if a Gaussian scale-space pyramid is available for processing
+        if (!SIFT3D_have_gpyr(sift3d)) {
+                SIFT3D_ERR("SIFT3D_extract_descriptors_pca: no Gaussian "
+                        "pyramid is available. Make sure "
+                        "SIFT3D_detect_keypoints was called prior to calling "
+                        "this function. \n");
+                return SIFT3D_FAILURE;
+        }
+
+        // Resize the output and initialize the metadata
+        set_dim_SIFT3D_Descriptor_soa(desc, dim);
+        if (resize_SIFT3D_Descriptor_soa(desc, num))
+                return SIFT3D_FAILURE;
+	desc->nx = first_level->nx;	
+	desc->ny = first_level->ny;	
+	desc->nz = first_level->nz;	
+
+        // Precompute the gradients, if the cache is enabled, and the windows
+        if (fill_Grad_cache(sift3d, kp) || fill_windows_SIFT3D(sift3d, kp, 
+                sift3d->desc_windows, desc_window_params))
+                return SIFT3D_FAILURE;
+
+        // Extract and project the descriptors
+        ret = SIFT3D_SUCCESS;
+#pragma omp parallel for
+	for (i = 0; i < num; i++) {
+
+                SIFT3D_Descriptor descrip;
+                float row[DESC_NUMEL];
+
+                const Keypoint *const key = kp->buf + i;
+		const Image *const level = 
+                        SIFT3D_PYR_IM_GET(gpyr, key->o, key->s);
+                const Image *const grad = get_Grad_cache(sift3d, key->o, 
+                        key->s);
+                const Sphere_table *const win = sift3d->desc_windows + 
+                        (level - gpyr->levels);
+                double *const coords = desc->coords + (size_t) i * IM_NDIMS;
+
+		if (extract_descrip(sift3d, level, grad, win, key, &descrip)) {
+                        ret = SIFT3D_FAILURE;
+                        continue;
+                }
+
+                coords[0] = descrip.xd;
+                coords[1] = descrip.yd;
+                coords[2] = descrip.zd;
+                desc->scales[i] = descrip.sd;
+                desc2soa_row(&descrip, row);
+                pca_project_row(pca, row, desc->hists + (size_t) i * dim);
+	}	
+
+	return ret;
+}
+
+/* Verify that keypoints kp are valid in image im. Returns SIFT3D_SUCCESS if
+ * valid, SIFT3D_FAILURE otherwise. */
+static int verify_keys(const Keypoint_store *const kp, const Image *const im) {
+
+        int i;
+
+	const int num = kp->slab.num;
+
+	// Check the number of keypoints
+	if (num < 1) {
+		SIFT3D_ERR("verify_keys: invalid number of keypoints: "
+				"%d \n", num);
+		return SIFT3D_FAILURE;
+	}
+
+	// Check each keypoint
+        for (i = 0; i < num; i++) {
+
+                const Keypoint *key = kp->buf + i;
+
+                const double octave_factor = pow(2.0, key->o);
+
+                if (key->xd < 0 ||
+                        key->yd < 0 ||
+                        key->zd < 0 ||
+                        key->xd * octave_factor >= (double) im->nx || 
+                        key->yd * octave_factor >= (double) im->ny || 
+                        key->zd * octave_factor >= (double) im->nz) {
+                        SIFT3D_ERR("verify_keys: keypoint %d (%f, %f, %f) "
+                                "octave %d exceeds image dimensions "
+                                "(%d, %d, %d) \n", i, key->xd, key->yd, key->zd,
+                                key->o, im->nx, im->ny, im->nz);
+                        return SIFT3D_FAILURE; 
+                }
+
+                if (key->sd <= 0) {
+                        SIFT3D_ERR("verify_keys: keypoint %d has invalid "
+                                "scale %f \n", i, key->sd);
+                        return SIFT3D_FAILURE;
+                }
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Convert the keypoint src to the equivalent one at octave 0, stored in dst. */
+static int keypoint2base(const Keypoint *const src, Keypoint *const dst) {
+
+        double base_factors[IM_NDIMS];
+        int j;
+
+        const double octave_factor = pow(2.0, src->o);
+
+        // Convert the factors to the base octave
+        for (j = 0; j < IM_NDIMS; j++) {
+                base_factors[j] = octave_factor;
+        }
+
+        // Scale the keypoint
+        if (scale_Keypoint(src, base_factors, dst))
+                return SIFT3D_FAILURE;
+
+        // Assign the keypoint the base octave and scale level
+        dst->o = 0;
+        dst->s = 0;
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Extract SIFT3D descriptors from a list of keypoints and 
+ * an image. To extract from a Gaussian scale-space pyramid, see
+ * SIFT3D_extract_descriptors. 
+ *
+ * Parameters:
+ *  sift3d - (initialized) struct defining the algorithm parameters
+ *  im - Pointer to an Image struct. A copy of the image is smoothed from 
+ *      sift3d->sigma_n to sift3d->sigma0 prior to descriptor extraction.
+ *  kp - keypoint list populated by a feature detector 
+ *  desc - (initialized) struct to hold the descriptors
+ *
+ * Return value:
+ *  Returns  SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise.
+ */
+int SIFT3D_extract_raw_descriptors(SIFT3D *const sift3d, 
+        const Image *const im, const Keypoint_store *const kp, 
+        SIFT3D_Descriptor_store *const desc) {
+
+        Keypoint_store kp_base;
+        Pyramid pyr;
+        Image *level;
+        int i;
+
+        const int first_octave = 0;
+        const int first_level = 0;
+        const int num_kp_levels = 1;
+        const int num_levels = 1;
+        const int num_octaves = 1;
+        const double sigma0 = sift3d->gpyr.sigma0;
+        const double sigma_n = sift3d->gpyr.sigma_n;
+
+        // Verify inputs
+        if (verify_keys(kp, im))
+                return SIFT3D_FAILURE;
+
+        // Initialize intermediates
+        init_Pyramid(&pyr);
+        init_Keypoint_store(&kp_base);
+
+        // Initialize the image pyramid
+        set_scales_Pyramid(sigma0, sigma_n, &pyr);
+        if (resize_Pyramid(im, first_level, num_kp_levels, num_levels,
+                first_octave, num_octaves, &pyr))
+                goto extract_raw_descriptors_quit;
+
+        // Smooth the input image, storing the result in the pyramid
+        level = SIFT3D_PYR_IM_GET(&pyr, first_octave, first_level); 
+        if (smooth_raw_input(sift3d, im, sift3d->recursive_gauss, level))
+                goto extract_raw_descriptors_quit;
+
+        // Allocate a temporary copy of the keypoints
+        if (resize_Keypoint_store(&kp_base, kp->slab.num))
+                goto extract_raw_descriptors_quit;
+
+        // Convert keypoints to the base scale and octave
+        for (i = 0; i < kp->slab.num; i++) {
+
+                const Keypoint *const src = kp->buf + i;
+                Keypoint *const dst = kp_base.buf + i; 
+
+                if (keypoint2base(src, dst))
+                        goto extract_raw_descriptors_quit;
+        }
+
+        // Extract the descriptors
+        if (_SIFT3D_extract_descriptors(sift3d, &pyr, &kp_base, desc))
+                goto extract_raw_descriptors_quit;
+
+        // Clean up
+        cleanup_Pyramid(&pyr);
+        cleanup_Keypoint_store(&kp_base);
+
+        return SIFT3D_SUCCESS;
+
+extract_raw_descriptors_quit:
+        cleanup_Pyramid(&pyr);
+        cleanup_Keypoint_store(&kp_base);
+        return SIFT3D_FAILURE;
+}
+
+/* Helper funciton to extract SIFT3D descriptors from a list of keypoints and 
+ * an image. Called by SIFT3D_extract_descriptors and 
+ * SIFT3D_extract_raw_descriptors.
+ *
+ * parameters:
+ *  sift3d - (initialized) struct defining the algorithm parameters
+ *  gpyr - A Gaussian Scale-Space pyramid containing the image data
+ *  kp - keypoint list populated by a feature detector 
+ *  desc - (initialized) struct to hold the descriptors
+ *  use_gpyr - see im for details */
+static int _SIFT3D_extract_descriptors(SIFT3D *const sift3d, 
+        const Pyramid *const gpyr, const Keypoint_store *const kp, 
+        SIFT3D_Descriptor_store *const desc) {
+
+	int i, ret;
+
+	const Image *const first_level = 
+                SIFT3D_PYR_IM_GET(gpyr, gpyr->first_octave, gpyr->first_level);
+
+	const int num = kp->slab.num;
+        const int use_cache = gpyr == &sift3d->gpyr;
+
+	// Initialize the metadata 
+	desc->nx = first_level->nx;	
+	desc->ny = first_level->ny;	
+	desc->nz = first_level->nz;	
+
+	// Resize the descriptor store (num cannot be zero)
+	desc->num = num;
+	if ((desc->buf = (SIFT3D_Descriptor *) SIFT3D_safe_realloc(desc->buf, 
+		num * sizeof(SIFT3D_Descriptor))) == NULL)
+                return SIFT3D_FAILURE;
+
+        // Precompute the gradients, if the cache is enabled, and the windows
+        if (use_cache && (fill_Grad_cache(sift3d, kp) ||
+                fill_windows_SIFT3D(sift3d, kp, sift3d->desc_windows, 
+                        desc_window_params)))
+                return SIFT3D_FAILURE;
+
+        // Extract the descriptors
+        ret = SIFT3D_SUCCESS;
+#pragma omp parallel for
+	for (i = 0; i < desc->num; i++) {
+
+                const Keypoint *const key = kp->buf + i;
+		SIFT3D_Descriptor *const descrip = desc->buf + i;
+		const Image *const level = 
+                        SIFT3D_PYR_IM_GET(gpyr, key->o, key->s);
+                const Image *const grad = use_cache ? 
+                        get_Grad_cache(sift3d, key->o, key->s) : NULL;
+                const Sphere_table *const win = use_cache ?
+                        sift3d->desc_windows + (level - gpyr->levels) : NULL;
+
+		if (extract_descrip(sift3d, level, grad, win, key, descrip)) {
+                        ret = SIFT3D_FAILURE;
+                }
+	}	
+
+	return ret;
+}
+
+/* L2-normalize an array of num histograms. The norms are accumulated bin by
+ * bin for all histograms at once, so that each step vectorizes across the 
+ * histograms, in the same order as for a single histogram. norms is scratch
+ * space for num elements. */
+static void normalize_Hist_row(Hist *const hists, const int num, 
+        double *const norms) {
+
+        int i, c;
+
+        for (i = 0; i < num; i++) {
+                norms[i] = 0.0;
+        }
+
+        for (c = 0; c < HIST_NUMEL; c++) {
+#pragma omp simd
+                for (i = 0; i < num; i++) {
+                        const float el = hists[i].bins[c];
+                        norms[i] += (double) el * el;
+                }
+        }
+
+        for (i = 0; i < num; i++) {
+
+                const float norm_inv = 1.0f / (sqrt(norms[i]) + DBL_EPSILON);
+
+#pragma omp simd
+                for (c = 0; c < HIST_NUMEL; c++) {
+                        hists[i].bins[c] *= norm_inv;
+                }
+        }
+}
+
+/* Dense gradient histogram postprocessing steps, for an array of num 
+ * histograms. Histogram i is converted to the norm vals[i * vals_stride]. 
+ * norms is scratch space for num elements. */
+static void postproc_Hist_row(Hist *const hists, const float *const vals,
+        const size_t vals_stride, const int num, double *const norms) {
+
+        int i, c;
+
+        const float hist_trunc = trunc_thresh * DESC_NUMEL / HIST_NUMEL;
+
+	// Histogram refinement steps
+        for (i = 0; i < num; i++) {
+	        refine_Hist(hists + i);
+        }
+
+	// Normalize the descriptors
+	normalize_Hist_row(hists, num, norms);
+
+	// Truncate
+        for (i = 0; i < num; i++) {
+#pragma omp simd
+                for (c = 0; c < HIST_NUMEL; c++) {
+		        hists[i].bins[c] = SIFT3D_MIN(hists[i].bins[c], 
+                                hist_trunc);
+                }
+        }
+
+	// Normalize again
+	normalize_Hist_row(hists, num, norms);
+
+        // Convert to the desired norms
+        for (i = 0; i < num; i++) {
+
+                const float norm = vals[i * vals_stride];
+
+#pragma omp simd
+                for (c = 0; c < HIST_NUMEL; c++) {
+                        hists[i].bins[c] *= norm;
+                }
+        }
+}
+
+/* Helper routine to extract a single SIFT3D histogram, with rotation. */
+static int extract_dense_descrip_rotate(SIFT3D *const sift3d, 
+           const Image *const im, const Image *const grad_im, 
+           const Sphere_table *const win, const Cvec *const vcenter, 
+           const double sigma, const Mat_rm *const R, Hist *const hist) {
+
+        Sphere_table tmp;
+        float buf[IM_NDIMS * IM_NDIMS];
+        Mat_rm Rt;
+	Cvec grad, grad_rot, bary, vim;
+	float mag, weight;
+        const Sphere_table *window;
+SIFT3D_IGNORE_UNUSED
+	int a, p, x, y, z, bin;
+
+        const Mesh *const mesh = &sift3d->mesh;
+	const float win_radius = desc_rad_fctr * sigma;
+
+        // Invert the rotation matrix
+        if (init_Mat_rm_p(&Rt, buf, IM_NDIMS, IM_NDIMS, FLOAT, SIFT3D_FALSE) ||
+                transpose_Mat_rm(R, &Rt))
+                return SIFT3D_FAILURE;
+
+        // Get the sphere window, in real-world coordinates
+        init_Sphere_table(&tmp);
+        if ((window = get_Sphere_table(win, &tmp, im, vcenter, 
+                win_radius * win_radius, sigma * sigma)) == NULL)
+                return SIFT3D_FAILURE;
+
+	// Zero the descriptor
+        hist_zero(hist);
+
+	// Iterate over the window
+	IM_LOOP_WINDOW_START(im, window, x, y, z, vcenter, &vim, weight)
+
+		// Take the gradient and rotate
+		IM_GET_GRAD_CACHED(im, grad_im, x, y, z, &grad);
+		SIFT3D_MUL_MAT_RM_CVEC(&Rt, &grad, &grad_rot);
+
+                // Get the index of the intersecting face
+                if (icos_hist_bin(sift3d, &grad_rot, &bary, &bin))
+                        continue;
+
+                // Get the magnitude of the vector
+                mag = SIFT3D_CVEC_L2_NORM(&grad);
+
+                // Interpolate over three vertices
+                MESH_HIST_GET(mesh, hist, bin, 0) += mag * weight * bary.x;
+                MESH_HIST_GET(mesh, hist, bin, 1) += mag * weight * bary.y;
+                MESH_HIST_GET(mesh, hist, bin, 2) += mag * weight * bary.z;
+
+	IM_LOOP_WINDOW_END
+        cleanup_Sphere_table(&tmp);
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Get a descriptor with a single histogram at each voxel of an image.
+ * The result is an image with HIST_NUMEL channels, where each channel is a
+ * bin of the histogram.
+ *
+ * Parameters:
+ * -sift3d Stores the algorithm parameters.
+ * -in The input image.
+ * -desc The output image of descriptors.
+ */
+int SIFT3D_extract_dense_descriptors(SIFT3D *const sift3d, 
+        const Image *const in, Image *const desc) {
+
+        int (*extract_fun)(SIFT3D *const, const Image *const, Image *const);
+        Image in_smooth;
+        int ret;
+
+        // Verify inputs
+        if (in->nc != 1) {
+                SIFT3D_ERR("SIFT3D_extract_dense_descriptors: invalid "
+                        "number of channels: %d. This function only supports "
+                        "single-channel images. \n", in->nc);
+                return SIFT3D_FAILURE;
+        }
+
+        // Select the appropriate subroutine
+        extract_fun = sift3d->dense_rotate ? 
+                extract_dense_descriptors_rotate :
+                extract_dense_descriptors_no_rotate;
+
+        // Resize the output image
+        memcpy(SIFT3D_IM_GET_DIMS(desc), SIFT3D_IM_GET_DIMS(in), 
+                IM_NDIMS * sizeof(int));
+        desc->nc = HIST_NUMEL;
+        im_default_stride(desc);
+        if (im_resize(desc))
+                return SIFT3D_FAILURE;
+
+        // Intialize intermediates
+        init_im(&in_smooth);
+
+        //TODO: Interpolate to be isotropic
+
+        // Smooth the input image
+        if (smooth_raw_input(sift3d, in, sift3d->recursive_gauss, 
+                &in_smooth))
+                goto extract_dense_quit;
+
+        // Extract the descriptors
+        if (extract_fun(sift3d, &in_smooth, desc))
+                goto extract_dense_quit;
+
+        // Post-process the descriptors, one row at a time, scaling each to 
+        // the image intensity at its voxel. The rows of desc are contiguous.
+        ret = SIFT3D_SUCCESS;
+#pragma omp parallel shared(ret)
+{
+        int yz;
+
+        double *const norms = (double *) malloc(desc->nx * sizeof(double));
+
+        if (norms == NULL)
+                ret = SIFT3D_FAILURE;
+
+#pragma omp for schedule(dynamic)
+        for (yz = 0; yz < desc->ny * desc->nz; yz++) {
+
+                const int y = yz % desc->ny;
+                const int z = yz / desc->ny;
+
+                if (norms == NULL)
+                        continue;
+
+                postproc_Hist_row((Hist *) &SIFT3D_IM_GET_VOX(desc, 0, y, z, 
+                        0), &SIFT3D_IM_GET_VOX(in, 0, y, z, 0), in->xs, 
+                        desc->nx, norms);
+        }
+
+        if (norms != NULL)
+                free(norms);
+}
+        if (ret)
+                goto extract_dense_quit;
+
+        // TODO transform back to original space
+
+        // Clean up
+        im_free(&in_smooth);
+
+        return SIFT3D_SUCCESS;
+
+extract_dense_quit:
+        im_free(&in_smooth);
+        return SIFT3D_FAILURE;
+}
+
+/* Helper function for SIFT3D_extract_dense_descriptors, without rotation 
+ * invariance. This function is much faster than its rotation-invariant 
+ * counterpart because histogram bins are pre-computed. */
+static int extract_dense_descriptors_no_rotate(SIFT3D *const sift3d,
+        const Image *const in, Image *const desc) {
+        return extract_dense_hists_no_rotate(sift3d, in, 
+                sift3d->recursive_gauss, desc);
+}
+
+/* Helper function for extract_dense_descriptors_no_rotate. If recursive is
+ * true, the histograms may be filtered with the recursive Gaussian 
+ * approximation, see Gauss_filter. */
+static int extract_dense_hists_no_rotate(SIFT3D *const sift3d,
+        const Image *const in, const int recursive, Image *const desc) {
+
+        Image temp; 
+        Gauss_filter gauss;
+	Cvec grad, bary;
+        int x, y, z, bin;
+
+        const int x_start = 1;
+        const int y_start = 1;
+        const int z_start = 1;
+        const int x_end = in->nx - 2;
+        const int y_end = in->ny - 2;
+        const int z_end = in->nz - 2;
+
+        Mesh * const mesh = &sift3d->mesh;
+        const double sigma_win = sift3d->gpyr.sigma0 * desc_sig_fctr / 
+                                 NHIST_PER_DIM;
+        const double unit = 1.0;
+
+        // Initialize the intermediate image
+        init_im(&temp);
+        if (im_copy_dims(desc, &temp))
+                return SIFT3D_FAILURE;
+
+        // Initialize the filter
+        if (init_Gauss_filter(&gauss, sigma_win, 3)) {
+                im_free(&temp);
+                return SIFT3D_FAILURE;
+        }
+        gauss.recursive = recursive;
+
+        // Initialize the descriptors for each voxel
+        im_zero(&temp);
+        SIFT3D_IM_LOOP_LIMITED_START(in, x, y, z, x_start, x_end, y_start, 
+                y_end, z_start, z_end)
+
+                // Take the gradient
+		IM_GET_GRAD_ISO(in, x, y, z, 0, &grad);
+
+                // Get the index of the intersecting face
+                if (icos_hist_bin(sift3d, &grad, &bary, &bin))
+                        continue;
+
+                // Initialize each vertex
+                SIFT3D_IM_GET_VOX(&temp, x, y, z, MESH_GET_IDX(mesh, bin, 0)) = 
+                        bary.x;
+                SIFT3D_IM_GET_VOX(&temp, x, y, z, MESH_GET_IDX(mesh, bin, 1)) = 
+                        bary.y;
+                SIFT3D_IM_GET_VOX(&temp, x, y, z, MESH_GET_IDX(mesh, bin, 2)) = 
+                        bary.z;
+
+        SIFT3D_IM_LOOP_END
+
+        // Filter the descriptors
+	if (apply_Gauss_filter(&temp, desc, &gauss, unit))
+                goto dense_extract_quit;
+
+        // Clean up
+        im_free(&temp);
+        cleanup_Gauss_filter(&gauss);
+
+        return SIFT3D_SUCCESS;
+
+dense_extract_quit:
+        im_free(&temp);
+        cleanup_Gauss_filter(&gauss);
+        return SIFT3D_FAILURE;
+}
+
+/* Copy a Hist to a voxel. Does no bounds checking. */
+static void hist2vox(Hist *const hist, const Image *const im, const int x, 
+        const int y, const int z) {
+
+        int c;
+        
+        for (c = 0; c < HIST_NUMEL; c++) {
+                SIFT3D_IM_GET_VOX(im, x, y, z, c) = hist->bins[c];
+        }
+}
+
+/* Initialize the shared data of the rotation-invariant dense descriptors
+ * of the image in, which is smoothed as in SIFT3D_extract_dense_descriptors.
+ * If recursive is true, the orientation field may be filtered with the 
+ * recursive Gaussian approximation, see Gauss_filter. On failure, dr is 
+ * cleaned up. */
+static int init_Dense_rotate(const SIFT3D *const sift3d, 
+        const Image *const in, const int recursive, Dense_rotate *const dr) {
+
+        int i;
+
+        const Cvec vorigin = {0.0f, 0.0f, 0.0f};
+        const double ori_sigma = sift3d->gpyr.sigma0 * ori_sig_fctr;
+        const double desc_sigma = sift3d->gpyr.sigma0 * 
+                desc_sig_fctr / NHIST_PER_DIM;
+        const double ori_radius = ori_sigma * ori_rad_fctr;
+        const float desc_radius = desc_rad_fctr * desc_sigma;
+        const size_t grad_bytes = (size_t) in->nx * in->ny * in->nz * 
+                IM_NDIMS * sizeof(float);
+
+        init_im(&dr->grad_im);
+        init_im(&dr->field);
+        init_Sphere_table(&dr->ori_win);
+        init_Sphere_table(&dr->desc_win);
+        dr->grad = NULL;
+        dr->ori_sigma = ori_sigma;
+        dr->desc_sigma = desc_sigma;
+
+        // Initialize the identity matrix
+        if (init_Mat_rm(&dr->Id, 3, 3, FLOAT, SIFT3D_TRUE)) {
+                cleanup_Sphere_table(&dr->ori_win);
+                cleanup_Sphere_table(&dr->desc_win);
+                return SIFT3D_FAILURE;
+        }
+        for (i = 0; i < 3; i++) {       
+                SIFT3D_MAT_RM_GET(&dr->Id, i, i, float) = 1.0f;
+        }
+
+        // Precompute the gradient, if it fits in the gradient cache. The 
+        // input differs on each call, so the gradient is not kept.
+        if (grad_bytes <= sift3d->grad_cache.max_bytes) {
+                if (im_grad_iso(in, &dr->grad_im))
+                        goto init_dense_rotate_quit;
+                dr->grad = &dr->grad_im;
+        }
+
+        // Build the windows, which are the same for every voxel, with the
+        // parameters of assign_eig_ori and extract_dense_descrip_rotate. In
+        // field mode, the orientation windows are replaced by the field.
+        if ((sift3d->ori_field ? 
+                make_ori_field(in, dr->grad, ori_sigma, recursive, 
+                        &dr->field) :
+                make_Sphere_table(&dr->ori_win, in, &vorigin, 
+                        ori_radius * ori_radius, ori_sigma * ori_sigma)) ||
+                make_Sphere_table(&dr->desc_win, in, &vorigin,
+                desc_radius * desc_radius, desc_sigma * desc_sigma))
+                goto init_dense_rotate_quit;
+
+        return SIFT3D_SUCCESS;
+
+init_dense_rotate_quit:
+        cleanup_Dense_rotate(dr);
+        return SIFT3D_FAILURE;
+}
+
+/* Free all memory associated with a Dense_rotate struct. */
+static void cleanup_Dense_rotate(Dense_rotate *const dr) {
+        im_free(&dr->grad_im);
+        im_free(&dr->field);
+        cleanup_Sphere_table(&dr->ori_win);
+        cleanup_Sphere_table(&dr->desc_win);
+        cleanup_Mat_rm(&dr->Id);
+}
+
+/* Extract the rotation-invariant dense descriptor of a single voxel of in, 
+ * using the shared data dr from init_Dense_rotate. R is scratch space for
+ * the rotation matrix, which must be distinct for each thread. */
+static int extract_dense_rotate_voxel(SIFT3D *const sift3d, 
+        const Dense_rotate *const dr, const Image *const in, 
+        const Cvec *const vcenter, Mat_rm *const R, Hist *const hist) {
+
+        const Mat_rm *ori;
+
+        // Attempt to assign an orientation
+        switch (sift3d->ori_field ?
+                assign_field_ori(&dr->field, vcenter, sift3d->corner_thresh, 
+                        R) :
+                assign_orientation_thresh(in, dr->grad, &dr->ori_win, 
+                        vcenter, dr->ori_sigma, sift3d->corner_thresh, R)) {
+                case SIFT3D_SUCCESS:
+                        // Use the assigned orientation
+                        ori = R;
+                        break;
+                case REJECT:
+                        // Default to identity
+                        ori = &dr->Id;
+                        break;
+                default:
+                        // Unexpected error
+                        return SIFT3D_FAILURE;
+        }
+
+        // Extract the descriptor
+        return extract_dense_descrip_rotate(sift3d, in, dr->grad, 
+                &dr->desc_win, vcenter, dr->desc_sigma, ori, hist);
+}
+
+/* As in extract_dense_descrip, but with rotation invariance */
+static int extract_dense_descriptors_rotate(SIFT3D *const sift3d,
+        const Image *const in, Image *const desc) {
+
+        Dense_rotate dr;
+        int num_slabs, ret;
+
+        // Initialize the shared data
+        if (init_Dense_rotate(sift3d, in, sift3d->recursive_gauss, &dr))
+                return SIFT3D_FAILURE;
+
+        // Iterate over slabs of z-planes in parallel. The shared data is only
+        // read, so each thread needs only its own rotation matrix.
+        num_slabs = (in->nz + dense_slab_depth - 1) / dense_slab_depth;
+        ret = SIFT3D_SUCCESS;
+#pragma omp parallel shared(ret)
+{
+        Mat_rm R;
+        int slab;
+
+        // Initialize the rotation matrix
+        const int R_err = init_Mat_rm(&R, 3, 3, FLOAT, SIFT3D_TRUE);
+
+        if (R_err)
+                ret = SIFT3D_FAILURE;
+
+#pragma omp for schedule(dynamic)
+        for (slab = 0; slab < num_slabs; slab++) {
+
+                int x, y, z;
+
+                const int z_start = slab * dense_slab_depth;
+                const int z_end = SIFT3D_MIN(z_start + dense_slab_depth, 
+                        in->nz) - 1;
+
+                if (R_err)
+                        continue;
+
+                SIFT3D_IM_LOOP_LIMITED_START(in, x, y, z, 0, in->nx - 1, 0,
+                        in->ny - 1, z_start, z_end)
+
+                        Hist hist;
+
+                        const Cvec vcenter = {x, y, z}; 
+
+                        if (extract_dense_rotate_voxel(sift3d, &dr, in, 
+                                &vcenter, &R, &hist)) {
+                                ret = SIFT3D_FAILURE;
+                                continue;
+                        }
+
+                        // Copy the descriptor to the image channels
+                        hist2vox(&hist, desc, x, y, z);
+
+                SIFT3D_IM_LOOP_END
+        }
+
+        if (!R_err)
+                cleanup_Mat_rm(&R);
+}
+
+        cleanup_Dense_rotate(&dr);
+        return ret;
+}
+
+/* Initialize a Dense_ROI struct to select every voxel of an image. */
+void init_Dense_ROI(Dense_ROI *const roi) {
+
+        int i;
+
+        roi->mask = NULL;
+        for (i = 0; i < IM_NDIMS; i++) {
+                roi->start[i] = 0;
+                roi->end[i] = -1;
+                roi->stride[i] = 1;
+        }
+}
+
+/* Helper function for SIFT3D_extract_dense_descriptors_roi. Returns the 
+ * number of voxels selected by roi, within the box [start, end], and 
+ * writes their coordinates to coords, unless it is NULL. */
+static int select_Dense_ROI(const Dense_ROI *const roi, 
+        const int *const start, const int *const end, int *const coords) {
+
+        int x, y, z, num;
+
+        num = 0;
+        for (z = start[2]; z <= end[2]; z += roi->stride[2]) {
+        for (y = start[1]; y <= end[1]; y += roi->stride[1]) {
+        for (x = start[0]; x <= end[0]; x += roi->stride[0]) {
+
+                if (roi->mask != NULL && 
+                        SIFT3D_IM_GET_VOX(roi->mask, x, y, z, 0) == 0.0f)
+                        continue;
+
+                if (coords != NULL) {
+                        coords[IM_NDIMS * num] = x;
+                        coords[IM_NDIMS * num + 1] = y;
+                        coords[IM_NDIMS * num + 2] = z;
+                }
+                num++;
+        }}}
+
+        return num;
+}
+
+/* Helper function for SIFT3D_extract_dense_descriptors_roi. Gets the margin
+ * around the selected voxels, in voxels of in along each dimension, within
+ * which the input affects their histograms. This is the reach of the FIR 
+ * filter of smooth_raw_input, plus that of the histogram filter, or of the 
+ * orientation and descriptor windows, with voxels for the gradient, its
+ * zeroed boundary, and the interpolation of filter taps in anisotropic 
+ * units. */
+static int get_Dense_ROI_margin(const SIFT3D *const sift3d, 
+        const Image *const in, int *const margin) {
+
+        Gauss_filter gauss;
+        int smooth_half, hist_half, field_half, d;
+
+        const double sigma_n = sift3d->gpyr.sigma_n;
+        const double sigma0 = sift3d->gpyr.sigma0;
+        const double ori_sigma = sigma0 * ori_sig_fctr;
+        const double desc_sigma = sigma0 * desc_sig_fctr / NHIST_PER_DIM;
+        const double win_radius = SIFT3D_MAX(ori_sigma * ori_rad_fctr,
+                desc_rad_fctr * desc_sigma);
+
+        // Get the half-widths of the filters
+        if (init_Gauss_incremental_filter(&gauss, sigma_n, sigma0, IM_NDIMS))
+                return SIFT3D_FAILURE;
+        smooth_half = gauss.f.width / 2;
+        cleanup_Gauss_filter(&gauss);
+        if (init_Gauss_filter(&gauss, desc_sigma, IM_NDIMS))
+                return SIFT3D_FAILURE;
+        hist_half = gauss.f.width / 2;
+        cleanup_Gauss_filter(&gauss);
+        if (init_Gauss_filter(&gauss, ori_sigma, IM_NDIMS))
+                return SIFT3D_FAILURE;
+        field_half = gauss.f.width / 2;
+        cleanup_Gauss_filter(&gauss);
+
+        // Convert them to voxels. The filters are applied in unit steps, 
+        // except the histogram filter, whose image has unit spacing.
+        for (d = 0; d < IM_NDIMS; d++) {
+
+                const double unit = SIFT3D_IM_GET_UNITS(in)[d];
+                const int smooth_reach = (int) ceil(smooth_half / unit) + 1;
+                int desc_reach;
+
+                if (!sift3d->dense_rotate) {
+                        desc_reach = hist_half + 2;
+                } else {
+                        desc_reach = (int) ceil(win_radius / unit) + 2;
+                        if (sift3d->ori_field)
+                                desc_reach = SIFT3D_MAX(desc_reach, 
+                                        (int) ceil(field_half / unit) + 3);
+                }
+
+                margin[d] = smooth_reach + desc_reach;
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Helper function for SIFT3D_extract_dense_descriptors_roi, without rotation
+ * invariance. Computes the histograms of in, which is already cropped around
+ * the selected voxels, then copies those of the selected voxels to hists. 
+ * The histograms are always filtered with the FIR Gaussian, since the 
+ * recursive approximation has unbounded support, and would depend on the 
+ * edges of the crop. */
+static int extract_dense_roi_no_rotate(SIFT3D *const sift3d, 
+        const Image *const in, const int *const coords, const int num,
+        Hist *const hists) {
+
+        Image desc;
+        int i;
+
+        init_im(&desc);
+
+        // Extract the descriptors of the whole crop
+        memcpy(SIFT3D_IM_GET_DIMS(&desc), SIFT3D_IM_GET_DIMS(in), 
+                IM_NDIMS * sizeof(int));
+        desc.nc = HIST_NUMEL;
+        im_default_stride(&desc);
+        if (im_resize(&desc) ||
+                extract_dense_hists_no_rotate(sift3d, in, SIFT3D_FALSE, 
+                        &desc)) {
+                im_free(&desc);
+                return SIFT3D_FAILURE;
+        }
+
+        // Copy the selected histograms
+        for (i = 0; i < num; i++) {
+
+                int c;
+
+                const int *const coord = coords + IM_NDIMS * i;
+
+                for (c = 0; c < HIST_NUMEL; c++) {
+                        hists[i].bins[c] = SIFT3D_IM_GET_VOX(&desc, coord[0], 
+                                coord[1], coord[2], c);
+                }
+        }
+
+        im_free(&desc);
+        return SIFT3D_SUCCESS;
+}
+
+/* Helper function for SIFT3D_extract_dense_descriptors_roi, with rotation
+ * invariance. Computes the histograms of the selected voxels in parallel. 
+ * The orientation field is always filtered with the FIR Gaussian, as in 
+ * extract_dense_roi_no_rotate. */
+static int extract_dense_roi_rotate(SIFT3D *const sift3d, 
+        const Image *const in, const int *const coords, const int num,
+        Hist *const hists) {
+
+        Dense_rotate dr;
+        int ret;
+
+        // Initialize the shared data
+        if (init_Dense_rotate(sift3d, in, SIFT3D_FALSE, &dr))
+                return SIFT3D_FAILURE;
+
+        ret = SIFT3D_SUCCESS;
+#pragma omp parallel shared(ret)
+{
+        Mat_rm R;
+        int i;
+
+        // Initialize the rotation matrix
+        const int R_err = init_Mat_rm(&R, 3, 3, FLOAT, SIFT3D_TRUE);
+
+        if (R_err)
+                ret = SIFT3D_FAILURE;
+
+#pragma omp for schedule(dynamic, 64)
+        for (i = 0; i < num; i++) {
+
+                const int *const coord = coords + IM_NDIMS * i;
+                const Cvec vcenter = {coord[0], coord[1], coord[2]};
+
+                if (R_err)
+                        continue;
+
+                if (extract_dense_rotate_voxel(sift3d, &dr, in, &vcenter, &R,
+                        hists + i))
+                        ret = SIFT3D_FAILURE;
+        }
+
+        if (!R_err)
+                cleanup_Mat_rm(&R);
+}
+
+        cleanup_Dense_rotate(&dr);
+        return ret;
+}
+
+/* As SIFT3D_extract_dense_descriptors, but only for the voxels selected by
+ * roi, which are stored compactly. This saves time and memory when the 
+ * voxels are a small part of the image, such as the inside of a 
+ * segmentation mask, or a coarse sampling grid.
+ *
+ * Parameters:
+ * -sift3d Stores the algorithm parameters.
+ * -in The input image.
+ * -roi Selects the voxels, see Dense_ROI. If roi->mask is not NULL, it must
+ *      have the same dimensions as in. The bounding box is clipped to in.
+ * -desc The output matrix, of type FLOAT. Each row is a selected voxel, in 
+ *      raster order, where the first IM_NDIMS columns are its coordinates, 
+ *      and the remaining HIST_NUMEL columns are its histogram, as in the 
+ *      channels of SIFT3D_extract_dense_descriptors. 
+ *
+ * The input is cropped to the bounding box of the selected voxels, with a 
+ * margin covering the support of every filter, so the intermediate images,
+ * such as the smoothed input, the gradient and the orientation field, are 
+ * bounded by that box rather than the whole image. The histograms match 
+ * those of SIFT3D_extract_dense_descriptors up to rounding. The crop is 
+ * always filtered with the FIR Gaussian, so if set_recursive_gauss_SIFT3D is
+ * enabled, they instead differ by the error of the recursive approximation,
+ * see get_recursive_error_Gauss_filter. */
+int SIFT3D_extract_dense_descriptors_roi(SIFT3D *const sift3d, 
+        const Image *const in, const Dense_ROI *const roi, 
+        Mat_rm *const desc) {
+
+        Image in_crop, in_smooth;
+        int start[IM_NDIMS], end[IM_NDIMS], margin[IM_NDIMS], lo[IM_NDIMS], 
+                hi[IM_NDIMS];
+        Hist *hists;
+        int *coords;
+        float *vals;
+        double *norms;
+        int i, d, c, x, y, z, num;
+
+        // Verify inputs
+        if (in->nc != 1) {
+                SIFT3D_ERR("SIFT3D_extract_dense_descriptors_roi: invalid "
+                        "number of channels: %d. This function only supports "
+                        "single-channel images. \n", in->nc);
+                return SIFT3D_FAILURE;
+        }
+        if (roi->mask != NULL && (roi->mask->nx != in->nx || 
+                roi->mask->ny != in->ny || roi->mask->nz != in->nz ||
+                roi->mask->nc != 1)) {
+                SIFT3D_ERR("SIFT3D_extract_dense_descriptors_roi: mask "
+                        "[%d x %d x %d x %d] does not match the image "
+                        "[%d x %d x %d] \n", roi->mask->nx, roi->mask->ny, 
+                        roi->mask->nz, roi->mask->nc, in->nx, in->ny, in->nz);
+                return SIFT3D_FAILURE;
+        }
+        for (d = 0; d < IM_NDIMS; d++) {
+                if (roi->stride[d] < 1) {
+                        SIFT3D_ERR("SIFT3D_extract_dense_descriptors_roi: "
+                                "invalid stride: %d \n", roi->stride[d]);
+                        return SIFT3D_FAILURE;
+                }
+        }
+
+        // Clip the bounding box to the image
+        for (d = 0; d < IM_NDIMS; d++) {
+
+                const int last = SIFT3D_IM_GET_DIMS(in)[d] - 1;
+
+                start[d] = SIFT3D_MAX(roi->start[d], 0);
+                end[d] = roi->end[d] < 0 ? last : SIFT3D_MIN(roi->end[d], last);
+        }
+
+        // Initialize intermediates
+        init_im(&in_crop);
+        init_im(&in_smooth);
+        hists = NULL;
+        coords = NULL;
+        vals = NULL;
+        norms = NULL;
+
+        // Find the selected voxels
+        num = select_Dense_ROI(roi, start, end, NULL);
+        if ((coords = (int *) malloc(SIFT3D_MAX(num, 1) * IM_NDIMS * 
+                sizeof(int))) == NULL ||
+                (hists = (Hist *) malloc(SIFT3D_MAX(num, 1) * 
+                sizeof(Hist))) == NULL ||
+                (vals = (float *) malloc(SIFT3D_MAX(num, 1) * 
+                sizeof(float))) == NULL ||
+                (norms = (double *) malloc(SIFT3D_MAX(num, 1) * 
+                sizeof(double))) == NULL) {
+                SIFT3D_ERR("SIFT3D_extract_dense_descriptors_roi: out of "
+                        "memory \n");
+                goto extract_dense_roi_quit;
+        }
+        select_Dense_ROI(roi, start, end, coords);
+
+        // Resize the output
+        desc->type = FLOAT;
+        desc->num_rows = num;
+        desc->num_cols = IM_NDIMS + HIST_NUMEL;
+        if (resize_Mat_rm(desc))
+                goto extract_dense_roi_quit;
+        if (num == 0)
+                goto extract_dense_roi_done;
+
+        // Get the bounding box of the selected voxels, with the margin
+        if (get_Dense_ROI_margin(sift3d, in, margin))
+                goto extract_dense_roi_quit;
+        for (d = 0; d < IM_NDIMS; d++) {
+                lo[d] = SIFT3D_IM_GET_DIMS(in)[d] - 1;
+                hi[d] = 0;
+        }
+        for (i = 0; i < num; i++) {
+                for (d = 0; d < IM_NDIMS; d++) {
+                        lo[d] = SIFT3D_MIN(lo[d], coords[IM_NDIMS * i + d]);
+                        hi[d] = SIFT3D_MAX(hi[d], coords[IM_NDIMS * i + d]);
+                }
+        }
+        for (d = 0; d < IM_NDIMS; d++) {
+                lo[d] = SIFT3D_MAX(lo[d] - margin[d], 0);
+                hi[d] = SIFT3D_MIN(hi[d] + margin[d], 
+                        SIFT3D_IM_GET_DIMS(in)[d] - 1);
+        }
+
+        // Crop the input
+        in_crop.nx = hi[0] - lo[0] + 1;
+        in_crop.ny = hi[1] - lo[1] + 1;
+        in_crop.nz = hi[2] - lo[2] + 1;
+        in_crop.nc = 1;
+        in_crop.ux = in->ux;
+        in_crop.uy = in->uy;
+        in_crop.uz = in->uz;
+        im_default_stride(&in_crop);
+        if (im_resize(&in_crop))
+                goto extract_dense_roi_quit;
+        SIFT3D_IM_LOOP_START(&in_crop, x, y, z)
+                SIFT3D_IM_GET_VOX(&in_crop, x, y, z, 0) = SIFT3D_IM_GET_VOX(in,
+                        x + lo[0], y + lo[1], z + lo[2], 0);
+        SIFT3D_IM_LOOP_END
+
+        // Get the image intensity at each voxel, then shift the coordinates
+        // to the crop
+        for (i = 0; i < num; i++) {
+
+                int *const coord = coords + IM_NDIMS * i;
+
+                vals[i] = SIFT3D_IM_GET_VOX(in, coord[0], coord[1], coord[2],
+                        0);
+                for (d = 0; d < IM_NDIMS; d++) {
+                        coord[d] -= lo[d];
+                }
+        }
+
+        // Smooth the crop
+        if (smooth_raw_input(sift3d, &in_crop, SIFT3D_FALSE, &in_smooth))
+                goto extract_dense_roi_quit;
+
+        // Extract the descriptors
+        if ((sift3d->dense_rotate ? 
+                extract_dense_roi_rotate(sift3d, &in_smooth, coords, num, 
+                        hists) :
+                extract_dense_roi_no_rotate(sift3d, &in_smooth, coords, num,
+                        hists)))
+                goto extract_dense_roi_quit;
+
+        // Post-process the descriptors in chunks, scaling each to the image 
+        // intensity at its voxel
+#pragma omp parallel for schedule(dynamic)
+        for (i = 0; i < num; i += dense_roi_chunk) {
+                postproc_Hist_row(hists + i, vals + i, 1, 
+                        SIFT3D_MIN(dense_roi_chunk, num - i), norms + i);
+        }
+
+        // Copy the coordinates and histograms to the output
+        for (i = 0; i < num; i++) {
+                for (d = 0; d < IM_NDIMS; d++) {
+                        SIFT3D_MAT_RM_GET(desc, i, d, float) = 
+                                (float) (coords[IM_NDIMS * i + d] + lo[d]);
+                }
+                for (c = 0; c < HIST_NUMEL; c++) {
+                        SIFT3D_MAT_RM_GET(desc, i, IM_NDIMS + c, float) = 
+                                hists[i].bins[c];
+                }
+        }
+
+extract_dense_roi_done:
+        im_free(&in_crop);
+        im_free(&in_smooth);
+        free(coords);
+        free(hists);
+        free(vals);
+        free(norms);
+        return SIFT3D_SUCCESS;
+
+extract_dense_roi_quit:
+        im_free(&in_crop);
+        im_free(&in_smooth);
+        free(coords);
+        free(hists);
+        free(vals);
+        free(norms);
+        return SIFT3D_FAILURE;
+}
+
+/* Convert a keypoint store to a matrix. 
+ * Output format:
+ *  [x1 y1 z1]
+ *  |   ...  |
+ *  [xn yn zn] 
+ * 
+ * mat must be initialized. */
+int Keypoint_store_to_Mat_rm(const Keypoint_store *const kp, Mat_rm *const mat) {
+
+    int i;
+
+    const int num = kp->slab.num;
+
+    // Resize mat
+    mat->num_rows = num;
+    mat->num_cols = IM_NDIMS;
+    mat->type = DOUBLE;
+    if (resize_Mat_rm(mat))
+	return SIFT3D_FAILURE;
+
+    // Build the matrix
+    for (i = 0; i < num; i++) {
+
+        const Keypoint *const key = kp->buf + i;
+
+        // Adjust the coordinates to the base octave
+        const double coord_factor = pow(2.0, key->o);
+
+	SIFT3D_MAT_RM_GET(mat, i, 0, double) = coord_factor * key->xd;
+	SIFT3D_MAT_RM_GET(mat, i, 1, double) = coord_factor * key->yd;
+	SIFT3D_MAT_RM_GET(mat, i, 2, double) = coord_factor * key->zd;
+    }
+
+    return SIFT3D_SUCCESS;
+}
+
+/* Convert SIFT3D desriptors to a coordinate matrix. This function has the same
+ * output format as Keypoint_store_to_Mat_rm */
+int SIFT3D_Descriptor_coords_to_Mat_rm(
+        const SIFT3D_Descriptor_store *const store, 
+        Mat_rm *const mat) {
+
+        int i;
+
+	const int num_rows = store->num;
+        const int num_cols = IM_NDIMS;
+
+	// Verify inputs
+	if (num_rows < 1) {
+		printf("SIFT3D_Descriptor_coords_to_Mat_rm: invalid number of "
+		       "descriptors: %d \n", num_rows);
+		return SIFT3D_FAILURE;
+	}
+
+        // Resize the output
+        mat->type = DOUBLE;
+        mat->num_rows = num_rows;
+        mat->num_cols = num_cols;
+        if (resize_Mat_rm(mat))
+                return SIFT3D_FAILURE;
+
+        // Copy the data
+        for (i = 0; i < num_rows; i++) {
+
+		const SIFT3D_Descriptor *const desc = store->buf + i;
+
+                SIFT3D_MAT_RM_GET(mat, i, 0, double) = desc->xd;
+                SIFT3D_MAT_RM_GET(mat, i, 1, double) = desc->yd;
+                SIFT3D_MAT_RM_GET(mat, i, 2, double) = desc->zd;
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Convert SIFT3D descriptors to a matrix.
+ *
+ * Output format:
+ *  [x y z el0 el1 ... el767]
+ * Each row is a feature descriptor. [x y z] are the coordinates in image
+ * space, and [el0 el1 ... el767 are the 768 dimensions of the descriptor.
+ *
+ * mat must be initialized prior to calling this function. mat will be resized.
+ * The type of mat will be changed to float.
+ */
+int SIFT3D_Descriptor_store_to_Mat_rm(const SIFT3D_Descriptor_store *const store, 
+				      Mat_rm *const mat) {
+	int i, j, a, p;
+
+	const int num_rows = store->num;
+	const int num_cols = IM_NDIMS + DESC_NUMEL;
+
+	// Verify inputs
+	if (num_rows < 1) {
+		printf("SIFT3D_Descriptor_store_to_Mat_rm: invalid number of "
+		       "descriptors: %d \n", num_rows);
+		return SIFT3D_FAILURE;
+	}
+
+	// Resize inputs
+	mat->type = FLOAT;
+	mat->num_rows = num_rows;
+	mat->num_cols = num_cols;
+	if (resize_Mat_rm(mat))
+		return SIFT3D_FAILURE;
+
+	// Copy the data
+	for (i = 0; i < num_rows; i++) {
+
+		const SIFT3D_Descriptor *const desc = store->buf + i;
+
+		// Copy the coordinates
+		SIFT3D_MAT_RM_GET(mat, i, 0, float) = (float) desc->xd;
+		SIFT3D_MAT_RM_GET(mat, i, 1, float) = (float) desc->yd;
+		SIFT3D_MAT_RM_GET(mat, i, 2, float) = (float) desc->zd;
+
+		// Copy the feature vector
+		for (j = 0; j < DESC_NUM_TOTAL_HIST; j++) {
+			const Hist *const hist = desc->hists + j;
+			HIST_LOOP_START(a, p)
+                                const int col = DESC_MAT_GET_COL(j, a, p);
+				SIFT3D_MAT_RM_GET(mat, i, col, float) = 
+					HIST_GET(hist, a, p);
+			HIST_LOOP_END
+		}
+	}
+
+	return SIFT3D_SUCCESS;
+}
+
+/* Convert a Mat_rm to a descriptor store. See 
+ * SIFT3D_Descriptor_store_to_Mat_rm for the input format. */
+int Mat_rm_to_SIFT3D_Descriptor_store(const Mat_rm *const mat, 
+				      SIFT3D_Descriptor_store *const store) {
+
+	int i, j, a, p;
 
-                const Hist *const hist = desc->hists + i;
+	const int num_rows = mat->num_rows;
+	const int num_cols = mat->num_cols;
 
-		HIST_LOOP_START(a, p) 
-			const float el = HIST_GET(hist, a, p);
-			norm += (double) el * el;
-		HIST_LOOP_END 
+	// Verify inputs
+	if (num_rows < 1 || num_cols != IM_NDIMS + DESC_NUMEL) {
+		printf("Mat_rm_to_SIFT3D_Descriptor_store: invalid matrix "
+		       "dimensions: [%d X %d] \n", num_rows, num_cols);
+		return SIFT3D_FAILURE;
 	}
 
-	norm = sqrt(norm) + DBL_EPSILON; 
+	// Resize the descriptor store (num cannot be zero)
+	store->num = num_rows;
+	if ((store->buf = (SIFT3D_Descriptor *) SIFT3D_safe_realloc(store->buf, 
+		num_rows * sizeof(SIFT3D_Descriptor))) == NULL)
+		return SIFT3D_FAILURE;
 
-	for (i = 0; i < DESC_NUM_TOTAL_HIST; i++) {
+	// Copy the data
+	for (i = 0; i < num_rows; i++) {
 
-                Hist *const hist = desc->hists + i;
-		const float norm_inv = 1.0f / norm; 
+		SIFT3D_Descriptor *const desc = store->buf + i;
 
-		HIST_LOOP_START(a, p) 
-			HIST_GET(hist, a, p) *= norm_inv; 
-		HIST_LOOP_END 
+		// Copy the coordinates
+		desc->xd = SIFT3D_MAT_RM_GET(mat, i, 0, float);
+		desc->yd = SIFT3D_MAT_RM_GET(mat, i, 1, float);
+		desc->zd = SIFT3D_MAT_RM_GET(mat, i, 2, float);
+
+		// Copy the feature vector
+		for (j = 0; j < DESC_NUM_TOTAL_HIST; j++) {
+			Hist *const hist = desc->hists + j;
+			HIST_LOOP_START(a, p)
+                                const int col = DESC_MAT_GET_COL(j, a, p);
+				HIST_GET(hist, a, p) = 
+                                        SIFT3D_MAT_RM_GET(mat, i, col, float);
+			HIST_LOOP_END
+		}
 	}
+	
+	return SIFT3D_SUCCESS;
 }
 
-/* Set a histogram to zero */
-static void hist_zero(Hist *hist) {
+/* Convert a descriptor store to a SIFT3D_Descriptor_soa, which is resized. 
+ * soa must be initialized prior to calling this function. */
+int SIFT3D_Descriptor_store_to_soa(const SIFT3D_Descriptor_store *const store,
+        SIFT3D_Descriptor_soa *const soa) {
 
-        int a, p;
+        int i;
 
-        HIST_LOOP_START(a, p)
-                HIST_GET(hist, a, p) = 0.0f;
-        HIST_LOOP_END
-}
+        const int num = store->num;
 
-/* Helper routine to extract a single SIFT3D descriptor */
-static int extract_descrip(SIFT3D *const sift3d, const Image *const im,
-	   const Keypoint *const key, SIFT3D_Descriptor *const desc) {
+        set_dim_SIFT3D_Descriptor_soa(soa, DESC_NUMEL);
+        if (resize_SIFT3D_Descriptor_soa(soa, num))
+                return SIFT3D_FAILURE;
+        soa->nx = store->nx;
+        soa->ny = store->ny;
+        soa->nz = store->nz;
 
-        float buf[IM_NDIMS * IM_NDIMS];
-        Mat_rm Rt;
-	Cvec vcenter, vim, vkp, vbins, grad, grad_rot;
-	Hist *hist;
-	float weight, sq_dist;
-	int i, x, y, z, a, p;
+	// Copy the data
+        for (i = 0; i < num; i++) {
 
-	// Compute basic parameters 
-        const float sigma = key->sd * desc_sig_fctr;
-	const float win_radius = desc_rad_fctr * sigma;
-	const float desc_hw = win_radius / sqrt(2);
-	const float desc_width = 2.0f * desc_hw;
-	const float desc_bin_fctr = (float) NHIST_PER_DIM / desc_width;
-	const double coord_factor = pow(2.0, key->o);
+		const SIFT3D_Descriptor *const desc = store->buf + i;
+                double *const coords = soa->coords + (size_t) i * IM_NDIMS;
 
-        // Invert the rotation matrix
-        if (init_Mat_rm_p(&Rt, buf, IM_NDIMS, IM_NDIMS, FLOAT, SIFT3D_FALSE) ||
-                transpose_Mat_rm(&key->R, &Rt))
-                return SIFT3D_FAILURE;
+		// Copy the coordinates and scale
+                coords[0] = desc->xd;
+                coords[1] = desc->yd;
+                coords[2] = desc->zd;
+                soa->scales[i] = desc->sd;
 
-	// Zero the descriptor
-	for (i = 0; i < DESC_NUM_TOTAL_HIST; i++) {
-		hist = desc->hists + i;
-                hist_zero(hist);
-	}
+		// Copy the feature vector
+                desc2soa_row(desc, soa->hists + (size_t) i * DESC_NUMEL);
+        }
 
-	// Iterate over a sphere window in real-world coordinates 
-	vcenter.x = key->xd;
-	vcenter.y = key->yd;
-	vcenter.z = key->zd;
-	IM_LOOP_SPHERE_START(im, x, y, z, &vcenter, win_radius, &vim, sq_dist)
+        return SIFT3D_SUCCESS;
+}
 
-		// Rotate to keypoint space
-		SIFT3D_MUL_MAT_RM_CVEC(&Rt, &vim, &vkp);		
+/* Helper function to copy the histograms of desc to row, in the column 
+ * order of SIFT3D_Descriptor_soa. */
+static void desc2soa_row(const SIFT3D_Descriptor *const desc, 
+        float *const row) {
 
-		// Compute spatial bins
-		vbins.x = (vkp.x + desc_hw) * desc_bin_fctr;
-		vbins.y = (vkp.y + desc_hw) * desc_bin_fctr;
-		vbins.z = (vkp.z + desc_hw) * desc_bin_fctr;
+        int j, a, p;
 
-		// Reject points outside the rectangular descriptor 
-		if (vbins.x < 0 || vbins.y < 0 || vbins.z < 0 ||
-			vbins.x >= (float) NHIST_PER_DIM ||
-			vbins.y >= (float) NHIST_PER_DIM ||
-			vbins.z >= (float) NHIST_PER_DIM)
-			continue;
+        for (j = 0; j < DESC_NUM_TOTAL_HIST; j++) {
+                const Hist *const hist = desc->hists + j;
+                HIST_LOOP_START(a, p)
+                        row[DESC_MAT_GET_COL(j, a, p) - IM_NDIMS] =
+                                HIST_GET(hist, a, p);
+                HIST_LOOP_END
+        }
+}
 
-		// Take the gradient
-		IM_GET_GRAD_ISO(im, x, y, z, 0, &grad);
+/* Convert a SIFT3D_Descriptor_soa to a descriptor store, which is resized. 
+ * store must be initialized prior to calling this function. */
+int SIFT3D_Descriptor_soa_to_store(const SIFT3D_Descriptor_soa *const soa,
+        SIFT3D_Descriptor_store *const store) {
 
-		// Apply a Gaussian window
-		weight = expf(-0.5f * sq_dist / (sigma * sigma));
-		SIFT3D_CVEC_SCALE(&grad, weight);
+        int i, j, a, p;
 
-                // Rotate the gradient to keypoint space
-		SIFT3D_MUL_MAT_RM_CVEC(&Rt, &grad, &grad_rot);
+        const int num = soa->num;
 
-		// Finally, accumulate bins by 5x linear interpolation
-		SIFT3D_desc_acc_interp(sift3d, &vbins, &grad_rot, desc);
-	IM_LOOP_SPHERE_END
+        // Projected descriptors cannot be converted back
+        if (soa->dim != DESC_NUMEL) {
+                SIFT3D_ERR("SIFT3D_Descriptor_soa_to_store: invalid "
+                        "descriptor length: %d \n", soa->dim);
+                return SIFT3D_FAILURE;
+        }
 
-	// Histogram refinement steps
-	for (i = 0; i < DESC_NUM_TOTAL_HIST; i++) {
-		refine_Hist(&desc->hists[i]);
-	}
+        store->nx = soa->nx;
+        store->ny = soa->ny;
+        store->nz = soa->nz;
+        store->num = num;
+        if (num == 0)
+                return SIFT3D_SUCCESS;
 
-	// Normalize the descriptor
-	normalize_desc(desc);
+	// Resize the descriptor store
+	if ((store->buf = (SIFT3D_Descriptor *) SIFT3D_safe_realloc(store->buf, 
+		num * sizeof(SIFT3D_Descriptor))) == NULL) {
+                store->num = 0;
+		return SIFT3D_FAILURE;
+        }
 
-	// Truncate
-	for (i = 0; i < DESC_NUM_TOTAL_HIST; i++) {
-		hist = desc->hists + i;
-		HIST_LOOP_START(a, p)
-			HIST_GET(hist, a, p) = SIFT3D_MIN(HIST_GET(hist, a, p), 
-						   (float) trunc_thresh);
-		HIST_LOOP_END
-	}
+	// Copy the data
+        for (i = 0; i < num; i++) {
 
-	// Normalize again
-	normalize_desc(desc);
+		SIFT3D_Descriptor *const desc = store->buf + i;
+                const float *const row = soa->hists + (size_t) i * DESC_NUMEL;
+                const double *const coords = soa->coords + 
+                        (size_t) i * IM_NDIMS;
 
-	// Save the descriptor location in the original image
-	// coordinates
-	desc->xd = key->xd * coord_factor;
-	desc->yd = key->yd * coord_factor;
-	desc->zd = key->zd * coord_factor;
-	desc->sd = key->sd;
+		// Copy the coordinates and scale
+                desc->xd = coords[0];
+                desc->yd = coords[1];
+                desc->zd = coords[2];
+                desc->sd = soa->scales[i];
+
+		// Copy the feature vector
+		for (j = 0; j < DESC_NUM_TOTAL_HIST; j++) {
+			Hist *const hist = desc->hists + j;
+			HIST_LOOP_START(a, p)
+				HIST_GET(hist, a, p) = 
+                                        row[DESC_MAT_GET_COL(j, a, p) - 
+                                                IM_NDIMS];
+			HIST_LOOP_END
+		}
+        }
 
         return SIFT3D_SUCCESS;
 }
 
-/* Check if the Gaussian scale-space pyramid in a SIFT3D struct is valid. This
- * shall return SIFT3D_TRUE if the struct was initialized, and 
- * SIFT3D_detect_keypoints has been successfully called on it since 
- * initialization. 
- *
- * Note: sift3d must be initialized before calling this function. */
-int SIFT3D_have_gpyr(const SIFT3D *const sift3d) {
+/* Initialize mat as a [num x dim] FLOAT matrix aliasing the 
+ * histograms of soa, without copying. mat is only valid until soa is 
+ * resized or cleaned up. It need not be cleaned up, but it cannot be 
+ * resized. */
+int SIFT3D_Descriptor_soa_hists_Mat_rm(const SIFT3D_Descriptor_soa *const soa,
+        Mat_rm *const mat) {
+        return init_Mat_rm_p(mat, soa->hists, soa->num, soa->dim, FLOAT, 
+                SIFT3D_FALSE);
+}
 
-        const Pyramid *const gpyr = &sift3d->gpyr;
+/* Convert a descriptor store to a SIFT3D_Descriptor_u8, which is resized. 
+ * Each histogram element is multiplied by SIFT3D_desc_quant_scale and 
+ * rounded. The descriptors have unit norm, so no element exceeds 255, even
+ * after re-normalization. desc must be initialized prior to calling this
+ * function. */
+int SIFT3D_Descriptor_store_to_u8(const SIFT3D_Descriptor_store *const store,
+        SIFT3D_Descriptor_u8 *const desc) {
 
-        return gpyr->levels != NULL && gpyr->num_levels != 0 && 
-                gpyr->num_octaves != 0;
-}
+        int i, j, a, p;
 
-/* Helper function to scale keypoint coordinates.
- *
- * Parameters:
- *  -src: The source keypoints.
- *  -factors: An array of length IM_NDIMS specifying the scaling factors.
- *  -dst: The scaled keypoints.
- *
- * Return: SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
-static int scale_Keypoint(const Keypoint *const src, 
-        const double *const factors, Keypoint *const dst) {
+        const int num = store->num;
 
-        // Copy the source keypoint
-        if (copy_Keypoint(src, dst)) {
-                SIFT3D_ERR("scale_Keypoint: failed to convert keypoints \n");
+        if (resize_SIFT3D_Descriptor_u8(desc, num))
                 return SIFT3D_FAILURE;
+        desc->nx = store->nx;
+        desc->ny = store->ny;
+        desc->nz = store->nz;
+
+	// Copy the data
+        for (i = 0; i < num; i++) {
+
+		const SIFT3D_Descriptor *const src = store->buf + i;
+                unsigned char *const row = desc->hists + 
+                        (size_t) i * DESC_NUMEL;
+                double *const coords = desc->coords + (size_t) i * IM_NDIMS;
+
+		// Copy the coordinates and scale
+                coords[0] = src->xd;
+                coords[1] = src->yd;
+                coords[2] = src->zd;
+                desc->scales[i] = src->sd;
+
+		// Quantize the feature vector
+		for (j = 0; j < DESC_NUM_TOTAL_HIST; j++) {
+			const Hist *const hist = src->hists + j;
+			HIST_LOOP_START(a, p)
+                                row[DESC_MAT_GET_COL(j, a, p) - IM_NDIMS] =
+					quantize_desc_val(HIST_GET(hist, a, p));
+			HIST_LOOP_END
+		}
         }
-      
-        // Scale the coordinates 
-        dst->xd *= factors[0];
-        dst->yd *= factors[1];
-        dst->zd *= factors[2];
 
         return SIFT3D_SUCCESS;
 }
 
-/* Helper function to smooth a "raw" input image, as if it were processed
- * via SIFT3D_detect_keypoints.
- *
- * Parameters:
- *  -sift3d: Stores the parameters sigma_n and sigma0.
- *  -src: The input "raw" image.
- *  -dst: The output, smoothed image.
- *
- * Return: SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
-static int smooth_raw_input(const SIFT3D *const sift3d, const Image *const src,
-        Image *const dst) {
-
-        Gauss_filter gauss;
+/* Convert a SIFT3D_Descriptor_u8 to a descriptor store, which is resized,
+ * undoing the scaling of SIFT3D_Descriptor_store_to_u8. store must be 
+ * initialized prior to calling this function. */
+int SIFT3D_Descriptor_u8_to_store(const SIFT3D_Descriptor_u8 *const desc,
+        SIFT3D_Descriptor_store *const store) {
 
-        const double sigma_n = sift3d->gpyr.sigma_n;
-        const double sigma0 = sift3d->gpyr.sigma0;
-        const double unit = 1.0;
+        int i, j, a, p;
 
-        // Initialize the smoothing filter        
-        if (init_Gauss_incremental_filter(&gauss, sigma_n, sigma0, IM_NDIMS))
-                return SIFT3D_FAILURE;
+        const int num = desc->num;
+        const float inv_scale = (float) (1.0 / SIFT3D_desc_quant_scale);
 
-        // Smooth the input
-        if (apply_Sep_FIR_filter(src, dst, &gauss.f, unit))
-                goto smooth_raw_input_quit;
+        store->nx = desc->nx;
+        store->ny = desc->ny;
+        store->nz = desc->nz;
+        store->num = num;
+        if (num == 0)
+                return SIFT3D_SUCCESS;
 
-        // Clean up
-        cleanup_Gauss_filter(&gauss);
-        
-        return SIFT3D_SUCCESS;
+	// Resize the descriptor store
+	if ((store->buf = (SIFT3D_Descriptor *) SIFT3D_safe_realloc(store->buf, 
+		num * sizeof(SIFT3D_Descriptor))) == NULL) {
+                store->num = 0;
+		return SIFT3D_FAILURE;
+        }
 
-smooth_raw_input_quit:
-        cleanup_Gauss_filter(&gauss);
-        return SIFT3D_FAILURE;
-}
+	// Copy the data
+        for (i = 0; i < num; i++) {
 
-/* Extract SIFT3D descriptors from a list of keypoints. Uses the Gaussian
- * scale-space pyramid from the previous call to SIFT3D_detect_keypoints on
- * this SIFT3D struct. To extract from an image, see 
- * SIFT3D_extract_raw_descriptors. 
- *
- * Note: To check if SIFT3D_detect_keypoints has been called on this struct,
- * use SIFT3D_have_gpyr.
- *
- * Parameters:
- *  sift3d - (initialized) struct defining the algorithm parameters. Must have
- *      been used in some previous call to SIFT3D_detect_keypoints.
- *  kp - keypoint list populated by a feature detector 
- *  desc - (initialized) struct to hold the descriptors
- *
- * Return value:
- *  Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise.
- */
-int SIFT3D_extract_descriptors(SIFT3D *const sift3d, 
-        const Keypoint_store *const kp, 
-        SIFT3D_Descriptor_store *const desc) {
+		SIFT3D_Descriptor *const dst = store->buf + i;
+                const unsigned char *const row = desc->hists + 
+                        (size_t) i * DESC_NUMEL;
+                const double *const coords = desc->coords + 
+                        (size_t) i * IM_NDIMS;
 
-	// Verify inputs
-	if (verify_keys(kp, &sift3d->im))
-		return SIFT3D_FAILURE;
+		// Copy the coordinates and scale
+                dst->xd = coords[0];
+                dst->yd = coords[1];
+                dst->zd = coords[2];
+                dst->sd = desc->scales[i];
 
-        // Check if a Gaussian scale-space pyramid is available for processing
-        if (!SIFT3D_have_gpyr(sift3d)) {
-                SIFT3D_ERR("SIFT3D_extract_descriptors: no Gaussian pyramid is "
-                        "available. Make sure SIFT3D_detect_keypoints was "
-                        "called prior to calling this function. \n");
-                return SIFT3D_FAILURE;
+		// Rescale the feature vector
+		for (j = 0; j < DESC_NUM_TOTAL_HIST; j++) {
+			Hist *const hist = dst->hists + j;
+			HIST_LOOP_START(a, p)
+				HIST_GET(hist, a, p) = inv_scale * (float)
+                                        row[DESC_MAT_GET_COL(j, a, p) - 
+                                                IM_NDIMS];
+			HIST_LOOP_END
+		}
         }
 
-        // Extract features
-        if (_SIFT3D_extract_descriptors(sift3d, &sift3d->gpyr, kp, desc))
-                return SIFT3D_FAILURE;
-
         return SIFT3D_SUCCESS;
 }
 
-/* Verify that keypoints kp are valid in image im. Returns SIFT3D_SUCCESS if
- * valid, SIFT3D_FAILURE otherwise. */
-static int verify_keys(const Keypoint_store *const kp, const Image *const im) {
+/* Learn a PCA basis of dim principal axes from the descriptors of 
+ * num_stores descriptor stores, such as those extracted from a corpus of
+ * training images. This is a shortcut for add_SIFT3D_PCA_stats and 
+ * learn_SIFT3D_PCA_stats, which learn from one store at a time. pca must be
+ * initialized prior to calling this function.
+ *
+ * A dim of 64 to 128 typically retains most of the variance of the 
+ * DESC_NUMEL-dimensional descriptors. */
+int learn_SIFT3D_PCA(const SIFT3D_Descriptor_store *const stores, 
+        const int num_stores, const int dim, SIFT3D_PCA *const pca) {
 
-        int i;
+        SIFT3D_PCA_stats stats;
+        int s, ret;
 
-	const int num = kp->slab.num;
+        if (init_SIFT3D_PCA_stats(&stats))
+                return SIFT3D_FAILURE;
 
-	// Check the number of keypoints
-	if (num < 1) {
-		SIFT3D_ERR("verify_keys: invalid number of keypoints: "
-				"%d \n", num);
-		return SIFT3D_FAILURE;
-	}
+        ret = SIFT3D_SUCCESS;
+        for (s = 0; s < num_stores; s++) {
+                if ((ret = add_SIFT3D_PCA_stats(&stats, stores + s)))
+                        break;
+        }
+        if (!ret)
+                ret = learn_SIFT3D_PCA_stats(&stats, dim, pca);
 
-	// Check each keypoint
-        for (i = 0; i < num; i++) {
+        cleanup_SIFT3D_PCA_stats(&stats);
+        return ret;
+}
 
-                const Keypoint *key = kp->buf + i;
+/* Add the descriptors of store to the statistics in stats. The sum of the
+ * outer products is accumulated in double precision, pca_chunk_rows 
+ * descriptors at a time. The store can be freed afterwards, so a corpus can
+ * be learned one file at a time. */
+int add_SIFT3D_PCA_stats(SIFT3D_PCA_stats *const stats, 
+        const SIFT3D_Descriptor_store *const store) {
 
-                const double octave_factor = pow(2.0, key->o);
+        SIFT3D_Descriptor_soa soa;
+        Mat_rm chunk, prod;
+        size_t start;
+        int i, k, ret;
 
-                if (key->xd < 0 ||
-                        key->yd < 0 ||
-                        key->zd < 0 ||
-                        key->xd * octave_factor >= (double) im->nx || 
-                        key->yd * octave_factor >= (double) im->ny || 
-                        key->zd * octave_factor >= (double) im->nz) {
-                        SIFT3D_ERR("verify_keys: keypoint %d (%f, %f, %f) "
-                                "octave %d exceeds image dimensions "
-                                "(%d, %d, %d) \n", i, key->xd, key->yd, key->zd,
-                                key->o, im->nx, im->ny, im->nz);
-                        return SIFT3D_FAILURE; 
+        // Initialize intermediates
+        init_SIFT3D_Descriptor_soa(&soa);
+        ret = SIFT3D_FAILURE;
+        if (init_Mat_rm(&chunk, 0, 0, DOUBLE, SIFT3D_FALSE))
+                goto add_pca_init_quit;
+        if (init_Mat_rm(&prod, 0, 0, DOUBLE, SIFT3D_FALSE))
+                goto add_pca_chunk_quit;
+
+        if (SIFT3D_Descriptor_store_to_soa(store, &soa))
+                goto add_pca_quit;
+
+        // Accumulate the sums of the descriptors and their outer products
+        for (start = 0; start < soa.num; start += pca_chunk_rows) {
+
+                const int num = SIFT3D_MIN(soa.num - start, pca_chunk_rows);
+
+                // Transpose the chunk, so that its product with itself is 
+                // the sum of the outer products
+                chunk.num_rows = DESC_NUMEL;
+                chunk.num_cols = num;
+                if (resize_Mat_rm(&chunk))
+                        goto add_pca_quit;
+                for (i = 0; i < num; i++) {
+
+                        const float *const row = soa.hists + 
+                                (start + i) * DESC_NUMEL;
+
+                        for (k = 0; k < DESC_NUMEL; k++) {
+                                SIFT3D_MAT_RM_GET(&chunk, k, i, double) = 
+                                        row[k];
+                                SIFT3D_MAT_RM_GET(&stats->sum, 0, k, 
+                                        double) += row[k];
+                        }
                 }
 
-                if (key->sd <= 0) {
-                        SIFT3D_ERR("verify_keys: keypoint %d has invalid "
-                                "scale %f \n", i, key->sd);
-                        return SIFT3D_FAILURE;
-                }
+                if (mul_Mat_rm_trans(&chunk, &chunk, &prod))
+                        goto add_pca_quit;
+                SIFT3D_MAT_RM_LOOP_START(&stats->prod, i, k)
+                        SIFT3D_MAT_RM_GET(&stats->prod, i, k, double) +=
+                                SIFT3D_MAT_RM_GET(&prod, i, k, double);
+                SIFT3D_MAT_RM_LOOP_END
         }
+        stats->num += soa.num;
 
-        return SIFT3D_SUCCESS;
+        ret = SIFT3D_SUCCESS;
+
+add_pca_quit:
+        cleanup_Mat_rm(&prod);
+add_pca_chunk_quit:
+        cleanup_Mat_rm(&chunk);
+add_pca_init_quit:
+        cleanup_SIFT3D_Descriptor_soa(&soa);
+        return ret;
 }
 
-/* Convert the keypoint src to the equivalent one at octave 0, stored in dst. */
-static int keypoint2base(const Keypoint *const src, Keypoint *const dst) {
+/* Learn a PCA basis of dim principal axes from the statistics in stats, as
+ * accumulated by add_SIFT3D_PCA_stats. pca must be initialized prior to 
+ * calling this function. See also learn_SIFT3D_PCA. */
+int learn_SIFT3D_PCA_stats(const SIFT3D_PCA_stats *const stats, 
+        const int dim, SIFT3D_PCA *const pca) {
 
-        double base_factors[IM_NDIMS];
-        int j;
+        Mat_rm cov, Q, L;
+        double mean[DESC_NUMEL];
+        int i, k, ret;
 
-        const double octave_factor = pow(2.0, src->o);
+        const size_t total = stats->num;
 
-        // Convert the factors to the base octave
-        for (j = 0; j < IM_NDIMS; j++) {
-                base_factors[j] = octave_factor;
+        // Verify inputs
+        if (dim < 1 || dim > DESC_NUMEL) {
+                SIFT3D_ERR("learn_SIFT3D_PCA_stats: invalid dimension %d, "
+                        "must be in [1, %d] \n", dim, DESC_NUMEL);
+                return SIFT3D_FAILURE;
+        }
+        if (total < 2) {
+                SIFT3D_ERR("learn_SIFT3D_PCA_stats: need at least two "
+                        "descriptors, have %lu \n", (unsigned long) total);
+                return SIFT3D_FAILURE;
         }
 
-        // Scale the keypoint
-        if (scale_Keypoint(src, base_factors, dst))
+        // Initialize intermediates
+        ret = SIFT3D_FAILURE;
+        if (init_Mat_rm(&cov, 0, 0, DOUBLE, SIFT3D_FALSE))
                 return SIFT3D_FAILURE;
+        if (init_Mat_rm(&Q, 0, 0, DOUBLE, SIFT3D_FALSE))
+                goto learn_pca_cov_quit;
+        if (init_Mat_rm(&L, 0, 0, DOUBLE, SIFT3D_FALSE))
+                goto learn_pca_Q_quit;
+
+        // Center the covariance
+        for (k = 0; k < DESC_NUMEL; k++) {
+                mean[k] = SIFT3D_MAT_RM_GET(&stats->sum, 0, k, double) / 
+                        (double) total;
+        }
+        if (copy_Mat_rm(&stats->prod, &cov))
+                goto learn_pca_quit;
+        SIFT3D_MAT_RM_LOOP_START(&cov, i, k)
+                SIFT3D_MAT_RM_GET(&cov, i, k, double) = 
+                        (SIFT3D_MAT_RM_GET(&cov, i, k, double) - 
+                        (double) total * mean[i] * mean[k]) / 
+                        (double) (total - 1);
+        SIFT3D_MAT_RM_LOOP_END
+
+        // Take the eigenvectors, in ascending order of the eigenvalues
+        if (eigen_Mat_rm(&cov, &Q, &L))
+                goto learn_pca_quit;
+
+        // Copy the mean and the last dim eigenvectors
+        pca->mean.type = pca->basis.type = FLOAT;
+        pca->mean.num_rows = 1;
+        pca->mean.num_cols = pca->basis.num_cols = DESC_NUMEL;
+        pca->basis.num_rows = dim;
+        if (resize_Mat_rm(&pca->mean) || resize_Mat_rm(&pca->basis))
+                goto learn_pca_quit;
+        for (k = 0; k < DESC_NUMEL; k++) {
+                SIFT3D_MAT_RM_GET(&pca->mean, 0, k, float) = (float) mean[k];
+        }
+        SIFT3D_MAT_RM_LOOP_START(&pca->basis, i, k)
+                SIFT3D_MAT_RM_GET(&pca->basis, i, k, float) = (float)
+                        SIFT3D_MAT_RM_GET(&Q, k, DESC_NUMEL - 1 - i, double);
+        SIFT3D_MAT_RM_LOOP_END
 
-        // Assign the keypoint the base octave and scale level
-        dst->o = 0;
-        dst->s = 0;
+        ret = SIFT3D_SUCCESS;
 
-        return SIFT3D_SUCCESS;
+learn_pca_quit:
+        cleanup_Mat_rm(&L);
+learn_pca_Q_quit:
+        cleanup_Mat_rm(&Q);
+learn_pca_cov_quit:
+        cleanup_Mat_rm(&cov);
+        return ret;
 }
 
-/* Extract SIFT3D descriptors from a list of keypoints and 
- * an image. To extract from a Gaussian scale-space pyramid, see
- * SIFT3D_extract_descriptors. 
- *
- * Parameters:
- *  sift3d - (initialized) struct defining the algorithm parameters
- *  im - Pointer to an Image struct. A copy of the image is smoothed from 
- *      sift3d->sigma_n to sift3d->sigma0 prior to descriptor extraction.
- *  kp - keypoint list populated by a feature detector 
- *  desc - (initialized) struct to hold the descriptors
- *
- * Return value:
- *  Returns  SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise.
- */
-int SIFT3D_extract_raw_descriptors(SIFT3D *const sift3d, 
-        const Image *const im, const Keypoint_store *const kp, 
-        SIFT3D_Descriptor_store *const desc) {
+/* Project the descriptors of in onto a PCA basis. out is resized to 
+ * in->num descriptors of pca->basis.num_rows elements, with the coordinates
+ * and scales of in. The result can be matched by SIFT3D_nn_match_soa.
+ * in and out must be different, initialized structs. */
+int SIFT3D_PCA_project(const SIFT3D_PCA *const pca, 
+        const SIFT3D_Descriptor_soa *const in, 
+        SIFT3D_Descriptor_soa *const out) {
 
-        Keypoint_store kp_base;
-        Pyramid pyr;
-        Image *level;
         int i;
 
-        const int first_octave = 0;
-        const int first_level = 0;
-        const int num_kp_levels = 1;
-        const int num_levels = 1;
-        const int num_octaves = 1;
-        const double sigma0 = sift3d->gpyr.sigma0;
-        const double sigma_n = sift3d->gpyr.sigma_n;
+        const int num = in->num;
+        const int dim = pca->basis.num_rows;
 
         // Verify inputs
-        if (verify_keys(kp, im))
+        if (verify_SIFT3D_PCA(pca))
                 return SIFT3D_FAILURE;
+        if (in->dim != DESC_NUMEL) {
+                SIFT3D_ERR("SIFT3D_PCA_project: input has dimension %d, "
+                        "expected %d \n", in->dim, DESC_NUMEL);
+                return SIFT3D_FAILURE;
+        }
+        if (in == out) {
+                SIFT3D_ERR("SIFT3D_PCA_project: cannot project in place \n");
+                return SIFT3D_FAILURE;
+        }
 
-        // Initialize intermediates
-        init_Pyramid(&pyr);
-        init_Keypoint_store(&kp_base);
+        // Resize the output and copy the metadata
+        set_dim_SIFT3D_Descriptor_soa(out, dim);
+        if (resize_SIFT3D_Descriptor_soa(out, num))
+                return SIFT3D_FAILURE;
+        out->nx = in->nx;
+        out->ny = in->ny;
+        out->nz = in->nz;
+        if (num > 0) {
+                memcpy(out->coords, in->coords, (size_t) num * IM_NDIMS *
+                        sizeof(double));
+                memcpy(out->scales, in->scales, (size_t) num * 
+                        sizeof(double));
+        }
 
-        // Initialize the image pyramid
-        set_scales_Pyramid(sigma0, sigma_n, &pyr);
-        if (resize_Pyramid(im, first_level, num_kp_levels, num_levels,
-                first_octave, num_octaves, &pyr))
-                goto extract_raw_descriptors_quit;
+        // Project the histograms
+#pragma omp parallel for
+        for (i = 0; i < num; i++) {
+                pca_project_row(pca, in->hists + (size_t) i * DESC_NUMEL,
+                        out->hists + (size_t) i * dim);
+        }
 
-        // Smooth the input image, storing the result in the pyramid
-        level = SIFT3D_PYR_IM_GET(&pyr, first_octave, first_level); 
-        if (smooth_raw_input(sift3d, im, level))
-                goto extract_raw_descriptors_quit;
+        return SIFT3D_SUCCESS;
+}
 
-        // Allocate a temporary copy of the keypoints
-        if (resize_Keypoint_store(&kp_base, kp->slab.num))
-                goto extract_raw_descriptors_quit;
+/* Helper function to verify that pca holds a valid basis. Returns 
+ * SIFT3D_SUCCESS if so, SIFT3D_FAILURE otherwise. */
+static int verify_SIFT3D_PCA(const SIFT3D_PCA *const pca) {
+
+        if (pca->mean.type != FLOAT || pca->basis.type != FLOAT ||
+                pca->mean.num_rows != 1 || 
+                pca->mean.num_cols != DESC_NUMEL ||
+                pca->basis.num_cols != DESC_NUMEL ||
+                pca->basis.num_rows < 1 || 
+                pca->basis.num_rows > DESC_NUMEL) {
+                SIFT3D_ERR("verify_SIFT3D_PCA: invalid PCA basis. Make sure "
+                        "it was learned by learn_SIFT3D_PCA or read by "
+                        "read_SIFT3D_PCA. \n");
+                return SIFT3D_FAILURE;
+        }
 
-        // Convert keypoints to the base scale and octave
-        for (i = 0; i < kp->slab.num; i++) {
+        return SIFT3D_SUCCESS;
+}
 
-                const Keypoint *const src = kp->buf + i;
-                Keypoint *const dst = kp_base.buf + i; 
+/* Helper function to project a row of DESC_NUMEL histogram elements onto 
+ * a PCA basis, writing pca->basis.num_rows elements to proj. */
+static void pca_project_row(const SIFT3D_PCA *const pca, 
+        const float *const row, float *const proj) {
 
-                if (keypoint2base(src, dst))
-                        goto extract_raw_descriptors_quit;
+        float centered[DESC_NUMEL];
+        int i, k;
+
+        const float *const mean = pca->mean.u.data_float;
+
+        for (k = 0; k < DESC_NUMEL; k++) {
+                centered[k] = row[k] - mean[k];
         }
 
-        // Extract the descriptors
-        if (_SIFT3D_extract_descriptors(sift3d, &pyr, &kp_base, desc))
-                goto extract_raw_descriptors_quit;
+        for (i = 0; i < pca->basis.num_rows; i++) {
 
-        // Clean up
-        cleanup_Pyramid(&pyr);
-        cleanup_Keypoint_store(&kp_base);
+                const float *const axis = &SIFT3D_MAT_RM_GET(&pca->basis, i,
+                        0, float);
+                float dot;
 
-        return SIFT3D_SUCCESS;
+                dot = 0.0f;
+                for (k = 0; k < DESC_NUMEL; k++) {
+                        dot += axis[k] * centered[k];
+                }
+                proj[i] = dot;
+        }
+}
 
-extract_raw_descriptors_quit:
-        cleanup_Pyramid(&pyr);
-        cleanup_Keypoint_store(&kp_base);
-        return SIFT3D_FAILURE;
+/* Helper function to quantize a histogram element. */
+static unsigned char quantize_desc_val(const float val) {
+
+        const double scaled = val * SIFT3D_desc_quant_scale + 0.5;
+
+        if (scaled <= 0.0)
+                return 0;
+        if (scaled >= 255.0)
+                return 255;
+        return (unsigned char) scaled;
 }
 
-/* Helper funciton to extract SIFT3D descriptors from a list of keypoints and 
- * an image. Called by SIFT3D_extract_descriptors and 
- * SIFT3D_extract_raw_descriptors.
+/* Convert a list of matches to matrices of point coordinates.
+ * Only valid matches will be included in the output matrices.
  *
- * parameters:
- *  sift3d - (initialized) struct defining the algorithm parameters
- *  gpyr - A Gaussian Scale-Space pyramid containing the image data
- *  kp - keypoint list populated by a feature detector 
- *  desc - (initialized) struct to hold the descriptors
- *  use_gpyr - see im for details */
-static int _SIFT3D_extract_descriptors(SIFT3D *const sift3d, 
-        const Pyramid *const gpyr, const Keypoint_store *const kp, 
-        SIFT3D_Descriptor_store *const desc) {
+ * The format of "matches" is specified in SIFT3D_nn_match.
+ *
+ * All matrices must be initialized prior to calling this function.
+ *
+ * Output format:
+ *  m x 3 matrices [x11 y11 z11] [x21 y21 z21]
+ * 		   |x12 y12 z12| |x22 y22 z22|
+ *		        ...	      ...
+ * 		   [x1N y1N z1N] [x2N y2N z2N] 
+ *
+ * Where points on corresponding rows are matches. */
+int SIFT3D_matches_to_Mat_rm(SIFT3D_Descriptor_store *d1,
+			     SIFT3D_Descriptor_store *d2,
+			     const int *const matches,
+			     Mat_rm *const match1, 
+			     Mat_rm *const match2) {
+    int i, num_matches;
 
-	int i, ret;
+    const int num = d1->num;
 
-	const Image *const first_level = 
-                SIFT3D_PYR_IM_GET(gpyr, gpyr->first_octave, gpyr->first_level);
+    // Resize matrices 
+    match1->num_rows = match2->num_rows = d1->num;
+    match1->num_cols = match2->num_cols = 3;
+    match1->type = match2->type = DOUBLE;
+    if (resize_Mat_rm(match1) || resize_Mat_rm(match2))
+	    return SIFT3D_FAILURE;
 
-	const int num = kp->slab.num;
+    // Populate the matrices
+    num_matches = 0;
+    for (i = 0; i < num; i++) {
 
-	// Initialize the metadata 
-	desc->nx = first_level->nx;	
-	desc->ny = first_level->ny;	
-	desc->nz = first_level->nz;	
+	    const SIFT3D_Descriptor *const desc1 = d1->buf + i;
+	    const SIFT3D_Descriptor *const desc2 = d2->buf + matches[i];
 
-	// Resize the descriptor store (num cannot be zero)
-	desc->num = num;
-	if ((desc->buf = (SIFT3D_Descriptor *) SIFT3D_safe_realloc(desc->buf, 
-		num * sizeof(SIFT3D_Descriptor))) == NULL)
-                return SIFT3D_FAILURE;
+	    if (matches[i] == -1)
+		    continue;
 
-        // Extract the descriptors
-        ret = SIFT3D_SUCCESS;
-#pragma omp parallel for
-	for (i = 0; i < desc->num; i++) {
+	    // Save the match
+	    SIFT3D_MAT_RM_GET(match1, num_matches, 0, double) = desc1->xd; 
+	    SIFT3D_MAT_RM_GET(match1, num_matches, 1, double) = desc1->yd; 
+	    SIFT3D_MAT_RM_GET(match1, num_matches, 2, double) = desc1->zd; 
+	    SIFT3D_MAT_RM_GET(match2, num_matches, 0, double) = desc2->xd; 
+	    SIFT3D_MAT_RM_GET(match2, num_matches, 1, double) = desc2->yd; 
+	    SIFT3D_MAT_RM_GET(match2, num_matches, 2, double) = desc2->zd; 
+	    num_matches++;
+    }
 
-                const Keypoint *const key = kp->buf + i;
-		SIFT3D_Descriptor *const descrip = desc->buf + i;
-		const Image *const level = 
-                        SIFT3D_PYR_IM_GET(gpyr, key->o, key->s);
+    // Release extra memory
+    match1->num_rows = match2->num_rows = num_matches;
+    if (resize_Mat_rm(match1) || resize_Mat_rm(match2))
+	    return SIFT3D_FAILURE;
+    
+    return SIFT3D_SUCCESS;
+}
 
-		if (extract_descrip(sift3d, level, key, descrip)) {
-                        ret = SIFT3D_FAILURE;
-                }
-	}	
+/* Perform nearest neighbor matching on two sets of
+ * SIFT descriptors.
+ *
+ * This function will reallocate *matches. As such, *matches must be either
+ * NULL or a pointer to previously-allocated array. Upon successful exit,
+ * *matches is an array of size d1->num.
+ *
+ * On return, the ith element of matches contains the index in d2 of the match
+ * corresponding to the ith descriptor in d1, or -1 if no match was found.
+ *
+ * This converts the stores to SIFT3D_Descriptor_soa, and calls
+ * SIFT3D_nn_match_soa.
+ *
+ * You might consider using SIFT3D_matches_to_Mat_rm to convert the matches to
+ * coordinate matrices. */
+int SIFT3D_nn_match(const SIFT3D_Descriptor_store *const d1,
+		    const SIFT3D_Descriptor_store *const d2,
+		    const float nn_thresh, int **const matches) {
+        return nn_match_store(d1, d2, nn_thresh, 0, matches);
+}
 
-	return ret;
+/* Approximate version of SIFT3D_nn_match. This converts the stores to
+ * SIFT3D_Descriptor_soa, and calls SIFT3D_nn_match_approx_soa. */
+int SIFT3D_nn_match_approx(const SIFT3D_Descriptor_store *const d1,
+		    const SIFT3D_Descriptor_store *const d2,
+		    const float nn_thresh, const int checks,
+                    int **const matches) {
+
+        if (checks < 1) {
+		SIFT3D_ERR("SIFT3D_nn_match_approx: invalid number of "
+			"checks: %d \n", checks);
+		return SIFT3D_FAILURE;
+        }
+
+        return nn_match_store(d1, d2, nn_thresh, checks, matches);
 }
 
-/* L2-normalize a histogram */
-static void normalize_hist(Hist *const hist) {
+/* Helper function for SIFT3D_nn_match and SIFT3D_nn_match_approx. Matches
+ * exactly if checks is zero, otherwise approximately. */
+static int nn_match_store(const SIFT3D_Descriptor_store *const d1,
+        const SIFT3D_Descriptor_store *const d2, const float nn_thresh,
+        const int checks, int **const matches) {
 
-        double norm;
-        float norm_inv;
-        int a, p;
+        SIFT3D_Descriptor_soa soa1, soa2;
+        int ret;
 
-        norm = 0.0;
-        HIST_LOOP_START(a, p)
-                const float el = HIST_GET(hist, a, p);
-                norm += (double) el * el;
-        HIST_LOOP_END
+        init_SIFT3D_Descriptor_soa(&soa1);
+        init_SIFT3D_Descriptor_soa(&soa2);
+
+        if (SIFT3D_Descriptor_store_to_soa(d1, &soa1) ||
+                SIFT3D_Descriptor_store_to_soa(d2, &soa2)) {
+                ret = SIFT3D_FAILURE;
+        } else if (checks > 0) {
+                ret = SIFT3D_nn_match_approx_soa(&soa1, &soa2, nn_thresh,
+                        checks, matches);
+        } else {
+                ret = SIFT3D_nn_match_soa(&soa1, &soa2, nn_thresh, matches);
+        }
 
-        norm = sqrt(norm) + DBL_EPSILON;
-        norm_inv = 1.0f / norm; 
+        cleanup_SIFT3D_Descriptor_soa(&soa1);
+        cleanup_SIFT3D_Descriptor_soa(&soa2);
 
-        HIST_LOOP_START(a, p)
-                 HIST_GET(hist, a, p) *= norm_inv; 
-        HIST_LOOP_END 
+        return ret;
 }
 
-/* Dense gradient histogram postprocessing steps */
-static void postproc_Hist(Hist *const hist, const float norm) {
-
-        int a, p;
+/* As SIFT3D_nn_match, but for descriptors stored in SIFT3D_Descriptor_soa.
+ * d1 and d2 must have the same dim, so this also matches descriptors
+ * projected by SIFT3D_PCA_project.
+ *
+ * The search is exhaustive. The squared distances are computed in tiles, as
+ * ||a||^2 + ||b||^2 - 2 * A * B^T, where the products are matrix
+ * multiplications by BLAS, directly on the histograms of d1 and d2. Each
+ * tile updates the nearest and second-nearest neighbors of its rows and
+ * columns at once, so that the forward and backward matches come from a
+ * single pass. The ratio test is then applied to the exact distances of the
+ * two candidates. Thus, the matches agree with those of exhaustive matching
+ * up to float rounding of the candidates. */
+int SIFT3D_nn_match_soa(const SIFT3D_Descriptor_soa *const d1,
+		    const SIFT3D_Descriptor_soa *const d2,
+		    const float nn_thresh, int **const matches) {
 
-        const float hist_trunc = trunc_thresh * DESC_NUMEL / HIST_NUMEL;
+        NN_pair *pairs1, *pairs2;
+        float *norms1, *norms2;
+        int i, j, num_threads, num_tiles, ret;
 
-	// Histogram refinement steps
-	refine_Hist(hist);
+	const int num = d1->num;
+        const int num2 = d2->num;
+        const int dim = d1->dim;
 
-	// Normalize the descriptor
-	normalize_hist(hist);
+        // Verify inputs
+	if (num < 1) {
+		SIFT3D_ERR("_SIFT3D_nn_match: invalid number of "
+			"descriptors in d1: %d \n", num);
+		return SIFT3D_FAILURE;
+	}
+        if (d2->dim != dim) {
+		SIFT3D_ERR("_SIFT3D_nn_match: mismatched descriptor "
+			"lengths: %d, %d \n", dim, d2->dim);
+		return SIFT3D_FAILURE;
+        }
 
-	// Truncate
-	HIST_LOOP_START(a, p)
-		HIST_GET(hist, a, p) = SIFT3D_MIN(HIST_GET(hist, a, p), 
-					   hist_trunc);
-	HIST_LOOP_END
+	// Resize the matches array (num cannot be zero)
+	if ((*matches = (int *) SIFT3D_safe_realloc(*matches,
+		num * sizeof(int))) == NULL) {
+	    SIFT3D_ERR("_SIFT3D_nn_match: out of memory! \n");
+	    return SIFT3D_FAILURE;
+	}
 
-	// Normalize again
-	normalize_hist(hist);
+	for (i = 0; i < num; i++) {
+	    // Mark -1 to signal there is no match
+	    (*matches)[i] = -1;
+	}
 
-        // Convert to the desired norm
-        HIST_LOOP_START(a, p)
-                HIST_GET(hist, a, p) *= norm;
-        HIST_LOOP_END
-}
+        // Nothing can match an empty d2
+        if (num2 < 1)
+                return SIFT3D_SUCCESS;
 
-/* Helper routine to extract a single SIFT3D histogram, with rotation. */
-static int extract_dense_descrip_rotate(SIFT3D *const sift3d, 
-           const Image *const im, const Cvec *const vcenter, 
-           const double sigma, const Mat_rm *const R, Hist *const hist) {
+#ifdef _OPENMP
+        num_threads = omp_get_max_threads();
+#else
+        num_threads = 1;
+#endif
 
-        float buf[IM_NDIMS * IM_NDIMS];
-        Mat_rm Rt;
-	Cvec grad, grad_rot, bary, vim;
-	float sq_dist, mag, weight;
-SIFT3D_IGNORE_UNUSED
-	int a, p, x, y, z, bin;
+        // Allocate the candidates and norms
+        norms1 = norms2 = NULL;
+        if (init_NN_pairs(num, num2, num_threads, &pairs1, &pairs2) ||
+                (norms1 = (float *) malloc(num * sizeof(float))) == NULL ||
+                (norms2 = (float *) malloc(num2 * sizeof(float))) == NULL) {
+                SIFT3D_ERR("_SIFT3D_nn_match: out of memory! \n");
+                ret = SIFT3D_FAILURE;
+                goto nn_match_quit;
+        }
 
-        const Mesh *const mesh = &sift3d->mesh;
-	const float win_radius = desc_rad_fctr * sigma;
+        // Take the squared norms
+        for (i = 0; i < num; i++) {
+                norms1[i] = desc_row_norm_sq(d1->hists +
+                        (size_t) i * dim, dim);
+        }
+        for (j = 0; j < num2; j++) {
+                norms2[j] = desc_row_norm_sq(d2->hists +
+                        (size_t) j * dim, dim);
+        }
 
-        // Invert the rotation matrix
-        if (init_Mat_rm_p(&Rt, buf, IM_NDIMS, IM_NDIMS, FLOAT, SIFT3D_FALSE) ||
-                transpose_Mat_rm(R, &Rt))
-                return SIFT3D_FAILURE;
+        // Compare each tile of rows to all of d2
+        num_tiles = (num + nn_tile_rows - 1) / nn_tile_rows;
+        ret = SIFT3D_SUCCESS;
+#pragma omp parallel shared(ret) num_threads(num_threads)
+{
+        Mat_rm tile1, tile2, dist;
+        int t;
 
-	// Zero the descriptor
-        hist_zero(hist);
+#ifdef _OPENMP
+        NN_pair *const cols = pairs2 + (size_t) omp_get_thread_num() * num2;
+#else
+        NN_pair *const cols = pairs2;
+#endif
 
-	// Iterate over a sphere window in real-world coordinates
-	IM_LOOP_SPHERE_START(im, x, y, z, vcenter, win_radius, &vim, sq_dist)
+        const int dist_err = init_Mat_rm(&dist, 0, 0, FLOAT, SIFT3D_FALSE);
 
-		// Take the gradient and rotate
-		IM_GET_GRAD_ISO(im, x, y, z, 0, &grad);
-		SIFT3D_MUL_MAT_RM_CVEC(&Rt, &grad, &grad_rot);
+        if (dist_err)
+                ret = SIFT3D_FAILURE;
 
-                // Get the index of the intersecting face
-                if (icos_hist_bin(sift3d, &grad_rot, &bary, &bin))
-                        continue;
+        // Static scheduling keeps the rows of each thread in ascending order,
+        // so that ties go to the first index, as in exhaustive search
+#pragma omp for schedule(static)
+        for (t = 0; t < num_tiles; t++) {
 
-                // Get the magnitude of the vector
-                mag = SIFT3D_CVEC_L2_NORM(&grad);
+                int j0, i, j;
 
-		// Get the Gaussian window weight
-		weight = expf(-0.5f * sq_dist / (sigma * sigma));
+                const int start1 = t * nn_tile_rows;
+                const int num1 = SIFT3D_MIN(num - start1, nn_tile_rows);
 
-                // Interpolate over three vertices
-                MESH_HIST_GET(mesh, hist, bin, 0) += mag * weight * bary.x;
-                MESH_HIST_GET(mesh, hist, bin, 1) += mag * weight * bary.y;
-                MESH_HIST_GET(mesh, hist, bin, 2) += mag * weight * bary.z;
+                if (dist_err)
+                        continue;
 
-	IM_LOOP_SPHERE_END
+                // Alias the rows of d1
+                if (init_Mat_rm_p(&tile1, d1->hists + (size_t) start1 *
+                        dim, num1, dim, FLOAT, SIFT3D_FALSE)) {
+                        ret = SIFT3D_FAILURE;
+                        continue;
+                }
 
-        return SIFT3D_SUCCESS;
-}
+                for (j0 = 0; j0 < num2; j0 += nn_tile_cols) {
 
-/* Get a descriptor with a single histogram at each voxel of an image.
- * The result is an image with HIST_NUMEL channels, where each channel is a
- * bin of the histogram.
- *
- * Parameters:
- * -sift3d Stores the algorithm parameters.
- * -in The input image.
- * -desc The output image of descriptors.
- */
-int SIFT3D_extract_dense_descriptors(SIFT3D *const sift3d, 
-        const Image *const in, Image *const desc) {
+                        const int num_cols = SIFT3D_MIN(num2 - j0,
+                                nn_tile_cols);
 
-        int (*extract_fun)(SIFT3D *const, const Image *const, Image *const);
-        Image in_smooth;
-        int x, y, z;
+                        // Multiply by the rows of d2
+                        if (init_Mat_rm_p(&tile2, d2->hists +
+                                (size_t) j0 * dim, num_cols,
+                                dim, FLOAT, SIFT3D_FALSE) ||
+                                mul_Mat_rm_trans(&tile1, &tile2, &dist)) {
+                                ret = SIFT3D_FAILURE;
+                                break;
+                        }
 
-        // Verify inputs
-        if (in->nc != 1) {
-                SIFT3D_ERR("SIFT3D_extract_dense_descriptors: invalid "
-                        "number of channels: %d. This function only supports "
-                        "single-channel images. \n", in->nc);
-                return SIFT3D_FAILURE;
-        }
+                        // Update the candidates of the rows and columns
+                        for (i = 0; i < num1; i++) {
 
-        // Select the appropriate subroutine
-        extract_fun = sift3d->dense_rotate ? 
-                extract_dense_descriptors_rotate :
-                extract_dense_descriptors_no_rotate;
+                                NN_pair *const row = pairs1 + start1 + i;
 
-        // Resize the output image
-        memcpy(SIFT3D_IM_GET_DIMS(desc), SIFT3D_IM_GET_DIMS(in), 
-                IM_NDIMS * sizeof(int));
-        desc->nc = HIST_NUMEL;
-        im_default_stride(desc);
-        if (im_resize(desc))
-                return SIFT3D_FAILURE;
+                                for (j = 0; j < num_cols; j++) {
 
-        // Intialize intermediates
-        init_im(&in_smooth);
+                                        const float ssd = norms1[start1 + i] +
+                                                norms2[j0 + j] - 2.0f *
+                                                SIFT3D_MAT_RM_GET(&dist, i, j,
+                                                        float);
 
-        //TODO: Interpolate to be isotropic
+                                        update_NN_pair(row, ssd, j0 + j);
+                                        update_NN_pair(cols + j0 + j, ssd,
+                                                start1 + i);
+                                }
+                        }
+                }
+        }
 
-        // Smooth the input image
-        if (smooth_raw_input(sift3d, in, &in_smooth))
-                goto extract_dense_quit;
+        if (!dist_err)
+                cleanup_Mat_rm(&dist);
+}
+        if (ret) {
+                SIFT3D_ERR("_SIFT3D_nn_match: failed to compute the "
+                        "distances \n");
+                goto nn_match_quit;
+        }
 
-        // Extract the descriptors
-        if (extract_fun(sift3d, &in_smooth, desc))
-                return SIFT3D_FAILURE;
+        // Merge the columns of each thread, in order
+        merge_NN_cols(pairs2, num2, num_threads);
 
-        // Post-process the descriptors
-        SIFT3D_IM_LOOP_START(desc, x, y, z)
+        // Apply the ratio test and check forward-backward consistency
+#pragma omp parallel for
+	for (i = 0; i < num; i++) {
 
-                Hist hist;
+                int *const match = *matches + i;
 
-                // Get the image intensity at this voxel 
-                const float val = SIFT3D_IM_GET_VOX(in, x, y, z, 0);
+                // Forward matching pass
+                *match = decide_NN_pair(pairs1 + i, d1, i, d2, nn_thresh);
 
-                // Copy to a Hist
-                vox2hist(desc, x, y, z, &hist);
+                // We are done if there was no match
+                if (*match < 0)
+                        continue;
 
-                // Post-process
-                postproc_Hist(&hist, val);
+                // Check for forward-backward consistency
+                if (decide_NN_pair(pairs2 + *match, d2, *match, d1,
+                        nn_thresh) != i) {
+                        *match = -1;
+                }
+        }
 
-                // Copy back to the image
-                hist2vox(&hist, desc, x, y, z);
+nn_match_quit:
+        if (pairs1 != NULL)
+                free(pairs1);
+        if (pairs2 != NULL)
+                free(pairs2);
+        if (norms1 != NULL)
+                free(norms1);
+        if (norms2 != NULL)
+                free(norms2);
 
-        SIFT3D_IM_LOOP_END
+	return ret;
+}
 
-        // TODO transform back to original space
+/* Helper function to compute the squared norm of a row of histograms,
+ * which has dim elements. */
+static float desc_row_norm_sq(const float *const row, const int dim) {
 
-        // Clean up
-        im_free(&in_smooth);
+        float sq;
+        int k;
 
-        return SIFT3D_SUCCESS;
+        sq = 0.0f;
+        for (k = 0; k < dim; k++) {
+                sq += row[k] * row[k];
+        }
 
-extract_dense_quit:
-        im_free(&in_smooth);
-        return SIFT3D_FAILURE;
+        return sq;
 }
 
-/* Helper function for SIFT3D_extract_dense_descriptors, without rotation 
- * invariance. This function is much faster than its rotation-invariant 
- * counterpart because histogram bins are pre-computed. */
-static int extract_dense_descriptors_no_rotate(SIFT3D *const sift3d,
-        const Image *const in, Image *const desc) {
+/* Initialize an NN_pair with no candidates. */
+static void init_NN_pair(NN_pair *const pair) {
+        pair->best = pair->nearest = -1;
+        pair->ssd_best = pair->ssd_nearest = FLT_MAX;
+}
 
-        Image temp; 
-        Gauss_filter gauss;
-	Cvec grad, bary;
-        int x, y, z, bin;
+/* Update the candidates of pair with descriptor idx, at squared distance
+ * ssd. Ties go to the earlier candidate. */
+static void update_NN_pair(NN_pair *const pair, const float ssd,
+        const int idx) {
+
+        if (ssd < pair->ssd_best) {
+                pair->nearest = pair->best;
+                pair->ssd_nearest = pair->ssd_best;
+                pair->best = idx;
+                pair->ssd_best = ssd;
+        } else if (ssd < pair->ssd_nearest) {
+                pair->nearest = idx;
+                pair->ssd_nearest = ssd;
+        }
+}
 
-        const int x_start = 1;
-        const int y_start = 1;
-        const int z_start = 1;
-        const int x_end = in->nx - 2;
-        const int y_end = in->ny - 2;
-        const int z_end = in->nz - 2;
+/* Merge the candidates of src into dst. The candidates of src must come
+ * after those of dst, for ties to go to the earlier candidate. */
+static void merge_NN_pair(NN_pair *const dst, const NN_pair *const src) {
+        if (src->best >= 0)
+                update_NN_pair(dst, src->ssd_best, src->best);
+        if (src->nearest >= 0)
+                update_NN_pair(dst, src->ssd_nearest, src->nearest);
+}
 
-        Mesh * const mesh = &sift3d->mesh;
-        const double sigma_win = sift3d->gpyr.sigma0 * desc_sig_fctr / 
-                                 NHIST_PER_DIM;
-        const double unit = 1.0;
+/* Helper function to compute the SSD of two rows of dim histogram elements
+ * in double precision. */
+static double desc_row_ssd(const float *const row1, const float *const row2,
+        const int dim) {
 
-        // Initialize the intermediate image
-        init_im(&temp);
-        if (im_copy_dims(desc, &temp))
-                return SIFT3D_FAILURE;
+        double ssd;
+        int k;
 
-        // Initialize the filter
-        if (init_Gauss_filter(&gauss, sigma_win, 3)) {
-                im_free(&temp);
-                return SIFT3D_FAILURE;
+        ssd = 0.0;
+        for (k = 0; k < dim; k++) {
+                const double diff = (double) row1[k] - (double) row2[k];
+                ssd += diff * diff;
         }
 
-        // Initialize the descriptors for each voxel
-        im_zero(&temp);
-        SIFT3D_IM_LOOP_LIMITED_START(in, x, y, z, x_start, x_end, y_start, 
-                y_end, z_start, z_end)
-
-                // Take the gradient
-		IM_GET_GRAD_ISO(in, x, y, z, 0, &grad);
+        return ssd;
+}
 
-                // Get the index of the intersecting face
-                if (icos_hist_bin(sift3d, &grad, &bary, &bin))
-                        continue;
+/* Helper function to match descriptor idx of query against those of store,
+ * given the candidates in pair. Applies the ratio test to the exact
+ * distances of the candidates. Returns the index of the match, or -1 if
+ * none was found. */
+static int decide_NN_pair(const NN_pair *const pair,
+        const SIFT3D_Descriptor_soa *const query, const int idx,
+        const SIFT3D_Descriptor_soa *const store, const float nn_thresh) {
 
-                // Initialize each vertex
-                SIFT3D_IM_GET_VOX(&temp, x, y, z, MESH_GET_IDX(mesh, bin, 0)) = 
-                        bary.x;
-                SIFT3D_IM_GET_VOX(&temp, x, y, z, MESH_GET_IDX(mesh, bin, 1)) = 
-                        bary.y;
-                SIFT3D_IM_GET_VOX(&temp, x, y, z, MESH_GET_IDX(mesh, bin, 2)) = 
-                        bary.z;
+        double ssd_best, ssd_nearest;
+        int best;
 
-        SIFT3D_IM_LOOP_END
+        const int dim = query->dim;
+        const float *const row = query->hists + (size_t) idx * dim;
 
-        // Filter the descriptors
-	if (apply_Sep_FIR_filter(&temp, desc, &gauss.f, unit))
-                goto dense_extract_quit;
+        if (pair->best < 0)
+                return -1;
 
-        // Clean up
-        im_free(&temp);
-        cleanup_Gauss_filter(&gauss);
+        // Recompute the distances
+        ssd_best = desc_row_ssd(row, store->hists + (size_t) pair->best *
+                dim, dim);
+        ssd_nearest = pair->nearest < 0 ? DBL_MAX : desc_row_ssd(row, 
+                store->hists + (size_t) pair->nearest * dim, dim);
 
-        return SIFT3D_SUCCESS;
+        // Apply the ratio test
+        if ((best = ratio_test_NN_pair(pair, ssd_best, ssd_nearest, 
+                nn_thresh)) < 0)
+                return -1;
 
-dense_extract_quit:
-        im_free(&temp);
-        cleanup_Gauss_filter(&gauss);
-        return SIFT3D_FAILURE;
+#ifdef SIFT3D_MATCH_MAX_DIST
+        // Reject matches of great distance
+        if (match_too_far(query->coords + IM_NDIMS * idx, 
+                store->coords + IM_NDIMS * best, store->nx, store->ny,
+                store->nz))
+                return -1;
+#endif
+        // The match was a success
+        return best;
 }
 
-/* Copy a voxel to a Hist. Does no bounds checking. */
-static void vox2hist(const Image *const im, const int x, const int y,
-        const int z, Hist *const hist) {
+/* Helper function to allocate and initialize the candidates of num rows in
+ * *pairs1, and of num2 columns in *pairs2, with a copy of the columns for
+ * each of num_threads threads. The caller must free both arrays, even on
+ * failure, in which case either may be NULL. */
+static int init_NN_pairs(const int num, const int num2, const int num_threads,
+        NN_pair **const pairs1, NN_pair **const pairs2) {
 
-        int c;
+        size_t j;
+        int i;
 
-        for (c = 0; c < HIST_NUMEL; c++) {
-                hist->bins[c] = SIFT3D_IM_GET_VOX(im, x, y, z, c);
+        const size_t num_cols = (size_t) num_threads * num2;
+
+        *pairs2 = NULL;
+        if ((*pairs1 = (NN_pair *) malloc(num * sizeof(NN_pair))) == NULL ||
+                (*pairs2 = (NN_pair *) malloc(num_cols * 
+                        sizeof(NN_pair))) == NULL)
+                return SIFT3D_FAILURE;
+
+        for (i = 0; i < num; i++) {
+                init_NN_pair(*pairs1 + i);
         }
+        for (j = 0; j < num_cols; j++) {
+                init_NN_pair(*pairs2 + j);
+        }
+
+        return SIFT3D_SUCCESS;
 }
 
-/* Copy a Hist to a voxel. Does no bounds checking. */
-static void hist2vox(Hist *const hist, const Image *const im, const int x, 
-        const int y, const int z) {
+/* Helper function to merge the columns of each thread into those of the
+ * first, in thread order. See init_NN_pairs. */
+static void merge_NN_cols(NN_pair *const pairs2, const int num2, 
+        const int num_threads) {
 
-        int c;
-        
-        for (c = 0; c < HIST_NUMEL; c++) {
-                SIFT3D_IM_GET_VOX(im, x, y, z, c) = hist->bins[c];
+        int t, j;
+
+        for (t = 1; t < num_threads; t++) {
+                for (j = 0; j < num2; j++) {
+                        merge_NN_pair(pairs2 + j,
+                                pairs2 + (size_t) t * num2 + j);
+                }
         }
 }
 
-/* As in extract_dense_descrip, but with rotation invariance */
-static int extract_dense_descriptors_rotate(SIFT3D *const sift3d,
-        const Image *const in, Image *const desc) {
+/* Helper function to apply the ratio test to the candidates in pair, given
+ * their exact squared distances, re-ordering them if needed. ssd_nearest
+ * is ignored if there is no second candidate. Returns the index of the 
+ * match, or -1 if none was found. */
+static int ratio_test_NN_pair(const NN_pair *const pair, double ssd_best,
+        double ssd_nearest, const float nn_thresh) {
 
-        Hist hist;
-        Mat_rm R, Id;
-        Mat_rm *ori;
-        int i, x, y, z;
+        int best;
 
-        // Initialize the identity matrix
-        if (init_Mat_rm(&Id, 3, 3, FLOAT, SIFT3D_TRUE)) {
-                return SIFT3D_FAILURE;
-        }
-        for (i = 0; i < 3; i++) {       
-                SIFT3D_MAT_RM_GET(&Id, i, i, float) = 1.0f;
-        }
+        if (pair->best < 0)
+                return -1;
 
-        // Initialize the rotation matrix
-        if (init_Mat_rm(&R, 3, 3, FLOAT, SIFT3D_TRUE)) {
-                cleanup_Mat_rm(&Id);
-                return SIFT3D_FAILURE;
+        best = pair->best;
+        if (pair->nearest < 0) {
+                ssd_nearest = DBL_MAX;
+        } else if (ssd_nearest < ssd_best || (ssd_nearest == ssd_best &&
+                pair->nearest < best)) {
+
+                const double temp = ssd_best;
+
+                best = pair->nearest;
+                ssd_best = ssd_nearest;
+                ssd_nearest = temp;
         }
 
-        // Iterate over each voxel
-        SIFT3D_IM_LOOP_START(in, x, y, z)
+        // Reject a match if the nearest neighbor is too close
+        if (ssd_best / ssd_nearest > nn_thresh * nn_thresh)
+                        return -1;
 
-                const Cvec vcenter = {x, y, z}; 
+        return best;
+}
 
-                const double ori_sigma = sift3d->gpyr.sigma0 * ori_sig_fctr;
-                const double desc_sigma = sift3d->gpyr.sigma0 * 
-                        desc_sig_fctr / NHIST_PER_DIM;
+#ifdef SIFT3D_MATCH_MAX_DIST
+/* Helper function to check if the match of the features at coords1 and
+ * coords2 is too far apart, in an image of dimensions [nx, ny, nz]. */
+static int match_too_far(const double *const coords1, 
+        const double *const coords2, const int nx, const int ny, 
+        const int nz) {
 
-                // Attempt to assign an orientation
-                switch (assign_orientation_thresh(in, &vcenter, ori_sigma,
-                                      sift3d->corner_thresh, &R)) {
-                        case SIFT3D_SUCCESS:
-                                // Use the assigned orientation
-                                ori = &R;
-                                break;
-                        case REJECT:
-                                // Default to identity
-                                ori = &Id;
-                                break;
-                        default:
-                                // Unexpected error
-                                goto dense_rotate_quit;
-                }
+        Cvec dims, dmatch;
+        double dist_match;
 
-                // Extract the descriptor
-                if (extract_dense_descrip_rotate(sift3d, in, &vcenter, 
-                        desc_sigma, ori, &hist))
-                        goto dense_rotate_quit;
+        // Compute spatial distance rejection threshold
+        dims.x = (float) nx;
+        dims.y = (float) ny;
+        dims.z = (float) nz;
+        const double diag = SIFT3D_CVEC_L2_NORM(&dims);
+        const double dist_thresh = diag * SIFT3D_MATCH_MAX_DIST;
 
-                // Copy the descriptor to the image channels
-                hist2vox(&hist, desc, x, y, z);
+        // Compute the spatial distance of the match
+        dmatch.x = (float) (coords2[0] - coords1[0]);
+        dmatch.y = (float) (coords2[1] - coords1[1]);
+        dmatch.z = (float) (coords2[2] - coords1[2]);
+        dist_match = (double) SIFT3D_CVEC_L2_NORM(&dmatch);
 
-        SIFT3D_IM_LOOP_END
+        return dist_match > dist_thresh;
+}
+#endif
 
-        // Clean up
-        cleanup_Mat_rm(&R);
-        cleanup_Mat_rm(&Id);
-        return SIFT3D_SUCCESS;
+/* As SIFT3D_nn_match, but for quantized descriptors. 
+ *
+ * The search is exhaustive, computing the squared distances in integer
+ * arithmetic, 16 bytes at a time where SSE2 is available. d1 and d2 are
+ * compared in tiles which fit in cache, each updating the nearest and 
+ * second-nearest neighbors of its rows and columns at once, as in 
+ * SIFT3D_nn_match_soa. The distances are exact, so the matches differ from
+ * those of the float descriptors only by quantization. */
+int SIFT3D_nn_match_u8(const SIFT3D_Descriptor_u8 *const d1,
+		    const SIFT3D_Descriptor_u8 *const d2,
+		    const float nn_thresh, int **const matches) {
 
-dense_rotate_quit:
-        // Clean up and return an error condition 
-        cleanup_Mat_rm(&R);
-        cleanup_Mat_rm(&Id);
-        return SIFT3D_FAILURE;
-}
+        NN_pair *pairs1, *pairs2;
+        int i, num_threads, num_tiles, ret;
 
-/* Convert a keypoint store to a matrix. 
- * Output format:
- *  [x1 y1 z1]
- *  |   ...  |
- *  [xn yn zn] 
- * 
- * mat must be initialized. */
-int Keypoint_store_to_Mat_rm(const Keypoint_store *const kp, Mat_rm *const mat) {
+	const int num = d1->num;
+        const int num2 = d2->num;
 
-    int i;
+        // Verify inputs
+	if (num < 1) {
+		SIFT3D_ERR("SIFT3D_nn_match_u8: invalid number of "
+			"descriptors in d1: %d \n", num);
+		return SIFT3D_FAILURE;
+	}
 
-    const int num = kp->slab.num;
+	// Resize the matches array (num cannot be zero)
+	if ((*matches = (int *) SIFT3D_safe_realloc(*matches,
+		num * sizeof(int))) == NULL) {
+	    SIFT3D_ERR("SIFT3D_nn_match_u8: out of memory! \n");
+	    return SIFT3D_FAILURE;
+	}
 
-    // Resize mat
-    mat->num_rows = num;
-    mat->num_cols = IM_NDIMS;
-    mat->type = DOUBLE;
-    if (resize_Mat_rm(mat))
-	return SIFT3D_FAILURE;
+	for (i = 0; i < num; i++) {
+	    // Mark -1 to signal there is no match
+	    (*matches)[i] = -1;
+	}
 
-    // Build the matrix
-    for (i = 0; i < num; i++) {
+        // Nothing can match an empty d2
+        if (num2 < 1)
+                return SIFT3D_SUCCESS;
 
-        const Keypoint *const key = kp->buf + i;
+#ifdef _OPENMP
+        num_threads = omp_get_max_threads();
+#else
+        num_threads = 1;
+#endif
 
-        // Adjust the coordinates to the base octave
-        const double coord_factor = pow(2.0, key->o);
+        // Allocate the candidates
+        if (init_NN_pairs(num, num2, num_threads, &pairs1, &pairs2)) {
+                SIFT3D_ERR("SIFT3D_nn_match_u8: out of memory! \n");
+                ret = SIFT3D_FAILURE;
+                goto nn_match_u8_quit;
+        }
 
-	SIFT3D_MAT_RM_GET(mat, i, 0, double) = coord_factor * key->xd;
-	SIFT3D_MAT_RM_GET(mat, i, 1, double) = coord_factor * key->yd;
-	SIFT3D_MAT_RM_GET(mat, i, 2, double) = coord_factor * key->zd;
-    }
+        // Compare each tile of rows to all of d2. Static scheduling keeps the
+        // rows of each thread in ascending order, so that ties go to the 
+        // first index, as in exhaustive search
+        num_tiles = (num + nn_u8_tile_rows - 1) / nn_u8_tile_rows;
+#pragma omp parallel for schedule(static) num_threads(num_threads)
+        for (i = 0; i < num_tiles; i++) {
 
-    return SIFT3D_SUCCESS;
-}
+                int j0, i1, j;
 
-/* Convert SIFT3D desriptors to a coordinate matrix. This function has the same
- * output format as Keypoint_store_to_Mat_rm */
-int SIFT3D_Descriptor_coords_to_Mat_rm(
-        const SIFT3D_Descriptor_store *const store, 
-        Mat_rm *const mat) {
+#ifdef _OPENMP
+                NN_pair *const cols = pairs2 + 
+                        (size_t) omp_get_thread_num() * num2;
+#else
+                NN_pair *const cols = pairs2;
+#endif
+                const int start1 = i * nn_u8_tile_rows;
+                const int end1 = SIFT3D_MIN(num, start1 + nn_u8_tile_rows);
 
-        int i;
+                for (j0 = 0; j0 < num2; j0 += nn_u8_tile_cols) {
 
-	const int num_rows = store->num;
-        const int num_cols = IM_NDIMS;
+                        const int end2 = SIFT3D_MIN(num2, 
+                                j0 + nn_u8_tile_cols);
 
-	// Verify inputs
-	if (num_rows < 1) {
-		printf("SIFT3D_Descriptor_coords_to_Mat_rm: invalid number of "
-		       "descriptors: %d \n", num_rows);
-		return SIFT3D_FAILURE;
-	}
+                        for (i1 = start1; i1 < end1; i1++) {
 
-        // Resize the output
-        mat->type = DOUBLE;
-        mat->num_rows = num_rows;
-        mat->num_cols = num_cols;
-        if (resize_Mat_rm(mat))
-                return SIFT3D_FAILURE;
+                                NN_pair *const row = pairs1 + i1;
+                                const unsigned char *const hists1 = 
+                                        d1->hists + (size_t) i1 * DESC_NUMEL;
 
-        // Copy the data
-        for (i = 0; i < num_rows; i++) {
+                                for (j = j0; j < end2; j++) {
 
-		const SIFT3D_Descriptor *const desc = store->buf + i;
+                                        const float ssd = (float) desc_u8_ssd(
+                                                hists1, d2->hists + 
+                                                (size_t) j * DESC_NUMEL);
 
-                SIFT3D_MAT_RM_GET(mat, i, 0, double) = desc->xd;
-                SIFT3D_MAT_RM_GET(mat, i, 1, double) = desc->yd;
-                SIFT3D_MAT_RM_GET(mat, i, 2, double) = desc->zd;
+                                        update_NN_pair(row, ssd, j);
+                                        update_NN_pair(cols + j, ssd, i1);
+                                }
+                        }
+                }
         }
 
-        return SIFT3D_SUCCESS;
-}
+        // Merge the columns of each thread, in order
+        merge_NN_cols(pairs2, num2, num_threads);
 
-/* Convert SIFT3D descriptors to a matrix.
- *
- * Output format:
- *  [x y z el0 el1 ... el767]
- * Each row is a feature descriptor. [x y z] are the coordinates in image
- * space, and [el0 el1 ... el767 are the 768 dimensions of the descriptor.
- *
- * mat must be initialized prior to calling this function. mat will be resized.
- * The type of mat will be changed to float.
- */
-int SIFT3D_Descriptor_store_to_Mat_rm(const SIFT3D_Descriptor_store *const store, 
-				      Mat_rm *const mat) {
-	int i, j, a, p;
+        // Apply the ratio test and check forward-backward consistency
+#pragma omp parallel for
+	for (i = 0; i < num; i++) {
 
-	const int num_rows = store->num;
-	const int num_cols = IM_NDIMS + DESC_NUMEL;
+                int *const match = *matches + i;
 
-	// Verify inputs
-	if (num_rows < 1) {
-		printf("SIFT3D_Descriptor_store_to_Mat_rm: invalid number of "
-		       "descriptors: %d \n", num_rows);
-		return SIFT3D_FAILURE;
-	}
+                // Forward matching pass
+                *match = decide_NN_pair_u8(pairs1 + i, d1, i, d2, nn_thresh);
 
-	// Resize inputs
-	mat->type = FLOAT;
-	mat->num_rows = num_rows;
-	mat->num_cols = num_cols;
-	if (resize_Mat_rm(mat))
-		return SIFT3D_FAILURE;
+                // We are done if there was no match
+                if (*match < 0)
+                        continue;
 
-	// Copy the data
-	for (i = 0; i < num_rows; i++) {
+                // Check for forward-backward consistency
+                if (decide_NN_pair_u8(pairs2 + *match, d2, *match, d1,
+                        nn_thresh) != i) {
+                        *match = -1;
+                }
+        }
+        ret = SIFT3D_SUCCESS;
 
-		const SIFT3D_Descriptor *const desc = store->buf + i;
+nn_match_u8_quit:
+        if (pairs1 != NULL)
+                free(pairs1);
+        if (pairs2 != NULL)
+                free(pairs2);
 
-		// Copy the coordinates
-		SIFT3D_MAT_RM_GET(mat, i, 0, float) = (float) desc->xd;
-		SIFT3D_MAT_RM_GET(mat, i, 1, float) = (float) desc->yd;
-		SIFT3D_MAT_RM_GET(mat, i, 2, float) = (float) desc->zd;
+	return ret;
+}
 
-		// Copy the feature vector
-		for (j = 0; j < DESC_NUM_TOTAL_HIST; j++) {
-			const Hist *const hist = desc->hists + j;
-			HIST_LOOP_START(a, p)
-                                const int col = DESC_MAT_GET_COL(j, a, p);
-				SIFT3D_MAT_RM_GET(mat, i, col, float) = 
-					HIST_GET(hist, a, p);
-			HIST_LOOP_END
-		}
-	}
+/* Helper function to compute the SSD of two rows of quantized histograms.
+ * The result is exact, as it is at most DESC_NUMEL * 255^2 < 2^31. The SSE2
+ * path takes 16 bytes at a time, so DESC_NUMEL must be a multiple of 16. */
+static int desc_u8_ssd(const unsigned char *const row1,
+        const unsigned char *const row2) {
 
-	return SIFT3D_SUCCESS;
-}
+        int k;
 
-/* Convert a Mat_rm to a descriptor store. See 
- * SIFT3D_Descriptor_store_to_Mat_rm for the input format. */
-int Mat_rm_to_SIFT3D_Descriptor_store(const Mat_rm *const mat, 
-				      SIFT3D_Descriptor_store *const store) {
+#ifdef __SSE2__
+        __m128i sum;
 
-	int i, j, a, p;
+        const __m128i zero = _mm_setzero_si128();
 
-	const int num_rows = mat->num_rows;
-	const int num_cols = mat->num_cols;
+        sum = zero;
+        for (k = 0; k < DESC_NUMEL; k += 16) {
 
-	// Verify inputs
-	if (num_rows < 1 || num_cols != IM_NDIMS + DESC_NUMEL) {
-		printf("Mat_rm_to_SIFT3D_Descriptor_store: invalid matrix "
-		       "dimensions: [%d X %d] \n", num_rows, num_cols);
-		return SIFT3D_FAILURE;
-	}
+                const __m128i a = _mm_loadu_si128(
+                        (const __m128i *) (row1 + k));
+                const __m128i b = _mm_loadu_si128(
+                        (const __m128i *) (row2 + k));
 
-	// Resize the descriptor store (num cannot be zero)
-	store->num = num_rows;
-	if ((store->buf = (SIFT3D_Descriptor *) SIFT3D_safe_realloc(store->buf, 
-		num_rows * sizeof(SIFT3D_Descriptor))) == NULL)
-		return SIFT3D_FAILURE;
+                // Take |a - b| with saturating subtraction, then widen to 
+                // 16 bits, square and add pairwise to 32 bits
+                const __m128i diff = _mm_or_si128(_mm_subs_epu8(a, b), 
+                        _mm_subs_epu8(b, a));
+                const __m128i lo = _mm_unpacklo_epi8(diff, zero);
+                const __m128i hi = _mm_unpackhi_epi8(diff, zero);
 
-	// Copy the data
-	for (i = 0; i < num_rows; i++) {
+                sum = _mm_add_epi32(sum, _mm_madd_epi16(lo, lo));
+                sum = _mm_add_epi32(sum, _mm_madd_epi16(hi, hi));
+        }
 
-		SIFT3D_Descriptor *const desc = store->buf + i;
+        // Add the four lanes
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 
+                _MM_SHUFFLE(1, 0, 3, 2)));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 
+                _MM_SHUFFLE(2, 3, 0, 1)));
 
-		// Copy the coordinates
-		desc->xd = SIFT3D_MAT_RM_GET(mat, i, 0, float);
-		desc->yd = SIFT3D_MAT_RM_GET(mat, i, 1, float);
-		desc->zd = SIFT3D_MAT_RM_GET(mat, i, 2, float);
+        return _mm_cvtsi128_si32(sum);
+#else
+        int ssd;
 
-		// Copy the feature vector
-		for (j = 0; j < DESC_NUM_TOTAL_HIST; j++) {
-			Hist *const hist = desc->hists + j;
-			HIST_LOOP_START(a, p)
-                                const int col = DESC_MAT_GET_COL(j, a, p);
-				HIST_GET(hist, a, p) = 
-                                        SIFT3D_MAT_RM_GET(mat, i, col, float);
-			HIST_LOOP_END
-		}
-	}
-	
-	return SIFT3D_SUCCESS;
-}
+        ssd = 0;
+        for (k = 0; k < DESC_NUMEL; k++) {
+                const int diff = (int) row1[k] - (int) row2[k];
+                ssd += diff * diff;
+        }
 
-/* Convert a list of matches to matrices of point coordinates.
- * Only valid matches will be included in the output matrices.
- *
- * The format of "matches" is specified in SIFT3D_nn_match.
- *
- * All matrices must be initialized prior to calling this function.
- *
- * Output format:
- *  m x 3 matrices [x11 y11 z11] [x21 y21 z21]
- * 		   |x12 y12 z12| |x22 y22 z22|
- *		        ...	      ...
- * 		   [x1N y1N z1N] [x2N y2N z2N] 
- *
- * Where points on corresponding rows are matches. */
-int SIFT3D_matches_to_Mat_rm(SIFT3D_Descriptor_store *d1,
-			     SIFT3D_Descriptor_store *d2,
-			     const int *const matches,
-			     Mat_rm *const match1, 
-			     Mat_rm *const match2) {
-    int i, num_matches;
+        return ssd;
+#endif
+}
 
-    const int num = d1->num;
+/* As decide_NN_pair, for quantized descriptors. */
+static int decide_NN_pair_u8(const NN_pair *const pair,
+        const SIFT3D_Descriptor_u8 *const query, const int idx,
+        const SIFT3D_Descriptor_u8 *const store, const float nn_thresh) {
 
-    // Resize matrices 
-    match1->num_rows = match2->num_rows = d1->num;
-    match1->num_cols = match2->num_cols = 3;
-    match1->type = match2->type = DOUBLE;
-    if (resize_Mat_rm(match1) || resize_Mat_rm(match2))
-	    return SIFT3D_FAILURE;
+        double ssd_best, ssd_nearest;
+        int best;
 
-    // Populate the matrices
-    num_matches = 0;
-    for (i = 0; i < num; i++) {
+        const unsigned char *const row = query->hists + 
+                (size_t) idx * DESC_NUMEL;
 
-	    const SIFT3D_Descriptor *const desc1 = d1->buf + i;
-	    const SIFT3D_Descriptor *const desc2 = d2->buf + matches[i];
+        if (pair->best < 0)
+                return -1;
 
-	    if (matches[i] == -1)
-		    continue;
+        // Recompute the distances, which may have been rounded to float
+        ssd_best = (double) desc_u8_ssd(row, store->hists + 
+                (size_t) pair->best * DESC_NUMEL);
+        ssd_nearest = pair->nearest < 0 ? DBL_MAX : (double) desc_u8_ssd(row,
+                store->hists + (size_t) pair->nearest * DESC_NUMEL);
 
-	    // Save the match
-	    SIFT3D_MAT_RM_GET(match1, num_matches, 0, double) = desc1->xd; 
-	    SIFT3D_MAT_RM_GET(match1, num_matches, 1, double) = desc1->yd; 
-	    SIFT3D_MAT_RM_GET(match1, num_matches, 2, double) = desc1->zd; 
-	    SIFT3D_MAT_RM_GET(match2, num_matches, 0, double) = desc2->xd; 
-	    SIFT3D_MAT_RM_GET(match2, num_matches, 1, double) = desc2->yd; 
-	    SIFT3D_MAT_RM_GET(match2, num_matches, 2, double) = desc2->zd; 
-	    num_matches++;
-    }
+        // Apply the ratio test
+        if ((best = ratio_test_NN_pair(pair, ssd_best, ssd_nearest, 
+                nn_thresh)) < 0)
+                return -1;
 
-    // Release extra memory
-    match1->num_rows = match2->num_rows = num_matches;
-    if (resize_Mat_rm(match1) || resize_Mat_rm(match2))
-	    return SIFT3D_FAILURE;
-    
-    return SIFT3D_SUCCESS;
+#ifdef SIFT3D_MATCH_MAX_DIST
+        // Reject matches of great distance
+        if (match_too_far(query->coords + IM_NDIMS * idx, 
+                store->coords + IM_NDIMS * best, store->nx, store->ny,
+                store->nz))
+                return -1;
+#endif
+        // The match was a success
+        return best;
 }
 
-/* Perform nearest neighbor matching on two sets of 
- * SIFT descriptors.
+/* As SIFT3D_nn_match_soa, but approximate, using a forest of randomized k-d
+ * trees for each set of descriptors. Has the same ratio test and
+ * forward-backward consistency check, but each search stops after comparing
+ * against "checks" descriptors, visiting the closest branches of all trees
+ * first. More checks give a higher recall of the exact matches, at a higher
+ * cost. The cost of a search does not grow with the number of descriptors,
+ * so this is much faster than SIFT3D_nn_match_soa for large sets.
  *
- * This function will reallocate *matches. As such, *matches must be either
- * NULL or a pointer to previously-allocated array. Upon successful exit,
- * *matches is an array of size d1->num.
- * 
- * On return, the ith element of matches contains the index in d2 of the match
- * corresponding to the ith descriptor in d1, or -1 if no match was found.
+ * The trees are built with a fixed seed, so the output is deterministic.
  *
- * You might consider using SIFT3D_matches_to_Mat_rm to convert the matches to
- * coordinate matrices. */
-int SIFT3D_nn_match(const SIFT3D_Descriptor_store *const d1,
-		    const SIFT3D_Descriptor_store *const d2,
-		    const float nn_thresh, int **const matches) {
+ * Parameters:
+ * -d1, d2, nn_thresh, matches: See SIFT3D_nn_match.
+ * -checks: The maximum number of descriptors compared per search. Must be
+ *      positive. */
+int SIFT3D_nn_match_approx_soa(const SIFT3D_Descriptor_soa *const d1,
+		    const SIFT3D_Descriptor_soa *const d2,
+		    const float nn_thresh, const int checks,
+                    int **const matches) {
 
-	int i;
+        Kd_forest forest1, forest2;
+        int i, ret;
 
 	const int num = d1->num;
 
         // Verify inputs
 	if (num < 1) {
-		SIFT3D_ERR("_SIFT3D_nn_match: invalid number of "
+		SIFT3D_ERR("SIFT3D_nn_match_approx: invalid number of "
 			"descriptors in d1: %d \n", num);
 		return SIFT3D_FAILURE;
 	}
+        if (d1->dim != d2->dim) {
+		SIFT3D_ERR("SIFT3D_nn_match_approx: mismatched descriptor "
+			"lengths: %d, %d \n", d1->dim, d2->dim);
+		return SIFT3D_FAILURE;
+        }
+        if (checks < 1) {
+		SIFT3D_ERR("SIFT3D_nn_match_approx: invalid number of "
+			"checks: %d \n", checks);
+		return SIFT3D_FAILURE;
+        }
 
 	// Resize the matches array (num cannot be zero)
-	if ((*matches = (int *) SIFT3D_safe_realloc(*matches, 
+	if ((*matches = (int *) SIFT3D_safe_realloc(*matches,
 		num * sizeof(int))) == NULL) {
-	    SIFT3D_ERR("_SIFT3D_nn_match: out of memory! \n");
+	    SIFT3D_ERR("SIFT3D_nn_match_approx: out of memory! \n");
 	    return SIFT3D_FAILURE;
 	}
 
-	for (i = 0; i < d1->num; i++) {
+	for (i = 0; i < num; i++) {
 	    // Mark -1 to signal there is no match
 	    (*matches)[i] = -1;
 	}
-	
-	// Exhaustive search for matches
-#pragma omp parallel for
+
+        // Nothing can match an empty d2
+        if (d2->num < 1)
+                return SIFT3D_SUCCESS;
+
+        // Index both sets
+        if (init_Kd_forest(d1, &forest1))
+                return SIFT3D_FAILURE;
+        if (init_Kd_forest(d2, &forest2)) {
+                cleanup_Kd_forest(&forest1);
+                return SIFT3D_FAILURE;
+        }
+
+        ret = SIFT3D_SUCCESS;
+#pragma omp parallel shared(ret)
+{
+        Kd_search search;
+
+        const int search_err = init_Kd_search(&search,
+                SIFT3D_MAX(d1->num, d2->num));
+
+        if (search_err)
+                ret = SIFT3D_FAILURE;
+
+#pragma omp for schedule(dynamic, 16)
 	for (i = 0; i < num; i++) {
 
-                const SIFT3D_Descriptor *const desc1 = d1->buf + i;
+                int match_back;
+
                 int *const match = *matches + i;
 
+                if (search_err)
+                        continue;
+
                 // Forward matching pass
-                *match = match_desc(desc1, d2, nn_thresh);
+                if (kd_forest_match(&forest2, &search, d1->hists +
+                        (size_t) i * d1->dim, nn_thresh, checks, match)) {
+                        ret = SIFT3D_FAILURE;
+                        continue;
+                }
 
                 // We are done if there was no match
                 if (*match < 0)
                         continue;
 
                 // Check for forward-backward consistency
-                if (match_desc(d2->buf + *match, d1, nn_thresh) != i) {
+                if (kd_forest_match(&forest1, &search, d2->hists +
+                        (size_t) *match * d2->dim, nn_thresh, checks,
+                        &match_back)) {
+                        ret = SIFT3D_FAILURE;
+                        continue;
+                }
+                if (match_back != i)
                         *match = -1;
+        }
+
+        if (!search_err)
+                cleanup_Kd_search(&search);
+}
+
+        cleanup_Kd_forest(&forest1);
+        cleanup_Kd_forest(&forest2);
+
+        if (ret)
+	        SIFT3D_ERR("SIFT3D_nn_match_approx: out of memory! \n");
+
+        return ret;
+}
+
+/* Helper function to draw a pseudorandom number in [0, 0x7fff] from the 
+ * state at seed. Unlike rand(), this is reentrant and leaves the global 
+ * state alone. */
+static unsigned int kd_rand(unsigned int *const seed) {
+        *seed = *seed * 1103515245u + 12345u;
+        return (*seed >> 16) & 0x7fff;
+}
+
+/* Build a forest of kd_num_trees randomized k-d trees over the descriptors
+ * in soa, which must not be modified while the forest is in use. Call 
+ * cleanup_Kd_forest to free the memory. */
+static int init_Kd_forest(const SIFT3D_Descriptor_soa *const soa,
+        Kd_forest *const forest) {
+
+        double *mean, *var;
+        int *top;
+        int i, t;
+
+        const int num = soa->num;
+
+        forest->num = num;
+        forest->max_nodes = 2 * num;
+        forest->data = soa->hists;
+        forest->dim = soa->dim;
+        forest->idx = NULL;
+        forest->nodes = NULL;
+        mean = var = NULL;
+        top = NULL;
+
+        // Allocate memory
+        if ((forest->idx = (int *) malloc((size_t) kd_num_trees * num * 
+                        sizeof(int))) == NULL ||
+                (forest->nodes = (Kd_node *) malloc((size_t) kd_num_trees *
+                        forest->max_nodes * sizeof(Kd_node))) == NULL ||
+                (mean = (double *) malloc(soa->dim * sizeof(double))) == 
+                        NULL ||
+                (var = (double *) malloc(soa->dim * sizeof(double))) == 
+                        NULL ||
+                (top = (int *) malloc(kd_num_top_dims * sizeof(int))) == 
+                        NULL) {
+                SIFT3D_ERR("init_Kd_forest: out of memory \n");
+                goto init_Kd_forest_quit;
+        }
+
+        // Build the trees, each from a different permutation
+        for (t = 0; t < kd_num_trees; t++) {
+
+                int next;
+
+                int *const idx = forest->idx + (size_t) t * num;
+                unsigned int seed = (unsigned int) t + 1;
+
+                for (i = 0; i < num; i++) {
+                        idx[i] = i;
+                }
+                for (i = num - 1; i > 0; i--) {
+
+                        const size_t r_hi = kd_rand(&seed);
+                        const size_t r = r_hi << 15 | kd_rand(&seed);
+                        const int k = (int) (r % (size_t) (i + 1));
+                        const int temp = idx[i];
+
+                        idx[i] = idx[k];
+                        idx[k] = temp;
                 }
+
+                next = t * forest->max_nodes;
+                build_kd_node(forest, mean, var, top, t * num, 
+                        (t + 1) * num, &next, &seed);
         }
 
-	return SIFT3D_SUCCESS;
+        free(mean);
+        free(var);
+        free(top);
+        return SIFT3D_SUCCESS;
+
+init_Kd_forest_quit:
+        if (mean != NULL)
+                free(mean);
+        if (var != NULL)
+                free(var);
+        if (top != NULL)
+                free(top);
+        cleanup_Kd_forest(forest);
+        return SIFT3D_FAILURE;
 }
 
-/* Helper function to match desc against the descriptors in store. Returns the
- * index of the match, or -1 if none was found. */
-static int match_desc(const SIFT3D_Descriptor *const desc,
-        const SIFT3D_Descriptor_store *const store, const float nn_thresh) {
+/* Free the memory of a Kd_forest. */
+static void cleanup_Kd_forest(Kd_forest *const forest) {
 
-	const SIFT3D_Descriptor *desc_best;
-        double ssd_best, ssd_nearest;
+        if (forest->idx != NULL)
+                free(forest->idx);
+        if (forest->nodes != NULL)
+                free(forest->nodes);
+        forest->data = NULL;
+        forest->idx = NULL;
+        forest->nodes = NULL;
+}
+
+/* Helper function to recursively build the k-d tree over the descriptors 
+ * forest->idx[start, end). Splits at the mean of a dimension drawn from 
+ * those of highest variance, estimated from the first kd_num_sample 
+ * descriptors, which are in random order. Returns the index of the new node,
+ * which is taken from *next. mean and var are scratch space of DESC_NUMEL 
+ * elements, and top of kd_num_top_dims elements. */
+static int build_kd_node(Kd_forest *const forest, double *const mean, 
+        double *const var, int *const top, const int start, const int end, 
+        int *const next, unsigned int *const seed) {
+
+        int i, j, d, num_top, dim, lim1, lim2, split;
+        float val;
+
+        int *const idx = forest->idx;
+        const int num = end - start;
+        const int num_sample = SIFT3D_MIN(num, kd_num_sample);
+        const int node = (*next)++;
+        const int num_dims = forest->dim;
+        Kd_node *const kd = forest->nodes + node;
+
+#define KD_GET(i, d) (forest->data[(size_t) idx[i] * num_dims + (d)])
+
+        // Make a leaf
+        if (num <= kd_leaf_size) {
+                kd->dim = -1;
+                kd->a = start;
+                kd->b = end;
+                return node;
+        }
+
+        // Estimate the mean and variance
+        memset(mean, 0, num_dims * sizeof(double));
+        memset(var, 0, num_dims * sizeof(double));
+        for (i = start; i < start + num_sample; i++) {
+                for (d = 0; d < num_dims; d++) {
+                        mean[d] += KD_GET(i, d);
+                }
+        }
+        for (d = 0; d < num_dims; d++) {
+                mean[d] /= num_sample;
+        }
+        for (i = start; i < start + num_sample; i++) {
+                for (d = 0; d < num_dims; d++) {
+                        const double diff = KD_GET(i, d) - mean[d];
+                        var[d] += diff * diff;
+                }
+        }
+
+        // Find the dimensions of highest variance, in descending order
+        num_top = 0;
+        for (d = 0; d < num_dims; d++) {
+
+                if (num_top == kd_num_top_dims && 
+                        var[d] <= var[top[num_top - 1]])
+                        continue;
+
+                if (num_top < kd_num_top_dims)
+                        num_top++;
+                for (j = num_top - 1; j > 0 && var[top[j - 1]] < var[d]; 
+                        j--) {
+                        top[j] = top[j - 1];
+                }
+                top[j] = d;
+        }
+
+        // Choose one at random, and split at its mean
+        dim = top[kd_rand(seed) % num_top];
+        val = (float) mean[dim];
+
+        // Partition into [start, lim1) < val, [lim1, lim2) == val, and 
+        // [lim2, end) > val
+#define KD_SWAP(i, j) { const int temp = idx[i]; idx[i] = idx[j]; \
+                        idx[j] = temp; }
+        i = start;
+        j = end - 1;
+        while (1) {
+                while (i <= j && KD_GET(i, dim) < val) i++;
+                while (i <= j && KD_GET(j, dim) >= val) j--;
+                if (i > j) break;
+                KD_SWAP(i, j);
+                i++; j--;
+        }
+        lim1 = i;
+        j = end - 1;
+        while (1) {
+                while (i <= j && KD_GET(i, dim) <= val) i++;
+                while (i <= j && KD_GET(j, dim) > val) j--;
+                if (i > j) break;
+                KD_SWAP(i, j);
+                i++; j--;
+        }
+        lim2 = i;
+#undef KD_SWAP
+#undef KD_GET
+
+        // Split near the middle of the ties, keeping both sides non-empty
+        split = start + num / 2;
+        if (lim1 > split)
+                split = lim1;
+        else if (lim2 < split)
+                split = lim2;
+        if (split <= start || split >= end)
+                split = start + num / 2;
+
+        // Make the children
+        kd->dim = dim;
+        kd->val = val;
+        kd->a = build_kd_node(forest, mean, var, top, start, split, next, 
+                seed);
+        kd->b = build_kd_node(forest, mean, var, top, split, end, next, 
+                seed);
+
+        return node;
+}
+
+/* Initialize the scratch memory of a search in forests of at most num 
+ * descriptors. Call cleanup_Kd_search to free the memory. */
+static int init_Kd_search(Kd_search *const search, const int num) {
+
+        search->num = 0;
+        search->cap = 0;
+        search->heap = NULL;
+        search->query = 0;
+        if ((search->stamp = (int *) calloc(num, sizeof(int))) == NULL)
+                return SIFT3D_FAILURE;
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Free the memory of a Kd_search. */
+static void cleanup_Kd_search(Kd_search *const search) {
+
+        if (search->heap != NULL)
+                free(search->heap);
+        if (search->stamp != NULL)
+                free(search->stamp);
+        search->heap = NULL;
+        search->stamp = NULL;
+}
+
+/* Helper function to push a branch onto the heap of a search. */
+static int kd_push(Kd_search *const search, const double dist, 
+        const int node) {
+
+        size_t i;
+
+        Kd_branch *heap = search->heap;
+
+        // Grow the heap
+        if (search->num == search->cap) {
+
+                const size_t cap = SIFT3D_MAX(2 * search->cap, 64);
+
+                if ((heap = (Kd_branch *) SIFT3D_safe_realloc(heap, 
+                        cap * sizeof(Kd_branch))) == NULL)
+                        return SIFT3D_FAILURE;
+                search->heap = heap;
+                search->cap = cap;
+        }
+
+        // Sift up
+        for (i = search->num++; i > 0 && heap[(i - 1) / 2].dist > dist; 
+                i = (i - 1) / 2) {
+                heap[i] = heap[(i - 1) / 2];
+        }
+        heap[i].dist = dist;
+        heap[i].node = node;
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Helper function to pop the closest branch from the heap of a search, 
+ * which must not be empty. */
+static Kd_branch kd_pop(Kd_search *const search) {
+
+        Kd_branch last;
+        size_t i, child;
+
+        Kd_branch *const heap = search->heap;
+        const Kd_branch top = heap[0];
+
+        // Sift down the last element
+        last = heap[--search->num];
+        for (i = 0; (child = 2 * i + 1) < search->num; i = child) {
+                if (child + 1 < search->num && 
+                        heap[child + 1].dist < heap[child].dist)
+                        child++;
+                if (heap[child].dist >= last.dist)
+                        break;
+                heap[i] = heap[child];
+        }
+        heap[i] = last;
+
+        return top;
+}
+
+/* Helper function to descend from node to a leaf, queueing the branches 
+ * not taken, and comparing the query to the unchecked descriptors of the 
+ * leaf. mindist is a lower bound on the SSD to the descriptors of node. */
+static int kd_descend(const Kd_forest *const forest, Kd_search *const search,
+        const float *const query, int node, const double mindist) {
+
+        const Kd_node *kd;
         int i;
 
-#ifdef SIFT3D_MATCH_MAX_DIST
-        Cvec dims, dmatch;
-        double dist_match;
-				
-        // Compute spatial distance rejection threshold
-        dims.x = (float) store->nx;	
-        dims.y = (float) store->ny;	
-        dims.z = (float) store->nz;	
-        const double diag = SIFT3D_CVEC_L2_NORM(&dims);	
-        const double dist_thresh = diag * SIFT3D_MATCH_MAX_DIST;
-#endif
+        // Descend to a leaf
+        while ((kd = forest->nodes + node)->dim >= 0) {
+
+                const double diff = (double) query[kd->dim] - kd->val;
+                const double bound = mindist + diff * diff;
+
+                if (bound < search->ssd_nearest && 
+                        kd_push(search, bound, diff < 0 ? kd->b : kd->a))
+                        return SIFT3D_FAILURE;
+
+                node = diff < 0 ? kd->a : kd->b;
+        }
 
-        // Linear search for the best and second-best SSD matches 
-        ssd_best = ssd_nearest = DBL_MAX;
-        desc_best = NULL;
-        for (i = 0; i < store->num; i++) { 
+        // Compare to the descriptors of the leaf
+        for (i = kd->a; i < kd->b; i++) {
 
                 double ssd;
-                int j;
+                int j, k;
 
-                const SIFT3D_Descriptor *const desc2 = store->buf + i;
+                const int desc = forest->idx[i];
+                const float *const data = forest->data + 
+                        (size_t) desc * forest->dim;
 
-                // Compute the SSD of the two descriptors
-                ssd = 0.0;
-                for (j = 0; j < DESC_NUM_TOTAL_HIST; j++) {
+                // Skip descriptors seen in another tree
+                if (search->stamp[desc] == search->query)
+                        continue;
+                search->stamp[desc] = search->query;
+                search->checked++;
 
-                        int a, p;
+                // Compute the SSD, stopping once it exceeds the second-nearest
+                ssd = 0.0;
+                for (j = 0; j < forest->dim; j += HIST_NUMEL) {
 
-                        const Hist *const hist1 = desc->hists + j;
-                        const Hist *const hist2 = desc2->hists + j;
+                        const int end = SIFT3D_MIN(j + HIST_NUMEL, 
+                                forest->dim);
 
-                        HIST_LOOP_START(a, p)
-                                const double diff = 
-                                        (double) HIST_GET(hist1, a, p) -
-                                        (double) HIST_GET(hist2, a, p);
-                                        ssd += diff * diff;
-                        HIST_LOOP_END
+                        for (k = j; k < end; k++) {
+                                const double diff = (double) query[k] - 
+                                        (double) data[k];
+                                ssd += diff * diff;
+                        }
 
-                        // Early termination
-                        if (ssd > ssd_nearest)
+                        if (ssd > search->ssd_nearest)
                                 break;
                 }
 
                 // Compare to the best matches
-                if (ssd < ssd_best) {
-                        desc_best = desc2; 
-                        ssd_nearest = ssd_best;
-                        ssd_best = ssd;
-                } else  {
-                        ssd_nearest = SIFT3D_MIN(ssd_nearest, ssd);
+                if (ssd < search->ssd_best) {
+                        search->best = desc;
+                        search->ssd_nearest = search->ssd_best;
+                        search->ssd_best = ssd;
+                } else {
+                        search->ssd_nearest = SIFT3D_MIN(search->ssd_nearest,
+                                ssd);
                 }
         }
 
-        // Reject a match if the nearest neighbor is too close
-        if (ssd_best / ssd_nearest > nn_thresh * nn_thresh)
-                        return -1;
+        return SIFT3D_SUCCESS;
+}
 
-#ifdef SIFT3D_MATCH_MAX_DIST
-        // Compute the spatial distance of the match
-        dmatch.x = (float) desc_best->xd - desc1->xd; 
-        dmatch.y = (float) desc_best->yd - desc1->yd; 
-        dmatch.z = (float) desc_best->zd - desc1->zd; 
-        dist_match = (double) SIFT3D_CVEC_L2_NORM(&dmatch);
+/* Helper function to approximately match the query descriptor against those
+ * in forest, as in SIFT3D_nn_match. Writes the index of the match to *match,
+ * or -1 if none was found. */
+static int kd_forest_match(const Kd_forest *const forest, 
+        Kd_search *const search, const float *const query, 
+        const float nn_thresh, const int checks, int *const match) {
+
+        int t;
+
+        // Start a new query
+        search->query++;
+        search->num = 0;
+        search->checked = 0;
+        search->best = -1;
+        search->ssd_best = search->ssd_nearest = DBL_MAX;
+
+        // Descend each tree to its nearest leaf
+        for (t = 0; t < kd_num_trees; t++) {
+                if (kd_descend(forest, search, query, t * forest->max_nodes,
+                        0.0))
+                        return SIFT3D_FAILURE;
+        }
 
-        // Reject matches of great distance
-        if (dist_match > dist_thresh)
-                return -1;
-#endif
-        // The match was a success
-        return desc_best - store->buf;
+        // Explore the closest branches of all trees, until enough 
+        // descriptors are checked or no branch can improve the matches
+        while (search->num > 0 && search->checked < checks) {
+
+                const Kd_branch branch = kd_pop(search);
+
+                if (branch.dist >= search->ssd_nearest)
+                        break;
+
+                if (kd_descend(forest, search, query, branch.node, 
+                        branch.dist))
+                        return SIFT3D_FAILURE;
+        }
+
+        // Reject a match if the nearest neighbor is too close
+        *match = search->best >= 0 && search->ssd_best / search->ssd_nearest
+                <= nn_thresh * nn_thresh ? search->best : -1;
+
+        return SIFT3D_SUCCESS;
 }
 			
 /* Draw the matches. 
@@ -3184,3 +7631,230 @@ write_desc_quit:
         return SIFT3D_FAILURE;
 }
 
+/* Write descriptors stored in a SIFT3D_Descriptor_soa to a text file. The
+ * format is that of write_SIFT3D_Descriptor_store, except that each row has
+ * soa->dim histogram elements, so this also writes projected descriptors. */
+int write_SIFT3D_Descriptor_soa(const char *path, 
+        const SIFT3D_Descriptor_soa *const soa) {
+
+        Mat_rm coords, hists;
+        int i, k, ret;
+
+        const int num = soa->num;
+
+	// Verify inputs
+	if (num < 1) {
+		SIFT3D_ERR("write_SIFT3D_Descriptor_soa: invalid number of "
+		       "descriptors: %d \n", num);
+		return SIFT3D_FAILURE;
+	}
+
+        // Copy the coordinates, and alias the histograms
+        if (init_Mat_rm(&coords, num, IM_NDIMS, FLOAT, SIFT3D_FALSE))
+                return SIFT3D_FAILURE;
+        for (i = 0; i < num; i++) {
+                for (k = 0; k < IM_NDIMS; k++) {
+                        SIFT3D_MAT_RM_GET(&coords, i, k, float) = 
+                                (float) soa->coords[i * IM_NDIMS + k];
+                }
+        }
+        if (SIFT3D_Descriptor_soa_hists_Mat_rm(soa, &hists)) {
+                cleanup_Mat_rm(&coords);
+                return SIFT3D_FAILURE;
+        }
+
+        // Write the coordinates next to the histograms
+        ret = write_Mat_rm_cat(path, &coords, &hists);
+
+        cleanup_Mat_rm(&coords);
+        return ret;
+}
+
+/* Write a PCA basis to a .csv or .csv.gz file. The first row is the mean, 
+ * and each following row is a principal axis, in the order of pca->basis. 
+ * The file can be read back by read_SIFT3D_PCA. */
+int write_SIFT3D_PCA(const char *path, const SIFT3D_PCA *const pca) {
+
+        Mat_rm mat;
+        int ret;
+
+        // Verify inputs
+        if (verify_SIFT3D_PCA(pca))
+                return SIFT3D_FAILURE;
+
+        // Stack the mean on top of the basis
+        if (init_Mat_rm(&mat, 0, 0, FLOAT, SIFT3D_FALSE))
+                return SIFT3D_FAILURE;
+        if (concat_Mat_rm(&pca->mean, &pca->basis, &mat, 0)) {
+                cleanup_Mat_rm(&mat);
+                return SIFT3D_FAILURE;
+        }
+
+        ret = write_Mat_rm(path, &mat);
+
+        cleanup_Mat_rm(&mat);
+        return ret;
+}
+
+/* Read a PCA basis from a file written by write_SIFT3D_PCA. pca must be
+ * initialized prior to calling this function. */
+int read_SIFT3D_PCA(const char *path, SIFT3D_PCA *const pca) {
+
+        Mat_rm mat;
+        int i, k, dim;
+
+        // Read the file
+        if (init_Mat_rm(&mat, 0, 0, DOUBLE, SIFT3D_FALSE))
+                return SIFT3D_FAILURE;
+        if (read_Mat_rm(path, &mat))
+                goto read_pca_quit;
+
+        // Verify the dimensions
+        dim = mat.num_rows - 1;
+        if (mat.num_cols != DESC_NUMEL || dim < 1 || dim > DESC_NUMEL) {
+                SIFT3D_ERR("read_SIFT3D_PCA: %s has dimensions [%d x %d], "
+                        "expected [dim + 1 x %d], where dim is in [1, %d] \n",
+                        path, mat.num_rows, mat.num_cols, DESC_NUMEL, 
+                        DESC_NUMEL);
+                goto read_pca_quit;
+        }
+
+        // Split the mean and the basis
+        pca->mean.type = pca->basis.type = FLOAT;
+        pca->mean.num_rows = 1;
+        pca->mean.num_cols = pca->basis.num_cols = DESC_NUMEL;
+        pca->basis.num_rows = dim;
+        if (resize_Mat_rm(&pca->mean) || resize_Mat_rm(&pca->basis))
+                goto read_pca_quit;
+        for (k = 0; k < DESC_NUMEL; k++) {
+                SIFT3D_MAT_RM_GET(&pca->mean, 0, k, float) = (float)
+                        SIFT3D_MAT_RM_GET(&mat, 0, k, double);
+        }
+        SIFT3D_MAT_RM_LOOP_START(&pca->basis, i, k)
+                SIFT3D_MAT_RM_GET(&pca->basis, i, k, float) = (float)
+                        SIFT3D_MAT_RM_GET(&mat, i + 1, k, double);
+        SIFT3D_MAT_RM_LOOP_END
+
+        cleanup_Mat_rm(&mat);
+        return SIFT3D_SUCCESS;
+
+read_pca_quit:
+        cleanup_Mat_rm(&mat);
+        return SIFT3D_FAILURE;
+}
+
+/* Write quantized SIFT3D descriptors to a text file. The format is that of
+ * write_SIFT3D_Descriptor_store, except that the histograms are written as
+ * integers in [0, 255]. Divide them by SIFT3D_desc_quant_scale to recover 
+ * the descriptors, or read them with read_SIFT3D_Descriptor_u8. */
+int write_SIFT3D_Descriptor_u8(const char *path, 
+        const SIFT3D_Descriptor_u8 *const desc) {
+
+        Mat_rm coords, hists;
+        int i, k, ret;
+
+        const int num = desc->num;
+
+	// Verify inputs
+	if (num < 1) {
+		SIFT3D_ERR("write_SIFT3D_Descriptor_u8: invalid number of "
+		       "descriptors: %d \n", num);
+		return SIFT3D_FAILURE;
+	}
+
+        // Initialize the matrices
+        if (init_Mat_rm(&coords, num, IM_NDIMS, FLOAT, SIFT3D_FALSE))
+                return SIFT3D_FAILURE;
+        if (init_Mat_rm(&hists, num, DESC_NUMEL, INT, SIFT3D_FALSE)) {
+                cleanup_Mat_rm(&coords);
+                return SIFT3D_FAILURE;
+        }
+
+        // Copy the data
+        for (i = 0; i < num; i++) {
+
+                const unsigned char *const row = desc->hists + 
+                        (size_t) i * DESC_NUMEL;
+
+                for (k = 0; k < IM_NDIMS; k++) {
+                        SIFT3D_MAT_RM_GET(&coords, i, k, float) = 
+                                (float) desc->coords[i * IM_NDIMS + k];
+                }
+                for (k = 0; k < DESC_NUMEL; k++) {
+                        SIFT3D_MAT_RM_GET(&hists, i, k, int) = row[k];
+                }
+        }
+
+        // Write the coordinates next to the histograms
+        ret = write_Mat_rm_cat(path, &coords, &hists);
+
+        cleanup_Mat_rm(&coords);
+        cleanup_Mat_rm(&hists);
+        return ret;
+}
+
+/* Read quantized SIFT3D descriptors written by write_SIFT3D_Descriptor_u8.
+ * desc is resized, and must be initialized prior to calling this function.
+ * The scales are not stored in the file, and are set to zero. Use 
+ * SIFT3D_Descriptor_u8_to_store to dequantize the descriptors. 
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int read_SIFT3D_Descriptor_u8(const char *path, 
+        SIFT3D_Descriptor_u8 *const desc) {
+
+        Mat_rm mat;
+        int i, k;
+
+        // Read the file
+        if (init_Mat_rm(&mat, 0, 0, DOUBLE, SIFT3D_FALSE))
+                return SIFT3D_FAILURE;
+        if (read_Mat_rm(path, &mat))
+                goto read_u8_quit;
+
+        // Verify the dimensions
+        if (mat.num_rows < 1 || mat.num_cols != IM_NDIMS + DESC_NUMEL) {
+                SIFT3D_ERR("read_SIFT3D_Descriptor_u8: invalid matrix "
+                        "dimensions: [%d X %d] \n", mat.num_rows, 
+                        mat.num_cols);
+                goto read_u8_quit;
+        }
+
+        if (resize_SIFT3D_Descriptor_u8(desc, mat.num_rows))
+                goto read_u8_quit;
+
+        // Copy the data
+        for (i = 0; i < mat.num_rows; i++) {
+
+                unsigned char *const row = desc->hists + 
+                        (size_t) i * DESC_NUMEL;
+
+                for (k = 0; k < IM_NDIMS; k++) {
+                        desc->coords[i * IM_NDIMS + k] = 
+                                SIFT3D_MAT_RM_GET(&mat, i, k, double);
+                }
+                desc->scales[i] = 0.0;
+
+                for (k = 0; k < DESC_NUMEL; k++) {
+
+                        const double val = SIFT3D_MAT_RM_GET(&mat, i, 
+                                IM_NDIMS + k, double);
+
+                        if (val < 0.0 || val > 255.0) {
+                                SIFT3D_ERR("read_SIFT3D_Descriptor_u8: "
+                                        "value %f out of range in row %d \n",
+                                        val, i);
+                                goto read_u8_quit;
+                        }
+
+                        row[k] = (unsigned char) floor(val + 0.5);
+                }
+        }
+
+        cleanup_Mat_rm(&mat);
+        return SIFT3D_SUCCESS;
+
+read_u8_quit:
+        cleanup_Mat_rm(&mat);
+        return SIFT3D_FAILURE;
+}
+
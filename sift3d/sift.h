@@ -30,6 +30,30 @@ void init_SIFT3D_Descriptor_store(SIFT3D_Descriptor_store *const desc);
 
 void cleanup_SIFT3D_Descriptor_store(SIFT3D_Descriptor_store *const desc);
 
+const extern double SIFT3D_desc_quant_scale; // Scale of quantized histograms
+
+void init_SIFT3D_Descriptor_soa(SIFT3D_Descriptor_soa *const soa);
+
+void cleanup_SIFT3D_Descriptor_soa(SIFT3D_Descriptor_soa *const soa);
+
+int resize_SIFT3D_Descriptor_soa(SIFT3D_Descriptor_soa *const soa, 
+        const size_t num);
+
+void init_SIFT3D_Descriptor_u8(SIFT3D_Descriptor_u8 *const desc);
+
+void cleanup_SIFT3D_Descriptor_u8(SIFT3D_Descriptor_u8 *const desc);
+
+int resize_SIFT3D_Descriptor_u8(SIFT3D_Descriptor_u8 *const desc, 
+        const size_t num);
+
+int init_SIFT3D_PCA(SIFT3D_PCA *const pca);
+
+void cleanup_SIFT3D_PCA(SIFT3D_PCA *const pca);
+
+int init_SIFT3D_PCA_stats(SIFT3D_PCA_stats *const stats);
+
+void cleanup_SIFT3D_PCA_stats(SIFT3D_PCA_stats *const stats);
+
 int set_peak_thresh_SIFT3D(SIFT3D *const sift3d,
                                 const double peak_thresh);
 
@@ -45,6 +69,14 @@ int set_sigma_n_SIFT3D(SIFT3D *const sift3d,
 int set_sigma0_SIFT3D(SIFT3D *const sift3d,
                                 const double sigma_n);
 
+void set_recursive_gauss_SIFT3D(SIFT3D *const sift3d, const int recursive);
+
+int set_fused_dog_SIFT3D(SIFT3D *const sift3d, const int fused);
+
+void set_grad_cache_SIFT3D(SIFT3D *const sift3d, const size_t max_bytes);
+
+void set_ori_field_SIFT3D(SIFT3D *const sift3d, const int field);
+
 int init_SIFT3D(SIFT3D *sift3d);
 
 int copy_SIFT3D(const SIFT3D *const src, SIFT3D *const dst);
@@ -72,13 +104,41 @@ int SIFT3D_extract_raw_descriptors(SIFT3D *const sift3d,
         const Image *const im, const Keypoint_store *const kp, 
         SIFT3D_Descriptor_store *const desc);
 
+int SIFT3D_extract_descriptors_pca(SIFT3D *const sift3d, 
+        const Keypoint_store *const kp, const SIFT3D_PCA *const pca,
+        SIFT3D_Descriptor_soa *const desc);
+
 int SIFT3D_extract_dense_descriptors(SIFT3D *const sift3d, 
         const Image *const in, Image *const desc);
 
+void init_Dense_ROI(Dense_ROI *const roi);
+
+int SIFT3D_extract_dense_descriptors_roi(SIFT3D *const sift3d, 
+        const Image *const in, const Dense_ROI *const roi, 
+        Mat_rm *const desc);
+
 int SIFT3D_nn_match(const SIFT3D_Descriptor_store *const d1,
 		    const SIFT3D_Descriptor_store *const d2,
 		    const float nn_thresh, int **const matches);
 
+int SIFT3D_nn_match_approx(const SIFT3D_Descriptor_store *const d1,
+		    const SIFT3D_Descriptor_store *const d2,
+		    const float nn_thresh, const int checks, 
+                    int **const matches);
+
+int SIFT3D_nn_match_soa(const SIFT3D_Descriptor_soa *const d1,
+		    const SIFT3D_Descriptor_soa *const d2,
+		    const float nn_thresh, int **const matches);
+
+int SIFT3D_nn_match_approx_soa(const SIFT3D_Descriptor_soa *const d1,
+		    const SIFT3D_Descriptor_soa *const d2,
+		    const float nn_thresh, const int checks, 
+                    int **const matches);
+
+int SIFT3D_nn_match_u8(const SIFT3D_Descriptor_u8 *const d1,
+		    const SIFT3D_Descriptor_u8 *const d2,
+		    const float nn_thresh, int **const matches);
+
 int Keypoint_store_to_Mat_rm(const Keypoint_store *const kp, Mat_rm *const mat);
 
 int SIFT3D_Descriptor_coords_to_Mat_rm(
@@ -88,6 +148,37 @@ int SIFT3D_Descriptor_coords_to_Mat_rm(
 int SIFT3D_Descriptor_store_to_Mat_rm(const SIFT3D_Descriptor_store *const store, 
 				      Mat_rm *const mat);
 
+int Mat_rm_to_SIFT3D_Descriptor_store(const Mat_rm *const mat, 
+				      SIFT3D_Descriptor_store *const store);
+
+int SIFT3D_Descriptor_store_to_soa(const SIFT3D_Descriptor_store *const store,
+        SIFT3D_Descriptor_soa *const soa);
+
+int SIFT3D_Descriptor_soa_to_store(const SIFT3D_Descriptor_soa *const soa,
+        SIFT3D_Descriptor_store *const store);
+
+int SIFT3D_Descriptor_soa_hists_Mat_rm(const SIFT3D_Descriptor_soa *const soa,
+        Mat_rm *const mat);
+
+int SIFT3D_Descriptor_store_to_u8(const SIFT3D_Descriptor_store *const store,
+        SIFT3D_Descriptor_u8 *const desc);
+
+int SIFT3D_Descriptor_u8_to_store(const SIFT3D_Descriptor_u8 *const desc,
+        SIFT3D_Descriptor_store *const store);
+
+int learn_SIFT3D_PCA(const SIFT3D_Descriptor_store *const stores, 
+        const int num_stores, const int dim, SIFT3D_PCA *const pca);
+
+int add_SIFT3D_PCA_stats(SIFT3D_PCA_stats *const stats, 
+        const SIFT3D_Descriptor_store *const store);
+
+int learn_SIFT3D_PCA_stats(const SIFT3D_PCA_stats *const stats, 
+        const int dim, SIFT3D_PCA *const pca);
+
+int SIFT3D_PCA_project(const SIFT3D_PCA *const pca, 
+        const SIFT3D_Descriptor_soa *const in, 
+        SIFT3D_Descriptor_soa *const out);
+
 int SIFT3D_matches_to_Mat_rm(SIFT3D_Descriptor_store *d1,
 			     SIFT3D_Descriptor_store *d2,
 			     const int *const matches,
@@ -104,6 +195,19 @@ int write_Keypoint_store(const char *path, const Keypoint_store *const kp);
 int write_SIFT3D_Descriptor_store(const char *path, 
         const SIFT3D_Descriptor_store *const desc);
 
+int write_SIFT3D_Descriptor_u8(const char *path, 
+        const SIFT3D_Descriptor_u8 *const desc);
+
+int read_SIFT3D_Descriptor_u8(const char *path, 
+        SIFT3D_Descriptor_u8 *const desc);
+
+int write_SIFT3D_Descriptor_soa(const char *path, 
+        const SIFT3D_Descriptor_soa *const soa);
+
+int write_SIFT3D_PCA(const char *path, const SIFT3D_PCA *const pca);
+
+int read_SIFT3D_PCA(const char *path, SIFT3D_PCA *const pca);
+
 #ifdef __cplusplus
 }
 #endif